@@ -0,0 +1,273 @@
+/*
+ * Bitmap kernels shared by the checker, the counter verification and readimage.
+ */
+
+#include <endian.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BITMAP_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define BITMAP_NEON
+#endif
+
+#include "bitmap.h"
+
+/*
+ * A kernel counts the set bits of num_words 64-bit words of a, or of a ^ b
+ * when b is not NULL
+ */
+typedef uint64_t (*count_kernel_fn)(unsigned char const *a, unsigned char const *b,
+									size_t num_words);
+
+static count_kernel_fn count_kernel;
+static char const *count_kernel_name;
+
+// ---------- Function Declarations ----------
+unsigned int bitmap_count(void const *bitmap, unsigned int num_bits);
+unsigned int bitmap_count_range(void const *bitmap, unsigned int from, unsigned int num_bits);
+unsigned int bitmap_diff(void const *a, void const *b, unsigned int num_bits);
+unsigned int bitmap_next_set(void const *bitmap, unsigned int num_bits, unsigned int from);
+char const *bitmap_kernel(void);
+
+
+
+// ---------- Helper Functions ----------
+
+/**
+ * Load 64 bits from a possibly unaligned address. Bitmaps are little-endian
+ * on disk, so bit n of the word is bit n % 8 of byte n / 8 on any host.
+ */
+static inline uint64_t load_word(unsigned char const *p) {
+	uint64_t word;
+	memcpy(&word, p, sizeof(word));
+	return le64toh(word);
+}
+
+/**
+ * Load the last, partial word of a bitmap: its first num_bits bits, the rest 0
+ * @param  p        start of the partial word
+ * @param  num_bits 1 to 63
+ */
+static inline uint64_t load_tail(unsigned char const *p, unsigned int num_bits) {
+	unsigned char bytes[8] = {0};
+	memcpy(bytes, p, (num_bits + 7) / 8);
+	return load_word(bytes) & ((UINT64_C(1) << num_bits) - 1);
+}
+
+/**
+ * Portable kernel; whatever __builtin_popcountll compiles to
+ */
+static uint64_t count_words_generic(unsigned char const *a, unsigned char const *b,
+									size_t num_words) {
+	uint64_t total = 0;
+	for (size_t i = 0; i < num_words; i++) {
+		uint64_t word = load_word(a + 8 * i);
+		if (b != NULL) {
+			word ^= load_word(b + 8 * i);
+		}
+		total += __builtin_popcountll(word);
+	}
+	return total;
+}
+
+#ifdef BITMAP_X86
+/**
+ * The portable kernel built for the POPCNT instruction
+ */
+__attribute__((target("popcnt"))) static uint64_t
+count_words_popcnt(unsigned char const *a, unsigned char const *b, size_t num_words) {
+	uint64_t total = 0;
+	for (size_t i = 0; i < num_words; i++) {
+		uint64_t word = load_word(a + 8 * i);
+		if (b != NULL) {
+			word ^= load_word(b + 8 * i);
+		}
+		total += __builtin_popcountll(word);
+	}
+	return total;
+}
+
+/**
+ * Per-byte popcounts of a 256-bit vector: look each nibble up in a 16-entry
+ * table with a byte shuffle
+ */
+__attribute__((target("avx2"))) static inline __m256i popcount_bytes_avx2(__m256i v) {
+	__m256i const table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+										   0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	__m256i const low_nibbles = _mm256_set1_epi8(0x0f);
+	__m256i lo = _mm256_and_si256(v, low_nibbles);
+	__m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_nibbles);
+	return _mm256_add_epi8(_mm256_shuffle_epi8(table, lo), _mm256_shuffle_epi8(table, hi));
+}
+
+/**
+ * AVX2 kernel: 256 bits per step, byte counts summed into 64-bit lanes
+ */
+__attribute__((target("avx2,popcnt"))) static uint64_t
+count_words_avx2(unsigned char const *a, unsigned char const *b, size_t num_words) {
+	__m256i const zero = _mm256_setzero_si256();
+	__m256i sums = zero;
+	size_t i = 0;
+	for (; i + 4 <= num_words; i += 4) {
+		__m256i v = _mm256_loadu_si256((__m256i const *)(a + 8 * i));
+		if (b != NULL) {
+			v = _mm256_xor_si256(v, _mm256_loadu_si256((__m256i const *)(b + 8 * i)));
+		}
+		sums = _mm256_add_epi64(sums, _mm256_sad_epu8(popcount_bytes_avx2(v), zero));
+	}
+	uint64_t total = (uint64_t)_mm256_extract_epi64(sums, 0) + (uint64_t)_mm256_extract_epi64(sums, 1) +
+					 (uint64_t)_mm256_extract_epi64(sums, 2) + (uint64_t)_mm256_extract_epi64(sums, 3);
+	for (; i < num_words; i++) {
+		uint64_t word = load_word(a + 8 * i);
+		if (b != NULL) {
+			word ^= load_word(b + 8 * i);
+		}
+		total += __builtin_popcountll(word);
+	}
+	return total;
+}
+#endif // BITMAP_X86
+
+#ifdef BITMAP_NEON
+/**
+ * NEON kernel: 128 bits per step, byte counts widened and summed
+ */
+static uint64_t count_words_neon(unsigned char const *a, unsigned char const *b, size_t num_words) {
+	uint64x2_t sums = vdupq_n_u64(0);
+	size_t i = 0;
+	for (; i + 2 <= num_words; i += 2) {
+		uint8x16_t v = vld1q_u8(a + 8 * i);
+		if (b != NULL) {
+			v = veorq_u8(v, vld1q_u8(b + 8 * i));
+		}
+		sums = vpadalq_u32(sums, vpaddlq_u16(vpaddlq_u8(vcntq_u8(v))));
+	}
+	uint64_t total = vaddvq_u64(sums);
+	for (; i < num_words; i++) {
+		uint64_t word = load_word(a + 8 * i);
+		if (b != NULL) {
+			word ^= load_word(b + 8 * i);
+		}
+		total += __builtin_popcountll(word);
+	}
+	return total;
+}
+#endif // BITMAP_NEON
+
+/**
+ * Pick the counting kernel once, before main()
+ */
+__attribute__((constructor)) static void pick_count_kernel(void) {
+	count_kernel = count_words_generic;
+	count_kernel_name = "generic";
+#if defined(BITMAP_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		count_kernel = count_words_avx2;
+		count_kernel_name = "avx2";
+	} else if (__builtin_cpu_supports("popcnt")) {
+		count_kernel = count_words_popcnt;
+		count_kernel_name = "popcnt";
+	}
+#elif defined(BITMAP_NEON)
+	count_kernel = count_words_neon;
+	count_kernel_name = "neon";
+#endif
+}
+
+/**
+ * Count the set bits of a, or of a ^ b, over the first num_bits bits
+ */
+static unsigned int count_bits(unsigned char const *a, unsigned char const *b,
+							   unsigned int num_bits) {
+	size_t num_words = num_bits / 64;
+	unsigned int tail_bits = num_bits % 64;
+	uint64_t total = count_kernel(a, b, num_words);
+	if (tail_bits != 0) {
+		uint64_t word = load_tail(a + 8 * num_words, tail_bits);
+		if (b != NULL) {
+			word ^= load_tail(b + 8 * num_words, tail_bits);
+		}
+		total += __builtin_popcountll(word);
+	}
+	return total;
+}
+
+
+
+// ---------- Function Implementations ----------
+
+/**
+ * Count the bits set in a bitmap
+ * @param  bitmap   the bitmap
+ * @param  num_bits number of bits to look at, from bit 0
+ * @return          the number of set bits
+ */
+unsigned int bitmap_count(void const *bitmap, unsigned int num_bits) {
+	return count_bits(bitmap, NULL, num_bits);
+}
+
+/**
+ * Count the bits set in part of a bitmap
+ * @param  bitmap   the bitmap
+ * @param  from     first bit to look at
+ * @param  num_bits number of bits to look at
+ * @return          the number of set bits
+ */
+unsigned int bitmap_count_range(void const *bitmap, unsigned int from, unsigned int num_bits) {
+	unsigned char const *bytes = bitmap;
+	unsigned int total = 0;
+	// up to the byte boundary a bit at a time, then from that byte on
+	while (num_bits > 0 && from % 8 != 0) {
+		total += (bytes[from / 8] >> (from % 8)) & 1;
+		from++;
+		num_bits--;
+	}
+	return total + count_bits(bytes + from / 8, NULL, num_bits);
+}
+
+/**
+ * Count the bits that differ between two bitmaps
+ * @param  a        one bitmap
+ * @param  b        the other
+ * @param  num_bits number of bits to compare, from bit 0
+ * @return          the number of differing bits; 0 if they are equal
+ */
+unsigned int bitmap_diff(void const *a, void const *b, unsigned int num_bits) {
+	return count_bits(a, b, num_bits);
+}
+
+/**
+ * Find the next set bit, skipping clear words whole
+ * @param  bitmap   the bitmap
+ * @param  num_bits number of bits in the bitmap
+ * @param  from     first bit to look at
+ * @return          index of the first set bit at or after from; num_bits if none
+ */
+unsigned int bitmap_next_set(void const *bitmap, unsigned int num_bits, unsigned int from) {
+	unsigned char const *bytes = bitmap;
+	while (from < num_bits) {
+		unsigned int word_start = from - from % 64;
+		unsigned int word_bits = num_bits - word_start < 64 ? num_bits - word_start : 64;
+		uint64_t word = word_bits == 64 ? load_word(bytes + word_start / 8)
+										: load_tail(bytes + word_start / 8, word_bits);
+		word &= ~UINT64_C(0) << (from % 64);
+		if (word != 0) {
+			return word_start + __builtin_ctzll(word);
+		}
+		from = word_start + 64;
+	}
+	return num_bits;
+}
+
+/**
+ * Name the counting kernel in use, for diagnostics
+ * @return "avx2", "neon", "popcnt" or "generic"
+ */
+char const *bitmap_kernel(void) {
+	return count_kernel_name;
+}
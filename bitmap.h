@@ -0,0 +1,18 @@
+#ifndef EXT2_BITMAP
+#define EXT2_BITMAP
+
+/*
+ * Whole-bitmap kernels for the inode and block bitmaps: population counts,
+ * diffs and set-bit scans a 64-bit word at a time. Counting and diffing use
+ * the widest implementation the CPU has (AVX2, NEON, hardware popcount or
+ * plain 64-bit), picked once at startup. Bit i is bit i % 8 of byte i / 8,
+ * as on disk.
+ */
+
+unsigned int bitmap_count(void const *bitmap, unsigned int num_bits);
+unsigned int bitmap_count_range(void const *bitmap, unsigned int from, unsigned int num_bits);
+unsigned int bitmap_diff(void const *a, void const *b, unsigned int num_bits);
+unsigned int bitmap_next_set(void const *bitmap, unsigned int num_bits, unsigned int from);
+char const *bitmap_kernel(void);
+
+#endif // EXT2_BITMAP
@@ -0,0 +1,255 @@
+/*
+ * Block-map cache used to free, re-mark, check and read whole files. See
+ * bmap.h.
+ *
+ * Maps are built by one walk of the block tree in the order
+ * walk_inode_blocks() visits it, each indirect block before the blocks it
+ * points to, so a file allocated in one piece comes out as a single owned
+ * run however many indirect blocks it has. The cache is bounded: past
+ * BMAP_MAX_ENTRIES maps it is emptied and starts over, or once operations
+ * sharing it are done (see bmap_share()). One lock covers the cache.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bmap.h"
+#include "ext2.h"
+#include "utils.h"
+
+// one inode's map, with what it was built from
+struct bmap_entry {
+	struct bmap_entry *next;
+	unsigned int inode_idx;
+	unsigned int i_blocks;
+	unsigned int i_block[EXT2_N_BLOCKS];
+	unsigned int max_data;
+	unsigned int max_owned;
+	struct bmap map;
+};
+
+#define BMAP_BUCKETS	 1024
+#define BMAP_MAX_ENTRIES 65536
+
+static struct bmap_entry *buckets[BMAP_BUCKETS];
+static unsigned int num_entries;
+static int shared; // see bmap_share()
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+// ---------- Function Declarations ----------
+struct bmap const *bmap_get(unsigned char *disk, unsigned int inode_idx);
+void bmap_forget(unsigned int inode_idx);
+void bmap_share(int on);
+void bmap_clear(void);
+
+
+
+// ---------- Helper Functions ----------
+
+/**
+ * Find the link pointing at an inode's entry, or at the NULL ending its chain
+ * @return the link
+ */
+static struct bmap_entry **bmap_link(unsigned int inode_idx) {
+	struct bmap_entry **link = &buckets[inode_idx % BMAP_BUCKETS];
+	while (*link != NULL && (*link)->inode_idx != inode_idx) {
+		link = &(*link)->next;
+	}
+	return link;
+}
+
+/**
+ * Take an entry out of its chain and free it
+ * @param link the link pointing at it
+ */
+static void bmap_drop(struct bmap_entry **link) {
+	struct bmap_entry *entry = *link;
+	*link = entry->next;
+	free(entry->map.data);
+	free(entry->map.owned);
+	free(entry);
+	num_entries--;
+}
+
+/**
+ * Free every entry
+ */
+static void bmap_empty(void) {
+	for (unsigned int i = 0; i < BMAP_BUCKETS; i++) {
+		while (buckets[i] != NULL) {
+			bmap_drop(&buckets[i]);
+		}
+	}
+}
+
+/**
+ * Add one block to a run list, extending the last run if the block follows it
+ * @param  runs  the list
+ * @param  num   number of runs in it
+ * @param  max   room in it
+ * @param  lblk  the block's logical number, or 0 in an owned list (a data
+ *               block numbered 0 always starts the list)
+ * @param  pblk  the block's physical number
+ * @return       0 on success, -ENOMEM
+ */
+static int add_block(struct bmap_run **runs, unsigned int *num, unsigned int *max, unsigned int lblk,
+					 unsigned int pblk) {
+	if (*num > 0) {
+		struct bmap_run *last = &(*runs)[*num - 1];
+		if (last->pblk + last->len == pblk && (lblk == 0 || last->lblk + last->len == lblk)) {
+			last->len++;
+			return 0;
+		}
+	}
+	if (*num == *max) {
+		unsigned int new_max = *max ? *max * 2 : 4;
+		struct bmap_run *grown = realloc(*runs, new_max * sizeof(struct bmap_run));
+		if (grown == NULL) {
+			return -ENOMEM;
+		}
+		*runs = grown;
+		*max = new_max;
+	}
+	(*runs)[(*num)++] = (struct bmap_run){lblk, pblk, 1};
+	return 0;
+}
+
+/**
+ * Add the blocks under one block pointer to a map
+ * @param  disk      the disk
+ * @param  entry     the map being built
+ * @param  block_num the pointer; 0 for a hole
+ * @param  level     0 for a data block, 1 to 3 for an indirect block
+ * @param  lblk      logical number of the first data block under it
+ * @return           0 on success, -ENOMEM
+ */
+static int add_tree(unsigned char *disk, struct bmap_entry *entry, unsigned int block_num, int level,
+					unsigned int lblk) {
+	struct bmap *map = &entry->map;
+	int result;
+	if (block_num == 0) {
+		return 0;
+	}
+	if ((result = add_block(&map->owned, &map->num_owned, &entry->max_owned, 0, block_num)) < 0) {
+		return result;
+	}
+	if (level == 0) {
+		return add_block(&map->data, &map->num_data, &entry->max_data, lblk, block_num);
+	}
+	unsigned int per_block = EXT2_BLOCK_SIZE / sizeof(unsigned int);
+	unsigned int span = 1;
+	for (int i = 1; i < level; i++) {
+		span *= per_block;
+	}
+	unsigned int *table = (unsigned int *)(disk + (size_t)EXT2_BLOCK_SIZE * block_num);
+	for (unsigned int i = 0; i < per_block; i++) {
+		if ((result = add_tree(disk, entry, table[i], level - 1, lblk + i * span)) < 0) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+
+
+// ---------- Function Implementations ----------
+
+/**
+ * An inode's block map, built now unless the cached one still matches the inode
+ * @param  disk      the disk
+ * @param  inode_idx the inode's index
+ * @return           the map, valid until the inode or the cache changes; NULL
+ *                   if out of memory
+ */
+struct bmap const *bmap_get(unsigned char *disk, unsigned int inode_idx) {
+	struct ext2_inode *inode = get_inode(disk, inode_idx);
+	struct bmap const *map = NULL;
+	pthread_mutex_lock(&lock);
+	struct bmap_entry **link = bmap_link(inode_idx);
+	struct bmap_entry *entry = *link;
+	if (entry != NULL && entry->i_blocks == inode->i_blocks &&
+		memcmp(entry->i_block, inode->i_block, sizeof(entry->i_block)) == 0) {
+		map = &entry->map;
+		goto out;
+	}
+
+	if (entry == NULL) {
+		if (num_entries >= BMAP_MAX_ENTRIES && !shared) {
+			bmap_empty();
+			link = bmap_link(inode_idx);
+		}
+		if ((entry = calloc(1, sizeof(struct bmap_entry))) == NULL) {
+			goto out;
+		}
+		entry->inode_idx = inode_idx;
+		*link = entry;
+		num_entries++;
+	}
+	entry->map.num_data = 0;
+	entry->map.num_owned = 0;
+	entry->i_blocks = inode->i_blocks;
+	memcpy(entry->i_block, inode->i_block, sizeof(entry->i_block));
+
+	// a fast symlink keeps its target where the pointers would be
+	if (is_fast_symlink(inode)) {
+		map = &entry->map;
+		goto out;
+	}
+	unsigned int lblk = 0;
+	for (int i = 0; i < EXT2_N_BLOCKS; i++) {
+		int level = i < EXT2_NDIR_BLOCKS ? 0 : i - EXT2_NDIR_BLOCKS + 1;
+		if (add_tree(disk, entry, inode->i_block[i], level, lblk) < 0) {
+			bmap_drop(link);
+			goto out;
+		}
+		unsigned int span = 1;
+		for (int j = 0; j < level; j++) {
+			span *= EXT2_BLOCK_SIZE / sizeof(unsigned int);
+		}
+		lblk += span;
+	}
+	map = &entry->map;
+
+out:
+	pthread_mutex_unlock(&lock);
+	return map;
+}
+
+/**
+ * Drop an inode's map
+ * @param inode_idx the inode's index
+ */
+void bmap_forget(unsigned int inode_idx) {
+	pthread_mutex_lock(&lock);
+	struct bmap_entry **link = bmap_link(inode_idx);
+	if (*link != NULL) {
+		bmap_drop(link);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Say whether operations run side by side. While they do, a map handed out
+ * to one must outlive the others' lookups, so a full cache is not emptied
+ * but goes on growing, and is emptied once they are done.
+ * @param on 1 when they start, 0 when they are done
+ */
+void bmap_share(int on) {
+	pthread_mutex_lock(&lock);
+	shared = on;
+	if (!on && num_entries >= BMAP_MAX_ENTRIES) {
+		bmap_empty();
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Free the whole cache
+ */
+void bmap_clear(void) {
+	pthread_mutex_lock(&lock);
+	bmap_empty();
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,33 @@
+#ifndef EXT2_BMAP
+#define EXT2_BMAP
+
+/*
+ * Block-map cache: an inode's block tree flattened, the first time it is
+ * asked for, into runs of physically contiguous blocks, so readers and the
+ * bitmap updates that free or re-mark a file work a run at a time instead of
+ * a pointer at a time. A map is checked against the inode's i_block and
+ * i_blocks each time it is handed out and rebuilt if either changed.
+ * Operations running side by side may share the cache between
+ * bmap_share(1) and bmap_share(0), each keeping the inodes whose maps it
+ * holds from changing.
+ */
+
+struct bmap_run {
+	unsigned int lblk; /* first logical block; unused in owned runs */
+	unsigned int pblk; /* first physical block */
+	unsigned int len;
+};
+
+struct bmap {
+	unsigned int num_data;
+	unsigned int num_owned;
+	struct bmap_run *data;	/* the data blocks by logical block, holes left out */
+	struct bmap_run *owned; /* every block the inode owns, indirect blocks included */
+};
+
+struct bmap const *bmap_get(unsigned char *disk, unsigned int inode_idx);
+void bmap_forget(unsigned int inode_idx);
+void bmap_share(int on);
+void bmap_clear(void);
+
+#endif // EXT2_BMAP
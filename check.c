@@ -0,0 +1,785 @@
+/*
+ * The lightweight file system checker behind ext2_checker: detects a small
+ * subset of possible inconsistencies and fixes them in place.
+ *
+ * The work is split in phases so the expensive, read-only parts run on
+ * several threads:
+ *   1. a linear sweep, group by group, counting free bits for a) and noting
+ *      for every in-use inode whether any of its blocks is unmarked for e);
+ *   2. a directory pass fed by a work queue: each worker scans one directory,
+ *      fixes entry types for b) and queues the subdirectories it finds;
+ *   3. a serial merge that walks the scanned directories in the same
+ *      depth-first order as a plain recursive checker, applying c) to e) and
+ *      printing every fix, so the report does not depend on thread timing.
+ *
+ * ext2_check_incremental() instead goes by the image's dirty log (see
+ * dirtylog.h) and runs the same checks on only what changed since the last
+ * check, on one thread.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+#include "dirtylog.h"
+#include "ext2.h"
+#include "stats.h"
+#include "utils.h"
+
+// per-inode flags
+#define INODE_SWEPT			 0x1 /* phase 1 walked the inode's blocks */
+#define INODE_BLOCKS_MISSING 0x2 /* ... and found some not marked in use */
+#define INODE_QUEUED		 0x4 /* directory handed to the phase 2 queue */
+#define INODE_CHECKED		 0x8 /* c) to e) done in the merge */
+
+#define CHECK_MAX_THREADS 64
+
+// free bits counted in one group's bitmaps
+struct group_count {
+	int free_inodes;
+	int free_blocks;
+};
+
+// one entry found while scanning a directory
+struct entry_ref {
+	unsigned int inode;
+	unsigned char type_fixed; /* b) changed its file_type */
+	unsigned char is_subdir;  /* a directory other than . and .. */
+};
+
+// the entries of one scanned directory, in on-disk order
+struct dir_record {
+	int num_entries;
+	int max_entries;
+	int merged;
+	struct entry_ref *entries;
+};
+
+// image being checked, and the number of fixes so far
+static unsigned char *disk;
+static struct ext2_super_block *super_block;
+static int total_err;
+
+// phase results
+static unsigned char *inode_flags;		 // indexed by inode number
+static struct group_count *group_counts; // indexed by group
+static struct dir_record **dir_records;	 // indexed by inode number
+static unsigned int next_group;			 // phase 1 work distribution
+
+// phase 2 queue of directory inodes; each is queued at most once
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int *queue;
+static unsigned int queue_head;
+static unsigned int queue_tail;
+static int queue_busy; // workers scanning a directory right now
+static int scan_failed;
+
+// ---------- Function Declarations ----------
+int ext2_check(unsigned char **disk);
+int ext2_check_parallel(unsigned char **disk, int num_threads);
+int ext2_check_incremental(unsigned char **disk);
+
+
+
+// ---------- Helper Functions ----------
+/**
+ * a) check if the superblock and block group counters for free blocks and free inodes match the
+ * number of free inodes and data blocks as indicated in the respective bitmaps. If an inconsistency
+ * is detected, trust the bitmaps and update the counters.
+ * Uses the per-group counts from the sweep.
+ */
+static void check_counters(void) {
+	unsigned int groups = num_groups(disk);
+	int total_free_inodes = 0;
+	int total_free_blocks = 0;
+	int num_diff = 0;
+
+	for (unsigned int group = 0; group < groups; group++) {
+		struct ext2_group_desc *group_desc = get_group_desc(disk, group);
+
+		int actual_free_inodes = group_counts[group].free_inodes;
+		if (group_desc->bg_free_inodes_count != actual_free_inodes) {
+			num_diff = abs(actual_free_inodes - (int)group_desc->bg_free_inodes_count);
+			group_desc->bg_free_inodes_count = actual_free_inodes;
+			dirty_meta(disk, group_desc, sizeof(*group_desc));
+			total_err += num_diff;
+			printf("Fixed: block group's free inodes counter was off by %d compared to the bitmap\n",
+				   num_diff);
+		}
+		total_free_inodes += actual_free_inodes;
+
+		// check block bitmap
+		int actual_free_blocks = group_counts[group].free_blocks;
+		if (group_desc->bg_free_blocks_count != actual_free_blocks) {
+			num_diff = abs(actual_free_blocks - (int)group_desc->bg_free_blocks_count);
+			group_desc->bg_free_blocks_count = actual_free_blocks;
+			dirty_meta(disk, group_desc, sizeof(*group_desc));
+			total_err += num_diff;
+			printf("Fixed: block group's free blocks counter was off by %d compared to the bitmap\n",
+				   num_diff);
+		}
+		total_free_blocks += actual_free_blocks;
+	}
+
+	if (super_block->s_free_inodes_count != total_free_inodes) {
+		num_diff = abs(total_free_inodes - (int)super_block->s_free_inodes_count);
+		super_block->s_free_inodes_count = total_free_inodes;
+		dirty_meta(disk, super_block, sizeof(*super_block));
+		total_err += num_diff;
+		printf("Fixed: superblock's free inodes counter was off by %d compared to the bitmap\n",
+			   num_diff);
+	}
+	if (super_block->s_free_blocks_count != total_free_blocks) {
+		num_diff = abs(total_free_blocks - (int)super_block->s_free_blocks_count);
+		super_block->s_free_blocks_count = total_free_blocks;
+		dirty_meta(disk, super_block, sizeof(*super_block));
+		total_err += num_diff;
+		printf("Fixed: superblock's free blocks counter was off by %d compared to the bitmap\n",
+			   num_diff);
+	}
+}
+
+/**
+ * b) check if its inode's i_mode matches the directory entry file_type.
+ * If it does not, then trust the inode's i_mode and fix the file_type to match.
+ * Reporting is left to the merge.
+ * @param  inode the inode to be checked
+ * @param  dir   the dirent
+ * @return       1 if the file_type was fixed, 0 otherwise
+ */
+static int check_mode(struct ext2_inode *inode, struct ext2_dir_entry *dir) {
+	unsigned short type = inode->i_mode & EXT2_S_IFMT;
+	unsigned char file_type;
+	if (type == EXT2_S_IFREG) {
+		file_type = EXT2_FT_REG_FILE;
+	} else if (type == EXT2_S_IFDIR) {
+		file_type = EXT2_FT_DIR;
+	} else if (type == EXT2_S_IFLNK) {
+		file_type = EXT2_FT_SYMLINK;
+	} else {
+		return 0;
+	}
+	if (dir->file_type == file_type) {
+		return 0;
+	}
+	dir->file_type = file_type;
+	dirty_meta(disk, dir, sizeof(*dir));
+	return 1;
+}
+
+/**
+ * c) check if inode is marked as allocated in the inode bitmap. If it isn't, then updated the inode
+ * bitmap to indicate that the inode is in use.
+ * @param inode_idx 	inode index to be checked
+ */
+static void check_allocated(unsigned int inode_idx) {
+	if (mark_inode(disk, inode_idx, 1)) {
+		total_err++;
+		printf("Fixed: inode [%d] not marked as in-use\n", inode_idx);
+	}
+}
+
+/**
+ * d) check if inode's i_dtime is set to 0. If it isn't, reset to 0 to indicate that the file should
+ * not be marked for removal
+ * @param inode_idx inode's index
+ * @param inode     the inode
+ */
+static void check_dtime(unsigned int inode_idx, struct ext2_inode *inode) {
+	if (inode->i_dtime != 0) {
+		total_err++;
+		inode->i_dtime = 0;
+		dirty_meta(disk, inode, sizeof(*inode));
+		printf("Fixed: valid inode marked for deletion: [%d]\n", inode_idx);
+	}
+}
+
+/**
+ * e) check if inode's data blocks are allocated in the data bitmap. If any of its blocks is not
+ * allocated, fix this by updating the data bitmap and the corresponding counters in the block group
+ * and superblock.
+ * @param inode_idx the inode idx
+ */
+static void check_block(unsigned int inode_idx) {
+	int block_count = mark_inode_blocks(disk, inode_idx, 1);
+	if (block_count < 0) {
+		fprintf(stderr, "check_block: no memory for the block map of inode [%d]\n", inode_idx);
+	} else if (block_count > 0) {
+		printf("Fixed: %d in-use data blocks not marked in data bitmap for inode: [%d]\n",
+			   block_count, inode_idx);
+		total_err++;
+	}
+}
+
+
+// ---------- Phase 1: Sweep ----------
+
+/**
+ * walk_inode_blocks() visitor for the sweep: stop at the first block that is
+ * out of range (left to the merge) or not marked in use
+ * @return 0 to go on; 1 for an unmarked block; -EINVAL for a bad block number
+ */
+static int sweep_block_visit(unsigned char *disk, unsigned int block, int is_meta, void *arg) {
+	if (block < super_block->s_first_data_block || block >= super_block->s_blocks_count) {
+		return -EINVAL;
+	}
+	return check_block_bit(disk, block) == 0;
+}
+
+/**
+ * Count a group's free bits and sweep its in-use inodes for unmarked blocks
+ * @param group the group number
+ */
+static void sweep_group(unsigned int group) {
+	unsigned int *inode_bitmap = group_inode_bitmap(disk, group);
+	unsigned int *block_bitmap = group_block_bitmap(disk, group);
+	unsigned int inodes_per_group = super_block->s_inodes_per_group;
+
+	unsigned int used_inodes = 0;
+	for (unsigned int i = bitmap_next_set(inode_bitmap, inodes_per_group, 0); i < inodes_per_group;
+		 i = bitmap_next_set(inode_bitmap, inodes_per_group, i + 1)) {
+		used_inodes++;
+
+		// only what looks like a live file; anything else reached later is walked by the merge
+		unsigned int inode_idx = group * inodes_per_group + i + 1;
+		struct ext2_inode *inode = get_inode(disk, inode_idx);
+		unsigned short type = inode->i_mode & EXT2_S_IFMT;
+		if (type != EXT2_S_IFREG && type != EXT2_S_IFDIR && type != EXT2_S_IFLNK) {
+			continue;
+		}
+		int result = walk_inode_blocks(disk, inode, sweep_block_visit, NULL);
+		if (result == 0) {
+			inode_flags[inode_idx] |= INODE_SWEPT;
+		} else if (result == 1) {
+			inode_flags[inode_idx] |= INODE_SWEPT | INODE_BLOCKS_MISSING;
+		}
+	}
+	int free_inodes = inodes_per_group - used_inodes;
+
+	int num_blocks = group_num_blocks(disk, group);
+	int free_blocks = num_blocks - bitmap_count(block_bitmap, num_blocks);
+
+	group_counts[group].free_inodes = free_inodes;
+	group_counts[group].free_blocks = free_blocks;
+}
+
+/**
+ * Phase 1 worker: take groups until none are left
+ */
+static void *sweep_worker(void *arg) {
+	unsigned int groups = num_groups(disk);
+	unsigned int group;
+	while ((group = __atomic_fetch_add(&next_group, 1, __ATOMIC_RELAXED)) < groups) {
+		sweep_group(group);
+	}
+	return NULL;
+}
+
+
+// ---------- Phase 2: Directory Pass ----------
+
+/**
+ * Queue a directory for scanning
+ * @param dir_idx the directory's inode index
+ */
+static void queue_push(unsigned int dir_idx) {
+	pthread_mutex_lock(&queue_lock);
+	queue[queue_tail++] = dir_idx;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+/**
+ * Take the next directory to scan, waiting while others may still queue more
+ * @return the directory's inode index; 0 once the pass is over
+ */
+static unsigned int queue_pop(void) {
+	unsigned int dir_idx = 0;
+	pthread_mutex_lock(&queue_lock);
+	while (queue_head == queue_tail && queue_busy > 0) {
+		pthread_cond_wait(&queue_cond, &queue_lock);
+	}
+	if (queue_head < queue_tail) {
+		dir_idx = queue[queue_head++];
+		queue_busy++;
+	} else { // empty and nobody left to fill it
+		pthread_cond_broadcast(&queue_cond);
+	}
+	pthread_mutex_unlock(&queue_lock);
+	return dir_idx;
+}
+
+/**
+ * Mark the directory taken by queue_pop() as done
+ */
+static void queue_done(void) {
+	pthread_mutex_lock(&queue_lock);
+	queue_busy--;
+	if (queue_busy == 0 && queue_head == queue_tail) {
+		pthread_cond_broadcast(&queue_cond);
+	}
+	pthread_mutex_unlock(&queue_lock);
+}
+
+/**
+ * Record an entry of a directory being scanned
+ * @return 0 on success; -ENOMEM
+ */
+static int record_entry(struct dir_record *record, struct entry_ref entry) {
+	if (record->num_entries == record->max_entries) {
+		int max_entries = record->max_entries ? record->max_entries * 2 : 16;
+		struct entry_ref *grown = realloc(record->entries, sizeof(struct entry_ref) * max_entries);
+		if (grown == NULL) {
+			return -ENOMEM;
+		}
+		record->entries = grown;
+		record->max_entries = max_entries;
+	}
+	record->entries[record->num_entries++] = entry;
+	return 0;
+}
+
+/**
+ * walk_dir() visitor for scan_dir: fix the entry's type (b), record it and
+ * queue it if it is a subdirectory not seen before
+ */
+static int scan_entry_visit(unsigned char *disk, unsigned int dir_idx, struct ext2_dir_entry *entry,
+							int depth, void *arg) {
+	struct dir_record *record = arg;
+	if (entry->inode > super_block->s_inodes_count) {
+		return WALK_NEXT;
+	}
+
+	struct entry_ref ref = {entry->inode, 0, 0};
+	ref.type_fixed = check_mode(get_inode(disk, entry->inode), entry);
+	if (entry->file_type == EXT2_FT_DIR && !is_dot_entry(entry)) {
+		ref.is_subdir = 1;
+		if (!(__atomic_fetch_or(&inode_flags[entry->inode], INODE_QUEUED, __ATOMIC_RELAXED) &
+			  INODE_QUEUED)) {
+			queue_push(entry->inode);
+		}
+	}
+	return record_entry(record, ref) < 0 ? -ENOMEM : WALK_NEXT;
+}
+
+/**
+ * Scan one directory's blocks: fix entry types (b) and queue new subdirectories
+ * @param  dir_idx the directory's inode index
+ * @return         0 on success; -ENOMEM
+ */
+static int scan_dir(unsigned int dir_idx) {
+	struct dir_record *record = calloc(1, sizeof(struct dir_record));
+	if (record == NULL) {
+		return -ENOMEM;
+	}
+	dir_records[dir_idx] = record;
+	return walk_dir(disk, dir_idx, scan_entry_visit, record);
+}
+
+/**
+ * Phase 2 worker: scan directories until the queue runs dry
+ */
+static void *dir_worker(void *arg) {
+	unsigned int dir_idx;
+	while ((dir_idx = queue_pop()) != 0) {
+		if (scan_dir(dir_idx) < 0) {
+			__atomic_store_n(&scan_failed, 1, __ATOMIC_RELAXED);
+		}
+		queue_done();
+	}
+	return NULL;
+}
+
+
+// ---------- Phase 3: Merge ----------
+
+/**
+ * Report and fix b) to e) for a scanned directory and, depth first, for every
+ * directory below it, in the order a recursive walk from the root visits them.
+ * Keeps its own stack of (directory, next entry) so depth costs no call stack.
+ * @param  root_idx the directory's inode index
+ * @return          0 on success; -ENOMEM
+ */
+static int merge_dir(unsigned int root_idx) {
+	int max_depth = 16;
+	struct merge_frame {
+		struct dir_record *record;
+		int next;
+	} *stack = malloc(sizeof(struct merge_frame) * max_depth); // FREE
+	if (stack == NULL) {
+		return -ENOMEM;
+	}
+
+	int depth = 0;
+	stack[0].record = dir_records[root_idx];
+	stack[0].next = 0;
+	stack[0].record->merged = 1;
+	while (depth >= 0) {
+		struct dir_record *record = stack[depth].record;
+		if (stack[depth].next == record->num_entries) {
+			depth--;
+			continue;
+		}
+		struct entry_ref *entry = &record->entries[stack[depth].next++];
+		struct ext2_inode *curr_inode = get_inode(disk, entry->inode);
+
+		if (entry->type_fixed) {
+			total_err++;
+			printf("Fixed: Entry type vs inode mismatch: inode [%d]\n", entry->inode);
+		}
+		if (!(inode_flags[entry->inode] & INODE_CHECKED)) { // later links find nothing new
+			inode_flags[entry->inode] |= INODE_CHECKED;
+			check_allocated(entry->inode);
+			check_dtime(entry->inode, curr_inode);
+			if ((inode_flags[entry->inode] & (INODE_SWEPT | INODE_BLOCKS_MISSING)) != INODE_SWEPT) {
+				check_block(entry->inode);
+			}
+		}
+
+		struct dir_record *child = entry->is_subdir ? dir_records[entry->inode] : NULL;
+		if (child == NULL || child->merged) {
+			continue;
+		}
+		child->merged = 1;
+		if (depth + 1 == max_depth) {
+			struct merge_frame *grown = realloc(stack, sizeof(struct merge_frame) * max_depth * 2);
+			if (grown == NULL) {
+				free(stack);
+				return -ENOMEM;
+			}
+			stack = grown;
+			max_depth *= 2;
+		}
+		depth++;
+		stack[depth].record = child;
+		stack[depth].next = 0;
+	}
+	free(stack);
+	return 0;
+}
+
+/**
+ * Start count threads on fn, falling back to running it here if none start
+ */
+static void run_workers(void *(*fn)(void *), int count) {
+	pthread_t threads[CHECK_MAX_THREADS];
+	int started = 0;
+	while (started < count && pthread_create(&threads[started], NULL, fn, NULL) == 0) {
+		started++;
+	}
+	if (started == 0) {
+		fn(NULL);
+	}
+	for (int i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+}
+
+/**
+ * Free the phase results
+ */
+static void free_results(void) {
+	if (dir_records != NULL) {
+		for (unsigned int i = 0; i <= super_block->s_inodes_count; i++) {
+			if (dir_records[i] != NULL) {
+				free(dir_records[i]->entries);
+				free(dir_records[i]);
+			}
+		}
+	}
+	free(dir_records);
+	free(inode_flags);
+	free(group_counts);
+	free(queue);
+	dir_records = NULL;
+	inode_flags = NULL;
+	group_counts = NULL;
+	queue = NULL;
+}
+
+
+// ---------- Incremental Check ----------
+
+/**
+ * c) to e) for an inode, the first time it comes up
+ * @param inode_idx the inode's index
+ */
+static void check_inode_once(unsigned int inode_idx) {
+	if (inode_flags[inode_idx] & INODE_CHECKED) {
+		return;
+	}
+	inode_flags[inode_idx] |= INODE_CHECKED;
+	check_allocated(inode_idx);
+	check_dtime(inode_idx, get_inode(disk, inode_idx));
+	check_block(inode_idx);
+}
+
+/**
+ * b) to e) for the entries of one directory block an operation changed
+ * @param block the block
+ */
+static void check_dir_block(unsigned char *block) {
+	int offset = 0;
+	while (offset <= EXT2_BLOCK_SIZE - (int)sizeof(struct ext2_dir_entry)) {
+		struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(block + offset);
+		if (entry->rec_len == 0) { // corrupt block
+			break;
+		}
+		offset += entry->rec_len;
+		if (entry->inode == 0 || entry->inode > super_block->s_inodes_count) {
+			continue;
+		}
+		if (check_mode(get_inode(disk, entry->inode), entry)) {
+			total_err++;
+			printf("Fixed: Entry type vs inode mismatch: inode [%d]\n", entry->inode);
+		}
+		check_inode_once(entry->inode);
+	}
+}
+
+/**
+ * Sort the metadata blocks in the dirty log by what they hold: flag the
+ * groups whose bitmaps, descriptor or inode table changed for a recount,
+ * and leave set in blocks only the inode table blocks, directory and
+ * indirect blocks
+ * @param blocks  the log's changed blocks, one bit per block
+ * @param recount set to 1 per group to count again
+ */
+static void sort_dirty_blocks(unsigned char *blocks, unsigned char *recount) {
+	unsigned int num_blocks = super_block->s_blocks_count;
+	unsigned int groups = num_groups(disk);
+	unsigned int per_desc_block = EXT2_BLOCK_SIZE / sizeof(struct ext2_group_desc);
+	unsigned int desc_first = super_block->s_first_data_block + 1;
+	unsigned int desc_end = desc_first + (groups + per_desc_block - 1) / per_desc_block;
+	unsigned int table_blocks =
+		(super_block->s_inodes_per_group * EXT2_INODE_SIZE + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+
+	for (unsigned int block = bitmap_next_set(blocks, num_blocks, 0); block < num_blocks;
+		 block = bitmap_next_set(blocks, num_blocks, block + 1)) {
+		if (block <= super_block->s_first_data_block) { // the superblock: always summed up
+			blocks[block / 8] &= ~(1 << (block % 8));
+			continue;
+		}
+		if (block >= desc_first && block < desc_end) {
+			unsigned int first = (block - desc_first) * per_desc_block;
+			for (unsigned int group = first; group < groups && group < first + per_desc_block; group++) {
+				recount[group] = 1;
+			}
+			blocks[block / 8] &= ~(1 << (block % 8));
+			continue;
+		}
+		unsigned int group = block_group(disk, block);
+		if (group >= groups) {
+			continue;
+		}
+		struct ext2_group_desc *group_desc = get_group_desc(disk, group);
+		if (block == group_desc->bg_block_bitmap || block == group_desc->bg_inode_bitmap) {
+			recount[group] = 1;
+			blocks[block / 8] &= ~(1 << (block % 8));
+		} else if (block >= group_desc->bg_inode_table &&
+				   block < group_desc->bg_inode_table + table_blocks) {
+			recount[group] = 1;
+		}
+	}
+}
+
+/**
+ * d) and e) for the live inodes of the inode table blocks an operation
+ * changed that no changed entry led to
+ * @param blocks the changed blocks, as sort_dirty_blocks() left them
+ */
+static void check_dirty_inodes(unsigned char const *blocks) {
+	unsigned int inodes_per_group = super_block->s_inodes_per_group;
+	unsigned int inodes_per_block = EXT2_BLOCK_SIZE / EXT2_INODE_SIZE;
+	for (unsigned int group = 0; group < num_groups(disk); group++) {
+		unsigned int table = get_group_desc(disk, group)->bg_inode_table;
+		for (unsigned int i = 0; i < inodes_per_group; i += inodes_per_block) {
+			unsigned int block = table + i / inodes_per_block;
+			if (!(blocks[block / 8] & (1 << (block % 8)))) {
+				continue;
+			}
+			for (unsigned int j = i; j < i + inodes_per_block && j < inodes_per_group; j++) {
+				unsigned int inode_idx = group * inodes_per_group + j + 1;
+				struct ext2_inode *inode = get_inode(disk, inode_idx);
+				if ((inode_idx == EXT2_ROOT_INO || inode_idx >= ext2_cur->first_ino) &&
+					inode->i_links_count > 0 && check_inode_bit(disk, inode_idx)) {
+					check_inode_once(inode_idx);
+				}
+			}
+		}
+	}
+}
+
+
+
+// ---------- Function Implementations ----------
+
+/**
+ * Check the image and repair what is found, with one thread per online CPU
+ * @param  image_disk the disk
+ * @return            number of inconsistencies repaired; -ENOMEM
+ */
+int ext2_check(unsigned char **image_disk) {
+	return ext2_check_parallel(image_disk, 0);
+}
+
+/**
+ * Check the image and repair what is found: a) the free counters, then b) to e)
+ * for every entry reachable from the root. Each fix is reported on stdout, in
+ * the same order whatever the number of threads.
+ * @param  image_disk  the disk
+ * @param  num_threads worker threads per phase; 0 for one per online CPU
+ * @return             number of inconsistencies repaired; -ENOMEM
+ */
+int ext2_check_parallel(unsigned char **image_disk, int num_threads) {
+	disk = *image_disk;
+	super_block = get_super_block(disk);
+	total_err = 0;
+
+	if (num_threads <= 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		num_threads = cpus > 0 ? cpus : 1;
+	}
+	if (num_threads > CHECK_MAX_THREADS) {
+		num_threads = CHECK_MAX_THREADS;
+	}
+
+	unsigned int groups = num_groups(disk);
+	inode_flags = calloc(super_block->s_inodes_count + 1, sizeof(unsigned char));
+	group_counts = calloc(groups, sizeof(struct group_count));
+	dir_records = calloc(super_block->s_inodes_count + 1, sizeof(struct dir_record *));
+	queue = malloc(sizeof(unsigned int) * (super_block->s_inodes_count + 1));
+	if (inode_flags == NULL || group_counts == NULL || dir_records == NULL || queue == NULL) {
+		perror("ext2_check: malloc");
+		free_results();
+		return -ENOMEM;
+	}
+
+	// 1. sweep the bitmaps and inode tables, then a)
+	STAT_PHASE_BEGIN(PHASE_CHECK_SWEEP);
+	next_group = 0;
+	run_workers(sweep_worker, num_threads < groups ? num_threads : groups);
+	check_counters();
+	STAT_PHASE_END(PHASE_CHECK_SWEEP);
+
+	// 2. scan every directory reachable from the root
+	STAT_PHASE_BEGIN(PHASE_CHECK_SCAN);
+	queue_head = 0;
+	queue_tail = 0;
+	queue_busy = 0;
+	scan_failed = 0;
+	inode_flags[EXT2_ROOT_INO] |= INODE_QUEUED;
+	queue_push(EXT2_ROOT_INO);
+	run_workers(dir_worker, num_threads);
+	STAT_PHASE_END(PHASE_CHECK_SCAN);
+	if (scan_failed) {
+		fprintf(stderr, "ext2_check: out of memory while scanning directories\n");
+		free_results();
+		return -ENOMEM;
+	}
+
+	// 3. b) to e) in directory order
+	STAT_PHASE_BEGIN(PHASE_CHECK_MERGE);
+	int merged = merge_dir(EXT2_ROOT_INO);
+	STAT_PHASE_END(PHASE_CHECK_MERGE);
+	if (merged < 0) {
+		fprintf(stderr, "ext2_check: out of memory while merging\n");
+		free_results();
+		return -ENOMEM;
+	}
+
+	free_results();
+	return total_err;
+}
+
+
+/**
+ * Check only what the image's dirty log says changed since its last check,
+ * trusting the rest: a) for the groups whose bitmaps, descriptors or inode
+ * tables changed and the superblock, b) to e) for the entries in the changed
+ * blocks of the directories the log names, then d) and e) for the other
+ * live inodes in changed inode table blocks. Fixes are reported as by
+ * ext2_check(), which it falls back to if the image has no usable log. The
+ * caller starts the log over with dirtylog_reset() once the fixes are in.
+ * @param  image_disk the disk
+ * @return            number of inconsistencies repaired; -ENOMEM
+ */
+int ext2_check_incremental(unsigned char **image_disk) {
+	disk = *image_disk;
+	super_block = get_super_block(disk);
+	total_err = 0;
+
+	unsigned char *blocks; // FREE
+	unsigned char *dirs;   // FREE
+	int result = dirtylog_read(ext2_cur, &blocks, &dirs);
+	if (result == -ENOENT || result == -EINVAL) {
+		fprintf(stderr, "ext2_check_incremental: no dirty log to go by, checking everything\n");
+		return ext2_check(image_disk);
+	}
+	if (result < 0) {
+		fprintf(stderr, "ext2_check_incremental: cannot read the dirty log: %s\n", strerror(-result));
+		return result;
+	}
+
+	unsigned int groups = num_groups(disk);
+	unsigned char *recount = calloc(groups, 1); // FREE
+	inode_flags = calloc(super_block->s_inodes_count + 1, sizeof(unsigned char));
+	group_counts = malloc(sizeof(struct group_count) * groups);
+	if (recount == NULL || inode_flags == NULL || group_counts == NULL) {
+		perror("ext2_check_incremental: malloc");
+		free(blocks);
+		free(dirs);
+		free(recount);
+		free_results();
+		return -ENOMEM;
+	}
+
+	// a) counting only the groups that changed; the others keep their counters
+	sort_dirty_blocks(blocks, recount);
+	for (unsigned int group = 0; group < groups; group++) {
+		struct ext2_group_desc *group_desc = get_group_desc(disk, group);
+		group_counts[group].free_inodes = group_desc->bg_free_inodes_count;
+		group_counts[group].free_blocks = group_desc->bg_free_blocks_count;
+		if (recount[group]) {
+			int num_blocks = group_num_blocks(disk, group);
+			group_counts[group].free_inodes =
+				super_block->s_inodes_per_group -
+				bitmap_count(group_inode_bitmap(disk, group), super_block->s_inodes_per_group);
+			group_counts[group].free_blocks =
+				num_blocks - bitmap_count(group_block_bitmap(disk, group), num_blocks);
+		}
+	}
+	check_counters();
+
+	// b) to e) for the changed blocks of the changed directories
+	unsigned int num_inodes = super_block->s_inodes_count;
+	for (unsigned int dir_idx = bitmap_next_set(dirs, num_inodes + 1, 0); dir_idx <= num_inodes;
+		 dir_idx = bitmap_next_set(dirs, num_inodes + 1, dir_idx + 1)) {
+		struct ext2_inode *dir_inode = get_inode(disk, dir_idx);
+		if (dir_idx == 0 || (dir_inode->i_mode & EXT2_S_IFMT) != EXT2_S_IFDIR ||
+			dir_inode->i_links_count == 0 || !check_inode_bit(disk, dir_idx)) {
+			continue; // removed since
+		}
+		unsigned int num_blocks = dir_num_blocks(dir_inode);
+		for (unsigned int lblk = 0; lblk < num_blocks; lblk++) {
+			unsigned int block = inode_block(disk, dir_inode, lblk);
+			unsigned char *data = dir_block(disk, dir_inode, lblk);
+			if (data != NULL && (blocks[block / 8] & (1 << (block % 8)))) {
+				check_dir_block(data);
+			}
+		}
+	}
+
+	check_dirty_inodes(blocks);
+
+	free(blocks);
+	free(dirs);
+	free(recount);
+	free_results();
+	return total_err;
+}
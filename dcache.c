@@ -0,0 +1,271 @@
+/*
+ * Dentry cache shared by the path resolver and the directory update helpers.
+ * Safe to use from several threads: the buckets are locked by stripe.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dcache.h"
+
+// one cached name; name_len 0 is the "directory fully scanned" marker
+struct dcache_entry {
+	struct dcache_entry *next;
+	unsigned int parent_idx;
+	unsigned int hash;
+	unsigned int inode_idx;
+	unsigned char name_len;
+	char name[];
+};
+
+#define DCACHE_MIN_BUCKETS 1024
+
+static struct dcache_entry **buckets;
+static unsigned int num_buckets;
+static unsigned int num_entries;
+
+// a bucket's stripe is the low bits of its hashes, so it stays the same as
+// the table grows; growing or clearing it takes every stripe
+#define DCACHE_LOCKS 64
+static pthread_mutex_t locks[DCACHE_LOCKS] = {[0 ... DCACHE_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER};
+
+// ---------- Function Declarations ----------
+int dcache_lookup(unsigned int parent_idx, char const *name, int name_len);
+void dcache_insert(unsigned int parent_idx, char const *name, int name_len, unsigned int inode_idx);
+void dcache_remove(unsigned int parent_idx, char const *name, int name_len);
+void dcache_set_complete(unsigned int parent_idx);
+void dcache_forget_dir(unsigned int parent_idx);
+void dcache_clear(void);
+
+
+
+// ---------- Helper Functions ----------
+
+/**
+ * FNV-1a hash of the name, seeded with the parent so equal names in different
+ * directories land in different buckets
+ * @param  parent_idx parent dir's inode index
+ * @param  name       the name
+ * @param  name_len   length of the name
+ * @return            the hash
+ */
+static unsigned int dcache_hash(unsigned int parent_idx, char const *name, int name_len) {
+	unsigned int hash = 2166136261u ^ parent_idx;
+	for (int i = 0; i < name_len; i++) {
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/**
+ * Find the link pointing at the matching entry, or at the NULL ending its chain
+ * @return the link
+ */
+static struct dcache_entry **dcache_find(unsigned int parent_idx, unsigned int hash,
+										 char const *name, int name_len) {
+	struct dcache_entry **link = &buckets[hash & (num_buckets - 1)];
+	for (; *link != NULL; link = &(*link)->next) {
+		struct dcache_entry *entry = *link;
+		if (entry->hash == hash && entry->parent_idx == parent_idx &&
+			entry->name_len == name_len && memcmp(entry->name, name, name_len) == 0) {
+			break;
+		}
+	}
+	return link;
+}
+
+static void dcache_lock_all(void) {
+	for (int i = 0; i < DCACHE_LOCKS; i++) {
+		pthread_mutex_lock(&locks[i]);
+	}
+}
+
+static void dcache_unlock_all(void) {
+	for (int i = DCACHE_LOCKS - 1; i >= 0; i--) {
+		pthread_mutex_unlock(&locks[i]);
+	}
+}
+
+/**
+ * Whether the cache holds a name, with its stripe locked
+ * @return the entry's inode index; -1 if it is not cached
+ */
+static long dcache_get(unsigned int parent_idx, char const *name, int name_len) {
+	unsigned int hash = dcache_hash(parent_idx, name, name_len);
+	long found = -1;
+	pthread_mutex_lock(&locks[hash % DCACHE_LOCKS]);
+	if (num_buckets > 0) {
+		struct dcache_entry *entry = *dcache_find(parent_idx, hash, name, name_len);
+		if (entry != NULL) {
+			found = entry->inode_idx;
+		}
+	}
+	pthread_mutex_unlock(&locks[hash % DCACHE_LOCKS]);
+	return found;
+}
+
+/**
+ * Double the bucket array once the chains get longer than one entry on
+ * average. Called with every stripe locked.
+ */
+static void dcache_grow(void) {
+	unsigned int new_num = num_buckets ? num_buckets * 2 : DCACHE_MIN_BUCKETS;
+	struct dcache_entry **new_buckets = calloc(new_num, sizeof(struct dcache_entry *));
+	if (new_buckets == NULL) { // keep using the old table, chains just get longer
+		return;
+	}
+	for (unsigned int i = 0; i < num_buckets; i++) {
+		struct dcache_entry *entry = buckets[i];
+		while (entry != NULL) {
+			struct dcache_entry *next = entry->next;
+			struct dcache_entry **head = &new_buckets[entry->hash & (new_num - 1)];
+			entry->next = *head;
+			*head = entry;
+			entry = next;
+		}
+	}
+	free(buckets);
+	buckets = new_buckets;
+	num_buckets = new_num;
+}
+
+
+
+// ---------- Function Implementations ----------
+
+/**
+ * Look a name up in the cache
+ * @param  parent_idx parent dir's inode index
+ * @param  name       the name (not necessarily null-terminated)
+ * @param  name_len   length of the name
+ * @return            the entry's inode index on a hit
+ * 					  -ENOENT if the dir is complete and has no such name
+ * 					  0 if the cache does not know
+ */
+int dcache_lookup(unsigned int parent_idx, char const *name, int name_len) {
+	long found = dcache_get(parent_idx, name, name_len);
+	if (found >= 0) {
+		return found;
+	}
+	if (dcache_get(parent_idx, "", 0) >= 0) {
+		return -ENOENT;
+	}
+	return 0;
+}
+
+/**
+ * Add or update a name in the cache
+ * @param parent_idx parent dir's inode index
+ * @param name       the name (not necessarily null-terminated)
+ * @param name_len   length of the name
+ * @param inode_idx  the entry's inode index
+ */
+void dcache_insert(unsigned int parent_idx, char const *name, int name_len, unsigned int inode_idx) {
+	if (__atomic_load_n(&num_entries, __ATOMIC_RELAXED) >= __atomic_load_n(&num_buckets, __ATOMIC_RELAXED)) {
+		dcache_lock_all();
+		if (num_entries >= num_buckets) {
+			dcache_grow();
+		}
+		dcache_unlock_all();
+	}
+	unsigned int hash = dcache_hash(parent_idx, name, name_len);
+	pthread_mutex_t *lock = &locks[hash % DCACHE_LOCKS];
+	pthread_mutex_lock(lock);
+	if (num_buckets == 0) {
+		goto out;
+	}
+	struct dcache_entry **link = dcache_find(parent_idx, hash, name, name_len);
+	if (*link != NULL) {
+		(*link)->inode_idx = inode_idx;
+		goto out;
+	}
+	struct dcache_entry *entry = malloc(sizeof(struct dcache_entry) + name_len);
+	if (entry == NULL) { // the cache is only an accelerator
+		goto out;
+	}
+	entry->next = NULL;
+	entry->parent_idx = parent_idx;
+	entry->hash = hash;
+	entry->inode_idx = inode_idx;
+	entry->name_len = name_len;
+	memcpy(entry->name, name, name_len);
+	*link = entry;
+	__atomic_add_fetch(&num_entries, 1, __ATOMIC_RELAXED);
+
+out:
+	pthread_mutex_unlock(lock);
+}
+
+/**
+ * Drop a name from the cache after its dirent was removed
+ * @param parent_idx parent dir's inode index
+ * @param name       the name (not necessarily null-terminated)
+ * @param name_len   length of the name
+ */
+void dcache_remove(unsigned int parent_idx, char const *name, int name_len) {
+	unsigned int hash = dcache_hash(parent_idx, name, name_len);
+	pthread_mutex_lock(&locks[hash % DCACHE_LOCKS]);
+	if (num_buckets > 0) {
+		struct dcache_entry **link = dcache_find(parent_idx, hash, name, name_len);
+		if (*link != NULL) {
+			struct dcache_entry *entry = *link;
+			*link = entry->next;
+			free(entry);
+			__atomic_sub_fetch(&num_entries, 1, __ATOMIC_RELAXED);
+		}
+	}
+	pthread_mutex_unlock(&locks[hash % DCACHE_LOCKS]);
+}
+
+/**
+ * Mark a directory as fully cached, so misses become authoritative
+ * @param parent_idx the dir's inode index
+ */
+void dcache_set_complete(unsigned int parent_idx) {
+	dcache_insert(parent_idx, "", 0, 0);
+}
+
+/**
+ * Forget everything cached for a directory
+ * @param parent_idx the dir's inode index
+ */
+void dcache_forget_dir(unsigned int parent_idx) {
+	dcache_lock_all();
+	for (unsigned int i = 0; i < num_buckets; i++) {
+		struct dcache_entry **link = &buckets[i];
+		while (*link != NULL) {
+			struct dcache_entry *entry = *link;
+			if (entry->parent_idx == parent_idx) {
+				*link = entry->next;
+				free(entry);
+				num_entries--;
+			} else {
+				link = &entry->next;
+			}
+		}
+	}
+	dcache_unlock_all();
+}
+
+/**
+ * Free the whole cache
+ */
+void dcache_clear(void) {
+	dcache_lock_all();
+	for (unsigned int i = 0; i < num_buckets; i++) {
+		struct dcache_entry *entry = buckets[i];
+		while (entry != NULL) {
+			struct dcache_entry *next = entry->next;
+			free(entry);
+			entry = next;
+		}
+	}
+	free(buckets);
+	buckets = NULL;
+	num_buckets = 0;
+	num_entries = 0;
+	dcache_unlock_all();
+}
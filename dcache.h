@@ -0,0 +1,18 @@
+#ifndef EXT2_DCACHE
+#define EXT2_DCACHE
+
+/*
+ * In-memory cache of directory entries keyed by (parent inode, name hash).
+ * Filled in while directory blocks are scanned; a directory that has been
+ * scanned to the end is marked complete so misses on it are answered
+ * without touching its blocks again.
+ */
+
+int dcache_lookup(unsigned int parent_idx, char const *name, int name_len);
+void dcache_insert(unsigned int parent_idx, char const *name, int name_len, unsigned int inode_idx);
+void dcache_remove(unsigned int parent_idx, char const *name, int name_len);
+void dcache_set_complete(unsigned int parent_idx);
+void dcache_forget_dir(unsigned int parent_idx);
+void dcache_clear(void);
+
+#endif // EXT2_DCACHE
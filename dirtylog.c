@@ -0,0 +1,443 @@
+/*
+ * Persistent dirty log for incremental checks. See dirtylog.h.
+ *
+ * The log is a header naming the image, then one record per committed
+ * operation:
+ *
+ *     struct dirtylog_header | record ...
+ *     record = struct dirtylog_record | block number per block | inode number per directory
+ *
+ * Records are only ever appended, so only the last one can be torn.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+#include "dirtylog.h"
+#include "ext2.h"
+#include "journal.h"
+#include "utils.h"
+
+#define DIRTYLOG_MAGIC 0x44325845u		  /* "EX2D" */
+#define DIRTYLOG_RECORD_MAGIC 0x52325845u /* "EX2R" */
+
+struct dirtylog_header {
+	uint32_t magic;
+	uint32_t blocks_count;
+	uint32_t inodes_count;
+	uint32_t reserved;
+	uint8_t uuid[16];
+};
+
+struct dirtylog_record {
+	uint32_t magic;
+	uint32_t num_blocks;
+	uint32_t num_dirs;
+	uint32_t checksum; /* FNV-1a over the numbers that follow */
+};
+
+// dirty_dir() is called by operations running side by side; the rest only
+// when one runs alone
+static pthread_mutex_t dirs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// ---------- Function Declarations ----------
+int dirtylog_attach(struct ext2_image *image, char const *file_name);
+void dirtylog_detach(struct ext2_image *image);
+void dirty_dir(unsigned char *disk, unsigned int dir_idx);
+void dirtylog_append(struct ext2_image *image, unsigned int const *meta, unsigned int logged);
+void dirtylog_discard(struct ext2_image *image);
+void dirtylog_drop(struct ext2_image *image, char const *why);
+int dirtylog_sync(struct ext2_image *image);
+int dirtylog_reset(struct ext2_image *image);
+int dirtylog_read(struct ext2_image *image, unsigned char **blocks, unsigned char **dirs);
+
+
+
+// ---------- Helper Functions ----------
+
+/**
+ * Name of an image's dirty log
+ * @return the malloc'ed path; NULL if out of memory
+ */
+static char *dirtylog_path(char const *file_name) {
+	char *path = malloc(strlen(file_name) + sizeof(".dirty"));
+	if (path != NULL) {
+		strcpy(path, file_name);
+		strcat(path, ".dirty");
+	}
+	return path;
+}
+
+/**
+ * FNV-1a over a record's numbers
+ */
+static uint32_t record_checksum(uint32_t const *numbers, size_t count) {
+	uint32_t hash = 2166136261u;
+	unsigned char const *bytes = (unsigned char const *)numbers;
+	for (size_t i = 0; i < count * sizeof(uint32_t); i++) {
+		hash ^= bytes[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/**
+ * The header a log of this image starts with
+ */
+static void make_header(struct ext2_image *image, struct dirtylog_header *header) {
+	memset(header, 0, sizeof(*header));
+	header->magic = DIRTYLOG_MAGIC;
+	header->blocks_count = image->super_block->s_blocks_count;
+	header->inodes_count = image->super_block->s_inodes_count;
+	memcpy(header->uuid, image->super_block->s_uuid, sizeof(header->uuid));
+}
+
+/**
+ * write all of buf at the end of the log, retrying short writes
+ * @return 0 on success; errno on failure
+ */
+static int write_full(int fd, void const *buf, size_t len) {
+	unsigned char const *bytes = buf;
+	while (len > 0) {
+		ssize_t written = write(fd, bytes, len);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		bytes += written;
+		len -= written;
+	}
+	return 0;
+}
+
+/**
+ * Give up on the log after a failure to keep it: remove it, so the next
+ * incremental check falls back to a full one instead of trusting a log with
+ * changes missing
+ */
+static void drop_log(struct ext2_image *image, char const *why) {
+	fprintf(stderr, "dirtylog: %s, removing %s; the next check will be a full one\n", why,
+			image->dirty_path);
+	close(image->dirty_fd);
+	unlink(image->dirty_path);
+	image->dirty_fd = -1;
+	image->dirty_unsynced = 0;
+	image->num_dirty_dirs = 0;
+}
+
+
+
+// ---------- Function Implementations ----------
+
+/**
+ * Open an image's dirty log, if it has one that is about this image
+ * @param  image     the image, with its superblock mapped
+ * @param  file_name the image file name
+ * @return           0 on success, log or not; -ENOMEM
+ */
+int dirtylog_attach(struct ext2_image *image, char const *file_name) {
+	image->dirty_fd = -1;
+	image->dirty_unsynced = 0;
+	image->dirty_dirs = NULL;
+	image->num_dirty_dirs = 0;
+	image->max_dirty_dirs = 0;
+	if ((image->dirty_path = dirtylog_path(file_name)) == NULL) {
+		perror("dirtylog_attach: malloc");
+		return -ENOMEM;
+	}
+
+	int fd = open(image->dirty_path, O_RDWR | O_APPEND);
+	if (fd < 0) { // never checked: nothing to record against
+		return 0;
+	}
+	struct dirtylog_header header;
+	struct dirtylog_header expected;
+	make_header(image, &expected);
+	if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+		memcmp(&header, &expected, sizeof(header)) != 0) { // left to the next check to replace
+		close(fd);
+		return 0;
+	}
+	image->dirty_fd = fd;
+	return 0;
+}
+
+
+/**
+ * Close an image's dirty log. Call after the journal is detached, whose
+ * last flush syncs it.
+ * @param image the image
+ */
+void dirtylog_detach(struct ext2_image *image) {
+	if (image->dirty_fd >= 0) {
+		close(image->dirty_fd);
+	}
+	free(image->dirty_path);
+	free(image->dirty_dirs);
+	image->dirty_path = NULL;
+	image->dirty_dirs = NULL;
+	image->dirty_fd = -1;
+	image->dirty_unsynced = 0;
+	image->num_dirty_dirs = 0;
+	image->max_dirty_dirs = 0;
+}
+
+
+/**
+ * Flag a directory whose entries the operation in progress changes, for the
+ * next incremental check to scan the blocks of it the operation changed
+ * @param disk    the disk
+ * @param dir_idx the directory's inode index
+ */
+void dirty_dir(unsigned char *disk, unsigned int dir_idx) {
+	struct ext2_image *image = ext2_cur;
+	pthread_mutex_lock(&dirs_lock);
+	if (image->dirty_fd < 0) {
+		goto out;
+	}
+	if (image->num_dirty_dirs > 0 && image->dirty_dirs[image->num_dirty_dirs - 1] == dir_idx) {
+		goto out; // the usual case: one directory changed over and over
+	}
+	if (image->num_dirty_dirs == image->max_dirty_dirs) {
+		int max_dirs = image->max_dirty_dirs ? image->max_dirty_dirs * 2 : 16;
+		unsigned int *grown = realloc(image->dirty_dirs, sizeof(unsigned int) * max_dirs);
+		if (grown == NULL) {
+			drop_log(image, "out of memory");
+			goto out;
+		}
+		image->dirty_dirs = grown;
+		image->max_dirty_dirs = max_dirs;
+	}
+	image->dirty_dirs[image->num_dirty_dirs++] = dir_idx;
+
+out:
+	pthread_mutex_unlock(&dirs_lock);
+}
+
+
+/**
+ * Append the record of an operation being committed: the metadata blocks it
+ * changed and the directories flagged with dirty_dir(). Not synced; see
+ * dirtylog_sync(). A log that cannot be written to is dropped.
+ * @param image  the image
+ * @param meta   the metadata blocks the operation changed
+ * @param logged how many
+ */
+void dirtylog_append(struct ext2_image *image, unsigned int const *meta, unsigned int logged) {
+	if (image->dirty_fd < 0) {
+		return;
+	}
+	unsigned int count = logged + image->num_dirty_dirs;
+	if (count == 0) {
+		return;
+	}
+
+	size_t len = sizeof(struct dirtylog_record) + sizeof(uint32_t) * count;
+	struct dirtylog_record *record = malloc(len); // FREE
+	if (record == NULL) {
+		drop_log(image, "out of memory");
+		return;
+	}
+	uint32_t *numbers = (uint32_t *)(record + 1);
+	unsigned int n = 0;
+	for (unsigned int i = 0; i < logged; i++) {
+		numbers[n++] = meta[i];
+	}
+	for (int i = 0; i < image->num_dirty_dirs; i++) {
+		numbers[n++] = image->dirty_dirs[i];
+	}
+	record->magic = DIRTYLOG_RECORD_MAGIC;
+	record->num_blocks = logged;
+	record->num_dirs = image->num_dirty_dirs;
+	record->checksum = record_checksum(numbers, count);
+	image->num_dirty_dirs = 0;
+
+	int result = write_full(image->dirty_fd, record, len);
+	free(record);
+	if (result < 0) {
+		drop_log(image, strerror(-result));
+		return;
+	}
+	image->dirty_unsynced = 1;
+}
+
+
+/**
+ * Forget the directories flagged by an operation being undone
+ * @param image the image
+ */
+void dirtylog_discard(struct ext2_image *image) {
+	image->num_dirty_dirs = 0;
+}
+
+
+/**
+ * Remove an image's dirty log ahead of changes it cannot describe
+ * @param image the image
+ * @param why   what the changes are, for the message
+ */
+void dirtylog_drop(struct ext2_image *image, char const *why) {
+	if (image->dirty_fd >= 0) {
+		drop_log(image, why);
+	}
+}
+
+
+/**
+ * Make the records appended since the last flush durable, before the flush
+ * lets the changes they describe reach the image
+ * @param  image the image
+ * @return       0 on success; errno on failure
+ */
+int dirtylog_sync(struct ext2_image *image) {
+	if (image->dirty_fd < 0 || !image->dirty_unsynced) {
+		return 0;
+	}
+	if (fdatasync(image->dirty_fd) < 0) {
+		return -errno;
+	}
+	image->dirty_unsynced = 0;
+	return 0;
+}
+
+
+/**
+ * Start an image's dirty log over, creating it if need be: the image has
+ * just been checked, so nothing it holds needs checking again. Operations
+ * committed before are flushed first, so what was checked is what a crash
+ * would leave.
+ * @param  image the image
+ * @return       0 on success; errno on failure
+ */
+int dirtylog_reset(struct ext2_image *image) {
+	int result;
+	if ((result = journal_flush(image)) < 0) {
+		return result;
+	}
+	if (image->dirty_fd >= 0) {
+		close(image->dirty_fd);
+		image->dirty_fd = -1;
+	}
+	image->dirty_unsynced = 0;
+
+	int fd = open(image->dirty_path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if (fd < 0) {
+		result = -errno;
+		fprintf(stderr, "dirtylog_reset: cannot create %s: %s\n", image->dirty_path, strerror(errno));
+		return result;
+	}
+	struct dirtylog_header header;
+	make_header(image, &header);
+	if ((result = write_full(fd, &header, sizeof(header))) == 0 && fdatasync(fd) < 0) {
+		result = -errno;
+	}
+	if (result < 0) {
+		fprintf(stderr, "dirtylog_reset: cannot write %s: %s\n", image->dirty_path, strerror(-result));
+		close(fd);
+		unlink(image->dirty_path);
+		return result;
+	}
+	image->dirty_fd = fd;
+	return 0;
+}
+
+
+/**
+ * Read an image's dirty log into bitmaps. A torn last record is left out:
+ * its operation was never flushed.
+ * @param  image  the image
+ * @param  blocks set to a malloc'ed bitmap of the metadata blocks changed, bit b for block b
+ * @param  dirs   set to a malloc'ed bitmap of the directories changed, bit i for inode i
+ * @return        0 on success; -ENOENT if the image has no log, -EINVAL if it is
+ *                not about this image, errno on failure
+ */
+int dirtylog_read(struct ext2_image *image, unsigned char **blocks, unsigned char **dirs) {
+	*blocks = NULL;
+	*dirs = NULL;
+	int fd = open(image->dirty_path, O_RDONLY);
+	if (fd < 0) {
+		return -errno;
+	}
+	struct stat stats;
+	unsigned char *log = NULL; // FREE
+	int result = 0;
+	if (fstat(fd, &stats) < 0) {
+		result = -errno;
+	} else if ((log = malloc(stats.st_size + 1)) == NULL) {
+		result = -ENOMEM;
+	} else {
+		off_t done = 0;
+		while (done < stats.st_size) {
+			ssize_t got = pread(fd, log + done, stats.st_size - done, done);
+			if (got <= 0) {
+				if (got < 0 && errno == EINTR) {
+					continue;
+				}
+				result = got < 0 ? -errno : -EIO;
+				break;
+			}
+			done += got;
+		}
+	}
+	close(fd);
+
+	struct dirtylog_header expected;
+	make_header(image, &expected);
+	if (result == 0 &&
+		((size_t)stats.st_size < sizeof(expected) || memcmp(log, &expected, sizeof(expected)) != 0)) {
+		result = -EINVAL;
+	}
+
+	unsigned int num_blocks = image->super_block->s_blocks_count;
+	unsigned int num_inodes = image->super_block->s_inodes_count;
+	if (result == 0) {
+		*blocks = calloc(num_blocks / 8 + 1, 1);
+		*dirs = calloc(num_inodes / 8 + 1, 1);
+		if (*blocks == NULL || *dirs == NULL) {
+			result = -ENOMEM;
+		}
+	}
+
+	size_t offset = sizeof(expected);
+	while (result == 0 && stats.st_size - offset >= sizeof(struct dirtylog_record)) {
+		struct dirtylog_record record;
+		memcpy(&record, log + offset, sizeof(record));
+		size_t count = (size_t)record.num_blocks + record.num_dirs;
+		if (record.magic != DIRTYLOG_RECORD_MAGIC ||
+			count > (stats.st_size - offset - sizeof(record)) / sizeof(uint32_t)) {
+			break;
+		}
+		uint32_t *numbers = (uint32_t *)(log + offset + sizeof(record));
+		if (record_checksum(numbers, count) != record.checksum) {
+			break;
+		}
+		for (size_t i = 0; i < count; i++) {
+			uint32_t n = numbers[i];
+			if (i < record.num_blocks && n < num_blocks) {
+				(*blocks)[n / 8] |= 1 << (n % 8);
+			} else if (i >= record.num_blocks && n <= num_inodes) {
+				(*dirs)[n / 8] |= 1 << (n % 8);
+			}
+		}
+		offset += sizeof(record) + sizeof(uint32_t) * count;
+	}
+
+	free(log);
+	if (result < 0) {
+		free(*blocks);
+		free(*dirs);
+		*blocks = NULL;
+		*dirs = NULL;
+	}
+	return result;
+}
@@ -0,0 +1,37 @@
+#ifndef EXT2_DIRTYLOG
+#define EXT2_DIRTYLOG
+
+/*
+ * Persistent dirty log, <image>.dirty: what the operations committed since
+ * the last clean check changed, for ext2_check_incremental() to re-check in
+ * place of the whole image. A full check creates it; the tools add to it
+ * only if it is there, so an image nobody checked has none and its first
+ * incremental check is a full one.
+ *
+ * journal_commit() appends one record per operation: the metadata blocks
+ * it flagged with dirty_meta() (bitmaps, descriptors, inode table blocks,
+ * directory and indirect blocks) and the directories whose entries it
+ * changed, flagged with dirty_dir(). The groups and inodes to re-check
+ * follow from where those blocks sit. journal_flush() syncs the log before
+ * it closes the journal, so no change reaches the image unrecorded; a torn
+ * last record belongs to an operation that never did.
+ *
+ * Changes made by other programs are not recorded: the log trusts that the
+ * tools here are the only writers.
+ */
+
+struct ext2_image;
+
+int dirtylog_attach(struct ext2_image *image, char const *file_name);
+void dirtylog_detach(struct ext2_image *image);
+
+void dirty_dir(unsigned char *disk, unsigned int dir_idx);
+
+void dirtylog_append(struct ext2_image *image, unsigned int const *meta, unsigned int logged);
+void dirtylog_discard(struct ext2_image *image);
+void dirtylog_drop(struct ext2_image *image, char const *why);
+int dirtylog_sync(struct ext2_image *image);
+int dirtylog_reset(struct ext2_image *image);
+int dirtylog_read(struct ext2_image *image, unsigned char **blocks, unsigned char **dirs);
+
+#endif // EXT2_DIRTYLOG
@@ -0,0 +1,186 @@
+/*
+ * Free-slot index used by the directory update helpers. Safe to use from
+ * several threads: one lock covers the whole index.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dslot.h"
+
+// one directory's gaps, by logical block
+struct dslot_dir {
+	struct dslot_dir *next;
+	unsigned int dir_idx;
+	unsigned int num_blocks;
+	unsigned int capacity;
+	unsigned int *largest;
+};
+
+#define DSLOT_BUCKETS 256
+
+static struct dslot_dir *buckets[DSLOT_BUCKETS];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+// ---------- Function Declarations ----------
+int dslot_tracked(unsigned int dir_idx);
+int dslot_track(unsigned int dir_idx);
+void dslot_set(unsigned int dir_idx, unsigned int lblk, int largest);
+int dslot_find(unsigned int dir_idx, int need);
+void dslot_forget_dir(unsigned int dir_idx);
+void dslot_clear(void);
+
+
+
+// ---------- Helper Functions ----------
+
+/**
+ * Find the link pointing at a directory's record, or at the NULL ending its chain
+ * @return the link
+ */
+static struct dslot_dir **dslot_link(unsigned int dir_idx) {
+	struct dslot_dir **link = &buckets[dir_idx % DSLOT_BUCKETS];
+	while (*link != NULL && (*link)->dir_idx != dir_idx) {
+		link = &(*link)->next;
+	}
+	return link;
+}
+
+/**
+ * Take a directory's record out of its chain and free it
+ * @param link the link pointing at it
+ */
+static void dslot_unlink(struct dslot_dir **link) {
+	struct dslot_dir *dir = *link;
+	*link = dir->next;
+	free(dir->largest);
+	free(dir);
+}
+
+
+
+// ---------- Function Implementations ----------
+
+/**
+ * Whether a directory's gaps are indexed
+ * @param  dir_idx the dir's inode index
+ * @return         1 if so, 0 if not
+ */
+int dslot_tracked(unsigned int dir_idx) {
+	pthread_mutex_lock(&lock);
+	int tracked = *dslot_link(dir_idx) != NULL;
+	pthread_mutex_unlock(&lock);
+	return tracked;
+}
+
+/**
+ * Start indexing a directory's gaps, with none known yet; the caller fills
+ * them in with dslot_set()
+ * @param  dir_idx the dir's inode index
+ * @return         0 on success, -ENOMEM
+ */
+int dslot_track(unsigned int dir_idx) {
+	int result = 0;
+	pthread_mutex_lock(&lock);
+	struct dslot_dir **link = dslot_link(dir_idx);
+	if (*link != NULL) {
+		(*link)->num_blocks = 0;
+	} else if ((*link = calloc(1, sizeof(struct dslot_dir))) != NULL) {
+		(*link)->dir_idx = dir_idx;
+	} else {
+		result = -ENOMEM;
+	}
+	pthread_mutex_unlock(&lock);
+	return result;
+}
+
+/**
+ * Record the largest gap in one block of an indexed directory; ignored for
+ * directories that are not indexed
+ * @param dir_idx the dir's inode index
+ * @param lblk    logical block in the directory
+ * @param largest bytes of its largest gap; 0 for a full block or a hole
+ */
+void dslot_set(unsigned int dir_idx, unsigned int lblk, int largest) {
+	pthread_mutex_lock(&lock);
+	struct dslot_dir **link = dslot_link(dir_idx);
+	struct dslot_dir *dir = *link;
+	if (dir == NULL) {
+		goto out;
+	}
+	if (lblk >= dir->capacity) {
+		unsigned int new_capacity = dir->capacity ? dir->capacity : 16;
+		while (new_capacity <= lblk) {
+			new_capacity *= 2;
+		}
+		unsigned int *new_largest = realloc(dir->largest, new_capacity * sizeof(unsigned int));
+		if (new_largest == NULL) { // the index is only an accelerator
+			dslot_unlink(link);
+			goto out;
+		}
+		dir->largest = new_largest;
+		dir->capacity = new_capacity;
+	}
+	if (lblk >= dir->num_blocks) {
+		memset(dir->largest + dir->num_blocks, 0, (lblk - dir->num_blocks) * sizeof(unsigned int));
+		dir->num_blocks = lblk + 1;
+	}
+	dir->largest[lblk] = largest;
+
+out:
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Find the first block of an indexed directory with a gap big enough
+ * @param  dir_idx the dir's inode index
+ * @param  need    bytes the new entry takes
+ * @return         the block's logical number; -ENOSPC if no block has room
+ * 				   or the directory is not indexed
+ */
+int dslot_find(unsigned int dir_idx, int need) {
+	int found = -ENOSPC;
+	pthread_mutex_lock(&lock);
+	struct dslot_dir *dir = *dslot_link(dir_idx);
+	for (unsigned int lblk = 0; dir != NULL && lblk < dir->num_blocks; lblk++) {
+		if (dir->largest[lblk] >= (unsigned int)need) {
+			found = lblk;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	return found;
+}
+
+/**
+ * Stop indexing a directory
+ * @param dir_idx the dir's inode index
+ */
+void dslot_forget_dir(unsigned int dir_idx) {
+	pthread_mutex_lock(&lock);
+	struct dslot_dir **link = dslot_link(dir_idx);
+	if (*link != NULL) {
+		dslot_unlink(link);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Free the whole index
+ */
+void dslot_clear(void) {
+	pthread_mutex_lock(&lock);
+	for (unsigned int i = 0; i < DSLOT_BUCKETS; i++) {
+		struct dslot_dir *dir = buckets[i];
+		while (dir != NULL) {
+			struct dslot_dir *next = dir->next;
+			free(dir->largest);
+			free(dir);
+			dir = next;
+		}
+		buckets[i] = NULL;
+	}
+	pthread_mutex_unlock(&lock);
+}
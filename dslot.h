@@ -0,0 +1,19 @@
+#ifndef EXT2_DSLOT
+#define EXT2_DSLOT
+
+/*
+ * Free-slot index: for each directory that has been inserted into, the
+ * largest gap a new entry could take in each of its blocks, so an insert
+ * can go straight to a block with room. Built on a directory's first insert
+ * and kept up by the directory update helpers. It is only a hint: a block
+ * it points at is still checked before an entry is placed in it.
+ */
+
+int dslot_tracked(unsigned int dir_idx);
+int dslot_track(unsigned int dir_idx);
+void dslot_set(unsigned int dir_idx, unsigned int lblk, int largest);
+int dslot_find(unsigned int dir_idx, int need);
+void dslot_forget_dir(unsigned int dir_idx);
+void dslot_clear(void);
+
+#endif // EXT2_DSLOT
@@ -0,0 +1,296 @@
+/*
+ * Export behind ext2_cat and ext2_export: reads files back out of the disk.
+ *
+ * A file's contents go out with writev() straight from the mapping, one
+ * iovec per run of its block map (holes point at a block of zeros), so the data is never copied into a buffer of our own. A subtree is
+ * exported by walking it with walk_tree(), creating the host directories,
+ * files and symlinks in the same depth-first order.
+ *
+ * The mapping shows every committed operation, flushed or not, file data
+ * written through the image fd included (see dirty_fd_data()), so a batch
+ * reads back what it copied in earlier.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "bmap.h"
+#include "ext2.h"
+#include "utils.h"
+
+#define EXPORT_MAX_IOV 1024
+
+// state of a subtree export: the host path of the directory being visited
+// at each depth, built up in one buffer; an entry's name overwrites whatever
+// followed its directory's path
+struct export_arg {
+	char path[PATH_MAX];
+	size_t *path_len; /* length of path at each depth */
+	int max_depth;
+	int result;
+};
+
+// ---------- Function Declarations ----------
+unsigned long long inode_size(struct ext2_inode *inode);
+int export_inode(unsigned char *disk, unsigned int inode_idx, int out_fd);
+int ext2_cat(unsigned char **disk, char const *path, int out_fd);
+int ext2_export(unsigned char **disk, char const *path, char const *local_path, int recursive);
+
+
+
+// ---------- Helper Functions ----------
+
+/**
+ * Write a whole iovec array, resuming after short writes
+ * @return 0 on success; errno on failure
+ */
+static int writev_full(int fd, struct iovec *iov, int count) {
+	while (count > 0) {
+		ssize_t written = writev(fd, iov, count);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("writev_full: writev");
+			return -errno;
+		}
+		while (count > 0 && (size_t)written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (char *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Export one inode to a host path
+ * @return 0 on success; errno on failure
+ */
+static int export_to_path(unsigned char *disk, unsigned int inode_idx, char const *local_path) {
+	struct ext2_inode *inode = get_inode(disk, inode_idx);
+	int result = 0;
+
+	if ((inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR) {
+		if (mkdir(local_path, 0755) == -1 && errno != EEXIST) {
+			perror("export_to_path: mkdir");
+			result = -errno;
+		}
+	} else if ((inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFLNK) {
+		char *target = read_symlink(disk, inode); // FREE
+		if (target == NULL) {
+			return -ENOMEM;
+		}
+		if (symlink(target, local_path) == -1) {
+			perror("export_to_path: symlink");
+			result = -errno;
+		}
+		free(target);
+	} else {
+		int out_fd = open(local_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (out_fd < 0) {
+			perror("export_to_path: open");
+			result = -errno;
+		} else {
+			result = export_inode(disk, inode_idx, out_fd);
+			if (close(out_fd) == -1 && result == 0) {
+				perror("export_to_path: close");
+				result = -errno;
+			}
+		}
+	}
+	if (result < 0) {
+		fprintf(stderr, "export_to_path: cannot export %s\n", local_path);
+	}
+	return result;
+}
+
+/**
+ * walk_tree() visitor: give each entry its host path below its directory's
+ * and export it there
+ */
+static int export_visit(unsigned char *disk, unsigned int dir_idx, struct ext2_dir_entry *entry,
+						int depth, void *arg) {
+	struct export_arg *export = arg;
+	if (is_dot_entry(entry)) {
+		return WALK_NEXT;
+	}
+	if (depth + 1 >= export->max_depth) {
+		size_t *grown = realloc(export->path_len, sizeof(size_t) * export->max_depth * 2);
+		if (grown == NULL) {
+			export->result = -ENOMEM;
+			return WALK_STOP;
+		}
+		export->path_len = grown;
+		export->max_depth *= 2;
+	}
+
+	size_t len = export->path_len[depth];
+	if (len + 1 + entry->name_len >= PATH_MAX) {
+		fprintf(stderr, "export_visit: host path too long under %s\n", export->path);
+		export->result = -ENAMETOOLONG;
+		return WALK_STOP;
+	}
+	export->path[len] = '/';
+	memcpy(export->path + len + 1, entry->name, entry->name_len);
+	export->path[len + 1 + entry->name_len] = '\0';
+	export->path_len[depth + 1] = len + 1 + entry->name_len;
+
+	if ((export->result = export_to_path(disk, entry->inode, export->path)) < 0) {
+		return WALK_STOP;
+	}
+	return WALK_NEXT;
+}
+
+
+
+// ---------- Function Implementations ----------
+
+/**
+ * A file's size in bytes, the high half included
+ */
+unsigned long long inode_size(struct ext2_inode *inode) {
+	unsigned long long size = inode->i_size;
+	if ((inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFREG) {
+		size |= (unsigned long long)inode->i_dir_acl << 32;
+	}
+	return size;
+}
+
+/**
+ * Write a file's contents to fd, a run of contiguous blocks per iovec, the
+ * runs taken from the inode's block map
+ * @param  disk      the disk
+ * @param  inode_idx the file's inode index
+ * @param  out_fd    where to write
+ * @return           0 on success; errno on failure
+ */
+int export_inode(unsigned char *disk, unsigned int inode_idx, int out_fd) {
+	static unsigned char const zeros[EXT2_MAX_BLOCK_SIZE];
+	struct iovec iov[EXPORT_MAX_IOV];
+	unsigned long long size = inode_size(get_inode(disk, inode_idx));
+	unsigned long long num_data = (size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+	int count = 0;
+	int result;
+
+	struct bmap const *map = bmap_get(disk, inode_idx);
+	if (map == NULL) {
+		return -ENOMEM;
+	}
+	unsigned long long lblk = 0;
+	unsigned int next_run = 0;
+	while (lblk < num_data) {
+		// a block of zeros per block of a hole, then the next run whole
+		struct bmap_run const *run = next_run < map->num_data ? &map->data[next_run] : NULL;
+		void *base = (void *)zeros;
+		unsigned long long len = 1;
+		if (run != NULL && run->lblk == lblk) {
+			base = disk + (size_t)EXT2_BLOCK_SIZE * run->pblk;
+			len = run->len < num_data - lblk ? run->len : num_data - lblk;
+			next_run++;
+		}
+		iov[count].iov_base = base;
+		iov[count].iov_len = lblk + len == num_data ? size - lblk * EXT2_BLOCK_SIZE
+													: (size_t)len * EXT2_BLOCK_SIZE;
+		if (++count == EXPORT_MAX_IOV) {
+			if ((result = writev_full(out_fd, iov, count)) < 0) {
+				return result;
+			}
+			count = 0;
+		}
+		lblk += len;
+	}
+	return writev_full(out_fd, iov, count);
+}
+
+/**
+ * Write a regular file's contents to fd, like cat. Symlinks on the path,
+ * the last component included, are followed.
+ * @param  disk   the disk
+ * @param  path   absolute path of the file on the disk
+ * @param  out_fd where to write
+ * @return        0 on success; -ENOENT if there is no such file, -EISDIR for a
+ *                directory, -ELOOP if the links on the path go round
+ */
+int ext2_cat(unsigned char **disk, char const *path, int out_fd) {
+	int parent_idx;
+	int curr_idx;
+	int result;
+	if ((result = resolve_path_hold(*disk, path, &parent_idx, &curr_idx)) == -ELOOP) {
+		fprintf(stderr, "ext2_cat: %s: too many levels of symlinks\n", path);
+		return result;
+	}
+	if (result < 0 || curr_idx == 0) {
+		fprintf(stderr, "ext2_cat: %s does not exist\n", path);
+		return -ENOENT;
+	}
+	if ((get_inode(*disk, curr_idx)->i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR) {
+		fprintf(stderr, "ext2_cat: %s is a directory\n", path);
+		return -EISDIR;
+	}
+	return export_inode(*disk, curr_idx, out_fd);
+}
+
+/**
+ * Copy a file, symlink or, with recursive, a directory and everything under
+ * it from the disk to the host. Host files are overwritten; host directories
+ * already there are used as they are.
+ * @param  disk       the disk
+ * @param  path       absolute path on the disk
+ * @param  local_path where to put it on the host
+ * @param  recursive  1 to export directories with their contents
+ * @return            0 on success; -ENOENT if path does not exist, -EISDIR for a
+ *                    directory without recursive, errno from the host
+ */
+int ext2_export(unsigned char **disk, char const *path, char const *local_path, int recursive) {
+	int parent_idx;
+	int curr_idx;
+	int result;
+	if ((result = resolve_path(*disk, path, &parent_idx, &curr_idx)) < 0 || curr_idx == 0) {
+		fprintf(stderr, "ext2_export: %s does not exist\n", path);
+		return -ENOENT;
+	}
+	int is_dir = (get_inode(*disk, curr_idx)->i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR;
+	if (is_dir && !recursive) {
+		fprintf(stderr, "ext2_export: %s is a directory (-r to export it)\n", path);
+		return -EISDIR;
+	}
+	if ((result = export_to_path(*disk, curr_idx, local_path)) < 0 || !is_dir) {
+		return result;
+	}
+
+	struct export_arg *export = malloc(sizeof(struct export_arg)); // FREE
+	if (export == NULL) {
+		return -ENOMEM;
+	}
+	export->max_depth = 16;
+	export->path_len = malloc(sizeof(size_t) * export->max_depth);
+	export->result = 0;
+	if (export->path_len == NULL || strlen(local_path) >= PATH_MAX) {
+		result = export->path_len == NULL ? -ENOMEM : -ENAMETOOLONG;
+		goto out;
+	}
+	strcpy(export->path, local_path);
+	export->path_len[0] = strlen(local_path);
+
+	result = walk_tree(*disk, curr_idx, export_visit, export);
+	if (export->result < 0) {
+		result = export->result;
+	}
+
+out:
+	free(export->path_len);
+	free(export);
+	return result;
+}
@@ -18,8 +18,13 @@
 #ifndef CSC369_EXT2_FS_H
 #define CSC369_EXT2_FS_H
 
-/* The ext2 block size used in the assignment. */
-#define EXT2_BLOCK_SIZE 1024
+/* Smallest ext2 block size; an image's actual size is 1024 << s_log_block_size. */
+#define EXT2_MIN_BLOCK_SIZE 1024
+#define EXT2_MAX_BLOCK_SIZE 65536
+
+/* The superblock always starts 1024 bytes into the image. */
+#define EXT2_SUPER_OFFSET 1024
+#define EXT2_SUPER_MAGIC  0xEF53
 
 /*
  * Structure of the super block
@@ -100,7 +105,9 @@ struct ext2_super_block {
 	unsigned short s_reserved_word_pad;
 	unsigned int   s_default_mount_opts;
 	unsigned int   s_first_meta_bg; /* First metablock block group */
-	unsigned int   s_reserved[190]; /* Padding to the end of the block */
+	unsigned int   s_reserved_pad[22]; /* s_mkfs_time to s_want_extra_isize, unused here */
+	unsigned int   s_flags;         /* Miscellaneous flags */
+	unsigned int   s_reserved[167]; /* Padding to the end of the block */
 };
 
 
@@ -140,7 +147,6 @@ struct ext2_inode {
 	unsigned short i_gid;         /* Low 16 bits of Group Id */
 	unsigned short i_links_count; /* Links count */
 	unsigned int   i_blocks;      /* Blocks count IN DISK SECTORS*/
-	/* You can ignore flags for the assignment. */
 	unsigned int   i_flags;       /* File flags */
 	/* You should set it to 0. */
 	unsigned int   osd1;          /* OS dependent 1 */
@@ -155,9 +161,40 @@ struct ext2_inode {
 };
 
 
+/*
+ * Constants relative to the data blocks
+ */
+#define    EXT2_NDIR_BLOCKS 12
+#define    EXT2_IND_BLOCK   EXT2_NDIR_BLOCKS
+#define    EXT2_DIND_BLOCK  (EXT2_IND_BLOCK + 1)
+#define    EXT2_TIND_BLOCK  (EXT2_DIND_BLOCK + 1)
+#define    EXT2_N_BLOCKS    (EXT2_TIND_BLOCK + 1)
+
+/* Superblock backups only in groups 0, 1 and powers of 3, 5 and 7 */
+#define    EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
+/* i_dir_acl holds the high 32 bits of i_size for regular files */
+#define    EXT2_FEATURE_RO_COMPAT_LARGE_FILE 0x0002
+/* Directory entries record the file type */
+#define    EXT2_FEATURE_INCOMPAT_FILETYPE 0x0002
+
+/* Growing directories get s_prealloc_dir_blocks blocks held past their end */
+#define    EXT2_FEATURE_COMPAT_DIR_PREALLOC 0x0001
+
+/* Hashed directory indexes (htree), see htree.h */
+#define    EXT2_FEATURE_COMPAT_DIR_INDEX 0x0020
+#define    EXT2_INDEX_FL                 0x00001000 /* i_flags: the directory has an index */
+#define    EXT2_FLAGS_SIGNED_HASH        0x0001     /* s_flags: names hash as signed chars */
+#define    EXT2_FLAGS_UNSIGNED_HASH      0x0002     /* s_flags: ... as unsigned chars */
+#define    EXT2_HASH_LEGACY              0
+#define    EXT2_HASH_HALF_MD4            1
+#define    EXT2_HASH_TEA                 2
+#define    EXT2_HASH_UNSIGNED            3 /* added to a version for unsigned chars */
+
+
 /*
  * Type field for file mode
  */
+#define    EXT2_S_IFMT   0xF000    /* mask for the file type bits */
 #define    EXT2_S_IFLNK  0xA000    /* symbolic link */
 #define    EXT2_S_IFREG  0x8000    /* regular file */
 #define    EXT2_S_IFDIR  0x4000    /* directory */
@@ -175,6 +212,9 @@ struct ext2_inode {
 #define    EXT2_ROOT_INO         2
 /* First non-reserved inode for old ext2 filesystems */
 #define EXT2_GOOD_OLD_FIRST_INO 11
+/* Inode size for old ext2 filesystems; newer ones record it in s_inode_size */
+#define EXT2_GOOD_OLD_REV        0
+#define EXT2_GOOD_OLD_INODE_SIZE 128
 
 
 /*
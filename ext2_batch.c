@@ -0,0 +1,225 @@
+/*
+ * This program takes an optional command line argument: a script of operations in the format of
+ * A4-self-test/cases.txt, one per line, e.g.
+ *
+ *     mkdir emptydisk.img /DIRECTORY
+ *     cp emptydisk.img FILE_ONEBLK.txt /FILE_ONEBLK.txt
+ *     cp emptydisk.img -r A4-self-test /tests
+ *     ln twolevel.img -s /afile /lnfile
+ *     rm twolevel.img /afile
+ *     rm twolevel.img -r /adir
+ *     restore twolevel.img /afile
+ *     restore twolevel.img -r /
+ *     cat twolevel.img /afile
+ *     export twolevel.img -r / twolevel.d
+ *     check twolevel.img
+ *     check twolevel.img --incremental
+ *     verify twolevel.img
+ *     flush twolevel.img
+ *
+ * The script is read from standard input when no file is given. Every operation runs in this one
+ * process through libext2ops; an image stays open, with its caches warm, until a line names a
+ * different image. verify compares the free counters with the bitmaps without fixing anything and
+ * fails the line if any disagree. check --incremental checks only what changed since the image was
+ * last checked, as ext2_checker --incremental does.
+ * -f sets when the operations are made durable: after each one (op, the default), after every n
+ * of them, or only when the image is closed and on flush lines (close). Each operation is atomic
+ * either way; a crash loses at most the operations since the last flush.
+ * Blank lines and lines starting with '#' are skipped. A failing line is reported and the run goes
+ * on; the exit status is the error of the last line that failed.
+ * --stats, before anything else, prints the run's counters and phase times on standard error at
+ * the end; --stats=json prints them as one JSON object.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ext2ops.h"
+#include "stats.h"
+
+#define MAX_ARGS 5
+
+struct ext2_image *image; // image currently open, NULL if none
+char *image_name;
+int flush_policy = EXT2OPS_FLUSH_OP;
+int flush_every;
+
+// ---------- HELPER FUNCTIONS ----------
+/**
+ * Make sure the named image is the one mapped, remapping only when it changes
+ * @param  file_name the image file name
+ * @return           0 on success; errno on failure
+ */
+int open_image(char const *file_name) {
+	int result;
+
+	if (image_name != NULL && strcmp(image_name, file_name) == 0) {
+		return 0;
+	}
+	if (image != NULL) {
+		ext2ops_close(image);
+		free(image_name);
+		image = NULL;
+		image_name = NULL;
+	}
+	if ((result = ext2ops_open(file_name, &image)) != 0) {
+		return result;
+	}
+	if ((result = ext2ops_set_flush(image, flush_policy, flush_every)) != 0) {
+		ext2ops_close(image);
+		image = NULL;
+		return result;
+	}
+	if ((image_name = strdup(file_name)) == NULL) {
+		ext2ops_close(image);
+		image = NULL;
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/**
+ * Run one script line
+ * @param  argc number of words on the line
+ * @param  argv the words: operation, image, then the operation's arguments
+ * @return      0 on success; errno on failure
+ */
+int run_line(int argc, char *argv[]) {
+	int result;
+
+	if (argc < 2) {
+		fprintf(stderr, "run_line: expected <operation> <image file name> [args]\n");
+		return -EINVAL;
+	}
+	if ((result = open_image(argv[1])) != 0) {
+		fprintf(stderr, "run_line: cannot open %s\n", argv[1]);
+		return result;
+	}
+
+	char const *op = argv[0];
+	if (strcmp(op, "mkdir") == 0 && argc == 3) {
+		return ext2ops_mkdir(image, argv[2]);
+	} else if (strcmp(op, "cp") == 0 && argc == 4) {
+		return ext2ops_cp(image, argv[2], argv[3]);
+	} else if (strcmp(op, "cp") == 0 && argc == 5 && strcmp(argv[2], "-r") == 0) {
+		return ext2ops_cp_tree(image, argv[3], argv[4]);
+	} else if (strcmp(op, "ln") == 0 && argc == 4) {
+		return ext2ops_ln(image, argv[2], argv[3], 0);
+	} else if (strcmp(op, "ln") == 0 && argc == 5 && strcmp(argv[2], "-s") == 0) {
+		return ext2ops_ln(image, argv[3], argv[4], 1);
+	} else if (strcmp(op, "rm") == 0 && argc == 3) {
+		return ext2ops_rm(image, argv[2]);
+	} else if (strcmp(op, "rm") == 0 && argc == 4 && strcmp(argv[2], "-r") == 0) {
+		return ext2ops_rm_tree(image, argv[3]);
+	} else if (strcmp(op, "restore") == 0 && argc == 3) {
+		return ext2ops_restore(image, argv[2]);
+	} else if (strcmp(op, "restore") == 0 && argc == 4 && strcmp(argv[2], "-r") == 0) {
+		int restored = ext2ops_restore_tree(image, argv[3]);
+		return restored < 0 ? restored : 0;
+	} else if (strcmp(op, "cat") == 0 && argc == 3) {
+		return ext2ops_cat(image, argv[2], STDOUT_FILENO);
+	} else if (strcmp(op, "export") == 0 && argc == 4) {
+		return ext2ops_export(image, argv[2], argv[3], 0);
+	} else if (strcmp(op, "export") == 0 && argc == 5 && strcmp(argv[2], "-r") == 0) {
+		return ext2ops_export(image, argv[3], argv[4], 1);
+	} else if (strcmp(op, "check") == 0 && argc == 2) {
+		return ext2ops_check(image) < 0 ? -EIO : 0;
+	} else if (strcmp(op, "check") == 0 && argc == 3 && strcmp(argv[2], "--incremental") == 0) {
+		return ext2ops_check_incremental(image) < 0 ? -EIO : 0;
+	} else if (strcmp(op, "verify") == 0 && argc == 2) {
+		return ext2ops_verify(image) > 0 ? -EUCLEAN : 0;
+	} else if (strcmp(op, "flush") == 0 && argc == 2) {
+		return ext2ops_flush(image);
+	}
+	fprintf(stderr, "run_line: unknown operation or wrong arguments for %s\n", op);
+	return -EINVAL;
+}
+
+
+/**
+ * Parse the argument of -f
+ * @return 0 on success; -EINVAL if it is not op, close or a positive count
+ */
+int parse_flush(char const *arg) {
+	char *end;
+	if (strcmp(arg, "op") == 0) {
+		flush_policy = EXT2OPS_FLUSH_OP;
+	} else if (strcmp(arg, "close") == 0) {
+		flush_policy = EXT2OPS_FLUSH_CLOSE;
+	} else if ((flush_every = strtol(arg, &end, 10)) > 0 && *end == '\0') {
+		flush_policy = EXT2OPS_FLUSH_BATCH;
+	} else {
+		return -EINVAL;
+	}
+	return 0;
+}
+
+
+int main(int argc, char const *argv[]) {
+	int stats = stats_take_option(&argc, argv);
+	int arg = 1;
+	if (argc > 2 && strcmp(argv[1], "-f") == 0) {
+		if (parse_flush(argv[2]) != 0) {
+			fprintf(stderr, "%s: -f takes op, close or a number of operations\n", argv[0]);
+			exit(-1);
+		}
+		arg = 3;
+	}
+	if (argc - arg > 1) {
+		fprintf(stderr, "Usage: %s [--stats[=json]] [-f op|close|<n>] [script file]\n", argv[0]);
+		exit(-1);
+	}
+
+	FILE *script = stdin;
+	if (argc - arg == 1 && (script = fopen(argv[arg], "r")) == NULL) {
+		perror("main: fopen");
+		return -ENOENT;
+	}
+
+	int result = 0;
+	int line_num = 0;
+	int num_failed = 0;
+	char *line = NULL; // FREE
+	size_t line_cap = 0;
+	while (getline(&line, &line_cap, script) != -1) {
+		line_num++;
+
+		// split into words
+		char *words[MAX_ARGS + 1];
+		int num_words = 0;
+		for (char *word = strtok(line, " \t\r\n"); word != NULL; word = strtok(NULL, " \t\r\n")) {
+			if (num_words == MAX_ARGS + 1) {
+				break;
+			}
+			words[num_words++] = word;
+		}
+		if (num_words == 0 || words[0][0] == '#') {
+			continue;
+		}
+
+		int line_result = num_words > MAX_ARGS ? -EINVAL : run_line(num_words, words);
+		if (line_result != 0) {
+			fprintf(stderr, "%s: line %d: %s failed: %s\n", argv[0], line_num, words[0],
+					strerror(-line_result));
+			num_failed++;
+			result = line_result;
+		}
+	}
+	free(line);
+	if (script != stdin) {
+		fclose(script);
+	}
+	ext2ops_close(image);
+	free(image_name);
+
+	if (num_failed > 0) {
+		fprintf(stderr, "%s: %d of %d lines failed\n", argv[0], num_failed, line_num);
+	}
+	if (stats != STATS_OFF) {
+		stats_print(stderr, stats);
+	}
+	return result;
+}
@@ -0,0 +1,402 @@
+/*
+ * This program times the core operations on an ext2 image, such as one made by ext2_mkimage, and
+ * writes one CSV line per benchmark:
+ *
+ *     benchmark,count,unit,seconds,per_second
+ *
+ * The benchmarks are new_block and new_inode allocations, path resolution with the dentry cache
+ * cold and warm, update_dir_entry inserts into a fresh directory, ext2_cp of a local file, ext2_rm
+ * of existing files and a full ext2_checker pass. Each one runs as an operation that is then
+ * aborted, so the image is left as it was found. Only the operations themselves are timed.
+ *
+ * With -j, the image is then opened with libext2ops and threads 1, 2, 4 and so on up to the
+ * number given run mkdir, cp of a small file, ln -s and rm side by side, each in a directory of
+ * its own, once flushing after every operation and once only at close. Those operations are
+ * committed, and what they made is removed again after each run.
+ *
+ *     -n <count>   operations per benchmark, paths and files sampled evenly over the image
+ *                  (default 10000)
+ *     -c <MiB>     size of the file ext2_cp copies (default 64)
+ *     -j <threads> most threads for the threaded benchmark (default 0: not run)
+ *     -m <count>   operations per threaded run, shared out among the threads (default 2000)
+ *     -o <file>    where to write the results (default standard output)
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dcache.h"
+#include "ext2.h"
+#include "ext2ops.h"
+#include "utils.h"
+
+unsigned char *disk;
+FILE *results;
+
+// every regular file on the image by path, and the path being built while walking
+char **paths;
+int num_paths;
+int max_paths;
+char walk_path[PATH_MAX];
+size_t walk_len[PATH_MAX / 2];
+
+// ---------- HELPER FUNCTIONS ----------
+/**
+ * Seconds on the monotonic clock
+ */
+double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Write one result line
+ */
+void report(char const *name, unsigned long long count, char const *unit, double seconds) {
+	fprintf(results, "%s,%llu,%s,%.6f,%.1f\n", name, count, unit, seconds,
+			seconds > 0 ? count / seconds : 0.0);
+}
+
+/**
+ * walk_tree() visitor: record the path of every regular file
+ */
+int collect_visit(unsigned char *disk, unsigned int dir_idx, struct ext2_dir_entry *entry, int depth,
+				  void *arg) {
+	if (is_dot_entry(entry)) {
+		return WALK_NEXT;
+	}
+	size_t len = walk_len[depth];
+	if (depth + 1 >= sizeof(walk_len) / sizeof(walk_len[0]) || len + 1 + entry->name_len >= PATH_MAX) {
+		return WALK_PRUNE;
+	}
+	walk_path[len] = '/';
+	memcpy(walk_path + len + 1, entry->name, entry->name_len);
+	walk_path[len + 1 + entry->name_len] = '\0';
+	walk_len[depth + 1] = len + 1 + entry->name_len;
+
+	if ((get_inode(disk, entry->inode)->i_mode & EXT2_S_IFMT) != EXT2_S_IFREG) {
+		return WALK_NEXT;
+	}
+	if (num_paths == max_paths) {
+		int new_max = max_paths ? max_paths * 2 : 1024;
+		char **grown = realloc(paths, sizeof(char *) * new_max);
+		if (grown == NULL) {
+			return WALK_STOP;
+		}
+		paths = grown;
+		max_paths = new_max;
+	}
+	if ((paths[num_paths] = strdup(walk_path)) == NULL) {
+		return WALK_STOP;
+	}
+	num_paths++;
+	return WALK_NEXT;
+}
+
+/**
+ * The i-th of count paths sampled evenly over the collected ones
+ */
+char const *sample_path(int i, int count) {
+	return paths[(long long)i * num_paths / count];
+}
+
+/**
+ * Time count single-block allocations
+ */
+void bench_new_block(int count) {
+	double start = now();
+	int done = 0;
+	while (done < count && new_block(&disk, 0) > 0) {
+		done++;
+	}
+	report("new_block", done, "blocks", now() - start);
+	end_op(-ECANCELED);
+}
+
+/**
+ * Time count inode allocations
+ */
+void bench_new_inode(int count) {
+	double start = now();
+	int done = 0;
+	while (done < count && (int)new_inode(&disk, EXT2_ROOT_INO) > 0) {
+		done++;
+	}
+	report("new_inode", done, "inodes", now() - start);
+	end_op(-ECANCELED);
+}
+
+/**
+ * Time resolving count sampled paths, first with the dentry cache empty, then again with it warm
+ */
+void bench_resolve_path(int count) {
+	int parent_idx;
+	int curr_idx;
+	if (num_paths == 0) {
+		return;
+	}
+	dcache_clear();
+	for (int pass = 0; pass < 2; pass++) {
+		double start = now();
+		for (int i = 0; i < count; i++) {
+			resolve_path(disk, sample_path(i, count), &parent_idx, &curr_idx);
+		}
+		report(pass == 0 ? "resolve_path_cold" : "resolve_path_warm", count, "paths", now() - start);
+	}
+}
+
+/**
+ * Time count inserts into a new directory
+ */
+void bench_update_dir_entry(int count) {
+	char name[32];
+	int dir_idx = make_dir(&disk, EXT2_ROOT_INO, "bench.dir");
+	if (dir_idx < 0) {
+		end_op(dir_idx);
+		return;
+	}
+	double start = now();
+	int done = 0;
+	for (; done < count; done++) {
+		sprintf(name, "e%d", done);
+		if (update_dir_entry(&disk, dir_idx, dir_idx, name, EXT2_FT_REG_FILE) < 0) {
+			break;
+		}
+	}
+	report("update_dir_entry", done, "entries", now() - start);
+	end_op(-ECANCELED);
+}
+
+/**
+ * Time copying a local file of size_mib MiB in with ext2_cp
+ */
+void bench_cp(int size_mib) {
+	char local_path[] = "/tmp/ext2_bench.XXXXXX";
+	int fd = mkstemp(local_path);
+	if (fd < 0) {
+		perror("bench_cp: mkstemp");
+		return;
+	}
+	char *chunk = malloc(1 << 20); // FREE
+	int written = 0;
+	if (chunk != NULL) {
+		for (int i = 0; i < (1 << 20); i++) {
+			chunk[i] = (char)(i * 131 + 7);
+		}
+		while (written < size_mib && write(fd, chunk, 1 << 20) == (1 << 20)) {
+			written++;
+		}
+	}
+	free(chunk);
+	close(fd);
+
+	double start = now();
+	int result = ext2_cp(&disk, local_path, "/bench.cp");
+	double seconds = now() - start;
+	if (result == 0) {
+		report("ext2_cp", written, "MiB", seconds);
+	}
+	end_op(-ECANCELED);
+	unlink(local_path);
+}
+
+/**
+ * Time removing count sampled files
+ */
+void bench_rm(int count) {
+	if (num_paths == 0) {
+		return;
+	}
+	if (count > num_paths) {
+		count = num_paths;
+	}
+	double start = now();
+	int done = 0;
+	for (; done < count; done++) {
+		if (ext2_rm(&disk, sample_path(done, count)) < 0) {
+			break;
+		}
+	}
+	report("ext2_rm", done, "files", now() - start);
+	end_op(-ECANCELED);
+}
+
+/**
+ * Time one full check
+ */
+void bench_check(void) {
+	double start = now();
+	int result = ext2_check(&disk);
+	double seconds = now() - start;
+	if (result >= 0) {
+		report("ext2_checker", 1, "passes", seconds);
+	}
+	end_op(-ECANCELED);
+}
+
+
+/**
+ * One thread of the threaded benchmark
+ */
+struct mt_worker {
+	pthread_t thread;
+	struct ext2_image *image;
+	char const *local_path; /* the file it copies in */
+	int id;
+	int ops; /* operations to run */
+	int done;
+};
+
+/**
+ * Run a thread's operations in its directory, four at a time: a new directory, a copy into it,
+ * a symlink to the copy and the symlink's removal
+ */
+void *mt_run(void *arg) {
+	struct mt_worker *worker = arg;
+	char dir[64];
+	char file[96];
+	char link[96];
+	for (int i = 0; worker->done + 4 <= worker->ops; i++) {
+		sprintf(dir, "/bench.mt/t%d/d%d", worker->id, i);
+		sprintf(file, "%s/f", dir);
+		sprintf(link, "/bench.mt/t%d/l%d", worker->id, i);
+		if (ext2ops_mkdir(worker->image, dir) < 0 || ext2ops_cp(worker->image, worker->local_path, file) < 0 ||
+			ext2ops_ln(worker->image, file, link, 1) < 0 || ext2ops_rm(worker->image, link) < 0) {
+			break;
+		}
+		worker->done += 4;
+	}
+	return NULL;
+}
+
+/**
+ * Time ops operations shared out among 1, 2, 4 and so on up to max_threads threads, under
+ * each flush policy
+ */
+void bench_threads(char const *file_name, int max_threads, int ops) {
+	static int const policies[] = {EXT2OPS_FLUSH_OP, EXT2OPS_FLUSH_CLOSE};
+	static char const *const policy_names[] = {"op", "close"};
+	char local_path[] = "/tmp/ext2_bench.XXXXXX";
+	char name[64];
+	int fd = mkstemp(local_path);
+	if (fd < 0) {
+		perror("bench_threads: mkstemp");
+		return;
+	}
+	char block[4096];
+	memset(block, 'x', sizeof(block));
+	int written = write(fd, block, sizeof(block)) == sizeof(block);
+	close(fd);
+
+	struct ext2_image *image = NULL;
+	struct mt_worker *workers = calloc(max_threads, sizeof(struct mt_worker)); // FREE
+	if (!written || workers == NULL || ext2ops_open(file_name, &image) != 0) {
+		fprintf(stderr, "bench_threads: cannot set up\n");
+		goto out;
+	}
+	for (int p = 0; p < 2; p++) {
+		ext2ops_set_flush(image, policies[p], 0);
+		for (int num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+			ext2ops_mkdir(image, "/bench.mt");
+			for (int i = 0; i < num_threads; i++) {
+				sprintf(name, "/bench.mt/t%d", i);
+				ext2ops_mkdir(image, name);
+				workers[i] = (struct mt_worker){0, image, local_path, i, ops / num_threads, 0};
+			}
+
+			double start = now();
+			int started = 0;
+			while (started < num_threads &&
+				   pthread_create(&workers[started].thread, NULL, mt_run, &workers[started]) == 0) {
+				started++;
+			}
+			int done = 0;
+			for (int i = 0; i < started; i++) {
+				pthread_join(workers[i].thread, NULL);
+				done += workers[i].done;
+			}
+			double seconds = now() - start;
+
+			sprintf(name, "ops_%s_%dthreads", policy_names[p], num_threads);
+			report(name, done, "ops", seconds);
+			ext2ops_rm_tree(image, "/bench.mt");
+		}
+	}
+
+out:
+	ext2ops_close(image);
+	free(workers);
+	unlink(local_path);
+}
+
+
+int main(int argc, char *argv[]) {
+	int count = 10000;
+	int cp_mib = 64;
+	int max_threads = 0;
+	int mt_ops = 2000;
+	char const *out_name = NULL;
+
+	int opt;
+	int bad = 0;
+	while ((opt = getopt(argc, argv, "n:c:j:m:o:")) != -1) {
+		switch (opt) {
+		case 'n': bad |= (count = atoi(optarg)) <= 0; break;
+		case 'c': bad |= (cp_mib = atoi(optarg)) <= 0; break;
+		case 'j': bad |= (max_threads = atoi(optarg)) < 0; break;
+		case 'm': bad |= (mt_ops = atoi(optarg)) <= 0; break;
+		case 'o': out_name = optarg; break;
+		default: bad = 1;
+		}
+	}
+	if (bad || optind != argc - 1) {
+		fprintf(stderr,
+				"Usage: %s [-n count] [-c MiB] [-j threads] [-m count] [-o results file] <image file name>\n",
+				argv[0]);
+		exit(-1);
+	}
+
+	int result;
+	if ((result = init(&disk, argv[optind])) != 0) {
+		fprintf(stderr, "main: init\n");
+		return result;
+	}
+	results = stdout;
+	if (out_name != NULL && (results = fopen(out_name, "w")) == NULL) {
+		perror("main: fopen");
+		fini(&disk);
+		return -errno;
+	}
+
+	walk_len[0] = 0;
+	walk_tree(disk, EXT2_ROOT_INO, collect_visit, NULL);
+
+	fprintf(results, "benchmark,count,unit,seconds,per_second\n");
+	bench_new_block(count);
+	bench_new_inode(count);
+	bench_resolve_path(count);
+	bench_update_dir_entry(count);
+	bench_cp(cp_mib);
+	bench_rm(count);
+	bench_check();
+
+	for (int i = 0; i < num_paths; i++) {
+		free(paths[i]);
+	}
+	free(paths);
+	fini(&disk); // the threaded benchmark opens the image again, with libext2ops
+	if (max_threads > 0) {
+		bench_threads(argv[optind], max_threads, mt_ops);
+	}
+	if (results != stdout) {
+		fclose(results);
+	}
+	return 0;
+}
@@ -0,0 +1,35 @@
+/**
+ * This program takes two command line arguments. The first is the name of an ext2 formatted
+ * virtual disk, and the second is an absolute path to a file on that disk. The program works like
+ * cat, writing the file's contents to standard output. If the path does not exist the program
+ * returns ENOENT, and EISDIR if it names a directory.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "ext2.h"
+#include "utils.h"
+
+unsigned char *disk;
+
+
+int main(int argc, char const *argv[]) {
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s <image file name> <absolute path>\n", argv[0]);
+		exit(-1);
+	}
+
+	int result;
+
+	if ((result = init_map(&disk, argv[1], EXT2_MAP_AUTO | EXT2_MAP_READ_ONLY)) != 0) {
+		fprintf(stderr, "main: init\n");
+		return result;
+	}
+
+	result = ext2_cat(&disk, argv[2], STDOUT_FILENO);
+	fini(&disk);
+	return result;
+}
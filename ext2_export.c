@@ -0,0 +1,38 @@
+/**
+ * This program takes three command line arguments. The first is the name of an ext2 formatted
+ * virtual disk, the second an absolute path on that disk and the third a path on your native
+ * operating system. The program copies the file or symlink at the absolute path out to the local
+ * path, overwriting a local file already there. With -r a directory is copied out with everything
+ * under it. If the absolute path does not exist the program returns ENOENT, and EISDIR for a
+ * directory without -r.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ext2.h"
+#include "utils.h"
+
+unsigned char *disk;
+
+
+int main(int argc, char const *argv[]) {
+	int recursive = argc == 5 && strcmp(argv[2], "-r") == 0;
+	if (argc != 4 && !recursive) {
+		fprintf(stderr, "Usage: %s <image file name> [-r] <absolute path> <local path>\n", argv[0]);
+		exit(-1);
+	}
+
+	int result;
+
+	if ((result = init_map(&disk, argv[1], EXT2_MAP_AUTO | EXT2_MAP_READ_ONLY)) != 0) {
+		fprintf(stderr, "main: init\n");
+		return result;
+	}
+
+	result = ext2_export(&disk, argv[argc - 2], argv[argc - 1], recursive);
+	fini(&disk);
+	return result;
+}
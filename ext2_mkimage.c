@@ -0,0 +1,438 @@
+/*
+ * This program makes a synthetic ext2 image to benchmark the tools on. It takes the name of the
+ * image to create and options for its geometry and contents:
+ *
+ *     -b <block size>   1024, 2048 or 4096 (default 4096)
+ *     -B <blocks>       number of blocks (default 262144)
+ *     -i <inodes>       number of inodes, rounded up to fill whole inode table blocks (default 65536)
+ *     -d <directories>  directories to create (default 1000)
+ *     -f <fan-out>      subdirectories per directory; the tree is filled breadth first (default 10)
+ *     -n <files>        regular files to create, spread round-robin over the directories
+ *                       (default 20000)
+ *     -s <min>:<max>    file sizes in bytes, log-uniform between the two (default 256:65536)
+ *     -S <seed>         seed for the sizes and the volume's UUID and hash seed (default 1)
+ *     -p <blocks>       blocks to preallocate past the end of each growing directory, up to 255;
+ *                       turns on the dir_prealloc feature (default 0, off)
+ *
+ * The image is formatted as revision 1 ext2 with the filetype, sparse_super and, unless -x is given,
+ * dir_index features, then populated through the same helpers ext2_mkdir and ext2_cp use. File
+ * contents are left zero, so the image stays sparse on the host. The same options and seed always
+ * make the same tree.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ext2.h"
+#include "utils.h"
+
+#define MKIMAGE_INODE_SIZE 128
+#define MKIMAGE_BATCH	   4096 /* creations per operation */
+
+unsigned char *disk;
+uint64_t rng_state;
+
+// ---------- HELPER FUNCTIONS ----------
+/**
+ * Next pseudo-random number (xorshift64*)
+ */
+uint64_t next_random(void) {
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 2685821657736338717ull;
+}
+
+/**
+ * A file size between min and max, each power-of-two range between them equally likely
+ */
+unsigned long long random_size(unsigned long long min, unsigned long long max) {
+	if (min >= max) {
+		return min;
+	}
+	int low = 63 - __builtin_clzll(min | 1);
+	int high = 63 - __builtin_clzll(max);
+	int bucket = low + next_random() % (high - low + 1);
+	unsigned long long from = bucket == low ? min : 1ull << bucket;
+	unsigned long long to = bucket == high ? max : (2ull << bucket) - 1;
+	return from + next_random() % (to - from + 1);
+}
+
+/**
+ * Whether a group holds a superblock backup under sparse_super
+ */
+int has_super(unsigned int group) {
+	if (group <= 1) {
+		return 1;
+	}
+	for (unsigned int base = 3; base <= 7; base += 2) {
+		unsigned int power = base;
+		while (power < group) {
+			power *= base;
+		}
+		if (power == group) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Write a directory block holding . and .. and, if name is not NULL, one more entry
+ */
+void format_dir_block(unsigned char *block, unsigned int block_size, unsigned int self,
+					  unsigned int parent, char const *name, unsigned int child) {
+	struct ext2_dir_entry *entry = (struct ext2_dir_entry *)block;
+	entry->inode = self;
+	entry->rec_len = 12;
+	entry->name_len = 1;
+	entry->file_type = EXT2_FT_DIR;
+	memcpy(entry->name, ".", 1);
+
+	entry = (struct ext2_dir_entry *)(block + 12);
+	entry->inode = parent;
+	entry->rec_len = name == NULL ? block_size - 12 : 12;
+	entry->name_len = 2;
+	entry->file_type = EXT2_FT_DIR;
+	memcpy(entry->name, "..", 2);
+	if (name == NULL) {
+		return;
+	}
+
+	entry = (struct ext2_dir_entry *)(block + 24);
+	entry->inode = child;
+	entry->rec_len = block_size - 24;
+	entry->name_len = strlen(name);
+	entry->file_type = EXT2_FT_DIR;
+	memcpy(entry->name, name, entry->name_len);
+}
+
+/**
+ * Set up a directory inode owning one block
+ */
+void format_dir_inode(struct ext2_inode *inode, unsigned short mode, unsigned int block_size,
+					  unsigned int block_num, unsigned short links) {
+	unsigned int now = (unsigned int)time(NULL);
+	inode->i_mode = EXT2_S_IFDIR | mode;
+	inode->i_size = block_size;
+	inode->i_atime = now;
+	inode->i_ctime = now;
+	inode->i_mtime = now;
+	inode->i_links_count = links;
+	inode->i_blocks = block_size / 512;
+	inode->i_block[0] = block_num;
+}
+
+/**
+ * Format an empty image: every group's bitmaps and inode table, superblock
+ * backups and group descriptor copies where sparse_super puts them, and a
+ * root directory holding lost+found
+ * @param  file_name   the image to create
+ * @param  block_size  the block size
+ * @param  num_blocks  requested number of blocks; a last group too small to
+ *                     hold its own metadata is left out
+ * @param  num_inodes  requested number of inodes
+ * @param  dir_index   1 to turn on the dir_index feature
+ * @param  prealloc    directory preallocation in blocks; 0 to leave dir_prealloc off
+ * @return             0 on success; errno on failure
+ */
+int format_image(char const *file_name, unsigned int block_size, unsigned int num_blocks,
+				 unsigned int num_inodes, int dir_index, unsigned int prealloc) {
+	unsigned int first_data_block = block_size == 1024 ? 1 : 0;
+	unsigned int blocks_per_group = 8 * block_size;
+	unsigned int inodes_per_block = block_size / MKIMAGE_INODE_SIZE;
+	if (num_blocks <= first_data_block) {
+		fprintf(stderr, "format_image: too few blocks\n");
+		return -EINVAL;
+	}
+	unsigned int groups = (num_blocks - first_data_block + blocks_per_group - 1) / blocks_per_group;
+	unsigned int inodes_per_group = (num_inodes + groups - 1) / groups;
+	inodes_per_group = (inodes_per_group + inodes_per_block - 1) / inodes_per_block * inodes_per_block;
+	if (inodes_per_group < inodes_per_block) {
+		inodes_per_group = inodes_per_block;
+	}
+	if (inodes_per_group > blocks_per_group) {
+		inodes_per_group = blocks_per_group;
+	}
+	unsigned int table_blocks = inodes_per_group / inodes_per_block;
+	unsigned int gdt_blocks = (groups * sizeof(struct ext2_group_desc) + block_size - 1) / block_size;
+
+	// drop a last group that cannot hold its own bitmaps and inode table
+	unsigned int last_size = num_blocks - first_data_block - (groups - 1) * blocks_per_group;
+	unsigned int last_overhead = (has_super(groups - 1) ? 1 + gdt_blocks : 0) + 2 + table_blocks;
+	if (last_size < last_overhead + 1) {
+		groups--;
+		num_blocks = first_data_block + groups * blocks_per_group;
+		gdt_blocks = (groups * sizeof(struct ext2_group_desc) + block_size - 1) / block_size;
+	}
+	if (groups == 0 || inodes_per_group * groups < EXT2_GOOD_OLD_FIRST_INO) {
+		fprintf(stderr, "format_image: too few blocks or inodes\n");
+		return -EINVAL;
+	}
+
+	int fd = open(file_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror("format_image: open");
+		return -errno;
+	}
+	size_t len = (size_t)block_size * num_blocks;
+	if (ftruncate(fd, len) == -1) {
+		perror("format_image: ftruncate");
+		close(fd);
+		return -errno;
+	}
+	unsigned char *image = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (image == MAP_FAILED) {
+		perror("format_image: mmap");
+		close(fd);
+		return -errno;
+	}
+
+	struct ext2_super_block *super_block = (struct ext2_super_block *)(image + EXT2_SUPER_OFFSET);
+	struct ext2_group_desc *group_desc =
+		(struct ext2_group_desc *)(image + (size_t)block_size * (first_data_block + 1));
+	unsigned int free_blocks = 0;
+	unsigned int root_block = 0;
+	for (unsigned int group = 0; group < groups; group++) {
+		unsigned int start = first_data_block + group * blocks_per_group;
+		unsigned int size = group == groups - 1 ? num_blocks - start : blocks_per_group;
+		unsigned int next = start + (has_super(group) ? 1 + gdt_blocks : 0);
+		group_desc[group].bg_block_bitmap = next;
+		group_desc[group].bg_inode_bitmap = next + 1;
+		group_desc[group].bg_inode_table = next + 2;
+		unsigned int used = next + 2 + table_blocks - start;
+		if (group == 0) { // the root's and lost+found's blocks
+			root_block = start + used;
+			used += 2;
+		}
+
+		unsigned char *block_bitmap = image + (size_t)block_size * group_desc[group].bg_block_bitmap;
+		unsigned char *inode_bitmap = image + (size_t)block_size * group_desc[group].bg_inode_bitmap;
+		for (unsigned int bit = 0; bit < 8 * block_size; bit++) {
+			if (bit < used || bit >= size) { // in use, or padding past the group's end
+				block_bitmap[bit / 8] |= 1 << (bit % 8);
+			}
+			if ((group == 0 && bit < EXT2_GOOD_OLD_FIRST_INO) || bit >= inodes_per_group) {
+				inode_bitmap[bit / 8] |= 1 << (bit % 8);
+			}
+		}
+		group_desc[group].bg_free_blocks_count = size - used;
+		group_desc[group].bg_free_inodes_count =
+			inodes_per_group - (group == 0 ? EXT2_GOOD_OLD_FIRST_INO : 0);
+		group_desc[group].bg_used_dirs_count = group == 0 ? 2 : 0;
+		free_blocks += size - used;
+	}
+
+	uint64_t uuid[2] = {next_random(), next_random()};
+	unsigned int now = (unsigned int)time(NULL);
+	super_block->s_inodes_count = inodes_per_group * groups;
+	super_block->s_blocks_count = num_blocks;
+	super_block->s_free_blocks_count = free_blocks;
+	super_block->s_free_inodes_count = inodes_per_group * groups - EXT2_GOOD_OLD_FIRST_INO;
+	super_block->s_first_data_block = first_data_block;
+	super_block->s_log_block_size = __builtin_ctz(block_size / EXT2_MIN_BLOCK_SIZE);
+	super_block->s_log_frag_size = super_block->s_log_block_size;
+	super_block->s_blocks_per_group = blocks_per_group;
+	super_block->s_frags_per_group = blocks_per_group;
+	super_block->s_inodes_per_group = inodes_per_group;
+	super_block->s_wtime = now;
+	super_block->s_max_mnt_count = 0xffff;
+	super_block->s_magic = EXT2_SUPER_MAGIC;
+	super_block->s_state = 1;  /* cleanly unmounted */
+	super_block->s_errors = 1; /* continue */
+	super_block->s_lastcheck = now;
+	super_block->s_rev_level = 1;
+	super_block->s_first_ino = EXT2_GOOD_OLD_FIRST_INO;
+	super_block->s_inode_size = MKIMAGE_INODE_SIZE;
+	super_block->s_feature_incompat = EXT2_FEATURE_INCOMPAT_FILETYPE;
+	super_block->s_feature_ro_compat = EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER;
+	memcpy(super_block->s_uuid, uuid, sizeof(super_block->s_uuid));
+	strcpy(super_block->s_volume_name, "bench");
+	if (dir_index) {
+		super_block->s_feature_compat |= EXT2_FEATURE_COMPAT_DIR_INDEX;
+		for (int i = 0; i < 4; i++) {
+			super_block->s_hash_seed[i] = (unsigned int)next_random();
+		}
+		super_block->s_def_hash_version = EXT2_HASH_HALF_MD4;
+		super_block->s_flags = EXT2_FLAGS_UNSIGNED_HASH;
+	}
+	if (prealloc > 0) {
+		super_block->s_feature_compat |= EXT2_FEATURE_COMPAT_DIR_PREALLOC;
+		super_block->s_prealloc_dir_blocks = prealloc;
+	}
+
+	// the root, with lost+found in it
+	unsigned char *inode_table = image + (size_t)block_size * group_desc[0].bg_inode_table;
+	struct ext2_inode *root = (struct ext2_inode *)(inode_table + MKIMAGE_INODE_SIZE * (EXT2_ROOT_INO - 1));
+	struct ext2_inode *lost_found =
+		(struct ext2_inode *)(inode_table + MKIMAGE_INODE_SIZE * (EXT2_GOOD_OLD_FIRST_INO - 1));
+	format_dir_inode(root, 0755, block_size, root_block, 3);
+	format_dir_inode(lost_found, 0700, block_size, root_block + 1, 2);
+	format_dir_block(image + (size_t)block_size * root_block, block_size, EXT2_ROOT_INO,
+					 EXT2_ROOT_INO, "lost+found", EXT2_GOOD_OLD_FIRST_INO);
+	format_dir_block(image + (size_t)block_size * (root_block + 1), block_size,
+					 EXT2_GOOD_OLD_FIRST_INO, EXT2_ROOT_INO, NULL, 0);
+
+	// backups of the superblock and the descriptors
+	for (unsigned int group = 1; group < groups; group++) {
+		if (!has_super(group)) {
+			continue;
+		}
+		unsigned char *backup = image + (size_t)block_size * (first_data_block + group * blocks_per_group);
+		memcpy(backup, super_block, sizeof(*super_block));
+		((struct ext2_super_block *)backup)->s_block_group_nr = group;
+		memcpy(backup + block_size, group_desc, groups * sizeof(struct ext2_group_desc));
+	}
+
+	int result = 0;
+	if (msync(image, len, MS_SYNC) == -1) {
+		perror("format_image: msync");
+		result = -errno;
+	}
+	munmap(image, len);
+	close(fd);
+	return result;
+}
+
+/**
+ * Parse a positive number
+ * @return 0 on success; -EINVAL
+ */
+int parse_count(char const *arg, unsigned long long *count) {
+	char *end;
+	*count = strtoull(arg, &end, 10);
+	return *arg != '\0' && *end == '\0' ? 0 : -EINVAL;
+}
+
+
+int main(int argc, char *argv[]) {
+	unsigned long long block_size = 4096;
+	unsigned long long num_blocks = 262144;
+	unsigned long long num_inodes = 65536;
+	unsigned long long num_dirs = 1000;
+	unsigned long long fan_out = 10;
+	unsigned long long num_files = 20000;
+	unsigned long long min_size = 256;
+	unsigned long long max_size = 65536;
+	unsigned long long seed = 1;
+	unsigned long long prealloc = 0;
+	int dir_index = 1;
+
+	int opt;
+	int bad = 0;
+	while ((opt = getopt(argc, argv, "b:B:i:d:f:n:s:S:p:x")) != -1) {
+		char *colon;
+		switch (opt) {
+		case 'b': bad |= parse_count(optarg, &block_size); break;
+		case 'B': bad |= parse_count(optarg, &num_blocks); break;
+		case 'i': bad |= parse_count(optarg, &num_inodes); break;
+		case 'd': bad |= parse_count(optarg, &num_dirs); break;
+		case 'f': bad |= parse_count(optarg, &fan_out); break;
+		case 'n': bad |= parse_count(optarg, &num_files); break;
+		case 'S': bad |= parse_count(optarg, &seed); break;
+		case 'p': bad |= parse_count(optarg, &prealloc); break;
+		case 'x': dir_index = 0; break;
+		case 's':
+			if ((colon = strchr(optarg, ':')) == NULL) {
+				bad = 1;
+				break;
+			}
+			*colon = '\0';
+			bad |= parse_count(optarg, &min_size) | parse_count(colon + 1, &max_size);
+			break;
+		default: bad = 1;
+		}
+	}
+	if (bad || optind != argc - 1 || (block_size != 1024 && block_size != 2048 && block_size != 4096) ||
+		num_blocks > UINT32_MAX || num_inodes > UINT32_MAX || fan_out == 0 || min_size > max_size ||
+		prealloc > 255) {
+		fprintf(stderr,
+				"Usage: %s [-b block size] [-B blocks] [-i inodes] [-d dirs] [-f fan-out] [-n files]\n"
+				"       [-s min:max] [-S seed] [-p prealloc] [-x] <image file name>\n",
+				argv[0]);
+		exit(-1);
+	}
+	char const *file_name = argv[optind];
+	rng_state = seed * 0x9e3779b97f4a7c15ull + 1;
+
+	int result;
+	if ((result = format_image(file_name, block_size, num_blocks, num_inodes, dir_index, prealloc)) != 0) {
+		fprintf(stderr, "main: cannot format %s\n", file_name);
+		return result;
+	}
+	if ((result = init(&disk, file_name)) != 0) {
+		fprintf(stderr, "main: init\n");
+		return result;
+	}
+
+	// draw the sizes first, to check the whole tree fits before making any of it
+	unsigned int *dirs = malloc(sizeof(unsigned int) * (num_dirs + 1));				 // FREE
+	unsigned long long *sizes = malloc(sizeof(unsigned long long) * (num_files + 1)); // FREE
+	if (dirs == NULL || sizes == NULL) {
+		result = -ENOMEM;
+		goto out;
+	}
+	struct ext2_super_block *super_block = get_super_block(disk);
+	unsigned long long total_size = 0;
+	unsigned long long blocks_needed = num_dirs;
+	for (unsigned long long file = 0; file < num_files; file++) {
+		sizes[file] = random_size(min_size, max_size);
+		total_size += sizes[file];
+		int data = (sizes[file] + block_size - 1) / block_size;
+		blocks_needed += data + indirect_blocks_needed(data);
+	}
+	// directories holding many entries grow past one block; they are not counted
+	if (num_dirs + num_files > super_block->s_free_inodes_count ||
+		blocks_needed > super_block->s_free_blocks_count) {
+		fprintf(stderr, "main: the tree needs %llu inodes and %llu blocks, %u and %u are free\n",
+				num_dirs + num_files, blocks_needed, super_block->s_free_inodes_count,
+				super_block->s_free_blocks_count);
+		result = -ENOSPC;
+		goto out;
+	}
+
+	// directories breadth first, dir k under dir k / fan_out - 1, then the files round-robin
+	char name[32];
+	for (unsigned long long done = 0; done < num_dirs + num_files && result >= 0; done++) {
+		if (done < num_dirs) {
+			unsigned int parent = done < fan_out ? EXT2_ROOT_INO : dirs[done / fan_out - 1];
+			sprintf(name, "d%llu", done);
+			if ((result = make_dir(&disk, parent, name)) > 0) {
+				dirs[done] = result;
+			}
+		} else {
+			unsigned long long file = done - num_dirs;
+			unsigned int parent = num_dirs == 0 ? EXT2_ROOT_INO : dirs[file % num_dirs];
+			int *data_blocks = NULL; // FREE
+			sprintf(name, "f%llu", file);
+			if ((result = make_file(&disk, parent, sizes[file], &data_blocks)) > 0) {
+				result = update_dir_entry(&disk, parent, result, name, EXT2_FT_REG_FILE);
+			}
+			free(data_blocks);
+		}
+		if (result >= 0 && (done + 1) % MKIMAGE_BATCH == 0) {
+			result = end_op(0);
+		}
+	}
+	if ((result = end_op(result)) < 0) {
+		fprintf(stderr, "main: cannot populate %s\n", file_name);
+		goto out;
+	}
+	printf("%s: %llu directories, %llu files (%llu bytes), %u of %u blocks and %u of %u inodes used\n",
+		   file_name, num_dirs, num_files, total_size,
+		   super_block->s_blocks_count - super_block->s_free_blocks_count, super_block->s_blocks_count,
+		   super_block->s_inodes_count - super_block->s_free_inodes_count, super_block->s_inodes_count);
+
+out:
+	free(dirs);
+	free(sizes);
+	fini(&disk);
+	return result < 0 ? result : 0;
+}
@@ -0,0 +1,44 @@
+/*
+ * This program makes, commits and discards copy-on-write overlays of ext2
+ * formatted virtual disks. With two command line arguments, the name of a base
+ * image and the name of a new overlay file, it makes an empty overlay of the
+ * base, which costs one block whatever the base's size. Every other tool then
+ * takes the overlay in place of an image: it stands for a copy of the base, and
+ * only the blocks changed in it are stored in it, the base is never written.
+ * With --commit and the name of an overlay, the blocks it holds are written into
+ * its base as one journaled operation and it is started over, empty, on the
+ * result. With --discard and the name of an overlay, what it holds is thrown away.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "overlay.h"
+
+
+int main(int argc, char const *argv[]) {
+	int commit = argc == 3 && strcmp(argv[1], "--commit") == 0;
+	int discard = argc == 3 && strcmp(argv[1], "--discard") == 0;
+	if (argc != 3 || (argv[1][0] == '-' && !commit && !discard)) {
+		fprintf(stderr,
+				"Usage: %s <base image file name> <overlay file name>\n"
+				"       %s --commit | --discard <overlay file name>\n",
+				argv[0], argv[0]);
+		return -1;
+	}
+
+	int result;
+	if (commit) {
+		if ((result = overlay_commit(argv[2])) >= 0) {
+			printf("%d blocks committed\n", result);
+			result = 0;
+		}
+	} else if (discard) {
+		result = overlay_discard(argv[2]);
+	} else {
+		result = overlay_create(argv[1], argv[2]);
+	}
+	return result;
+}
@@ -0,0 +1,428 @@
+/*
+ * Public image-handle entry points of libext2ops; each selects the image and
+ * hands over to the implementation in utils.c or check.c.
+ *
+ * The current image is process-wide. mkdir, cp, ln, rm and cat hold the ops
+ * lock for reading and run side by side as shared operations (see
+ * begin_shared_op()), locking only the groups and directories they touch;
+ * the others hold it for writing and run alone, as does a shared operation
+ * that has to be redone after one beside it failed. Switching images takes
+ * it for writing too. ext2ops_cp() lets go of it altogether while it streams
+ * the file into blocks it reserved.
+ */
+
+#define _GNU_SOURCE // PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dirtylog.h"
+#include "ext2.h"
+#include "ext2ops.h"
+#include "overlay.h"
+#include "stats.h"
+#include "utils.h"
+
+// ---------- Function Declarations ----------
+int ext2ops_open(char const *file_name, struct ext2_image **image);
+void ext2ops_close(struct ext2_image *image);
+int ext2ops_set_flush(struct ext2_image *image, int policy, int n);
+int ext2ops_flush(struct ext2_image *image);
+int ext2ops_mkdir(struct ext2_image *image, char const *path);
+int ext2ops_cp(struct ext2_image *image, char const *local_path, char const *path);
+int ext2ops_cp_tree(struct ext2_image *image, char const *local_path, char const *path);
+int ext2ops_ln(struct ext2_image *image, char const *src_path, char const *dest_path, int soft_link);
+int ext2ops_rm(struct ext2_image *image, char const *path);
+int ext2ops_rm_tree(struct ext2_image *image, char const *path);
+int ext2ops_rm_paths(struct ext2_image *image, char const *const *paths, int num_paths, int recursive);
+int ext2ops_restore(struct ext2_image *image, char const *path);
+int ext2ops_restore_paths(struct ext2_image *image, char const *const *paths, int num_paths);
+int ext2ops_restore_tree(struct ext2_image *image, char const *path);
+int ext2ops_cat(struct ext2_image *image, char const *path, int out_fd);
+int ext2ops_export(struct ext2_image *image, char const *path, char const *local_path, int recursive);
+int ext2ops_check(struct ext2_image *image);
+int ext2ops_check_incremental(struct ext2_image *image);
+int ext2ops_verify(struct ext2_image *image);
+int ext2ops_overlay(char const *base_name, char const *file_name);
+int ext2ops_overlay_commit(char const *file_name);
+int ext2ops_overlay_discard(char const *file_name);
+
+// writers first, so the operations that run alone are not starved
+static pthread_rwlock_t ops_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+
+
+
+// ---------- Helper Functions ----------
+
+/**
+ * Take the ops lock for an operation that runs alone and make an image current
+ */
+static void op_begin(struct ext2_image *image) {
+	pthread_rwlock_wrlock(&ops_lock);
+	image_use(image);
+}
+
+/**
+ * Let go of the ops lock
+ * @return result, passed through
+ */
+static int op_done(int result) {
+	pthread_rwlock_unlock(&ops_lock);
+	return result;
+}
+
+/**
+ * Take the ops lock for a shared operation on an image, making the image
+ * current first if it is not, and begin the operation
+ */
+static void op_share(struct ext2_image *image) {
+	pthread_rwlock_rdlock(&ops_lock);
+	while (ext2_cur != image) {
+		pthread_rwlock_unlock(&ops_lock);
+		op_begin(image);
+		op_done(0);
+		pthread_rwlock_rdlock(&ops_lock);
+	}
+	begin_shared_op();
+}
+
+/**
+ * End a shared operation and let go of the ops lock, see end_shared_op()
+ * @return its result; -ERESTART if it has to be redone alone
+ */
+static int op_unshare(int result) {
+	result = end_shared_op(result);
+	pthread_rwlock_unlock(&ops_lock);
+	return result;
+}
+
+
+
+// ---------- Function Implementations ----------
+
+/**
+ * Open and map an image
+ * @param  file_name the image file name
+ * @param  image     set to the new handle
+ * @return           0 on success; errno on failure
+ */
+int ext2ops_open(char const *file_name, struct ext2_image **image) {
+	struct ext2_image *opened = calloc(1, sizeof(struct ext2_image));
+	if (opened == NULL) {
+		return -ENOMEM;
+	}
+	opened->map_fd = -1;
+	opened->journal_fd = -1;
+	opened->dirty_fd = -1;
+	opened->base_fd = -1;
+
+	int result;
+	STAT_PHASE_BEGIN(PHASE_OPEN);
+	result = image_open(opened, file_name, EXT2_MAP_AUTO);
+	STAT_PHASE_END(PHASE_OPEN);
+	if (result != 0) {
+		free(opened);
+		return result;
+	}
+	*image = opened;
+	return 0;
+}
+
+/**
+ * Unmap an image and free its handle
+ * @param image the handle; may be NULL
+ */
+void ext2ops_close(struct ext2_image *image) {
+	if (image == NULL) {
+		return;
+	}
+	pthread_rwlock_wrlock(&ops_lock);
+	image_close(image);
+	pthread_rwlock_unlock(&ops_lock);
+	free(image);
+}
+
+/**
+ * Choose when an open image's committed operations are made durable
+ * @param  image  the handle
+ * @param  policy EXT2OPS_FLUSH_OP, EXT2OPS_FLUSH_BATCH or EXT2OPS_FLUSH_CLOSE
+ * @param  n      operations per flush under EXT2OPS_FLUSH_BATCH
+ * @return        0 on success; -EINVAL for a bad policy
+ */
+int ext2ops_set_flush(struct ext2_image *image, int policy, int n) {
+	op_begin(image);
+	return op_done(journal_set_policy(image, policy, n));
+}
+
+/**
+ * Make every operation on an open image so far durable
+ * @param  image the handle
+ * @return       0 on success; errno on failure
+ */
+int ext2ops_flush(struct ext2_image *image) {
+	op_begin(image);
+	return op_done(journal_flush(image));
+}
+
+/**
+ * mkdir on an open image, see ext2_mkdir()
+ */
+int ext2ops_mkdir(struct ext2_image *image, char const *path) {
+	op_share(image);
+	int result = op_unshare(ext2_mkdir(&image->disk, path));
+	if (result == -ERESTART) { // undone with the operations alongside it: run it alone
+		op_begin(image);
+		do { // and again if it ran out of blocks held until a flush, see end_op()
+			result = end_op(ext2_mkdir(&image->disk, path));
+		} while (result == -ERESTART);
+		op_done(0);
+	}
+	return result;
+}
+
+/**
+ * cp onto an open image, see ext2_cp(). The file is copied into its reserved
+ * blocks with the ops lock let go, then created and linked as one operation.
+ */
+int ext2ops_cp(struct ext2_image *image, char const *local_path, char const *path) {
+	struct cp_plan plan;
+	int result;
+	op_share(image);
+	int prepared = ext2_cp_prepare(&image->disk, local_path, path, &plan);
+	result = op_unshare(prepared);
+	if (result < 0 && (prepared == 0 || prepared == -ERESTART)) { // the blocks may not be free after all
+		op_begin(image);
+		if (prepared == 0) {
+			cp_plan_release(image->disk, &plan);
+		}
+		while (result == -ERESTART) { // see ext2ops_mkdir()
+			result = end_op(ext2_cp_prepare(&image->disk, local_path, path, &plan));
+		}
+		op_done(0);
+	}
+	if (result < 0) {
+		return result;
+	}
+
+	STAT_PHASE_BEGIN(PHASE_CP_COPY);
+	result = cp_plan_copy(&plan);
+	STAT_PHASE_END(PHASE_CP_COPY);
+
+	if (result < 0) {
+		fprintf(stderr, "ext2_cp: cp_plan_copy\n");
+	} else {
+		op_share(image);
+		result = op_unshare(ext2_cp_finish(&image->disk, path, &plan));
+		if (result == -ERESTART) { // its blocks are still reserved for it
+			op_begin(image);
+			do {
+				result = end_op(ext2_cp_finish(&image->disk, path, &plan));
+			} while (result == -ERESTART);
+			op_done(0);
+		}
+	}
+	op_share(image);
+	cp_plan_release(image->disk, &plan);
+	return op_unshare(result);
+}
+
+/**
+ * cp -r on an open image, see ext2_cp_tree(); the whole tree is one operation
+ */
+int ext2ops_cp_tree(struct ext2_image *image, char const *local_path, char const *path) {
+	int result;
+	op_begin(image);
+	do { // see ext2ops_mkdir()
+		result = end_op(ext2_cp_tree(&image->disk, local_path, path, 0));
+	} while (result == -ERESTART);
+	return op_done(result);
+}
+
+/**
+ * ln [-s] on an open image, see ext2_ln()
+ */
+int ext2ops_ln(struct ext2_image *image, char const *src_path, char const *dest_path, int soft_link) {
+	op_share(image);
+	int result = op_unshare(ext2_ln(&image->disk, src_path, dest_path, soft_link));
+	if (result == -ERESTART) { // see ext2ops_mkdir()
+		op_begin(image);
+		do {
+			result = end_op(ext2_ln(&image->disk, src_path, dest_path, soft_link));
+		} while (result == -ERESTART);
+		op_done(0);
+	}
+	return result;
+}
+
+/**
+ * rm on an open image, see ext2_rm()
+ */
+int ext2ops_rm(struct ext2_image *image, char const *path) {
+	op_share(image);
+	int result = op_unshare(ext2_rm(&image->disk, path));
+	if (result == -ERESTART) { // see ext2ops_mkdir()
+		op_begin(image);
+		do {
+			result = end_op(ext2_rm(&image->disk, path));
+		} while (result == -ERESTART);
+		op_done(0);
+	}
+	return result;
+}
+
+/**
+ * rm -r on an open image, see ext2_rm_tree(); the whole tree is one operation
+ */
+int ext2ops_rm_tree(struct ext2_image *image, char const *path) {
+	int result;
+	op_begin(image);
+	do { // see ext2ops_mkdir()
+		result = end_op(ext2_rm_tree(&image->disk, path));
+	} while (result == -ERESTART);
+	return op_done(result);
+}
+
+/**
+ * rm [-r] of several paths on an open image as one operation, see
+ * ext2_rm_paths()
+ * @return number of paths removed
+ */
+int ext2ops_rm_paths(struct ext2_image *image, char const *const *paths, int num_paths, int recursive) {
+	int result;
+	op_begin(image);
+	do { // see ext2ops_mkdir()
+		result = end_op(ext2_rm_paths(&image->disk, paths, num_paths, recursive));
+	} while (result == -ERESTART);
+	return op_done(result);
+}
+
+/**
+ * restore on an open image, see ext2_restore()
+ */
+int ext2ops_restore(struct ext2_image *image, char const *path) {
+	int result;
+	op_begin(image);
+	do { // see ext2ops_mkdir()
+		result = end_op(ext2_restore(&image->disk, path));
+	} while (result == -ERESTART);
+	return op_done(result);
+}
+
+/**
+ * restore of several paths on an open image as one operation, see
+ * ext2_restore_paths()
+ * @return number of files restored
+ */
+int ext2ops_restore_paths(struct ext2_image *image, char const *const *paths, int num_paths) {
+	int result;
+	op_begin(image);
+	do { // see ext2ops_mkdir()
+		result = end_op(ext2_restore_paths(&image->disk, paths, num_paths));
+	} while (result == -ERESTART);
+	return op_done(result);
+}
+
+/**
+ * restore -r on an open image, see ext2_restore_tree(); the whole tree is one
+ * operation
+ * @return number of files restored
+ */
+int ext2ops_restore_tree(struct ext2_image *image, char const *path) {
+	int result;
+	op_begin(image);
+	do { // see ext2ops_mkdir()
+		result = end_op(ext2_restore_tree(&image->disk, path));
+	} while (result == -ERESTART);
+	return op_done(result);
+}
+
+/**
+ * cat on an open image, see ext2_cat(); it changes nothing
+ */
+int ext2ops_cat(struct ext2_image *image, char const *path, int out_fd) {
+	op_share(image);
+	return op_unshare(ext2_cat(&image->disk, path, out_fd));
+}
+
+/**
+ * Copy out of an open image, see ext2_export(); it changes nothing
+ */
+int ext2ops_export(struct ext2_image *image, char const *path, char const *local_path, int recursive) {
+	op_begin(image);
+	return op_done(ext2_export(&image->disk, path, local_path, recursive));
+}
+
+/**
+ * Check and repair an open image, see ext2_check(), then start its dirty log
+ * over
+ * @return number of inconsistencies fixed
+ */
+int ext2ops_check(struct ext2_image *image) {
+	int result;
+	op_begin(image);
+	do { // see ext2ops_mkdir()
+		result = end_op(ext2_check(&image->disk));
+	} while (result == -ERESTART);
+	if (result >= 0) {
+		dirtylog_reset(image);
+	}
+	return op_done(result);
+}
+
+/**
+ * Check and repair only what changed since an open image's last check, see
+ * ext2_check_incremental(), then start its dirty log over
+ * @return number of inconsistencies fixed
+ */
+int ext2ops_check_incremental(struct ext2_image *image) {
+	int result;
+	op_begin(image);
+	do { // see ext2ops_mkdir()
+		result = end_op(ext2_check_incremental(&image->disk));
+	} while (result == -ERESTART);
+	if (result >= 0) {
+		dirtylog_reset(image);
+	}
+	return op_done(result);
+}
+
+/**
+ * Compare an open image's free counters with its bitmaps, read-only; see
+ * verify_counters()
+ * @return number of counters that disagree
+ */
+int ext2ops_verify(struct ext2_image *image) {
+	op_begin(image);
+	return op_done(verify_counters(image->disk));
+}
+
+
+/**
+ * Make an empty overlay over a base image, see overlay_create(); the overlay
+ * then opens with ext2ops_open() like an image
+ */
+int ext2ops_overlay(char const *base_name, char const *file_name) {
+	return overlay_create(base_name, file_name);
+}
+
+
+/**
+ * Write an overlay's blocks into its base, see overlay_commit(). The
+ * overlay and its base must not be open in this process.
+ * @return number of blocks written into the base
+ */
+int ext2ops_overlay_commit(char const *file_name) {
+	pthread_rwlock_wrlock(&ops_lock); // commits through the current image
+	return op_done(overlay_commit(file_name));
+}
+
+
+/**
+ * Throw away what an overlay holds, see overlay_discard(). The overlay must
+ * not be open in this process.
+ */
+int ext2ops_overlay_discard(char const *file_name) {
+	return overlay_discard(file_name);
+}
@@ -0,0 +1,72 @@
+#ifndef EXT2_OPS
+#define EXT2_OPS
+
+/*
+ * libext2ops: the operations behind ext2_mkdir, ext2_cp, ext2_ln, ext2_rm,
+ * ext2_restore, ext2_cat, ext2_export and ext2_checker, callable in-process
+ * on an open image.
+ *
+ * An image is opened once and every operation on it reuses the mapping,
+ * the cached group metadata and the dentry cache. Several images may be
+ * open at a time; the dentry cache follows the image last operated on.
+ *
+ * The functions may be called from any number of threads. mkdir, cp, ln,
+ * rm and cat on the same image run side by side, locking only the block
+ * groups and directories they change, and are committed and flushed
+ * together; files copied at the same time also stream into their blocks
+ * side by side. The other operations, and any operation in a process
+ * switching between images, run one at a time. An image is open in one
+ * process at a time: opening one another process has open waits until it
+ * is closed.
+ *
+ * Every operation is atomic: it lands on the image whole or, if it fails,
+ * not at all. By default each one is also flushed before it returns;
+ * ext2ops_set_flush() trades that for fewer, larger flushes, and a crash
+ * then loses at most the operations since the last one.
+ *
+ * An overlay made with ext2ops_overlay() opens like an image and stands for
+ * a copy of its base, costing only the blocks changed in it; the base is
+ * never written. ext2ops_overlay_commit() writes those blocks into the base
+ * and ext2ops_overlay_discard() throws them away. See overlay.h.
+ *
+ * Every function returns 0 (or a count, for the checks, ext2ops_verify, the
+ * bulk rm and restores and ext2ops_overlay_commit) on success and a negative
+ * errno on failure.
+ *
+ * The operations can be counted and timed with stats.h, in a build made
+ * with make STATS=1.
+ */
+
+/* Flush policies for ext2ops_set_flush() */
+#define EXT2OPS_FLUSH_OP 0	  /* after every operation; the default */
+#define EXT2OPS_FLUSH_BATCH 1 /* after every n operations */
+#define EXT2OPS_FLUSH_CLOSE 2 /* only on ext2ops_flush() and ext2ops_close() */
+
+struct ext2_image;
+
+int ext2ops_open(char const *file_name, struct ext2_image **image);
+void ext2ops_close(struct ext2_image *image);
+int ext2ops_set_flush(struct ext2_image *image, int policy, int n);
+int ext2ops_flush(struct ext2_image *image);
+
+int ext2ops_mkdir(struct ext2_image *image, char const *path);
+int ext2ops_cp(struct ext2_image *image, char const *local_path, char const *path);
+int ext2ops_cp_tree(struct ext2_image *image, char const *local_path, char const *path);
+int ext2ops_ln(struct ext2_image *image, char const *src_path, char const *dest_path, int soft_link);
+int ext2ops_rm(struct ext2_image *image, char const *path);
+int ext2ops_rm_tree(struct ext2_image *image, char const *path);
+int ext2ops_rm_paths(struct ext2_image *image, char const *const *paths, int num_paths, int recursive);
+int ext2ops_restore(struct ext2_image *image, char const *path);
+int ext2ops_restore_paths(struct ext2_image *image, char const *const *paths, int num_paths);
+int ext2ops_restore_tree(struct ext2_image *image, char const *path);
+int ext2ops_cat(struct ext2_image *image, char const *path, int out_fd);
+int ext2ops_export(struct ext2_image *image, char const *path, char const *local_path, int recursive);
+int ext2ops_check(struct ext2_image *image);
+int ext2ops_check_incremental(struct ext2_image *image);
+int ext2ops_verify(struct ext2_image *image);
+
+int ext2ops_overlay(char const *base_name, char const *file_name);
+int ext2ops_overlay_commit(char const *file_name);
+int ext2ops_overlay_discard(char const *file_name);
+
+#endif // EXT2_OPS
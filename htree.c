@@ -0,0 +1,734 @@
+/*
+ * Hashed directory indexes: name hashing, index lookup and index upkeep as
+ * directories grow. See htree.h for the layout.
+ *
+ * The root block, after . and .., and each index node, after its empty
+ * entry, hold a count/limit header and then (hash, block) pairs sorted by
+ * hash. The header takes the place of the first pair's hash: that pair covers
+ * every hash below the second's. A leaf's hash with bit 0 set marks a split
+ * inside a run of equal hashes, so a lookup that misses at the end of the
+ * previous leaf carries on into it.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ext2.h"
+#include "htree.h"
+#include "utils.h"
+
+#define DX_ROOT_OFFSET 24 /* after . (12 bytes) and .. (12 bytes) */
+#define DX_MAX_LEVELS 2	  /* the root and one level of nodes */
+#define DX_BLOCK_MASK 0x0fffffffu
+
+#define DX_DEFAULT_SEED {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476}
+
+struct dx_root_info {
+	uint32_t reserved_zero;
+	uint8_t hash_version;
+	uint8_t info_length; /* 8 */
+	uint8_t indirect_levels;
+	uint8_t unused_flags;
+};
+
+struct dx_entry {
+	uint32_t hash;
+	uint32_t block; /* logical block in the directory */
+};
+
+/* overlays the first dx_entry's hash */
+struct dx_countlimit {
+	uint16_t limit;
+	uint16_t count;
+};
+
+/* one level of a lookup: the entries searched and the one followed */
+struct dx_frame {
+	struct dx_entry *entries;
+	struct dx_entry *at;
+};
+
+/* a leaf entry being redistributed by a split */
+struct dx_map_entry {
+	uint32_t hash;
+	uint16_t offset;
+	uint16_t size;
+};
+
+// ---------- Function Declarations ----------
+unsigned int dx_hash(unsigned char *disk, int version, char const *name, int name_len);
+int dx_can_index(unsigned char *disk);
+int dx_make_indexed(unsigned char **disk, unsigned int dir_idx);
+int dx_lookup(unsigned char *disk, unsigned int dir_idx, char const *name, int name_len,
+			  struct dir_slot *slot);
+int dx_leaf(unsigned char *disk, unsigned int dir_idx, char const *name, int name_len,
+			unsigned int *lblk);
+int dx_insert(unsigned char **disk, unsigned int dir_idx, unsigned int child_idx, char const *name,
+			  int name_len, unsigned char type);
+
+
+
+// ---------- Helper Functions ----------
+
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + (x), a = (a << (s)) | (a >> (32 - (s))))
+#define K2 013240474631u
+#define K3 015666365641u
+
+/**
+ * The half-MD4 block transform, as ext3 uses it
+ * @return the "most hashed" word
+ */
+static uint32_t half_md4_transform(uint32_t buf[4], uint32_t const in[8]) {
+	uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+	ROUND(F, a, b, c, d, in[0], 3);
+	ROUND(F, d, a, b, c, in[1], 7);
+	ROUND(F, c, d, a, b, in[2], 11);
+	ROUND(F, b, c, d, a, in[3], 19);
+	ROUND(F, a, b, c, d, in[4], 3);
+	ROUND(F, d, a, b, c, in[5], 7);
+	ROUND(F, c, d, a, b, in[6], 11);
+	ROUND(F, b, c, d, a, in[7], 19);
+
+	ROUND(G, a, b, c, d, in[1] + K2, 3);
+	ROUND(G, d, a, b, c, in[3] + K2, 5);
+	ROUND(G, c, d, a, b, in[5] + K2, 9);
+	ROUND(G, b, c, d, a, in[7] + K2, 13);
+	ROUND(G, a, b, c, d, in[0] + K2, 3);
+	ROUND(G, d, a, b, c, in[2] + K2, 5);
+	ROUND(G, c, d, a, b, in[4] + K2, 9);
+	ROUND(G, b, c, d, a, in[6] + K2, 13);
+
+	ROUND(H, a, b, c, d, in[3] + K3, 3);
+	ROUND(H, d, a, b, c, in[7] + K3, 9);
+	ROUND(H, c, d, a, b, in[2] + K3, 11);
+	ROUND(H, b, c, d, a, in[6] + K3, 15);
+	ROUND(H, a, b, c, d, in[1] + K3, 3);
+	ROUND(H, d, a, b, c, in[5] + K3, 9);
+	ROUND(H, c, d, a, b, in[0] + K3, 11);
+	ROUND(H, b, c, d, a, in[4] + K3, 15);
+
+	buf[0] += a;
+	buf[1] += b;
+	buf[2] += c;
+	buf[3] += d;
+	return buf[1];
+}
+
+/**
+ * The TEA block transform, 16 rounds
+ */
+static void tea_transform(uint32_t buf[4], uint32_t const in[4]) {
+	uint32_t sum = 0;
+	uint32_t b0 = buf[0], b1 = buf[1];
+	uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+
+	for (int n = 0; n < 16; n++) {
+		sum += 0x9e3779b9;
+		b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+		b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+	}
+	buf[0] += b0;
+	buf[1] += b1;
+}
+
+/**
+ * The original ext3 directory hash
+ */
+static uint32_t legacy_hash(char const *name, int name_len, int unsigned_chars) {
+	uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+
+	for (int i = 0; i < name_len; i++) {
+		int c = unsigned_chars ? (int)(unsigned char)name[i] : (int)(signed char)name[i];
+		hash = hash1 + (hash0 ^ (uint32_t)(c * 7152373));
+		if (hash & 0x80000000) {
+			hash -= 0x7fffffff;
+		}
+		hash1 = hash0;
+		hash0 = hash;
+	}
+	return hash0 << 1;
+}
+
+/**
+ * Pack up to num * 4 bytes of a name into words for a block transform,
+ * padding with a pattern of its length
+ */
+static void name_to_words(char const *name, int name_len, uint32_t *words, int num,
+						  int unsigned_chars) {
+	uint32_t pad = (uint32_t)name_len | ((uint32_t)name_len << 8);
+	pad |= pad << 16;
+	uint32_t val = pad;
+
+	if (name_len > num * 4) {
+		name_len = num * 4;
+	}
+	for (int i = 0; i < name_len; i++) {
+		int c = unsigned_chars ? (int)(unsigned char)name[i] : (int)(signed char)name[i];
+		val = c + (val << 8);
+		if (i % 4 == 3) {
+			*words++ = val;
+			val = pad;
+			num--;
+		}
+	}
+	if (--num >= 0) {
+		*words++ = val;
+	}
+	while (--num >= 0) {
+		*words++ = pad;
+	}
+}
+
+static inline struct dx_countlimit *countlimit(struct dx_entry *entries) {
+	return (struct dx_countlimit *)entries;
+}
+
+static inline unsigned int dx_block(struct dx_entry *entry) {
+	return entry->block & DX_BLOCK_MASK;
+}
+
+static inline struct dx_root_info *root_info(unsigned char *root) {
+	return (struct dx_root_info *)(root + DX_ROOT_OFFSET);
+}
+
+static inline struct dx_entry *root_entries(unsigned char *root) {
+	return (struct dx_entry *)(root + DX_ROOT_OFFSET + sizeof(struct dx_root_info));
+}
+
+static inline unsigned int root_limit(void) {
+	return (EXT2_BLOCK_SIZE - DX_ROOT_OFFSET - sizeof(struct dx_root_info)) / sizeof(struct dx_entry);
+}
+
+static inline unsigned int node_limit(void) {
+	return (EXT2_BLOCK_SIZE - sizeof(struct ext2_dir_entry)) / sizeof(struct dx_entry);
+}
+
+/**
+ * Check a block of entries' header against the limit its kind of block has
+ * @return 1 if sound, 0 if not
+ */
+static int entries_ok(struct dx_entry *entries, unsigned int limit) {
+	struct dx_countlimit *cl = countlimit(entries);
+	return cl->limit == limit && cl->count > 0 && cl->count <= limit;
+}
+
+/**
+ * Find the entry covering a hash: the last whose hash is not above it
+ */
+static struct dx_entry *dx_search(struct dx_entry *entries, uint32_t hash) {
+	struct dx_entry *p = entries + 1;
+	struct dx_entry *q = entries + countlimit(entries)->count - 1;
+	while (p <= q) {
+		struct dx_entry *m = p + (q - p) / 2;
+		if (m->hash > hash) {
+			q = m - 1;
+		} else {
+			p = m + 1;
+		}
+	}
+	return p - 1;
+}
+
+/**
+ * An index node's entries
+ * @return the entries; NULL if the block is missing or not a sound node
+ */
+static struct dx_entry *node_entries(unsigned char *disk, struct ext2_inode *dir_inode,
+									 unsigned int lblk) {
+	if (lblk >= dir_num_blocks(dir_inode)) {
+		return NULL;
+	}
+	unsigned char *node = dir_block(disk, dir_inode, lblk);
+	if (node == NULL) {
+		return NULL;
+	}
+	struct ext2_dir_entry *fake = (struct ext2_dir_entry *)node;
+	struct dx_entry *entries = (struct dx_entry *)(node + sizeof(struct ext2_dir_entry));
+	if (fake->inode != 0 || fake->rec_len != EXT2_BLOCK_SIZE || !entries_ok(entries, node_limit())) {
+		return NULL;
+	}
+	return entries;
+}
+
+/**
+ * Hash a name as a directory's index does and walk the index down to the
+ * leaf that covers the hash
+ * @param  disk      the disk
+ * @param  dir_inode the directory's inode
+ * @param  name      the name
+ * @param  name_len  length of the name
+ * @param  hash      set to the name's hash
+ * @param  frames    filled in from the root down
+ * @param  levels    set to the number of node levels under the root
+ * @return           0 on success; -EUCLEAN if the index is not sound
+ */
+static int dx_probe(unsigned char *disk, struct ext2_inode *dir_inode, char const *name, int name_len,
+					uint32_t *hash, struct dx_frame frames[DX_MAX_LEVELS], int *levels) {
+	unsigned char *root = dir_num_blocks(dir_inode) > 1 ? dir_block(disk, dir_inode, 0) : NULL;
+	if (root == NULL) {
+		return -EUCLEAN;
+	}
+	struct ext2_dir_entry *dot = (struct ext2_dir_entry *)root;
+	struct ext2_dir_entry *dotdot = (struct ext2_dir_entry *)(root + 12);
+	struct dx_root_info *info = root_info(root);
+	if (dot->rec_len != 12 || dotdot->rec_len != EXT2_BLOCK_SIZE - 12 || info->reserved_zero != 0 ||
+		info->info_length != sizeof(*info) || info->hash_version > EXT2_HASH_TEA ||
+		info->indirect_levels >= DX_MAX_LEVELS || !entries_ok(root_entries(root), root_limit())) {
+		return -EUCLEAN;
+	}
+
+	*hash = dx_hash(disk, info->hash_version, name, name_len);
+	*levels = info->indirect_levels;
+	frames[0].entries = root_entries(root);
+	frames[0].at = dx_search(frames[0].entries, *hash);
+	for (int i = 1; i <= *levels; i++) {
+		if ((frames[i].entries = node_entries(disk, dir_inode, dx_block(frames[i - 1].at))) == NULL) {
+			return -EUCLEAN;
+		}
+		frames[i].at = dx_search(frames[i].entries, *hash);
+	}
+	if (dx_block(frames[*levels].at) >= dir_num_blocks(dir_inode)) {
+		return -EUCLEAN;
+	}
+	return 0;
+}
+
+/**
+ * Step the frames to the next leaf, if it continues a run of the hash
+ * @return 1 if stepped, 0 if the hash can be in no further leaf; -EUCLEAN if
+ *         the index is not sound
+ */
+static int dx_next_leaf(unsigned char *disk, struct ext2_inode *dir_inode, struct dx_frame *frames,
+						int levels, uint32_t hash) {
+	int i = levels;
+	while (++frames[i].at >= frames[i].entries + countlimit(frames[i].entries)->count) {
+		if (i == 0) {
+			return 0;
+		}
+		i--;
+	}
+	if ((frames[i].at->hash & ~1u) != hash) {
+		return 0;
+	}
+	for (; i < levels; i++) {
+		if ((frames[i + 1].entries = node_entries(disk, dir_inode, dx_block(frames[i].at))) == NULL) {
+			return -EUCLEAN;
+		}
+		frames[i + 1].at = frames[i + 1].entries;
+	}
+	return 1;
+}
+
+/**
+ * Make room after at in a block of entries and fill it in
+ */
+static void dx_insert_entry(struct dx_entry *entries, struct dx_entry *at, uint32_t hash,
+							unsigned int block) {
+	struct dx_countlimit *cl = countlimit(entries);
+	struct dx_entry *end = entries + cl->count;
+	memmove(at + 2, at + 1, (end - (at + 1)) * sizeof(*at));
+	at[1].hash = hash;
+	at[1].block = block;
+	cl->count++;
+}
+
+/**
+ * Get room in the deepest index block of a lookup: add a level of nodes
+ * under a full root, or split a full node in two
+ * @return 0 on success; -ENOSPC if the index is as big as it gets, errno on failure
+ */
+static int dx_grow_index(unsigned char **disk, unsigned int dir_idx, struct dx_frame *frames,
+						 int *levels) {
+	struct ext2_inode *dir_inode = get_inode(*disk, dir_idx);
+	struct dx_frame *frame = &frames[*levels];
+	struct dx_countlimit *cl = countlimit(frame->entries);
+	if (cl->count < cl->limit) {
+		return 0;
+	}
+	if (*levels > 0 && countlimit(frames[0].entries)->count >= countlimit(frames[0].entries)->limit) {
+		fprintf(stderr, "dx_grow_index: directory index full\n");
+		return -ENOSPC;
+	}
+
+	unsigned int lblk;
+	int block_num = dir_add_block(disk, dir_idx, &lblk);
+	if (block_num < 0) {
+		return block_num;
+	}
+	unsigned char *node = *disk + (size_t)EXT2_BLOCK_SIZE * block_num;
+	struct dx_entry *entries = (struct dx_entry *)(node + sizeof(struct ext2_dir_entry));
+	unsigned char *root = dir_block(*disk, dir_inode, 0);
+	unsigned char *old_node = (unsigned char *)frame->entries - sizeof(struct ext2_dir_entry);
+
+	if (*levels == 0) { // the root's entries move down into the new node
+		memcpy(entries, frame->entries, cl->count * sizeof(*entries));
+		countlimit(entries)->limit = node_limit();
+		frames[1].entries = entries;
+		frames[1].at = entries + (frame->at - frame->entries);
+		cl->count = 1;
+		frame->entries[0].block = lblk;
+		frame->at = frame->entries;
+		root_info(root)->indirect_levels = 1;
+		*levels = 1;
+	} else { // the node's upper half moves to the new node
+		unsigned int keep = cl->count / 2;
+		unsigned int move = cl->count - keep;
+		uint32_t hash2 = frame->entries[keep].hash;
+		memcpy(entries, frame->entries + keep, move * sizeof(*entries));
+		countlimit(entries)->limit = node_limit();
+		countlimit(entries)->count = move;
+		cl->count = keep;
+		dx_insert_entry(frames[0].entries, frames[0].at, hash2, lblk);
+		if (frame->at >= frame->entries + keep) {
+			frame->at = entries + (frame->at - frame->entries - keep);
+			frame->entries = entries;
+			frames[0].at++;
+		}
+		dirty_meta(*disk, old_node, EXT2_BLOCK_SIZE);
+	}
+	dirty_meta(*disk, root, EXT2_BLOCK_SIZE);
+	dirty_meta(*disk, node, EXT2_BLOCK_SIZE);
+	return 0;
+}
+
+static int compare_map_entries(void const *a, void const *b) {
+	struct dx_map_entry const *x = a, *y = b;
+	if (x->hash != y->hash) {
+		return x->hash < y->hash ? -1 : 1;
+	}
+	return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/**
+ * Lay packed entries out in a block, the last one stretched to its end
+ */
+static void pack_entries(unsigned char *block, unsigned char const *from,
+						 struct dx_map_entry const *map, int num) {
+	int offset = 0;
+	struct ext2_dir_entry *entry = NULL;
+	for (int i = 0; i < num; i++) {
+		entry = (struct ext2_dir_entry *)(block + offset);
+		memcpy(entry, from + map[i].offset, map[i].size);
+		entry->rec_len = map[i].size;
+		offset += map[i].size;
+	}
+	entry->rec_len += EXT2_BLOCK_SIZE - offset;
+}
+
+/**
+ * Split a full leaf by hash, its upper half moving to a new leaf, and index
+ * the new leaf after the frame's entry
+ * @return the hash starting the new leaf, continuation bit included; errno on failure
+ */
+static int64_t dx_split_leaf(unsigned char **disk, unsigned int dir_idx, struct dx_frame *frame,
+							 unsigned int *new_lblk) {
+	struct ext2_inode *dir_inode = get_inode(*disk, dir_idx);
+	unsigned char *leaf = dir_block(*disk, dir_inode, dx_block(frame->at));
+	int version = root_info(dir_block(*disk, dir_inode, 0))->hash_version;
+
+	// hash the live entries, in block order
+	unsigned char *copy = malloc(EXT2_BLOCK_SIZE); // FREE
+	struct dx_map_entry *map = malloc(EXT2_BLOCK_SIZE / 12 * sizeof(*map)); // FREE
+	int64_t result;
+	int num = 0;
+	if (copy == NULL || map == NULL) {
+		result = -ENOMEM;
+		goto out;
+	}
+	for (int offset = 0; offset < EXT2_BLOCK_SIZE;) {
+		struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(leaf + offset);
+		if (entry->rec_len == 0) {
+			result = -EUCLEAN;
+			goto out;
+		}
+		if (entry->inode != 0) {
+			map[num].hash = dx_hash(*disk, version, entry->name, entry->name_len);
+			map[num].offset = offset;
+			map[num].size = dir_entry_size(entry->name_len);
+			num++;
+		}
+		offset += entry->rec_len;
+	}
+	if (num < 2) {
+		result = -ENOSPC;
+		goto out;
+	}
+	qsort(map, num, sizeof(*map), compare_map_entries);
+
+	// the entries whose sizes add up to half a block at most move
+	int split = num;
+	int moved = 0;
+	while (split > 1 && moved + map[split - 1].size <= EXT2_BLOCK_SIZE / 2) {
+		moved += map[--split].size;
+	}
+	if (split == num) {
+		split--;
+	}
+	uint32_t hash2 = map[split].hash;
+	if (hash2 == map[split - 1].hash) {
+		hash2 |= 1;
+	}
+
+	int block_num = dir_add_block(disk, dir_idx, new_lblk);
+	if (block_num < 0) {
+		result = block_num;
+		goto out;
+	}
+	unsigned char *new_leaf = *disk + (size_t)EXT2_BLOCK_SIZE * block_num;
+	memcpy(copy, leaf, EXT2_BLOCK_SIZE);
+	pack_entries(new_leaf, copy, map + split, num - split);
+	pack_entries(leaf, copy, map, split);
+	dx_insert_entry(frame->entries, frame->at, hash2, *new_lblk);
+
+	dirty_meta(*disk, frame->entries, countlimit(frame->entries)->limit * sizeof(struct dx_entry));
+	dirty_meta(*disk, leaf, EXT2_BLOCK_SIZE);
+	dirty_meta(*disk, new_leaf, EXT2_BLOCK_SIZE);
+	result = hash2;
+
+out:
+	free(copy);
+	free(map);
+	return result;
+}
+
+
+
+// ---------- Function Implementations ----------
+
+/**
+ * Hash a name as a directory index does
+ * @param  disk     the disk, for its hash seed and signedness
+ * @param  version  EXT2_HASH_LEGACY, EXT2_HASH_HALF_MD4 or EXT2_HASH_TEA
+ * @param  name     the name
+ * @param  name_len length of the name
+ * @return          the hash, bit 0 clear
+ */
+unsigned int dx_hash(unsigned char *disk, int version, char const *name, int name_len) {
+	struct ext2_super_block *sb = get_super_block(disk);
+	uint32_t buf[4] = DX_DEFAULT_SEED;
+	uint32_t in[8];
+	uint32_t hash = 0;
+	int unsigned_chars = (sb->s_flags & EXT2_FLAGS_UNSIGNED_HASH) != 0;
+
+	for (int i = 0; i < 4; i++) {
+		if (sb->s_hash_seed[i] != 0) {
+			memcpy(buf, sb->s_hash_seed, sizeof(buf));
+			break;
+		}
+	}
+
+	switch (version) {
+	case EXT2_HASH_LEGACY:
+		hash = legacy_hash(name, name_len, unsigned_chars);
+		break;
+	case EXT2_HASH_HALF_MD4:
+		for (; name_len > 0; name += 32, name_len -= 32) {
+			name_to_words(name, name_len, in, 8, unsigned_chars);
+			half_md4_transform(buf, in);
+		}
+		hash = buf[1];
+		break;
+	case EXT2_HASH_TEA:
+		for (; name_len > 0; name += 16, name_len -= 16) {
+			name_to_words(name, name_len, in, 4, unsigned_chars);
+			tea_transform(buf, in);
+		}
+		hash = buf[0];
+		break;
+	}
+	return hash & ~1u;
+}
+
+/**
+ * Whether directories on the disk may be indexed: the file system has the
+ * dir_index feature and a default hash this code knows
+ */
+int dx_can_index(unsigned char *disk) {
+	struct ext2_super_block *sb = get_super_block(disk);
+	return (sb->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) &&
+		   sb->s_def_hash_version <= EXT2_HASH_TEA;
+}
+
+/**
+ * Index a one-block directory: its entries past . and .. move to a new
+ * block, the sole leaf, and block 0 becomes the index root
+ * @param  disk    the disk
+ * @param  dir_idx inode index of the directory
+ * @return         0 on success; -EUCLEAN if block 0 does not start with . and ..,
+ *                 errno on failure
+ */
+int dx_make_indexed(unsigned char **disk, unsigned int dir_idx) {
+	struct ext2_inode *dir_inode = get_inode(*disk, dir_idx);
+	unsigned char *root = dir_block(*disk, dir_inode, 0);
+	if (root == NULL || dir_num_blocks(dir_inode) != 1) {
+		return -EUCLEAN;
+	}
+	struct ext2_dir_entry *dot = (struct ext2_dir_entry *)root;
+	struct ext2_dir_entry *dotdot = (struct ext2_dir_entry *)(root + 12);
+	if (dot->rec_len != 12 || dot->name_len != 1 || dot->name[0] != '.' ||
+		dotdot->rec_len < 12 || dotdot->name_len != 2 || memcmp(dotdot->name, "..", 2) != 0) {
+		return -EUCLEAN;
+	}
+
+	unsigned int lblk;
+	int block_num = dir_add_block(disk, dir_idx, &lblk);
+	if (block_num < 0) {
+		return block_num;
+	}
+	unsigned char *leaf = *disk + (size_t)EXT2_BLOCK_SIZE * block_num;
+
+	// the live entries after .. pack into the leaf
+	struct dx_map_entry *map = malloc(EXT2_BLOCK_SIZE / 12 * sizeof(*map)); // FREE
+	if (map == NULL) {
+		return -ENOMEM;
+	}
+	int num = 0;
+	for (int offset = 12 + dotdot->rec_len; offset < EXT2_BLOCK_SIZE;) {
+		struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(root + offset);
+		if (entry->rec_len == 0) {
+			break;
+		}
+		if (entry->inode != 0) {
+			map[num].offset = offset;
+			map[num].size = dir_entry_size(entry->name_len);
+			num++;
+		}
+		offset += entry->rec_len;
+	}
+	if (num > 0) {
+		pack_entries(leaf, root, map, num);
+	}
+	free(map);
+
+	dotdot->rec_len = EXT2_BLOCK_SIZE - 12;
+	memset(root + DX_ROOT_OFFSET, 0, EXT2_BLOCK_SIZE - DX_ROOT_OFFSET);
+	struct dx_root_info *info = root_info(root);
+	info->hash_version = get_super_block(*disk)->s_def_hash_version;
+	info->info_length = sizeof(*info);
+	struct dx_entry *entries = root_entries(root);
+	countlimit(entries)->limit = root_limit();
+	countlimit(entries)->count = 1;
+	entries[0].block = lblk;
+
+	dir_inode->i_flags |= EXT2_INDEX_FL;
+	dirty_meta(*disk, dir_inode, sizeof(*dir_inode));
+	dirty_meta(*disk, root, EXT2_BLOCK_SIZE);
+	dirty_meta(*disk, leaf, EXT2_BLOCK_SIZE);
+	return 0;
+}
+
+/**
+ * Find a live entry by name through a directory's index
+ * @param  disk     the disk
+ * @param  dir_idx  inode index of the indexed directory
+ * @param  name     the name (not necessarily null-terminated)
+ * @param  name_len length of the name
+ * @param  slot     filled with where the entry is
+ * @return          1 if found, 0 if not; -EUCLEAN if the index is not sound
+ */
+int dx_lookup(unsigned char *disk, unsigned int dir_idx, char const *name, int name_len,
+			  struct dir_slot *slot) {
+	struct ext2_inode *dir_inode = get_inode(disk, dir_idx);
+	struct dx_frame frames[DX_MAX_LEVELS];
+	uint32_t hash;
+	int levels;
+	int result;
+
+	if ((result = dx_probe(disk, dir_inode, name, name_len, &hash, frames, &levels)) < 0) {
+		return result;
+	}
+	do {
+		unsigned int lblk = dx_block(frames[levels].at);
+		unsigned char *leaf = dir_block(disk, dir_inode, lblk);
+		if (leaf == NULL) {
+			return -EUCLEAN;
+		}
+		if (dir_block_find(leaf, name, name_len, slot)) {
+			slot->lblk = lblk;
+			return 1;
+		}
+	} while ((result = dx_next_leaf(disk, dir_inode, frames, levels, hash)) > 0);
+	return result;
+}
+
+/**
+ * The leaf a name belongs in, by a directory's index
+ * @param  disk     the disk
+ * @param  dir_idx  inode index of the indexed directory
+ * @param  name     the name
+ * @param  name_len length of the name
+ * @param  lblk     set to the leaf's logical block
+ * @return          0 on success; -EUCLEAN if the index is not sound
+ */
+int dx_leaf(unsigned char *disk, unsigned int dir_idx, char const *name, int name_len,
+			unsigned int *lblk) {
+	struct dx_frame frames[DX_MAX_LEVELS];
+	uint32_t hash;
+	int levels;
+	int result;
+
+	if ((result = dx_probe(disk, get_inode(disk, dir_idx), name, name_len, &hash, frames, &levels)) < 0) {
+		return result;
+	}
+	*lblk = dx_block(frames[levels].at);
+	return 0;
+}
+
+/**
+ * Add an entry to an indexed directory: into the leaf its hash belongs in,
+ * after its last entry or else in a gap, splitting the leaf (and growing the index to make room for the new one)
+ * if it is full. A directory whose index is not sound loses its index flag,
+ * so it is read and extended as a plain directory from then on.
+ * @param  disk      the disk
+ * @param  dir_idx   inode index of the indexed directory
+ * @param  child_idx inode index of the new entry
+ * @param  name      its name
+ * @param  name_len  length of the name
+ * @param  type      its dirent file type
+ * @return           0 on success; -EUCLEAN if the index was dropped, errno on failure
+ */
+int dx_insert(unsigned char **disk, unsigned int dir_idx, unsigned int child_idx, char const *name,
+			  int name_len, unsigned char type) {
+	struct ext2_inode *dir_inode = get_inode(*disk, dir_idx);
+	struct dx_frame frames[DX_MAX_LEVELS];
+	uint32_t hash;
+	int levels;
+	int result;
+
+	// a split can leave the name's half still too full for a long name; a
+	// second split of that half makes room
+	for (int tries = 0; tries < 3; tries++) {
+		if (dx_probe(*disk, dir_inode, name, name_len, &hash, frames, &levels) < 0) {
+			fprintf(stderr, "dx_insert: directory %u has a broken index, dropping it\n", dir_idx);
+			dir_inode->i_flags &= ~EXT2_INDEX_FL;
+			dirty_meta(*disk, dir_inode, sizeof(*dir_inode));
+			return -EUCLEAN;
+		}
+		unsigned char *leaf = dir_block(*disk, dir_inode, dx_block(frames[levels].at));
+		if (dir_block_append(leaf, child_idx, name, name_len, type) ||
+			dir_block_insert(leaf, child_idx, name, name_len, type)) {
+			return 0;
+		}
+
+		if ((result = dx_grow_index(disk, dir_idx, frames, &levels)) < 0) {
+			return result;
+		}
+		unsigned int new_lblk;
+		int64_t hash2 = dx_split_leaf(disk, dir_idx, &frames[levels], &new_lblk);
+		if (hash2 < 0) {
+			return hash2;
+		}
+		leaf = dir_block(*disk, dir_inode, hash >= (uint32_t)hash2 ? new_lblk : dx_block(frames[levels].at));
+		if (dir_block_append(leaf, child_idx, name, name_len, type)) {
+			return 0;
+		}
+	}
+	return -ENOSPC;
+}
@@ -0,0 +1,30 @@
+#ifndef EXT2_HTREE
+#define EXT2_HTREE
+
+/*
+ * Hashed directory indexes, laid out as ext3/ext4 lay them out so e2fsck and
+ * the kernel read them. Directory block 0 holds . and .., whose rec_len hides
+ * the index root behind them; the root (and, past one level, index nodes
+ * hidden behind an empty entry spanning their block) maps ranges of name
+ * hashes to leaf blocks, which are ordinary directory blocks. A lookup or an
+ * insert reads the root, at most one node and one leaf, whatever the
+ * directory's size. Linear readers still see every entry.
+ *
+ * A directory is indexed when its first block fills up, on file systems with
+ * the dir_index feature.
+ */
+
+struct ext2_dir_entry;
+struct dir_slot;
+
+unsigned int dx_hash(unsigned char *disk, int version, char const *name, int name_len);
+int dx_can_index(unsigned char *disk);
+int dx_make_indexed(unsigned char **disk, unsigned int dir_idx);
+int dx_lookup(unsigned char *disk, unsigned int dir_idx, char const *name, int name_len,
+			  struct dir_slot *slot);
+int dx_leaf(unsigned char *disk, unsigned int dir_idx, char const *name, int name_len,
+			unsigned int *lblk);
+int dx_insert(unsigned char **disk, unsigned int dir_idx, unsigned int child_idx, char const *name,
+			  int name_len, unsigned char type);
+
+#endif // EXT2_HTREE
@@ -0,0 +1,352 @@
+/*
+ * Recursive import behind ext2_cp -r: copies a local directory tree onto the
+ * disk as one operation, in three phases:
+ *   1. a scan of the local tree, recording every directory and regular file
+ *      with its size, parents before their children;
+ *   2. a serial plan, the single writer of metadata: one pass over the scan
+ *      creates every directory and every file's inode, reserves and maps each
+ *      file's blocks and links it, so all allocation happens up front and
+ *      each file ends up owning a disjoint run of blocks;
+ *   3. a copy of the file contents by a pool of workers, each streaming
+ *      whole files into their reserved blocks, so the copying runs at disk
+ *      speed rather than one file at a time.
+ *
+ * Nothing else touches metadata while the workers run. Like every operation,
+ * the import lands on the disk whole or, if any file fails, not at all.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ext2.h"
+#include "stats.h"
+#include "utils.h"
+
+#define IMPORT_MAX_THREADS 64
+
+// one local directory or regular file to import
+struct import_node {
+	char *local_path;		  /* malloc'ed */
+	char *name;				  /* its last component, inside local_path */
+	int parent;				  /* index of the parent node; -1 for the top */
+	int is_dir;
+	unsigned long long size;
+	unsigned int inode_idx;	  /* set by the plan */
+	int *data_blocks;		  /* ... and, for a file, its blocks; malloc'ed */
+};
+
+// the scanned tree
+static struct import_node *nodes;
+static int num_nodes;
+static int max_nodes;
+
+// phase 3 work distribution
+static unsigned char *import_disk;
+static int next_node;
+static int copy_error;
+
+// ---------- Function Declarations ----------
+int ext2_cp_tree(unsigned char **disk, char const *local_path, char const *path, int num_threads);
+
+
+
+// ---------- Helper Functions ----------
+
+/**
+ * Record a local entry
+ * @return its node index; -ENOMEM
+ */
+static int add_node(char const *dir_path, char const *name, int parent, struct stat const *stats) {
+	if (num_nodes == max_nodes) {
+		int new_max = max_nodes ? max_nodes * 2 : 256;
+		struct import_node *grown = realloc(nodes, sizeof(struct import_node) * new_max);
+		if (grown == NULL) {
+			return -ENOMEM;
+		}
+		nodes = grown;
+		max_nodes = new_max;
+	}
+	struct import_node *node = &nodes[num_nodes];
+	size_t dir_len = strlen(dir_path);
+	node->local_path = malloc(dir_len + strlen(name) + 2);
+	if (node->local_path == NULL) {
+		return -ENOMEM;
+	}
+	if (dir_len > 0) {
+		sprintf(node->local_path, "%s/%s", dir_path, name);
+		node->name = node->local_path + dir_len + 1;
+	} else {
+		strcpy(node->local_path, name);
+		node->name = node->local_path;
+	}
+	node->parent = parent;
+	node->is_dir = S_ISDIR(stats->st_mode);
+	node->size = node->is_dir ? 0 : stats->st_size;
+	node->inode_idx = 0;
+	node->data_blocks = NULL;
+	return num_nodes++;
+}
+
+/**
+ * 1. Record the local tree under the top node, breadth first, so every node
+ * comes after its parent. Entries other than directories and regular files
+ * are reported and left out.
+ * @return 0 on success; errno on failure
+ */
+static int scan_tree(void) {
+	for (int i = 0; i < num_nodes; i++) {
+		if (!nodes[i].is_dir) {
+			continue;
+		}
+		DIR *dir = opendir(nodes[i].local_path);
+		if (dir == NULL) {
+			perror("scan_tree: opendir");
+			return -errno;
+		}
+		struct dirent *entry;
+		while ((entry = readdir(dir)) != NULL) {
+			if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+				continue;
+			}
+			if (strlen(entry->d_name) > EXT2_NAME_LEN) {
+				fprintf(stderr, "scan_tree: name too long in %s\n", nodes[i].local_path);
+				closedir(dir);
+				return -ENAMETOOLONG;
+			}
+			// nodes may move as it grows; the path is read before adding
+			char *dir_path = nodes[i].local_path;
+			char *path = malloc(strlen(dir_path) + strlen(entry->d_name) + 2); // FREE
+			if (path == NULL) {
+				closedir(dir);
+				return -ENOMEM;
+			}
+			sprintf(path, "%s/%s", dir_path, entry->d_name);
+			struct stat stats;
+			int result = lstat(path, &stats);
+			free(path);
+			if (result == -1) {
+				perror("scan_tree: lstat");
+				closedir(dir);
+				return -errno;
+			}
+			if (!S_ISDIR(stats.st_mode) && !S_ISREG(stats.st_mode)) {
+				fprintf(stderr, "scan_tree: skipping %s/%s, not a regular file or directory\n",
+						dir_path, entry->d_name);
+				continue;
+			}
+			if ((result = add_node(dir_path, entry->d_name, i, &stats)) < 0) {
+				closedir(dir);
+				return result;
+			}
+		}
+		closedir(dir);
+	}
+	return 0;
+}
+
+/**
+ * 2. Create the tree on the disk, contents aside: check it fits as a whole,
+ * then create each node under its parent, in scan order
+ * @param  disk       the disk
+ * @param  parent_idx inode index of the top node's parent on the disk
+ * @param  top_name   the top node's name on the disk
+ * @return            0 on success; errno on failure
+ */
+static int plan_tree(unsigned char **disk, unsigned int parent_idx, char *top_name) {
+	struct ext2_super_block *super_block = get_super_block(*disk);
+	unsigned long long blocks_needed = 0;
+	for (int i = 0; i < num_nodes; i++) {
+		if (nodes[i].is_dir) {
+			blocks_needed++;
+		} else {
+			int data = (nodes[i].size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+			blocks_needed += data + indirect_blocks_needed(data);
+		}
+	}
+	// directories holding many entries grow past one block; they are not counted
+	if (num_nodes > super_block->s_free_inodes_count || blocks_needed > super_block->s_free_blocks_count) {
+		fprintf(stderr, "plan_tree: the tree needs %d inodes and %llu blocks\n", num_nodes,
+				blocks_needed);
+		return -ENOSPC;
+	}
+
+	for (int i = 0; i < num_nodes; i++) {
+		struct import_node *node = &nodes[i];
+		unsigned int dir_idx = node->parent < 0 ? parent_idx : nodes[node->parent].inode_idx;
+		char *name = node->parent < 0 ? top_name : node->name;
+		int result;
+		if (node->is_dir) {
+			result = make_dir(disk, dir_idx, name);
+		} else if ((result = make_file(disk, dir_idx, node->size, &node->data_blocks)) > 0) {
+			int linked = update_dir_entry(disk, dir_idx, result, name, EXT2_FT_REG_FILE);
+			if (linked < 0) {
+				result = linked;
+			}
+		}
+		if (result < 0) {
+			fprintf(stderr, "plan_tree: cannot create %s\n", node->local_path);
+			return result;
+		}
+		node->inode_idx = result;
+	}
+	return 0;
+}
+
+/**
+ * 3. Copy files into their reserved blocks until none are left or one fails
+ */
+static void *copy_worker(void *arg) {
+	int i;
+	while ((i = __atomic_fetch_add(&next_node, 1, __ATOMIC_RELAXED)) < num_nodes &&
+		   __atomic_load_n(&copy_error, __ATOMIC_RELAXED) == 0) {
+		struct import_node *node = &nodes[i];
+		if (node->is_dir) {
+			continue;
+		}
+		int result;
+		int src_fd = open(node->local_path, O_RDONLY);
+		if (src_fd < 0) {
+			perror("copy_worker: open");
+			result = -errno;
+		} else {
+			int num_data = (node->size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+			result = copy_into_blocks(import_disk, src_fd, node->data_blocks, num_data, node->size);
+			close(src_fd);
+		}
+		if (result < 0) {
+			fprintf(stderr, "copy_worker: cannot copy %s\n", node->local_path);
+			__atomic_store_n(&copy_error, result, __ATOMIC_RELAXED);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Start count threads on fn, falling back to running it here if none start
+ */
+static void run_workers(void *(*fn)(void *), int count) {
+	pthread_t threads[IMPORT_MAX_THREADS];
+	int started = 0;
+	while (started < count && pthread_create(&threads[started], NULL, fn, NULL) == 0) {
+		started++;
+	}
+	if (started == 0) {
+		fn(NULL);
+	}
+	for (int i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+}
+
+/**
+ * Free the scanned tree
+ */
+static void free_nodes(void) {
+	for (int i = 0; i < num_nodes; i++) {
+		free(nodes[i].local_path);
+		free(nodes[i].data_blocks);
+	}
+	free(nodes);
+	nodes = NULL;
+	num_nodes = 0;
+	max_nodes = 0;
+}
+
+
+
+// ---------- Function Implementations ----------
+
+/**
+ * Copy a local directory tree onto the disk, like cp -r. Directories and
+ * regular files are copied; anything else is reported and skipped.
+ * @param  disk        the disk
+ * @param  local_path  the local directory
+ * @param  path        absolute path of the new directory on the disk
+ * @param  num_threads threads copying file contents; 0 for one per online CPU
+ * @return             0 on success; -ENOENT if the source or the parent is missing,
+ *                     -EEXIST if the target exists, -ENOSPC if the tree does not fit
+ */
+int ext2_cp_tree(unsigned char **disk, char const *local_path, char const *path, int num_threads) {
+	int result;
+
+	struct stat stats;
+	if (stat(local_path, &stats) == -1) {
+		perror("ext2_cp_tree: stat");
+		return -ENOENT;
+	}
+	if (!S_ISDIR(stats.st_mode)) {
+		fprintf(stderr, "ext2_cp_tree: local file [%s] needs to be a directory.\n", local_path);
+		return -ENOTDIR;
+	}
+
+	// find parent dir's inode index and check the target does not exist yet
+	int parent_idx;
+	int curr_idx;
+	if ((result = resolve_path(*disk, path, &parent_idx, &curr_idx)) < 0) {
+		fprintf(stderr, "ext2_cp_tree: resolve_path\n");
+		return result;
+	}
+	if (curr_idx > 0) {
+		fprintf(stderr, "ext2_cp_tree: file already exists\n");
+		return -EEXIST;
+	}
+
+	char *dir_path = NULL; // FREE
+	char *name = NULL;	   // FREE
+	if ((result = parse_path(path, &dir_path, &name)) != 0) {
+		fprintf(stderr, "ext2_cp_tree: parse_path\n");
+		return result;
+	}
+
+	if (num_threads <= 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		num_threads = cpus > 0 ? cpus : 1;
+	}
+	if (num_threads > IMPORT_MAX_THREADS) {
+		num_threads = IMPORT_MAX_THREADS;
+	}
+
+	// 1. scan
+	STAT_PHASE_BEGIN(PHASE_IMPORT_SCAN);
+	if ((result = add_node("", local_path, -1, &stats)) >= 0) {
+		result = scan_tree();
+	}
+	STAT_PHASE_END(PHASE_IMPORT_SCAN);
+	if (result < 0) {
+		goto out;
+	}
+
+	// 2. create everything but the contents
+	STAT_PHASE_BEGIN(PHASE_IMPORT_PLAN);
+	result = plan_tree(disk, parent_idx, name);
+	STAT_PHASE_END(PHASE_IMPORT_PLAN);
+	if (result < 0) {
+		goto out;
+	}
+
+	// 3. fill the files in
+	import_disk = *disk;
+	next_node = 0;
+	copy_error = 0;
+	int num_files = 0;
+	for (int i = 0; i < num_nodes; i++) {
+		num_files += !nodes[i].is_dir;
+	}
+	STAT_PHASE_BEGIN(PHASE_IMPORT_COPY);
+	run_workers(copy_worker, num_threads < num_files ? num_threads : num_files);
+	STAT_PHASE_END(PHASE_IMPORT_COPY);
+	result = copy_error;
+
+out:
+	free_nodes();
+	free(dir_path);
+	free(name);
+	return result;
+}
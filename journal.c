@@ -0,0 +1,1011 @@
+/*
+ * Write-ahead journal for the image mapping: dirty block tracking, commit,
+ * flush and crash recovery. See journal.h for the protocol.
+ *
+ * The log holds one segment per operation committed since the last flush,
+ * and is closed by a commit record when it is flushed:
+ *
+ *     segment ... | struct journal_commit
+ *     segment = struct journal_header | block number per logged block | the blocks
+ *
+ * A block logged by several operations is replayed once per segment, in
+ * order, so its latest copy wins. The log is emptied once the flush has
+ * written it in place.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+#include "dirtylog.h"
+#include "ext2.h"
+#include "journal.h"
+#include "overlay.h"
+#include "stats.h"
+#include "utils.h"
+
+#define JOURNAL_MAGIC 0x4a325845u		 /* "EX2J" */
+#define JOURNAL_COMMIT_MAGIC 0x43325845u /* "EX2C" */
+
+#define SET_MIN_ENTRIES 64	  /* entries a dirty set starts with */
+#define SET_KEEP_ENTRIES 4096 /* a set grown bigger is freed when emptied */
+
+/* Which blocks of a dirty set set_blocks() picks */
+#define PICK_ALL 0
+#define PICK_META 1
+#define PICK_DATA 2
+
+struct journal_header {
+	uint32_t magic;
+	uint32_t block_size;
+	uint32_t num_blocks;
+	uint32_t sequence; /* the same for every segment of a log */
+};
+
+struct journal_commit {
+	uint32_t magic;
+	uint32_t sequence;
+	uint64_t checksum; /* FNV-1a over every segment */
+};
+
+// ---------- Function Declarations ----------
+int journal_exists(char const *file_name);
+int journal_recover(int image_fd, char const *file_name);
+int journal_attach(struct ext2_image *image, char const *file_name);
+void journal_detach(struct ext2_image *image);
+void dirty_meta(unsigned char *disk, void const *ptr, size_t len);
+void dirty_data(unsigned char *disk, void const *ptr, size_t len);
+void dirty_fd_data(unsigned char *disk, unsigned int block, unsigned int count);
+int journal_commit(struct ext2_image *image);
+int journal_abort(struct ext2_image *image);
+int journal_flush(struct ext2_image *image);
+int journal_set_policy(struct ext2_image *image, int policy, int every);
+int journal_take_dirtied(void);
+
+// whether the calling thread flagged anything since journal_take_dirtied()
+static __thread int thread_dirtied;
+
+// guards the dirty sets: file data copied in with the ops lock let go is
+// checked against them while another operation commits
+static pthread_mutex_t sets_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+
+// ---------- Helper Functions ----------
+
+/**
+ * Name of an image's journal
+ * @return the malloc'ed path; NULL if out of memory
+ */
+static char *journal_path(char const *file_name) {
+	char *path = malloc(strlen(file_name) + sizeof(".journal"));
+	if (path != NULL) {
+		strcpy(path, file_name);
+		strcat(path, ".journal");
+	}
+	return path;
+}
+
+/**
+ * Fold bytes into a running FNV-1a hash
+ */
+static uint64_t checksum_add(uint64_t hash, void const *buf, size_t len) {
+	unsigned char const *bytes = buf;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+#define CHECKSUM_INIT 14695981039346656037ull
+
+/**
+ * pwrite all of buf, retrying short writes
+ * @return 0 on success; errno on failure
+ */
+static int pwrite_full(int fd, void const *buf, size_t len, off_t offset) {
+	unsigned char const *bytes = buf;
+	while (len > 0) {
+		ssize_t written = pwrite(fd, bytes, len, offset);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		bytes += written;
+		len -= written;
+		offset += written;
+	}
+	return 0;
+}
+
+/**
+ * pread all of len into buf
+ * @return 0 on success; -EIO on a short read; errno on failure
+ */
+static int pread_full(int fd, void *buf, size_t len, off_t offset) {
+	unsigned char *bytes = buf;
+	while (len > 0) {
+		ssize_t got = pread(fd, bytes, len, offset);
+		if (got < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		if (got == 0) {
+			return -EIO;
+		}
+		bytes += got;
+		len -= got;
+		offset += got;
+	}
+	return 0;
+}
+
+/**
+ * Slot of the hash a block's entry is looked for from
+ */
+static unsigned int set_home(struct dirty_set const *set, unsigned int block) {
+	return (block * 0x9e3779b1u) & (2 * set->max_entries - 1);
+}
+
+/**
+ * Find a block's entry in a set
+ * @return the entry; NULL if the block is not in the set
+ */
+static struct dirty_block *set_find(struct dirty_set const *set, unsigned int block) {
+	if (set->num_entries == 0) {
+		return NULL;
+	}
+	unsigned int mask = 2 * set->max_entries - 1;
+	for (unsigned int slot = set_home(set, block); set->slots[slot] != 0; slot = (slot + 1) & mask) {
+		struct dirty_block *entry = &set->entries[set->slots[slot] - 1];
+		if (entry->block == block) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Make room in a set for count entries, rehashing it if it has to grow
+ * @return 0 on success; -ENOMEM, leaving the set as it was
+ */
+static int set_reserve(struct dirty_set *set, unsigned int count) {
+	if (count <= set->max_entries) {
+		return 0;
+	}
+	unsigned int max_entries = set->max_entries > 0 ? set->max_entries : SET_MIN_ENTRIES;
+	while (max_entries < count) {
+		max_entries *= 2;
+	}
+	struct dirty_block *entries = realloc(set->entries, sizeof(struct dirty_block) * max_entries);
+	if (entries == NULL) {
+		return -ENOMEM;
+	}
+	set->entries = entries;
+	unsigned int *slots = calloc(2 * (size_t)max_entries, sizeof(unsigned int));
+	if (slots == NULL) {
+		return -ENOMEM;
+	}
+	free(set->slots);
+	set->slots = slots;
+	set->max_entries = max_entries;
+
+	unsigned int mask = 2 * max_entries - 1;
+	for (unsigned int i = 0; i < set->num_entries; i++) {
+		unsigned int slot = set_home(set, set->entries[i].block);
+		while (slots[slot] != 0) {
+			slot = (slot + 1) & mask;
+		}
+		slots[slot] = i + 1;
+	}
+	return 0;
+}
+
+/**
+ * Add a block to a set; one already in it becomes metadata if meta is set
+ * @return its entry; NULL if out of memory
+ */
+static struct dirty_block *set_add(struct dirty_set *set, unsigned int block, int meta) {
+	struct dirty_block *entry = set_find(set, block);
+	if (entry == NULL) {
+		if (set_reserve(set, set->num_entries + 1) < 0) {
+			return NULL;
+		}
+		unsigned int mask = 2 * set->max_entries - 1;
+		unsigned int slot = set_home(set, block);
+		while (set->slots[slot] != 0) {
+			slot = (slot + 1) & mask;
+		}
+		entry = &set->entries[set->num_entries++];
+		set->slots[slot] = set->num_entries;
+		entry->block = block;
+		entry->meta = 0;
+		entry->logged_at = 0;
+	}
+	entry->meta |= meta;
+	return entry;
+}
+
+/**
+ * Free what a set holds
+ */
+static void set_free(struct dirty_set *set) {
+	free(set->entries);
+	free(set->slots);
+	memset(set, 0, sizeof(*set));
+}
+
+/**
+ * Empty a set. One grown big is freed, so a large operation does not leave
+ * every later one clearing its hash.
+ */
+static void set_clear(struct dirty_set *set) {
+	if (set->max_entries > SET_KEEP_ENTRIES) {
+		set_free(set);
+		return;
+	}
+	if (set->num_entries > 0) {
+		memset(set->slots, 0, sizeof(unsigned int) * 2 * set->max_entries);
+	}
+	set->num_entries = 0;
+	set->failed = 0;
+}
+
+/**
+ * Compare block numbers
+ */
+static int cmp_block(void const *a, void const *b) {
+	unsigned int x = *(unsigned int const *)a;
+	unsigned int y = *(unsigned int const *)b;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * The blocks of a set, in block order
+ * @param  set    the set
+ * @param  which  PICK_ALL, PICK_META or PICK_DATA
+ * @param  blocks set to the malloc'ed block numbers
+ * @return        how many there are; -ENOMEM
+ */
+static int set_blocks(struct dirty_set const *set, int which, unsigned int **blocks) {
+	*blocks = malloc(sizeof(unsigned int) * (set->num_entries + 1));
+	if (*blocks == NULL) {
+		return -ENOMEM;
+	}
+	unsigned int count = 0;
+	for (unsigned int i = 0; i < set->num_entries; i++) {
+		if (which == PICK_ALL || set->entries[i].meta == (which == PICK_META)) {
+			(*blocks)[count++] = set->entries[i].block;
+		}
+	}
+	qsort(*blocks, count, sizeof(unsigned int), cmp_block);
+	return count;
+}
+
+/**
+ * Length of the run of consecutive blocks starting at blocks[i]
+ */
+static unsigned int run_length(unsigned int const *blocks, unsigned int count, unsigned int i) {
+	unsigned int len = 1;
+	while (i + len < count && blocks[i + len] == blocks[i] + len) {
+		len++;
+	}
+	return len;
+}
+
+/**
+ * Flag the blocks under [ptr, ptr + len) as changed by the operation in
+ * progress. Locked, as the checker's workers flag the directory entries they
+ * fix concurrently, and so do operations running side by side.
+ */
+static void flag_blocks(struct ext2_image *image, void const *ptr, size_t len, int meta) {
+	if (image->journal_path == NULL || len == 0) {
+		return;
+	}
+	size_t offset = (unsigned char const *)ptr - image->disk;
+	if (offset >= image->map_len) { // not in the mapping
+		return;
+	}
+	unsigned int first = offset / image->block_size;
+	unsigned int last = (offset + len - 1) / image->block_size;
+	pthread_mutex_lock(&sets_lock);
+	for (unsigned int block = first; block <= last; block++) {
+		if (set_add(&image->op_set, block, meta) == NULL && !image->op_set.failed) {
+			fprintf(stderr, "dirty_meta: out of memory, the operation will be undone\n");
+			image->op_set.failed = 1;
+		}
+	}
+	__atomic_store_n(&image->has_dirty, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&sets_lock);
+}
+
+/**
+ * Write blocks from the mapping into the image file, a run at a time
+ * @param  image  the image
+ * @param  blocks the blocks, in block order
+ * @param  count  how many
+ * @return        1 if anything was written, 0 if not; errno on failure
+ */
+static int write_in_place(struct ext2_image *image, unsigned int const *blocks, unsigned int count) {
+	size_t block_size = image->block_size;
+	int result;
+
+	for (unsigned int i = 0, len; i < count; i += len) {
+		len = run_length(blocks, count, i);
+		if ((result = pwrite_full(image->map_fd, image->disk + blocks[i] * block_size, len * block_size,
+								  (off_t)blocks[i] * block_size)) < 0) {
+			return result;
+		}
+	}
+	return count > 0;
+}
+
+/**
+ * Throw away the private copies of the pages holding a run of blocks, so
+ * those pages show the image file again. Blocks on those pages that an
+ * overlay holds are read back from it, then those committed but not yet
+ * flushed from the log.
+ * @return 0 on success; errno if a block could not be read back
+ */
+static int drop_private_run(struct ext2_image *image, unsigned int block, unsigned int len) {
+	size_t block_size = image->block_size;
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t start = (size_t)block * block_size / page * page;
+	size_t end = ((size_t)(block + len) * block_size + page - 1) / page * page;
+	int result;
+
+	if (end > image->map_len) {
+		end = image->map_len;
+	}
+	madvise(image->disk + start, end - start, MADV_DONTNEED);
+	if ((result = overlay_load(image, start, end)) < 0) {
+		return result;
+	}
+	if (image->ops_pending == 0) {
+		return 0;
+	}
+	for (unsigned int logged = start / block_size; logged < (end + block_size - 1) / block_size; logged++) {
+		struct dirty_block *entry = set_find(&image->pending, logged);
+		if (entry != NULL && entry->logged_at != 0 &&
+			(result = pread_full(image->journal_fd, image->disk + logged * block_size, block_size,
+								 entry->logged_at)) < 0) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/**
+ * drop_private_run() over every run of a set's blocks, or over the whole
+ * mapping if the set may be missing some
+ * @return 0 on success; errno on failure
+ */
+static int drop_private_pages(struct ext2_image *image, struct dirty_set const *set) {
+	unsigned int *blocks = NULL; // FREE
+	int count = set->failed ? -ENOMEM : set_blocks(set, PICK_ALL, &blocks);
+	int result = 0;
+	if (count < 0) {
+		result = drop_private_run(image, 0, image->super_block->s_blocks_count);
+	}
+	for (int i = 0, len; i < count && result == 0; i += len) {
+		len = run_length(blocks, count, i);
+		result = drop_private_run(image, blocks[i], len);
+	}
+	free(blocks);
+	return result;
+}
+
+/**
+ * Read blocks just written through the image file back into the mapping
+ * where a page of theirs has gone private: written through the mapping
+ * since the last flush, that page is a copy taken before and would go on
+ * showing what the blocks held then. Other pages still share the file's
+ * page cache and see the write as it is.
+ * @param image the image
+ * @param block first block written
+ * @param count number of blocks
+ */
+static void read_back_private(struct ext2_image *image, unsigned int block, unsigned int count) {
+	unsigned int num_blocks = image->super_block->s_blocks_count;
+	size_t block_size = image->block_size;
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	unsigned int per_page = block_size >= page ? 1 : page / block_size;
+
+	for (unsigned int first = block, last; first < block + count; first = last) {
+		unsigned int page_start = first - first % per_page;
+		unsigned int page_end = page_start + per_page < num_blocks ? page_start + per_page : num_blocks;
+		last = page_end < block + count ? page_end : block + count;
+
+		int is_private = 0;
+		pthread_mutex_lock(&sets_lock);
+		for (unsigned int on_page = page_start; on_page < page_end && !is_private; on_page++) {
+			is_private = set_find(&image->pending, on_page) != NULL || set_find(&image->op_set, on_page) != NULL;
+		}
+		pthread_mutex_unlock(&sets_lock);
+		int result;
+		if (is_private && (result = pread_full(image->map_fd, image->disk + first * block_size,
+											   (last - first) * block_size, (off_t)first * block_size)) < 0) {
+			fprintf(stderr, "dirty_fd_data: cannot read back blocks %u-%u: %s\n", first, last - 1,
+					strerror(-result));
+		}
+	}
+}
+
+/**
+ * Append the metadata blocks the operation in progress changed to the log,
+ * unsynced, as one segment
+ * @param  image      the image
+ * @param  meta       the blocks, in block order
+ * @param  num_logged how many
+ * @param  copies     set to the offset of the first block's copy in the log;
+ *                    the others follow it in the same order
+ * @return            0 on success; errno on failure, leaving the log as it was
+ */
+static int write_segment(struct ext2_image *image, unsigned int const *meta, unsigned int num_logged,
+						 off_t *copies) {
+	size_t block_size = image->block_size;
+	off_t start = image->journal_len;
+	int result;
+
+	// header and block numbers
+	size_t head_len = sizeof(struct journal_header) + sizeof(uint32_t) * num_logged;
+	unsigned char *head = malloc(head_len); // FREE
+	if (head == NULL) {
+		return -ENOMEM;
+	}
+	struct journal_header header = {JOURNAL_MAGIC, block_size, num_logged, image->journal_seq};
+	memcpy(head, &header, sizeof(header));
+	uint32_t *tags = (uint32_t *)(head + sizeof(header));
+	for (unsigned int i = 0; i < num_logged; i++) {
+		tags[i] = meta[i];
+	}
+	uint64_t checksum = checksum_add(image->journal_sum, head, head_len);
+	result = pwrite_full(image->journal_fd, head, head_len, start);
+	free(head);
+	if (result < 0) {
+		goto fail;
+	}
+
+	// the blocks, a run of the mapping at a time
+	off_t offset = start + head_len;
+	for (unsigned int i = 0, len; i < num_logged; i += len) {
+		len = run_length(meta, num_logged, i);
+		unsigned char const *run = image->disk + meta[i] * block_size;
+		checksum = checksum_add(checksum, run, len * block_size);
+		if ((result = pwrite_full(image->journal_fd, run, len * block_size, offset)) < 0) {
+			goto fail;
+		}
+		offset += len * block_size;
+	}
+
+	*copies = start + head_len;
+	image->journal_len = offset;
+	image->journal_sum = checksum;
+	return 0;
+
+fail:
+	if (ftruncate(image->journal_fd, start) < 0) {
+		perror("journal_commit: ftruncate");
+	}
+	return result;
+}
+
+/**
+ * Commit the operation in progress: write its file data in place and log its
+ * metadata, then hand its blocks over to the next flush
+ * @return 0 on success; errno on failure, leaving the operation in progress
+ */
+static int commit_op(struct ext2_image *image) {
+	unsigned int *data = NULL; // FREE
+	unsigned int *meta = NULL; // FREE
+	int num_data = -ENOMEM;
+	int num_logged = -ENOMEM;
+	off_t copies = 0;
+	int result = -ENOMEM;
+
+	if (image->op_set.failed || image->freed_failed || (num_data = set_blocks(&image->op_set, PICK_DATA, &data)) < 0 ||
+		(num_logged = set_blocks(&image->op_set, PICK_META, &meta)) < 0 ||
+		set_reserve(&image->pending, image->pending.num_entries + image->op_set.num_entries) < 0) {
+		goto out;
+	}
+
+	// file data first: it goes to blocks no flushed metadata points at yet
+	if ((result = write_in_place(image, data, num_data)) < 0) {
+		goto out;
+	}
+	if (result > 0) {
+		__atomic_store_n(&image->unsynced_data, 1, __ATOMIC_RELAXED);
+		overlay_mark(image, data, num_data);
+	}
+
+	if (num_logged > 0) {
+		if (image->journal_fd == -1) {
+			image->journal_fd = open(image->journal_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+			if (image->journal_fd < 0) { // -2 from here on: don't retry every commit
+				fprintf(stderr, "journal_commit: cannot create %s, writing unlogged: %s\n",
+						image->journal_path, strerror(errno));
+				image->journal_fd = -2;
+			}
+		}
+		if (image->journal_fd >= 0 && (result = write_segment(image, meta, num_logged, &copies)) < 0) {
+			goto out;
+		}
+	}
+	dirtylog_append(image, meta, num_logged);
+
+	// the segment is whole: its copies are now the ones to roll back to
+	pthread_mutex_lock(&sets_lock); // room was made above
+	for (int i = 0; i < num_logged; i++) {
+		struct dirty_block *entry = set_add(&image->pending, meta[i], 1);
+		if (copies != 0) {
+			entry->logged_at = copies + (off_t)i * image->block_size;
+		}
+	}
+	for (int i = 0; i < num_data; i++) {
+		set_add(&image->pending, data[i], 0);
+	}
+	set_clear(&image->op_set);
+	__atomic_store_n(&image->has_dirty, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&sets_lock);
+	commit_freed_blocks(image);
+	image->ops_pending += image->txn_ops > 0 ? image->txn_ops : 1;
+	STAT_ADD(STAT_COMMITS, 1);
+	STAT_ADD(STAT_BLOCKS_LOGGED, num_logged);
+	result = 0;
+
+out:
+	free(data);
+	free(meta);
+	return result;
+}
+
+
+/**
+ * Walk the segments of a log, checking them against its commit record, or
+ * writing their blocks into the image once they have been checked
+ * @param  fd       the log
+ * @param  size     its size in bytes
+ * @param  image_fd the image to replay into; -1 to only check the log
+ * @param  replayed set to the number of logged blocks
+ * @return          1 if the log is complete and intact, 0 if not; errno on failure
+ */
+static int walk_log(int fd, off_t size, int image_fd, unsigned int *replayed) {
+	uint32_t *tags = NULL;		 // FREE
+	unsigned char *block = NULL; // FREE
+	uint32_t block_size = 0;
+	uint32_t sequence = 0;
+	uint64_t checksum = CHECKSUM_INIT;
+	off_t offset = 0;
+	int result = 0;
+
+	*replayed = 0;
+	for (;;) {
+		uint32_t magic;
+		if (pread_full(fd, &magic, sizeof(magic), offset) < 0) {
+			goto out;
+		}
+		if (magic == JOURNAL_COMMIT_MAGIC) {
+			struct journal_commit commit;
+			result = *replayed > 0 && offset + (off_t)sizeof(commit) == size &&
+					 pread_full(fd, &commit, sizeof(commit), offset) == 0 &&
+					 commit.sequence == sequence && commit.checksum == checksum;
+			goto out;
+		}
+		struct journal_header header;
+		if (magic != JOURNAL_MAGIC || pread_full(fd, &header, sizeof(header), offset) < 0) {
+			goto out;
+		}
+		if (block == NULL) { // the first segment sets the geometry
+			block_size = header.block_size;
+			sequence = header.sequence;
+			if (block_size < EXT2_MIN_BLOCK_SIZE || block_size > EXT2_MAX_BLOCK_SIZE ||
+				(block_size & (block_size - 1)) != 0) {
+				goto out;
+			}
+			if ((block = malloc(block_size)) == NULL) {
+				result = -ENOMEM;
+				goto out;
+			}
+		}
+		size_t tags_len = sizeof(uint32_t) * (size_t)header.num_blocks;
+		if (header.block_size != block_size || header.sequence != sequence || header.num_blocks == 0 ||
+			offset + sizeof(header) + tags_len + (off_t)block_size * header.num_blocks > size) {
+			goto out;
+		}
+		uint32_t *grown = realloc(tags, tags_len);
+		if (grown == NULL) {
+			result = -ENOMEM;
+			goto out;
+		}
+		tags = grown;
+		if (pread_full(fd, tags, tags_len, offset + sizeof(header)) < 0) {
+			goto out;
+		}
+		checksum = checksum_add(checksum, &header, sizeof(header));
+		checksum = checksum_add(checksum, tags, tags_len);
+		offset += sizeof(header) + tags_len;
+
+		for (unsigned int i = 0; i < header.num_blocks; i++) {
+			if (pread_full(fd, block, block_size, offset) < 0) {
+				goto out;
+			}
+			checksum = checksum_add(checksum, block, block_size);
+			if (image_fd >= 0 &&
+				(result = pwrite_full(image_fd, block, block_size, (off_t)block_size * tags[i])) < 0) {
+				goto out;
+			}
+			offset += block_size;
+		}
+		*replayed += header.num_blocks;
+	}
+
+out:
+	free(tags);
+	free(block);
+	return result;
+}
+
+/**
+ * Clear what a flush leaves behind
+ */
+static void clear_flushed(struct ext2_image *image) {
+	pthread_mutex_lock(&sets_lock);
+	set_clear(&image->pending);
+	pthread_mutex_unlock(&sets_lock);
+	release_freed_blocks(image, 1);
+	image->journal_len = 0;
+	image->journal_sum = CHECKSUM_INIT;
+	image->ops_pending = 0;
+	image->journal_seq++;
+}
+
+
+
+// ---------- Function Implementations ----------
+
+/**
+ * Whether an image has a journal, which journal_recover() has to look at
+ * before the image is opened
+ * @param  file_name the image file name
+ * @return           1 if it has one, or it cannot tell; 0 if not
+ */
+int journal_exists(char const *file_name) {
+	char *path = journal_path(file_name); // FREE
+	int exists = path == NULL || access(path, F_OK) == 0 || errno != ENOENT;
+	free(path);
+	return exists;
+}
+
+
+/**
+ * Replay the transaction an interrupted flush left in an image's journal,
+ * then remove the journal. A log without a valid commit record was never
+ * flushed and is dropped: the image already holds the state before it.
+ * Runs on the bare file, before the image is mapped.
+ * @param  image_fd  the image file, open for writing
+ * @param  file_name the image file name
+ * @return           0 on success or if there is nothing to replay; errno on failure
+ */
+int journal_recover(int image_fd, char const *file_name) {
+	char *path = journal_path(file_name); // FREE
+	if (path == NULL) {
+		return -ENOMEM;
+	}
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		int result = errno == ENOENT ? 0 : -errno;
+		free(path);
+		return result;
+	}
+
+	int result = 0;
+	unsigned int num_blocks;
+	struct stat stats;
+	if (fstat(fd, &stats) < 0) {
+		goto drop;
+	}
+	// check the whole log before writing any of it
+	if ((result = walk_log(fd, stats.st_size, -1, &num_blocks)) <= 0) {
+		if (result < 0) {
+			goto out;
+		}
+		goto drop;
+	}
+	if ((result = walk_log(fd, stats.st_size, image_fd, &num_blocks)) < 0) {
+		fprintf(stderr, "journal_recover: cannot replay %s: %s\n", path, strerror(-result));
+		goto out;
+	}
+	if (fdatasync(image_fd) < 0) {
+		result = -errno;
+		goto out;
+	}
+	fprintf(stderr, "journal_recover: replayed %u blocks from %s\n", num_blocks, path);
+	result = 0;
+
+drop:
+	unlink(path);
+out:
+	close(fd);
+	free(path);
+	return result;
+}
+
+
+/**
+ * Set up dirty tracking for a freshly mapped image
+ * @param  image     the image, with its mapping and superblock set
+ * @param  file_name the image file name
+ * @return           0 on success; -ENOMEM
+ */
+int journal_attach(struct ext2_image *image, char const *file_name) {
+	image->journal_path = journal_path(file_name);
+	memset(&image->pending, 0, sizeof(image->pending));
+	memset(&image->op_set, 0, sizeof(image->op_set));
+	image->journal_fd = -1;
+	image->journal_seq = 0;
+	image->journal_len = 0;
+	image->journal_sum = CHECKSUM_INIT;
+	image->has_dirty = 0;
+	image->unsynced_data = 0;
+	image->ops_pending = 0;
+	if (image->journal_path == NULL) {
+		perror("journal_attach: malloc");
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+
+/**
+ * Commit and flush anything still pending and tear dirty tracking down. The
+ * journal is empty after a flush, so it is removed; if the flush failed it is
+ * left for journal_recover() to replay on the next open.
+ * @param image the image
+ */
+void journal_detach(struct ext2_image *image) {
+	int flushed = 1;
+	if (image->journal_path != NULL &&
+		((image->has_dirty && commit_op(image) < 0) || journal_flush(image) < 0)) {
+		fprintf(stderr, "journal_detach: cannot flush, %s is left to recover from\n", image->journal_path);
+		flushed = 0;
+	}
+	if (image->journal_fd >= 0) {
+		close(image->journal_fd);
+		if (flushed) {
+			unlink(image->journal_path);
+		}
+	}
+	free(image->journal_path);
+	set_free(&image->pending);
+	set_free(&image->op_set);
+	image->journal_path = NULL;
+	image->journal_fd = -1;
+	image->has_dirty = 0;
+	image->ops_pending = 0;
+}
+
+
+/**
+ * Flag metadata changed in the mapping, to be logged at the next commit
+ * @param disk the disk
+ * @param ptr  start of the change, in the mapping
+ * @param len  its length in bytes
+ */
+void dirty_meta(unsigned char *disk, void const *ptr, size_t len) {
+	thread_dirtied = 1;
+	flag_blocks(ext2_cur, ptr, len, 1);
+}
+
+
+/**
+ * Flag file contents changed in the mapping, to be written in place, unlogged,
+ * at the next commit
+ * @param disk the disk
+ * @param ptr  start of the change, in the mapping
+ * @param len  its length in bytes
+ */
+void dirty_data(unsigned char *disk, void const *ptr, size_t len) {
+	thread_dirtied = 1;
+	flag_blocks(ext2_cur, ptr, len, 0);
+}
+
+
+/**
+ * Note that file contents were written straight to the image file, so the
+ * next flush syncs them before closing the log that points at them. The
+ * mapping's private pages over those blocks are refreshed, so reads in the
+ * meantime see what was written.
+ * @param disk  the disk
+ * @param block first block written
+ * @param count number of blocks
+ */
+void dirty_fd_data(unsigned char *disk, unsigned int block, unsigned int count) {
+	if (ext2_cur->in_delta != NULL) {
+		overlay_fd_data(ext2_cur, block, count);
+	} else if (ext2_cur->journal_path != NULL) {
+		read_back_private(ext2_cur, block, count);
+	}
+	thread_dirtied = 1;
+	__atomic_store_n(&ext2_cur->unsynced_data, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&ext2_cur->has_dirty, 1, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * End a successful operation: commit what it changed, then flush if the
+ * image's policy says so. Without a journal every operation is flushed, as
+ * nothing else could undo a later failed one.
+ * @param  image the image
+ * @return       0 on success; errno on failure, leaving the operation in
+ *               progress if the commit failed and the commits pending if the flush did
+ */
+int journal_commit(struct ext2_image *image) {
+	int result = 0;
+	STAT_PHASE_BEGIN(PHASE_COMMIT);
+	if (__atomic_load_n(&image->has_dirty, __ATOMIC_RELAXED)) {
+		result = commit_op(image);
+	}
+	STAT_PHASE_END(PHASE_COMMIT);
+	if (result < 0) {
+		fprintf(stderr, "journal_commit: %s\n", strerror(-result));
+		return result;
+	}
+	if (image->flush_policy == EXT2OPS_FLUSH_OP || image->journal_fd == -2 ||
+		(image->flush_policy == EXT2OPS_FLUSH_BATCH && image->ops_pending >= image->flush_every)) {
+		return journal_flush(image);
+	}
+	return 0;
+}
+
+
+/**
+ * Undo the operation in progress: the blocks it changed go back to the image
+ * file as it stands, or to their copies in the log if an earlier operation
+ * changed them too
+ * @param  image the image
+ * @return       1 if anything was undone, 0 if the operation changed nothing
+ */
+int journal_abort(struct ext2_image *image) {
+	dirtylog_discard(image);
+	release_freed_blocks(image, 0);
+	if (!__atomic_load_n(&image->has_dirty, __ATOMIC_RELAXED)) {
+		return 0;
+	}
+	if (drop_private_pages(image, &image->op_set) < 0) {
+		fprintf(stderr, "journal_abort: cannot read the log back, committed changes were lost\n");
+	}
+	pthread_mutex_lock(&sets_lock);
+	set_clear(&image->op_set);
+	__atomic_store_n(&image->has_dirty, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&sets_lock);
+	return 1;
+}
+
+
+/**
+ * Make every operation committed since the last flush durable, in the order
+ * of journal.h. If the journal cannot be created the metadata is written in
+ * place unlogged, as it would have been without one.
+ * @param  image the image
+ * @return       0 on success; errno on failure, leaving the commits pending
+ */
+int journal_flush(struct ext2_image *image) {
+	if (image->ops_pending == 0) {
+		return 0;
+	}
+	unsigned int *meta = NULL; // FREE
+	int result;
+	STAT_PHASE_BEGIN(PHASE_FLUSH);
+	int num_meta = set_blocks(&image->pending, PICK_META, &meta);
+	if (num_meta < 0) {
+		result = num_meta;
+		goto fail;
+	}
+
+	// 1. file data, so flushed metadata never points at stale blocks, and
+	// what an overlay holds. Data a copy in flight writes from here on is
+	// left for the next flush, with the operation that commits it.
+	if ((result = overlay_sync(image, meta, num_meta)) < 0) {
+		goto fail;
+	}
+	int unsynced = __atomic_exchange_n(&image->unsynced_data, 0, __ATOMIC_ACQ_REL);
+	if ((unsynced || result > 0) && fdatasync(image->map_fd) < 0) {
+		result = -errno;
+		__atomic_store_n(&image->unsynced_data, 1, __ATOMIC_RELAXED);
+		goto fail;
+	}
+
+	// 2. close the log, once the dirty log holds what it is about to let through
+	if ((result = dirtylog_sync(image)) < 0) {
+		goto fail;
+	}
+	int logged = image->journal_fd >= 0 && image->journal_len > 0;
+	if (logged) {
+		struct journal_commit commit = {JOURNAL_COMMIT_MAGIC, image->journal_seq, image->journal_sum};
+		if ((result = pwrite_full(image->journal_fd, &commit, sizeof(commit), image->journal_len)) < 0) {
+			goto fail;
+		}
+		if (fdatasync(image->journal_fd) < 0) {
+			result = -errno;
+			goto fail;
+		}
+	}
+
+	// 3. in place, then retire the log
+	if ((result = write_in_place(image, meta, num_meta)) < 0) {
+		goto fail;
+	}
+	if (result > 0 && fdatasync(image->map_fd) < 0) {
+		result = -errno;
+		goto fail;
+	}
+	if (logged && ftruncate(image->journal_fd, 0) < 0) {
+		result = -errno;
+		goto fail;
+	}
+
+	// the file now matches the mapping: hand the private pages back, unless
+	// the image is an overlay, whose mapping would show its base under them
+	image->ops_pending = 0; // nothing to read back from the log
+	if (image->in_delta == NULL) {
+		drop_private_pages(image, &image->pending);
+	}
+	clear_flushed(image);
+	free(meta);
+	STAT_ADD(STAT_FLUSHES, 1);
+	STAT_PHASE_END(PHASE_FLUSH);
+	return 0;
+
+fail:
+	free(meta);
+	STAT_PHASE_END(PHASE_FLUSH);
+	fprintf(stderr, "journal_flush: %s\n", strerror(-result));
+	return result;
+}
+
+
+/**
+ * Choose when committed operations are flushed. Anything held back is
+ * flushed when switching to flushing every operation.
+ * @param  image  the image
+ * @param  policy EXT2OPS_FLUSH_OP, EXT2OPS_FLUSH_BATCH or EXT2OPS_FLUSH_CLOSE
+ * @param  every  operations per flush under EXT2OPS_FLUSH_BATCH; ignored otherwise
+ * @return        0 on success; -EINVAL for a bad policy; errno if the flush failed
+ */
+int journal_set_policy(struct ext2_image *image, int policy, int every) {
+	if ((policy != EXT2OPS_FLUSH_OP && policy != EXT2OPS_FLUSH_BATCH && policy != EXT2OPS_FLUSH_CLOSE) ||
+		(policy == EXT2OPS_FLUSH_BATCH && every < 1)) {
+		return -EINVAL;
+	}
+	image->flush_policy = policy;
+	image->flush_every = every;
+	if (policy == EXT2OPS_FLUSH_OP) {
+		return journal_flush(image);
+	}
+	return 0;
+}
+
+
+/**
+ * Whether the calling thread flagged any change since it last asked, so an
+ * operation sharing the one in progress with others knows if it is part of
+ * what gets committed, see begin_shared_op()
+ * @return 1 if it did, 0 if not
+ */
+int journal_take_dirtied(void) {
+	int dirtied = thread_dirtied;
+	thread_dirtied = 0;
+	return dirtied;
+}
@@ -0,0 +1,73 @@
+#ifndef EXT2_JOURNAL
+#define EXT2_JOURNAL
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Write-ahead journal. Images are mapped private, so nothing an operation
+ * changes reaches the file until it is committed. Writers flag what they
+ * change: dirty_meta() for metadata (bitmaps, counters, inodes, directory,
+ * indirect and symlink blocks), dirty_data() for file contents written
+ * through the mapping and dirty_fd_data() for file contents written straight
+ * to the image file. What is tracked, and what each commit and flush costs,
+ * grows with the blocks changed, not with the image.
+ *
+ * journal_commit() ends a successful operation: its file data is written in
+ * place, where no flushed metadata points yet (blocks freed since the last
+ * flush are not handed out again before it), and its metadata blocks are
+ * appended to <image>.journal, coalesced into runs in block order. Neither
+ * is synced. journal_flush() makes every commit since the last flush durable:
+ *   1. it syncs the data,
+ *   2. closes the log with a checksummed commit record and syncs it,
+ *   3. writes the metadata in place, in block order, syncs, and empties the log.
+ * The image's flush policy decides whether journal_commit() flushes after
+ * every operation, every so many, or only when asked to and on close.
+ *
+ * A crash before 2 completes leaves the image as of the last flush; after
+ * it, journal_recover() replays the log when the image is next opened, which
+ * costs a read of the log rather than a check of the whole image.
+ * journal_abort() undoes a failed operation, leaving earlier commits alone.
+ *
+ * Operations running side by side (see begin_shared_op()) make up one
+ * operation in progress and are committed, or undone, together. The flags
+ * are set under a lock; journal_take_dirtied() tells a thread whether it set any.
+ */
+
+/*
+ * Blocks flagged for the journal, a set of block numbers sized to what was
+ * changed rather than to the image: an array of entries in the order they
+ * were first flagged, and an open-addressed hash of their positions.
+ */
+struct dirty_block {
+	unsigned int block;
+	int meta;		 /* 1 if metadata, 0 if file data */
+	off_t logged_at; /* offset of its latest copy in the log; 0 if none */
+};
+
+struct dirty_set {
+	struct dirty_block *entries;
+	unsigned int num_entries;
+	unsigned int max_entries;
+	unsigned int *slots; /* 2 * max_entries of them: an entry's position + 1; 0 if empty */
+	int failed;			 /* a block could not be added for want of memory */
+};
+
+struct ext2_image;
+
+int journal_exists(char const *file_name);
+int journal_recover(int image_fd, char const *file_name);
+int journal_attach(struct ext2_image *image, char const *file_name);
+void journal_detach(struct ext2_image *image);
+
+void dirty_meta(unsigned char *disk, void const *ptr, size_t len);
+void dirty_data(unsigned char *disk, void const *ptr, size_t len);
+void dirty_fd_data(unsigned char *disk, unsigned int block, unsigned int count);
+
+int journal_commit(struct ext2_image *image);
+int journal_abort(struct ext2_image *image);
+int journal_flush(struct ext2_image *image);
+int journal_set_policy(struct ext2_image *image, int policy, int every);
+int journal_take_dirtied(void);
+
+#endif // EXT2_JOURNAL
@@ -0,0 +1,747 @@
+/*
+ * Copy-on-write overlays over a read-only base image. See overlay.h.
+ *
+ * The overlay's blocks sit at the offsets they have in the image, so the
+ * journal, the tools that write file data straight to the image file and
+ * recovery all write into the overlay as they would into an image, and only
+ * reads need to know which blocks come from where. The bitmap of the blocks
+ * the overlay holds is written at each flush, with the file data.
+ */
+
+#define _GNU_SOURCE // copy_file_range, fallocate
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+#include "dirtylog.h"
+#include "ext2.h"
+#include "journal.h"
+#include "overlay.h"
+#include "utils.h"
+
+#define OVERLAY_MAGIC 0x56325845u /* "EX2V" */
+#define OVERLAY_TRAILER_SIZE 4096 /* the trailer and the base path, zero padded */
+#define OVERLAY_COPY_BUFFER (1 << 20)
+
+struct overlay_trailer {
+	uint32_t magic;
+	uint32_t block_size;
+	uint32_t blocks_count;
+	uint32_t path_len; /* bytes of the base path that follow */
+	/* the base file as the overlay was started over it */
+	uint64_t base_dev;
+	uint64_t base_ino;
+	uint64_t base_size;
+	int64_t base_mtime_sec;
+	int64_t base_mtime_nsec;
+};
+
+// ---------- Function Declarations ----------
+int overlay_create(char const *base_name, char const *file_name);
+int overlay_commit(char const *file_name);
+int overlay_discard(char const *file_name);
+int overlay_open(struct ext2_image *image, int fd, char const *file_name);
+void overlay_detach(struct ext2_image *image);
+int overlay_load(struct ext2_image *image, size_t start, size_t end);
+void overlay_mark(struct ext2_image *image, unsigned int const *blocks, unsigned int count);
+void overlay_fd_data(struct ext2_image *image, unsigned int block, unsigned int count);
+int overlay_sync(struct ext2_image *image, unsigned int const *meta, unsigned int count);
+
+
+
+// ---------- Helper Functions ----------
+
+/**
+ * pwrite all of buf, retrying short writes
+ * @return 0 on success; errno on failure
+ */
+static int pwrite_full(int fd, void const *buf, size_t len, off_t offset) {
+	unsigned char const *bytes = buf;
+	while (len > 0) {
+		ssize_t written = pwrite(fd, bytes, len, offset);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		bytes += written;
+		len -= written;
+		offset += written;
+	}
+	return 0;
+}
+
+/**
+ * pread all of len into buf
+ * @return 0 on success; -EIO on a short read; errno on failure
+ */
+static int pread_full(int fd, void *buf, size_t len, off_t offset) {
+	unsigned char *bytes = buf;
+	while (len > 0) {
+		ssize_t got = pread(fd, bytes, len, offset);
+		if (got < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		if (got == 0) {
+			return -EIO;
+		}
+		bytes += got;
+		len -= got;
+		offset += got;
+	}
+	return 0;
+}
+
+/**
+ * Copy a byte range between two files at the same offset, sharing the
+ * extents where the file system can
+ * @return 0 on success; errno on failure
+ */
+static int copy_range(int src_fd, int dst_fd, off_t offset, size_t len) {
+	while (len > 0) {
+		loff_t in = offset;
+		loff_t out = offset;
+		ssize_t copied = copy_file_range(src_fd, &in, dst_fd, &out, len, 0);
+		if (copied <= 0) { // not supported here: through a buffer
+			break;
+		}
+		offset += copied;
+		len -= copied;
+	}
+	if (len == 0) {
+		return 0;
+	}
+
+	size_t buf_len = len < OVERLAY_COPY_BUFFER ? len : OVERLAY_COPY_BUFFER;
+	unsigned char *buf = malloc(buf_len); // FREE
+	if (buf == NULL) {
+		return -ENOMEM;
+	}
+	int result = 0;
+	while (len > 0) {
+		size_t chunk = len < buf_len ? len : buf_len;
+		if ((result = pread_full(src_fd, buf, chunk, offset)) < 0 ||
+			(result = pwrite_full(dst_fd, buf, chunk, offset)) < 0) {
+			break;
+		}
+		offset += chunk;
+		len -= chunk;
+	}
+	free(buf);
+	return result;
+}
+
+/**
+ * Lock a file, saying so if it has to wait for another process
+ * @param  how LOCK_SH or LOCK_EX
+ * @return     0 on success; -ENOLCK
+ */
+static int lock_file(int fd, char const *file_name, int how) {
+	int locked = flock(fd, how | LOCK_NB);
+	if (locked < 0 && errno == EWOULDBLOCK) {
+		fprintf(stderr, "overlay: %s is in use, waiting\n", file_name);
+		locked = flock(fd, how);
+	}
+	if (locked < 0) {
+		perror("overlay: flock");
+		return -ENOLCK;
+	}
+	return 0;
+}
+
+/**
+ * Remove one of an overlay's sidecar files, <overlay><suffix>, if it has it
+ */
+static void unlink_sidecar(char const *file_name, char const *suffix) {
+	char *path = malloc(strlen(file_name) + strlen(suffix) + 1); // FREE
+	if (path == NULL) {
+		return;
+	}
+	strcpy(path, file_name);
+	strcat(path, suffix);
+	unlink(path);
+	free(path);
+}
+
+/**
+ * Bytes of an overlay's bitmap
+ */
+static size_t bitmap_len(struct overlay_trailer const *trailer) {
+	return ((size_t)trailer->blocks_count + 7) / 8;
+}
+
+/**
+ * Bytes of the image an overlay stands for, where its bitmap starts
+ */
+static off_t image_len(struct overlay_trailer const *trailer) {
+	return (off_t)trailer->block_size * trailer->blocks_count;
+}
+
+/**
+ * Read an overlay's trailer, if the file is one
+ * @param  fd        the file
+ * @param  file_name its name, for messages
+ * @param  trailer   set to the trailer
+ * @param  base_name set to the malloc'ed base path, if it is an overlay
+ * @return           1 if the file is an overlay, 0 if not; errno on failure
+ */
+static int read_trailer(int fd, char const *file_name, struct overlay_trailer *trailer,
+						char **base_name) {
+	struct stat stats;
+	if (fstat(fd, &stats) < 0) {
+		return -errno;
+	}
+	if (stats.st_size < OVERLAY_TRAILER_SIZE ||
+		pread_full(fd, trailer, sizeof(*trailer), stats.st_size - OVERLAY_TRAILER_SIZE) < 0 ||
+		trailer->magic != OVERLAY_MAGIC) {
+		return 0;
+	}
+	if (trailer->block_size < EXT2_MIN_BLOCK_SIZE || trailer->block_size > EXT2_MAX_BLOCK_SIZE ||
+		(trailer->block_size & (trailer->block_size - 1)) != 0 || trailer->path_len == 0 ||
+		trailer->path_len >= OVERLAY_TRAILER_SIZE - sizeof(*trailer) ||
+		stats.st_size != image_len(trailer) + (off_t)bitmap_len(trailer) + OVERLAY_TRAILER_SIZE) {
+		fprintf(stderr, "overlay: %s is a damaged overlay\n", file_name);
+		return -EINVAL;
+	}
+	char *path = malloc(trailer->path_len + 1);
+	if (path == NULL) {
+		return -ENOMEM;
+	}
+	int result = pread_full(fd, path, trailer->path_len,
+							stats.st_size - OVERLAY_TRAILER_SIZE + sizeof(*trailer));
+	if (result < 0) {
+		free(path);
+		return result;
+	}
+	path[trailer->path_len] = '\0';
+	*base_name = path;
+	return 1;
+}
+
+/**
+ * Whether a base file is as an overlay's trailer recorded it
+ */
+static int base_unchanged(int base_fd, struct overlay_trailer const *trailer) {
+	struct stat stats;
+	return fstat(base_fd, &stats) == 0 && (uint64_t)stats.st_dev == trailer->base_dev &&
+		   (uint64_t)stats.st_ino == trailer->base_ino && (uint64_t)stats.st_size == trailer->base_size &&
+		   stats.st_mtim.tv_sec == trailer->base_mtime_sec &&
+		   stats.st_mtim.tv_nsec == trailer->base_mtime_nsec;
+}
+
+/**
+ * Empty an overlay and stamp it with its base as the base stands. The old
+ * trailer stays until the last step, so an overlay left half started over
+ * is refused as stale rather than opened.
+ * @param  fd        the overlay, locked
+ * @param  base_fd   the base image, locked
+ * @param  base_name the base's absolute path
+ * @return           0 on success; errno on failure
+ */
+static int start_over(int fd, int base_fd, char const *base_name) {
+	struct ext2_super_block super_block;
+	struct stat stats;
+	if (pread_full(base_fd, &super_block, sizeof(super_block), EXT2_SUPER_OFFSET) < 0 ||
+		super_block.s_magic != EXT2_SUPER_MAGIC || super_block.s_log_block_size > 6) {
+		fprintf(stderr, "overlay: %s is not an ext2 image\n", base_name);
+		return -EINVAL;
+	}
+	if (fstat(base_fd, &stats) < 0) {
+		return -errno;
+	}
+
+	unsigned char padded[OVERLAY_TRAILER_SIZE] = {0};
+	struct overlay_trailer *trailer = (struct overlay_trailer *)padded;
+	trailer->magic = OVERLAY_MAGIC;
+	trailer->block_size = EXT2_MIN_BLOCK_SIZE << super_block.s_log_block_size;
+	trailer->blocks_count = super_block.s_blocks_count;
+	trailer->path_len = strlen(base_name);
+	trailer->base_dev = stats.st_dev;
+	trailer->base_ino = stats.st_ino;
+	trailer->base_size = stats.st_size;
+	trailer->base_mtime_sec = stats.st_mtim.tv_sec;
+	trailer->base_mtime_nsec = stats.st_mtim.tv_nsec;
+	if (trailer->path_len >= OVERLAY_TRAILER_SIZE - sizeof(*trailer)) {
+		fprintf(stderr, "overlay: the path of %s is too long\n", base_name);
+		return -ENAMETOOLONG;
+	}
+	if (stats.st_size < image_len(trailer)) {
+		fprintf(stderr, "overlay: %s is truncated\n", base_name);
+		return -EINVAL;
+	}
+	memcpy(padded + sizeof(*trailer), base_name, trailer->path_len);
+
+	// the blocks and the bitmap go, leaving holes; without hole punching the
+	// file is cut down and grown again
+	off_t start = image_len(trailer);
+	off_t tail = start + bitmap_len(trailer);
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, tail) < 0 && ftruncate(fd, 0) < 0) {
+		return -errno;
+	}
+	if (ftruncate(fd, tail + OVERLAY_TRAILER_SIZE) < 0) {
+		return -errno;
+	}
+
+	// the overlay always holds the superblock, so init() finds it where it
+	// would in an image
+	unsigned int block = EXT2_SUPER_OFFSET / trailer->block_size;
+	unsigned char bit = 1 << (block % 8);
+	int result;
+	if ((result = copy_range(base_fd, fd, (off_t)block * trailer->block_size, trailer->block_size)) < 0 ||
+		(result = pwrite_full(fd, &bit, 1, start + block / 8)) < 0 ||
+		(result = pwrite_full(fd, padded, sizeof(padded), tail)) < 0) {
+		return result;
+	}
+	if (fdatasync(fd) < 0) {
+		return -errno;
+	}
+	return 0;
+}
+
+/**
+ * Open and lock an overlay to commit or discard it
+ * @param  file_name the overlay
+ * @param  trailer   set to its trailer
+ * @param  base_name set to the malloc'ed base path
+ * @return           the overlay fd; errno on failure
+ */
+static int open_overlay(char const *file_name, struct overlay_trailer *trailer, char **base_name) {
+	int fd = open(file_name, O_RDWR);
+	if (fd < 0) {
+		perror("overlay: open");
+		return -errno;
+	}
+	int result;
+	if ((result = lock_file(fd, file_name, LOCK_EX)) < 0) {
+		close(fd);
+		return result;
+	}
+	if ((result = read_trailer(fd, file_name, trailer, base_name)) <= 0) {
+		if (result == 0) {
+			fprintf(stderr, "overlay: %s is not an overlay\n", file_name);
+			result = -EINVAL;
+		}
+		close(fd);
+		return result;
+	}
+	return fd;
+}
+
+
+
+// ---------- Function Implementations ----------
+
+/**
+ * Make an empty overlay over a base image. Costs the write of one block,
+ * whatever the size of the base.
+ * @param  base_name the base image; not an overlay itself
+ * @param  file_name the overlay to create; must not exist
+ * @return           0 on success; errno on failure
+ */
+int overlay_create(char const *base_name, char const *file_name) {
+	char *base_path = realpath(base_name, NULL); // FREE
+	if (base_path == NULL) {
+		perror("overlay_create: realpath");
+		return -errno;
+	}
+	int base_fd = open(base_path, O_RDONLY);
+	if (base_fd < 0) {
+		perror("overlay_create: open");
+		free(base_path);
+		return -errno;
+	}
+
+	struct overlay_trailer trailer;
+	char *base_base = NULL; // FREE
+	int fd = -1;
+	int result;
+	if ((result = lock_file(base_fd, base_name, LOCK_SH)) < 0) {
+		goto out;
+	}
+	// an overlay over an overlay would need the blocks of both
+	if ((result = read_trailer(base_fd, base_name, &trailer, &base_base)) != 0) {
+		if (result > 0) {
+			fprintf(stderr, "overlay_create: %s is an overlay itself, of %s\n", base_name, base_base);
+			result = -EINVAL;
+		}
+		goto out;
+	}
+	if ((fd = open(file_name, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0) {
+		perror("overlay_create: open");
+		result = -errno;
+		goto out;
+	}
+	if ((result = start_over(fd, base_fd, base_path)) < 0) {
+		unlink(file_name);
+	}
+
+out:
+	if (fd >= 0) {
+		close(fd);
+	}
+	close(base_fd);
+	free(base_base);
+	free(base_path);
+	return result;
+}
+
+
+/**
+ * Write an overlay's blocks into its base, then start it over on the result.
+ * The blocks the base has in use are logged, so the commit lands whole or
+ * not at all; the others are free in the base until it does and are written
+ * in place, like new file data. Waits for every other overlay over the base
+ * to be closed. The base's dirty log cannot say what the overlay changed, so
+ * it is dropped and the base's next incremental check is a full one.
+ * @param  file_name the overlay
+ * @return           number of blocks written into the base; errno on failure
+ */
+int overlay_commit(char const *file_name) {
+	struct overlay_trailer trailer;
+	char *base_name = NULL; // FREE
+	int fd = open_overlay(file_name, &trailer, &base_name);
+	if (fd < 0) {
+		return fd;
+	}
+	unsigned char *in_delta = NULL; // FREE
+	unsigned char *logged = NULL;	// FREE
+	struct ext2_image base = {.map_fd = -1, .journal_fd = -1, .dirty_fd = -1, .base_fd = -1};
+	int result;
+
+	// an interrupted flush of the overlay's own goes in first
+	if ((result = journal_recover(fd, file_name)) < 0) {
+		fprintf(stderr, "overlay_commit: cannot recover %s from its journal\n", file_name);
+		goto out;
+	}
+	size_t map_len = bitmap_len(&trailer);
+	in_delta = malloc(map_len);
+	logged = calloc(map_len, 1);
+	if (in_delta == NULL || logged == NULL) {
+		result = -ENOMEM;
+		goto out;
+	}
+	if ((result = pread_full(fd, in_delta, map_len, image_len(&trailer))) < 0) {
+		goto out;
+	}
+
+	if ((result = image_open(&base, base_name, EXT2_MAP_AUTO)) < 0) {
+		goto out;
+	}
+	if (!base_unchanged(base.map_fd, &trailer) || base.block_size != (int)trailer.block_size ||
+		base.super_block->s_blocks_count != trailer.blocks_count) {
+		fprintf(stderr, "overlay_commit: %s changed since %s was started over it\n", base_name,
+				file_name);
+		result = -ESTALE;
+		goto close;
+	}
+	image_use(&base);
+	dirtylog_drop(&base, "an overlay is committed into the image");
+
+	// which blocks to log is up to the base's bitmaps before any are copied in
+	unsigned int num_blocks = trailer.blocks_count;
+	unsigned int first_data = base.super_block->s_first_data_block;
+	unsigned int count = 0;
+	for (unsigned int block = bitmap_next_set(in_delta, num_blocks, 0); block < num_blocks;
+		 block = bitmap_next_set(in_delta, num_blocks, block + 1)) {
+		if (block < first_data || check_block_bit(base.disk, block)) {
+			logged[block / 8] |= 1 << (block % 8);
+		}
+		count++;
+	}
+	size_t block_size = trailer.block_size;
+	for (unsigned int block = bitmap_next_set(in_delta, num_blocks, 0); block < num_blocks;) {
+		unsigned int end = block;
+		while (end < num_blocks && check_bitmap((unsigned int *)in_delta, end)) {
+			end++;
+		}
+		unsigned char *run = base.disk + block * block_size;
+		if ((result = pread_full(fd, run, (end - block) * block_size, (off_t)block * block_size)) < 0) {
+			fprintf(stderr, "overlay_commit: cannot read %s: %s\n", file_name, strerror(-result));
+			break;
+		}
+		for (; block < end; block++, run += block_size) {
+			if (check_bitmap((unsigned int *)logged, block)) {
+				dirty_meta(base.disk, run, block_size);
+			} else {
+				dirty_data(base.disk, run, block_size);
+			}
+		}
+		block = bitmap_next_set(in_delta, num_blocks, end);
+	}
+	if ((result = end_op(result)) < 0 || (result = journal_flush(&base)) < 0) {
+		goto close;
+	}
+
+	// the overlay now adds nothing to the base
+	unlink_sidecar(file_name, ".dirty");
+	if ((result = start_over(fd, base.map_fd, base_name)) < 0) {
+		fprintf(stderr, "overlay_commit: committed, but cannot start %s over: %s\n", file_name,
+				strerror(-result));
+		goto close;
+	}
+	result = count;
+
+close:
+	image_close(&base);
+out:
+	close(fd);
+	free(in_delta);
+	free(logged);
+	free(base_name);
+	return result;
+}
+
+
+/**
+ * Throw away what an overlay holds, and the operations its journal has not
+ * flushed yet, and start it over on its base as the base stands
+ * @param  file_name the overlay
+ * @return           0 on success; errno on failure
+ */
+int overlay_discard(char const *file_name) {
+	struct overlay_trailer trailer;
+	char *base_name = NULL; // FREE
+	int fd = open_overlay(file_name, &trailer, &base_name);
+	if (fd < 0) {
+		return fd;
+	}
+	int result;
+	int base_fd = open(base_name, O_RDONLY);
+	if (base_fd < 0) {
+		fprintf(stderr, "overlay_discard: cannot open %s: %s\n", base_name, strerror(errno));
+		result = -errno;
+		goto out;
+	}
+	if ((result = lock_file(base_fd, base_name, LOCK_SH)) == 0) {
+		unlink_sidecar(file_name, ".journal");
+		unlink_sidecar(file_name, ".dirty");
+		result = start_over(fd, base_fd, base_name);
+	}
+	close(base_fd);
+
+out:
+	close(fd);
+	free(base_name);
+	return result;
+}
+
+
+/**
+ * Set an image up as an overlay if its file is one: open and share-lock the
+ * base, check it is the base the overlay was started over and read the
+ * overlay's bitmap. The image is mapped from image->base_fd if it is set,
+ * and overlay_load() lays the overlay's blocks over that.
+ * @param  image     the image being opened
+ * @param  fd        its file, locked and recovered
+ * @param  file_name its file name
+ * @return           0 on success, overlay or not; errno on failure
+ */
+int overlay_open(struct ext2_image *image, int fd, char const *file_name) {
+	image->base_fd = -1;
+	image->in_delta = NULL;
+	image->delta_unsynced = 0;
+
+	struct overlay_trailer trailer;
+	char *base_name = NULL; // FREE
+	int result = read_trailer(fd, file_name, &trailer, &base_name);
+	if (result <= 0) {
+		return result;
+	}
+	int base_fd = open(base_name, O_RDONLY);
+	if (base_fd < 0) {
+		fprintf(stderr, "init: cannot open %s, the base of %s: %s\n", base_name, file_name,
+				strerror(errno));
+		result = -errno;
+		free(base_name);
+		return result;
+	}
+	if ((result = lock_file(base_fd, base_name, LOCK_SH)) < 0) {
+		goto fail;
+	}
+	if (!base_unchanged(base_fd, &trailer)) {
+		fprintf(stderr, "init: %s changed since %s was started over it\n", base_name, file_name);
+		result = -ESTALE;
+		goto fail;
+	}
+	size_t map_len = bitmap_len(&trailer);
+	unsigned char *in_delta = malloc(map_len);
+	if (in_delta == NULL) {
+		result = -ENOMEM;
+		goto fail;
+	}
+	if ((result = pread_full(fd, in_delta, map_len, image_len(&trailer))) < 0) {
+		free(in_delta);
+		goto fail;
+	}
+	image->base_fd = base_fd;
+	image->in_delta = in_delta;
+	free(base_name);
+	return 0;
+
+fail:
+	close(base_fd);
+	free(base_name);
+	return result;
+}
+
+
+/**
+ * Let go of an overlay's base
+ * @param image the image; anything but an overlay is left alone
+ */
+void overlay_detach(struct ext2_image *image) {
+	if (image->in_delta == NULL) {
+		return;
+	}
+	close(image->base_fd);
+	free(image->in_delta);
+	image->base_fd = -1;
+	image->in_delta = NULL;
+	image->delta_unsynced = 0;
+}
+
+
+/**
+ * Read the blocks an overlay holds in a stretch of the mapping over whatever
+ * the mapping shows there, the base's blocks after a fresh mapping or after
+ * private pages were dropped
+ * @param  image the image
+ * @param  start first byte of the stretch
+ * @param  end   byte after it
+ * @return       0 on success, or if the image is not an overlay; errno on failure
+ */
+int overlay_load(struct ext2_image *image, size_t start, size_t end) {
+	if (image->in_delta == NULL) {
+		return 0;
+	}
+	size_t block_size = image->block_size;
+	unsigned int num_blocks = image->super_block->s_blocks_count;
+	unsigned int last = (end + block_size - 1) / block_size;
+	if (last > num_blocks) {
+		last = num_blocks;
+	}
+	for (unsigned int block = bitmap_next_set(image->in_delta, last, start / block_size); block < last;) {
+		unsigned int run_end = block;
+		while (run_end < last && check_bitmap((unsigned int *)image->in_delta, run_end)) {
+			run_end++;
+		}
+		int result = pread_full(image->map_fd, image->disk + block * block_size,
+								(run_end - block) * block_size, (off_t)block * block_size);
+		if (result < 0) {
+			return result;
+		}
+		block = bitmap_next_set(image->in_delta, last, run_end);
+	}
+	return 0;
+}
+
+
+/**
+ * Note that blocks were written into an overlay
+ * @param image  the image; anything but an overlay is left alone
+ * @param blocks the blocks written
+ * @param count  how many
+ */
+void overlay_mark(struct ext2_image *image, unsigned int const *blocks, unsigned int count) {
+	if (image->in_delta == NULL) {
+		return;
+	}
+	for (unsigned int i = 0; i < count; i++) {
+		unsigned char bit = 1 << (blocks[i] % 8);
+		if (!(image->in_delta[blocks[i] / 8] & bit)) {
+			image->in_delta[blocks[i] / 8] |= bit;
+			image->delta_unsynced = 1;
+		}
+	}
+}
+
+
+/**
+ * Note that file data was written straight into an overlay's blocks, and
+ * read it into the mapping, which shows the base there. Safe to call from
+ * several threads at once for different blocks.
+ * @param image the image; anything but an overlay is left alone
+ * @param block first block written
+ * @param count number of blocks
+ */
+void overlay_fd_data(struct ext2_image *image, unsigned int block, unsigned int count) {
+	if (image->in_delta == NULL || count == 0) {
+		return;
+	}
+	for (unsigned int i = block; i < block + count; i++) {
+		unsigned char bit = 1 << (i % 8);
+		if (!(image->in_delta[i / 8] & bit)) {
+			__atomic_fetch_or(&image->in_delta[i / 8], bit, __ATOMIC_RELAXED);
+		}
+	}
+	__atomic_store_n(&image->delta_unsynced, 1, __ATOMIC_RELAXED);
+	size_t block_size = image->block_size;
+	int result = pread_full(image->map_fd, image->disk + block * block_size, count * block_size,
+							(off_t)block * block_size);
+	if (result < 0) {
+		fprintf(stderr, "overlay_fd_data: cannot read back blocks %u-%u: %s\n", block,
+				block + count - 1, strerror(-result));
+	}
+}
+
+
+/**
+ * Before a flush closes the log: copy up from the base the metadata blocks
+ * it is about to write in place that the overlay does not hold yet, so each
+ * block the bitmap claims holds a whole copy should recovery have to replay
+ * over it, then write the bitmap. Unsynced; the flush's data sync covers it.
+ * @param  image the image
+ * @param  meta  the metadata blocks the flush writes, in block order
+ * @param  count how many
+ * @return       1 if anything was written, 0 if not; errno on failure
+ */
+int overlay_sync(struct ext2_image *image, unsigned int const *meta, unsigned int count) {
+	if (image->in_delta == NULL) {
+		return 0;
+	}
+	unsigned int num_blocks = image->super_block->s_blocks_count;
+	size_t block_size = image->block_size;
+	int result;
+
+	for (unsigned int i = 0; i < count;) {
+		unsigned int block = meta[i];
+		if (check_bitmap((unsigned int *)image->in_delta, block)) {
+			i++;
+			continue;
+		}
+		unsigned int end = block;
+		while (i < count && meta[i] == end && !check_bitmap((unsigned int *)image->in_delta, end)) {
+			end++;
+			i++;
+		}
+		if ((result = copy_range(image->base_fd, image->map_fd, (off_t)block * block_size,
+								 (end - block) * block_size)) < 0) {
+			return result;
+		}
+		for (unsigned int copied = block; copied < end; copied++) {
+			image->in_delta[copied / 8] |= 1 << (copied % 8);
+		}
+		image->delta_unsynced = 1;
+	}
+
+	if (!image->delta_unsynced) {
+		return 0;
+	}
+	if ((result = pwrite_full(image->map_fd, image->in_delta, (num_blocks + 7) / 8, image->map_len)) < 0) {
+		return result;
+	}
+	image->delta_unsynced = 0;
+	return 1;
+}
@@ -0,0 +1,43 @@
+#ifndef EXT2_OVERLAY
+#define EXT2_OVERLAY
+
+#include <stddef.h>
+
+/*
+ * Copy-on-write overlays. An overlay is a working copy of a base image that
+ * holds only the blocks changed in it: the tools open it in place of an
+ * image, init() maps the base read-only and private and lays the overlay's
+ * blocks over it, and what the operations change goes to the overlay. The
+ * base is never written, so any number of overlays can be opened over it at
+ * once; it can be opened itself only while none is.
+ *
+ * The overlay file has the image's layout, sparse, followed by a bitmap of
+ * the blocks it holds and a trailer naming the base:
+ *
+ *     block ... (holes where it holds none) | bitmap | struct overlay_trailer, base path
+ *
+ * It goes through the journal like an image. Every block its bitmap claims
+ * holds a whole copy: metadata is copied up from the base before a flush
+ * logs over it, so recovery replays into the overlay as into any image.
+ *
+ * The trailer records the base file as it was when the overlay was started
+ * over it; an overlay over a base that changed since is refused.
+ * overlay_commit() writes an overlay's blocks into its base as one journaled
+ * operation and starts it over, empty, on the result; overlay_discard()
+ * starts it over without writing anything.
+ */
+
+struct ext2_image;
+
+int overlay_create(char const *base_name, char const *file_name);
+int overlay_commit(char const *file_name);
+int overlay_discard(char const *file_name);
+
+int overlay_open(struct ext2_image *image, int fd, char const *file_name);
+void overlay_detach(struct ext2_image *image);
+int overlay_load(struct ext2_image *image, size_t start, size_t end);
+void overlay_mark(struct ext2_image *image, unsigned int const *blocks, unsigned int count);
+void overlay_fd_data(struct ext2_image *image, unsigned int block, unsigned int count);
+int overlay_sync(struct ext2_image *image, unsigned int const *meta, unsigned int count);
+
+#endif // EXT2_OVERLAY
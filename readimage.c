@@ -1,5 +1,20 @@
-#include "ext2.h"
+/*
+ * This program takes the name of an ext2 formatted virtual disk and prints what is on it. By
+ * default it lists the superblock and group counts, each group's bitmaps, every inode in use and
+ * the entries of every directory block. The inode table is split into shards that worker threads
+ * format in parallel, each into its own buffer; the buffers are written out in inode order, so the
+ * output is the same whatever the number of threads.
+ *
+ *     -s           print a summary instead of the listing: inodes by type, histograms of file
+ *                  sizes and of blocks per file, and how fragmented the files' block maps are
+ *     -c <file>    write one CSV row per inode in use to file, for tools to load; with -c and no
+ *                  -s, the listing is not printed
+ *     -j <threads> worker threads (default one per online CPU)
+ */
+
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,13 +23,76 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "ext2.h"
+#include "utils.h"
+
+#define READIMAGE_MAX_THREADS  64
+#define READIMAGE_SHARD_INODES 4096 /* inodes a worker takes at a time */
+#define SIZE_BUCKETS		   65	/* 0, then [2^(k-1), 2^k) for k = 1..64 */
+#define BLOCK_BUCKETS		   33
+
+// what the summary adds up; one per shard, merged once the workers are done
+struct summary {
+	unsigned long long files, dirs, links, others;
+	unsigned long long size_hist[SIZE_BUCKETS];	  /* regular files by size in bytes */
+	unsigned long long block_hist[BLOCK_BUCKETS]; /* inodes by data blocks */
+	unsigned long long mapped;					  /* inodes with data blocks */
+	unsigned long long data_blocks;
+	unsigned long long meta_blocks; /* indirect blocks */
+	unsigned long long runs;		/* runs of consecutive blocks over all mapped inodes */
+	unsigned long long fragmented;	/* mapped inodes in more than one run */
+};
+
+// a range of the inode table and what its worker made of it
+struct shard {
+	unsigned int first; /* inode numbers first to end - 1 */
+	unsigned int end;
+	char *inodes_text; /* the listing's Inodes section for the range */
+	size_t inodes_len;
+	char *dirs_text; /* ... and its Directory Blocks section */
+	size_t dirs_len;
+	char *csv;
+	size_t csv_len;
+	struct summary summary;
+	int failed;
+};
+
+// the block map of one inode, as walk_inode_blocks() visits it
+struct block_map {
+	unsigned int data;
+	unsigned int meta;
+	unsigned int runs;
+	unsigned int first; /* first block visited */
+	unsigned int last;	/* last block visited */
+};
+
 unsigned char *disk;
+struct shard *shards;
+unsigned int num_shards;
+unsigned int next_shard; // work distribution
+int want_listing;
+int want_summary;
+int want_csv;
 
 // ---------- Helper Function Declarations ----------
 int check_inode(int inode_count, struct ext2_inode *inode);
 int print_bitmap(unsigned char *bitmap, int size);
 char get_inode_type(unsigned short mode);
 char get_dir_type(unsigned char type);
+int in_use(unsigned int inode_idx, struct ext2_inode *inode);
+unsigned long long file_size(struct ext2_inode *inode);
+int size_bucket(unsigned long long n);
+int map_visit(unsigned char *disk, unsigned int block_num, int is_meta, void *arg);
+void list_inode(FILE *out, unsigned int inode_idx, struct ext2_inode *inode);
+void list_dir_blocks(FILE *out, unsigned int inode_idx, struct ext2_inode *inode);
+void count_inode(struct summary *summary, struct ext2_inode *inode, struct block_map *map);
+void scan_shard(struct shard *shard);
+void *scan_worker(void *arg);
+void run_workers(void *(*fn)(void *), int count);
+void merge_summary(struct summary *total, struct summary const *part);
+void print_histogram(char const *title, unsigned long long const *hist, int buckets, int bytes);
+void print_summary(struct summary const *summary);
+int write_csv(char const *file_name);
 
 // ---------- Helper Functions ----------
 /**
@@ -29,18 +107,28 @@ int check_inode(int inode_count, struct ext2_inode *inode) {
 }
 
 /**
- * print out a given bit map.
+ * print out a given bit map. Formats it into one buffer and writes that once
+ * instead of a printf per bit.
  * @param  bitmap the bitmap
  * @param  size   the size of the bitmap
- * @return        0 on success
+ * @return        0 on success; -1 if out of memory
  */
 int print_bitmap(unsigned char *bitmap, int size) {
+	char *line = malloc(size + size / 8 + 2); // FREE
+	if (line == NULL) {
+		perror("print_bitmap: malloc");
+		return -1;
+	}
+	int len = 0;
 	for (int i = 0; i < size; i++) {
 		if (i % 8 == 0) {
-			printf(" ");
+			line[len++] = ' ';
 		}
-		printf("%d", bitmap[i / 8] >> (i % 8) & 0x1);
+		line[len++] = '0' + (bitmap[i / 8] >> (i % 8) & 0x1);
 	}
+	line[len] = '\0';
+	fputs(line, stdout);
+	free(line);
 	return 0;
 }
 
@@ -51,17 +139,15 @@ int print_bitmap(unsigned char *bitmap, int size) {
  * 				'f': file
  * 				'd': dir
  * 				'l': link
- * 				-1: error
+ * 				'?': anything else
  */
 char get_inode_type(unsigned short mode) {
-	if (mode & EXT2_S_IFREG) {
-		return 'f';
-	} else if (mode & EXT2_S_IFDIR) {
-		return 'd';
-	} else if (mode & EXT2_S_IFLNK) {
-		return 'l';
+	switch (mode & EXT2_S_IFMT) {
+	case EXT2_S_IFREG: return 'f';
+	case EXT2_S_IFDIR: return 'd';
+	case EXT2_S_IFLNK: return 'l';
 	}
-	return -1;
+	return '?';
 }
 
 /**
@@ -71,7 +157,7 @@ char get_inode_type(unsigned short mode) {
  * 				'f': file
  * 				'd': dir
  * 				'l': link
- * 				-1: error
+ * 				'?': anything else
  */
 char get_dir_type(unsigned char type) {
 	if (type == EXT2_FT_REG_FILE)
@@ -80,129 +166,430 @@ char get_dir_type(unsigned char type) {
 		return 'd';
 	else if (type == EXT2_FT_SYMLINK)
 		return 'l';
-	return -1;
+	return '?';
 }
 
-// ---------- MAIN ----------
-
-int main(int argc, char **argv) {
+/**
+ * Whether an inode counts for the summary and the CSV: marked in its bitmap
+ * and either the root or past the reserved inodes
+ */
+int in_use(unsigned int inode_idx, struct ext2_inode *inode) {
+	return (inode_idx == EXT2_ROOT_INO || inode_idx >= ext2_cur->first_ino) &&
+		   check_inode_bit(disk, inode_idx) && inode->i_mode != 0;
+}
 
-	if (argc != 2) {
-		fprintf(stderr, "Usage: %s <image file name>\n", argv[0]);
-		exit(1);
+/**
+ * An inode's size in bytes; a regular file keeps the high 32 bits in i_dir_acl
+ */
+unsigned long long file_size(struct ext2_inode *inode) {
+	unsigned long long size = inode->i_size;
+	if ((inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFREG) {
+		size |= (unsigned long long)inode->i_dir_acl << 32;
 	}
-	int fd = open(argv[1], O_RDWR);
+	return size;
+}
 
-	disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (disk == MAP_FAILED) {
-		perror("mmap");
-		exit(1);
-	}
+/**
+ * The histogram bucket of n: 0 for 0, k for 2^(k-1) <= n < 2^k
+ */
+int size_bucket(unsigned long long n) {
+	return n == 0 ? 0 : 64 - __builtin_clzll(n);
+}
 
-	struct ext2_super_block *super_block =
-		(struct ext2_super_block *)(disk + 1024);
-	struct ext2_group_desc *group_desc =
-		(struct ext2_group_desc *)(disk + 1024 * 2);
+/**
+ * walk_inode_blocks() visitor adding a block to a struct block_map. Blocks are
+ * visited in map order, indirect blocks before what they map, which is the
+ * order they are allocated in, so a contiguous file is a single run.
+ */
+int map_visit(unsigned char *disk, unsigned int block_num, int is_meta, void *arg) {
+	struct block_map *map = arg;
+	if (map->runs == 0) {
+		map->first = block_num;
+		map->runs = 1;
+	} else if (block_num != map->last + 1) {
+		map->runs++;
+	}
+	map->last = block_num;
+	if (is_meta) {
+		map->meta++;
+	} else {
+		map->data++;
+	}
+	return 0;
+}
 
-	printf("Inodes: %d\n", super_block->s_inodes_count);
-	printf("Blocks: %d\n", super_block->s_blocks_count);
+/**
+ * Format an inode's lines of the listing
+ */
+void list_inode(FILE *out, unsigned int inode_idx, struct ext2_inode *inode) {
+	fprintf(out, "[%d] type: %c size: %d links: %d blocks: %d\n", inode_idx,
+			get_inode_type(inode->i_mode), inode->i_size, inode->i_links_count, inode->i_blocks);
+	fprintf(out, "[%d] Blocks: ", inode_idx);
+	for (int j = 0; j < EXT2_N_BLOCKS && inode->i_block[j] != 0 && !is_fast_symlink(inode); j++) {
+		fprintf(out, " %d", inode->i_block[j]);
+	}
+	fprintf(out, "\n");
+}
 
-	printf("Block group:\n");
-	printf("    block bitmap: %d\n", group_desc->bg_block_bitmap);
-	printf("    inode bitmap: %d\n", group_desc->bg_inode_bitmap);
-	printf("    inode table: %d\n", group_desc->bg_inode_table);
-	printf("    free blocks: %d\n", group_desc->bg_free_blocks_count);
-	printf("    free inodes: %d\n", group_desc->bg_free_inodes_count);
-	printf("    used_idrs: %d\n", group_desc->bg_used_dirs_count);
+/**
+ * Format the entries of every block of a directory, each block's records
+ * followed by their rec_len to its end
+ */
+void list_dir_blocks(FILE *out, unsigned int inode_idx, struct ext2_inode *inode) {
+	unsigned int num_blocks = dir_num_blocks(inode);
+	for (unsigned int lblk = 0; lblk < num_blocks; lblk++) {
+		unsigned char *block = dir_block(disk, inode, lblk);
+		if (block == NULL) {
+			continue;
+		}
+		fprintf(out, "   DIR BLOCK NUM: %d (for inode %d)\n", inode_block(disk, inode, lblk),
+				inode_idx);
+
+		int offset = 0;
+		while (offset <= EXT2_BLOCK_SIZE - (int)sizeof(struct ext2_dir_entry)) {
+			struct ext2_dir_entry *dir = (struct ext2_dir_entry *)(block + offset);
+			if (dir->rec_len == 0) { // corrupt block
+				break;
+			}
+			fprintf(out, "Inode: %d rec_len: %d name_len: %d type= %c name=%.*s \n", dir->inode,
+					dir->rec_len, dir->name_len, get_dir_type(dir->file_type), dir->name_len,
+					dir->name);
+			offset += dir->rec_len;
+		}
+	}
+}
 
+/**
+ * Add an inode in use and its block map to a summary
+ */
+void count_inode(struct summary *summary, struct ext2_inode *inode, struct block_map *map) {
+	switch (get_inode_type(inode->i_mode)) {
+	case 'f':
+		summary->files++;
+		summary->size_hist[size_bucket(file_size(inode))]++;
+		break;
+	case 'd': summary->dirs++; break;
+	case 'l': summary->links++; break;
+	default: summary->others++;
+	}
+	int bucket = size_bucket(map->data);
+	summary->block_hist[bucket < BLOCK_BUCKETS ? bucket : BLOCK_BUCKETS - 1]++;
+	if (map->runs > 0) {
+		summary->mapped++;
+		summary->data_blocks += map->data;
+		summary->meta_blocks += map->meta;
+		summary->runs += map->runs;
+		summary->fragmented += map->runs > 1;
+	}
+}
 
-	// pointer to the block bitmap
-	unsigned char *block_bitmap =
-		(unsigned char *)(disk + 1024 * group_desc->bg_block_bitmap);
+/**
+ * Scan one shard of the inode table into the shard's buffers and summary
+ */
+void scan_shard(struct shard *shard) {
+	FILE *inodes_out = NULL;
+	FILE *dirs_out = NULL;
+	FILE *csv_out = NULL;
+	if ((want_listing && ((inodes_out = open_memstream(&shard->inodes_text, &shard->inodes_len)) == NULL ||
+						  (dirs_out = open_memstream(&shard->dirs_text, &shard->dirs_len)) == NULL)) ||
+		(want_csv && (csv_out = open_memstream(&shard->csv, &shard->csv_len)) == NULL)) {
+		perror("scan_shard: open_memstream");
+		shard->failed = 1;
+	}
 
-	printf("Block bitmap:");
-	print_bitmap(block_bitmap, super_block->s_blocks_count);
-	printf("\n");
+	for (unsigned int i = shard->first; i < shard->end && !shard->failed; i++) {
+		struct ext2_inode *inode = get_inode(disk, i);
+		if (inodes_out != NULL && check_inode(i - 1, inode)) {
+			list_inode(inodes_out, i, inode);
+			if (get_inode_type(inode->i_mode) == 'd') {
+				list_dir_blocks(dirs_out, i, inode);
+			}
+		}
+		if ((want_summary || want_csv) && in_use(i, inode)) {
+			struct block_map map = {0};
+			walk_inode_blocks(disk, inode, map_visit, &map);
+			count_inode(&shard->summary, inode, &map);
+			if (csv_out != NULL) {
+				fprintf(csv_out, "%u,%c,%u,%llu,%u,%u,%u,%u,%u\n", i, get_inode_type(inode->i_mode),
+						inode->i_mode, file_size(inode), inode->i_links_count, map.data, map.meta,
+						map.runs, map.first);
+			}
+		}
+	}
 
-	// pointer to the inode bitmap
-	unsigned char *inode_bitmap =
-		(unsigned char *)(disk + 1024 * group_desc->bg_inode_bitmap);
+	// closing makes the buffers final; a failed flush is out of memory too
+	if ((inodes_out != NULL && fclose(inodes_out) != 0) || (dirs_out != NULL && fclose(dirs_out) != 0) ||
+		(csv_out != NULL && fclose(csv_out) != 0)) {
+		shard->failed = 1;
+	}
+}
 
-	printf("Inode bitmap: ");
-	print_bitmap(inode_bitmap, super_block->s_inodes_count);
-	printf("\n");
+/**
+ * Scan shards until there are none left
+ */
+void *scan_worker(void *arg) {
+	unsigned int shard;
+	while ((shard = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED)) < num_shards) {
+		scan_shard(&shards[shard]);
+	}
+	return NULL;
+}
 
-	// pointer to the first inode
-	struct ext2_inode *inodes =
-		(struct ext2_inode *)(disk + 1024 * group_desc->bg_inode_table);
-
-	printf("\nInodes:\n");
-	for (int i = 0; i < super_block->s_inodes_count; i++) {
-		struct ext2_inode *current_inode = &inodes[i];
-		if (check_inode(i, current_inode)) {
-			char type = get_inode_type(current_inode->i_mode);
-			if (type == -1) {
-				fprintf(stderr, "Invalid file type in inode: %d\n", i);
-				exit(-1);
-			}
-			int size = current_inode->i_size;
-			int links_count = current_inode->i_links_count;
-			int blocks = current_inode->i_blocks;
+/**
+ * Start count threads on fn, falling back to running it here if none start
+ */
+void run_workers(void *(*fn)(void *), int count) {
+	pthread_t threads[READIMAGE_MAX_THREADS];
+	int started = 0;
+	while (started < count && pthread_create(&threads[started], NULL, fn, NULL) == 0) {
+		started++;
+	}
+	if (started == 0) {
+		fn(NULL);
+	}
+	for (int i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+}
 
-			printf("[%d] type: %c size: %d links: %d blocks: %d\n", i + 1, type,
-				   size, links_count, blocks);
+/**
+ * Add a shard's summary into the total
+ */
+void merge_summary(struct summary *total, struct summary const *part) {
+	total->files += part->files;
+	total->dirs += part->dirs;
+	total->links += part->links;
+	total->others += part->others;
+	for (int i = 0; i < SIZE_BUCKETS; i++) {
+		total->size_hist[i] += part->size_hist[i];
+	}
+	for (int i = 0; i < BLOCK_BUCKETS; i++) {
+		total->block_hist[i] += part->block_hist[i];
+	}
+	total->mapped += part->mapped;
+	total->data_blocks += part->data_blocks;
+	total->meta_blocks += part->meta_blocks;
+	total->runs += part->runs;
+	total->fragmented += part->fragmented;
+}
 
-			printf("[%d] Blocks: ", i + 1);
-			for (int j = 0; current_inode->i_block[j] != 0; j++) {
-				printf(" %d", current_inode->i_block[j]);
+/**
+ * Print the non-empty buckets of a power-of-two histogram
+ * @param title   the heading
+ * @param hist    the buckets, as size_bucket() numbers them
+ * @param buckets how many there are; the last also holds everything bigger
+ * @param bytes   1 to print the bounds with K, M and G suffixes
+ */
+void print_histogram(char const *title, unsigned long long const *hist, int buckets, int bytes) {
+	printf("%s:\n", title);
+	for (int i = 0; i < buckets; i++) {
+		if (hist[i] == 0) {
+			continue;
+		}
+		if (i == 0) {
+			printf("  %-22s %12llu\n", "0", hist[i]);
+			continue;
+		}
+		char range[48];
+		char low[16];
+		char high[16];
+		unsigned long long bounds[2] = {1ull << (i - 1), i < 64 ? 1ull << i : 0};
+		char *text[2] = {low, high};
+		for (int j = 0; j < 2; j++) {
+			int shift = bounds[j] == 0 ? 64 : __builtin_ctzll(bounds[j]);
+			if (bytes && shift >= 30) {
+				snprintf(text[j], sizeof(low), "%dG", 1 << (shift - 30));
+			} else if (bytes && shift >= 20) {
+				snprintf(text[j], sizeof(low), "%dM", 1 << (shift - 20));
+			} else if (bytes && shift >= 10) {
+				snprintf(text[j], sizeof(low), "%dK", 1 << (shift - 10));
+			} else {
+				snprintf(text[j], sizeof(low), "%llu", bounds[j]);
 			}
-			printf("\n");
 		}
+		if (i == buckets - 1) {
+			snprintf(range, sizeof(range), ">= %s", low);
+		} else {
+			snprintf(range, sizeof(range), "%s - <%s", low, high);
+		}
+		printf("  %-22s %12llu\n", range, hist[i]);
 	}
+}
 
+/**
+ * Print the summary. The fragmentation score is the share of the breaks a
+ * block map could have that it does have: 0% when every mapped inode is one
+ * run of blocks, 100% when no two consecutive blocks of any are adjacent.
+ */
+void print_summary(struct summary const *summary) {
+	printf("\nInodes in use:\n");
+	printf("  %-22s %12llu\n", "regular files", summary->files);
+	printf("  %-22s %12llu\n", "directories", summary->dirs);
+	printf("  %-22s %12llu\n", "symbolic links", summary->links);
+	printf("  %-22s %12llu\n", "other", summary->others);
 
-	printf("\nDirectory Blocks:\n");
-
-	for (int i = 0; i < super_block->s_inodes_count; i++) {
-		struct ext2_inode *current_inode = &inodes[i];
+	printf("\n");
+	print_histogram("File sizes (bytes)", summary->size_hist, SIZE_BUCKETS, 1);
+	printf("\n");
+	print_histogram("Data blocks per inode", summary->block_hist, BLOCK_BUCKETS, 0);
+
+	unsigned long long blocks = summary->data_blocks + summary->meta_blocks;
+	unsigned long long breaks = blocks - summary->mapped;
+	printf("\nFragmentation:\n");
+	printf("  %-22s %12llu\n", "data blocks", summary->data_blocks);
+	printf("  %-22s %12llu\n", "indirect blocks", summary->meta_blocks);
+	printf("  %-22s %12llu\n", "runs", summary->runs);
+	printf("  %-22s %12llu (%.1f%% of %llu)\n", "fragmented inodes", summary->fragmented,
+		   summary->mapped ? 100.0 * summary->fragmented / summary->mapped : 0.0, summary->mapped);
+	printf("  %-22s %11.2f%%\n", "score",
+		   breaks ? 100.0 * (summary->runs - summary->mapped) / breaks : 0.0);
+}
 
-		if (check_inode(i, current_inode) &&
-			get_inode_type(current_inode->i_mode) == 'd') {
+/**
+ * Write the CSV dump: a header, then the shards' rows in inode order
+ * @return 0 on success; -errno if the file cannot be written
+ */
+int write_csv(char const *file_name) {
+	FILE *out = fopen(file_name, "w");
+	if (out == NULL) {
+		int err = errno;
+		perror("write_csv: fopen");
+		return -err;
+	}
+	fputs("inode,type,mode,size,links,data_blocks,indirect_blocks,runs,first_block\n", out);
+	for (unsigned int i = 0; i < num_shards; i++) {
+		fwrite(shards[i].csv, 1, shards[i].csv_len, out);
+	}
+	if (fclose(out) != 0) {
+		int err = errno;
+		perror("write_csv: fclose");
+		return -err;
+	}
+	return 0;
+}
 
-			for (int j = 0; current_inode->i_block[j] != 0; j++) {
-				printf("   DIR BLOCK NUM: %d (for inode %d)\n",
-					   current_inode->i_block[j], i + 1);
+// ---------- MAIN ----------
 
-				struct ext2_dir_entry *dir_base =
-					(struct ext2_dir_entry *)(disk + 1024 * current_inode->i_block[j]);
+int main(int argc, char **argv) {
+	char const *csv_name = NULL;
+	int num_threads = 0;
+	int opt;
+	int bad = 0;
+	while ((opt = getopt(argc, argv, "sc:j:")) != -1) {
+		switch (opt) {
+		case 's': want_summary = 1; break;
+		case 'c': csv_name = optarg; break;
+		case 'j': bad |= (num_threads = atoi(optarg)) <= 0; break;
+		default: bad = 1;
+		}
+	}
+	if (bad || optind != argc - 1) {
+		fprintf(stderr, "Usage: %s [-s] [-c csv file] [-j threads] <image file name>\n", argv[0]);
+		exit(1);
+	}
+	want_csv = csv_name != NULL;
+	want_listing = !want_summary && !want_csv;
+	if (num_threads == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		num_threads = cpus > 0 ? cpus : 1;
+	}
+	if (num_threads > READIMAGE_MAX_THREADS) {
+		num_threads = READIMAGE_MAX_THREADS;
+	}
 
-				unsigned short curr_len = 0;
-				while (curr_len < current_inode->i_size) {
-					struct ext2_dir_entry *dir =
-						(struct ext2_dir_entry *)((unsigned char *)dir_base + curr_len);
+	if (init_map(&disk, argv[optind], EXT2_MAP_AUTO | EXT2_MAP_READ_ONLY) != 0) {
+		fprintf(stderr, "main: init\n");
+		exit(1);
+	}
 
-					int inode = dir->inode;
-					int rec_len = dir->rec_len;
-					int name_len = dir->name_len;
-					char type = get_dir_type(dir->file_type);
-					if (type == -1) {
-						fprintf(stderr, "Invalid file type in block: %s\n", dir->name);
-						exit(-1);
-					}
+	struct ext2_super_block *super_block = get_super_block(disk);
 
-					char name[name_len + 1];
-					strncpy(name, dir->name, name_len);
-					name[name_len] = '\0';
+	printf("Inodes: %d\n", super_block->s_inodes_count);
+	printf("Blocks: %d\n", super_block->s_blocks_count);
 
-					printf("Inode: %d rec_len: %d name_len: %d type= %c "
-						   "name=%s \n",
-						   inode, rec_len, name_len, type, name);
+	if (want_summary) {
+		printf("Free inodes: %d\n", super_block->s_free_inodes_count);
+		printf("Free blocks: %d\n", super_block->s_free_blocks_count);
+		printf("Block groups: %d\n", num_groups(disk));
+		printf("Block size: %d\n", EXT2_BLOCK_SIZE);
+	}
+	for (unsigned int group = 0; want_listing && group < num_groups(disk); group++) {
+		struct ext2_group_desc *group_desc = get_group_desc(disk, group);
+
+		printf("Block group:\n");
+		printf("    block bitmap: %d\n", group_desc->bg_block_bitmap);
+		printf("    inode bitmap: %d\n", group_desc->bg_inode_bitmap);
+		printf("    inode table: %d\n", group_desc->bg_inode_table);
+		printf("    free blocks: %d\n", group_desc->bg_free_blocks_count);
+		printf("    free inodes: %d\n", group_desc->bg_free_inodes_count);
+		printf("    used_idrs: %d\n", group_desc->bg_used_dirs_count);
+
+		// pointer to the block bitmap
+		unsigned char *block_bitmap = (unsigned char *)group_block_bitmap(disk, group);
+
+		printf("Block bitmap:");
+		// one group prints s_blocks_count bits, as readimage always has; with
+		// more, each prints the blocks it has
+		print_bitmap(block_bitmap, num_groups(disk) == 1 ? super_block->s_blocks_count : group_num_blocks(disk, group));
+		printf("\n");
+
+		// pointer to the inode bitmap
+		unsigned char *inode_bitmap = (unsigned char *)group_inode_bitmap(disk, group);
+
+		printf("Inode bitmap: ");
+		print_bitmap(inode_bitmap, super_block->s_inodes_per_group);
+		printf("\n");
+	}
+	fflush(stdout);
+
+	// scan the inode table in shards
+	unsigned int inodes = super_block->s_inodes_count;
+	num_shards = (inodes + READIMAGE_SHARD_INODES - 1) / READIMAGE_SHARD_INODES;
+	shards = calloc(num_shards, sizeof(struct shard)); // FREE
+	if (shards == NULL) {
+		perror("main: calloc");
+		exit(1);
+	}
+	for (unsigned int i = 0; i < num_shards; i++) {
+		shards[i].first = i * READIMAGE_SHARD_INODES + 1;
+		shards[i].end = i + 1 < num_shards ? shards[i].first + READIMAGE_SHARD_INODES : inodes + 1;
+	}
+	run_workers(scan_worker, (unsigned int)num_threads < num_shards ? num_threads : (int)num_shards);
+
+	int result = 0;
+	struct summary total = {0};
+	for (unsigned int i = 0; i < num_shards; i++) {
+		if (shards[i].failed) {
+			fprintf(stderr, "main: out of memory scanning inodes %u to %u\n", shards[i].first,
+					shards[i].end - 1);
+			result = 1;
+		}
+		merge_summary(&total, &shards[i].summary);
+	}
 
-					curr_len += dir->rec_len;
-				}
-			}
+	if (want_listing) {
+		printf("\nInodes:\n");
+		for (unsigned int i = 0; i < num_shards; i++) {
+			fwrite(shards[i].inodes_text, 1, shards[i].inodes_len, stdout);
 		}
+		printf("\nDirectory Blocks:\n");
+		for (unsigned int i = 0; i < num_shards; i++) {
+			fwrite(shards[i].dirs_text, 1, shards[i].dirs_len, stdout);
+		}
+	}
+	if (want_summary) {
+		print_summary(&total);
+	}
+	if (want_csv && write_csv(csv_name) != 0) {
+		result = 1;
 	}
 
-	return 0;
+	for (unsigned int i = 0; i < num_shards; i++) {
+		free(shards[i].inodes_text);
+		free(shards[i].dirs_text);
+		free(shards[i].csv);
+	}
+	free(shards);
+	fini(&disk);
+	return result;
 }
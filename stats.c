@@ -0,0 +1,146 @@
+/*
+ * Instrumentation counters and their report; see stats.h.
+ *
+ * The report adds the process's page faults since stats_enable(), from
+ * getrusage(): nearly all of them are faults on the image mapping, the
+ * rest of what the tools touch being small.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "stats.h"
+
+int stats_on;
+unsigned long long stats_counters[STAT_NUM_COUNTERS];
+unsigned long long stats_phase_ns[STAT_NUM_PHASES];
+
+// state when stats were turned on, for the faults and the total
+static struct rusage start_usage;
+static unsigned long long start_ns;
+
+#ifdef EXT2_STATS_ON
+static char const *const counter_names[STAT_NUM_COUNTERS] = {
+	"bitmap_words_scanned", "dir_records_visited", "dir_blocks_read", "dcache_hits",
+	"dcache_misses",		"inodes_allocated",	   "blocks_allocated", "blocks_freed",
+	"blocks_logged",		"commits",			   "flushes",
+};
+
+static char const *const phase_names[STAT_NUM_PHASES] = {
+	"open",		   "commit",	  "flush",		 "cp_copy",	   "import_scan",
+	"import_plan", "import_copy", "check_sweep", "check_scan", "check_merge",
+};
+#endif
+
+// ---------- Function Declarations ----------
+unsigned long long stats_now(void);
+void stats_enable(int on);
+void stats_reset(void);
+int stats_print(FILE *out, int format);
+int stats_take_option(int *argc, char const *argv[]);
+
+
+
+// ---------- Function Implementations ----------
+
+/**
+ * Monotonic time in nanoseconds
+ */
+unsigned long long stats_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Start or stop counting; starting also resets everything
+ * @param on 1 to count, 0 to stop
+ */
+void stats_enable(int on) {
+	if (on) {
+		stats_reset();
+	}
+	stats_on = on;
+}
+
+/**
+ * Zero the counters and timers and start the run's clock over
+ */
+void stats_reset(void) {
+	memset(stats_counters, 0, sizeof(stats_counters));
+	memset(stats_phase_ns, 0, sizeof(stats_phase_ns));
+	getrusage(RUSAGE_SELF, &start_usage);
+	start_ns = stats_now();
+}
+
+/**
+ * Print what was counted since stats_enable()
+ * @param  out    where to print
+ * @param  format STATS_TEXT for a summary, STATS_JSON for one JSON object
+ * @return        0 on success; -ENOTSUP if the instrumentation is compiled out
+ */
+int stats_print(FILE *out, int format) {
+#ifndef EXT2_STATS_ON
+	fprintf(out, "stats: not compiled in, rebuild with make STATS=1\n");
+	return -ENOTSUP;
+#else
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	long minor = usage.ru_minflt - start_usage.ru_minflt;
+	long major = usage.ru_majflt - start_usage.ru_majflt;
+	double total = (stats_now() - start_ns) / 1e9;
+
+	if (format == STATS_JSON) {
+		fprintf(out, "{\"counters\": {");
+		for (int i = 0; i < STAT_NUM_COUNTERS; i++) {
+			fprintf(out, "%s\"%s\": %llu", i ? ", " : "", counter_names[i], stats_counters[i]);
+		}
+		fprintf(out, "}, \"page_faults\": {\"minor\": %ld, \"major\": %ld}, \"phases_s\": {", minor,
+				major);
+		for (int i = 0; i < STAT_NUM_PHASES; i++) {
+			fprintf(out, "%s\"%s\": %.6f", i ? ", " : "", phase_names[i], stats_phase_ns[i] / 1e9);
+		}
+		fprintf(out, "}, \"total_s\": %.6f}\n", total);
+		return 0;
+	}
+
+	fprintf(out, "stats:\n");
+	for (int i = 0; i < STAT_NUM_COUNTERS; i++) {
+		fprintf(out, "  %-22s %12llu\n", counter_names[i], stats_counters[i]);
+	}
+	fprintf(out, "  %-22s %12ld minor, %ld major\n", "page_faults", minor, major);
+	fprintf(out, "wall time:\n");
+	for (int i = 0; i < STAT_NUM_PHASES; i++) {
+		if (stats_phase_ns[i] > 0) {
+			fprintf(out, "  %-22s %12.6f s\n", phase_names[i], stats_phase_ns[i] / 1e9);
+		}
+	}
+	fprintf(out, "  %-22s %12.6f s\n", "total", total);
+	return 0;
+#endif
+}
+
+/**
+ * Take a leading --stats or --stats=json off a tool's arguments, and turn
+ * counting on if it was there
+ * @param  argc the argument count, decremented if the option is taken
+ * @param  argv the arguments, shifted down over the option
+ * @return      STATS_OFF, STATS_TEXT or STATS_JSON
+ */
+int stats_take_option(int *argc, char const *argv[]) {
+	int format = STATS_OFF;
+	if (*argc > 1 && strcmp(argv[1], "--stats") == 0) {
+		format = STATS_TEXT;
+	} else if (*argc > 1 && strcmp(argv[1], "--stats=json") == 0) {
+		format = STATS_JSON;
+	} else {
+		return STATS_OFF;
+	}
+	memmove(&argv[1], &argv[2], sizeof(char *) * (*argc - 1)); // argv[argc] is NULL
+	(*argc)--;
+	stats_enable(1);
+	return format;
+}
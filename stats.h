@@ -0,0 +1,82 @@
+#ifndef EXT2_STATS
+#define EXT2_STATS
+
+#include <stdio.h>
+
+/*
+ * Optional instrumentation of the hot paths: event counters and per-phase
+ * wall time, printed by the tools' --stats option as a summary or as JSON.
+ *
+ * It is compiled in only with -DEXT2_STATS_ON (make STATS=1); otherwise
+ * STAT_ADD() and the phase timers expand to nothing and do not evaluate their
+ * arguments. Compiled in, everything is gated on one flag, off until
+ * stats_enable(), so a run without --stats pays a predicted branch per
+ * event. Counters are updated atomically and may be bumped from any thread.
+ */
+
+enum stat_counter {
+	STAT_BITMAP_WORDS,	 /* 64-bit bitmap words scanned for a free or used bit */
+	STAT_DIR_RECORDS,	 /* directory records stepped over looking for a name or room */
+	STAT_DIR_BLOCKS,	 /* directory blocks read */
+	STAT_DCACHE_HITS,	 /* find_idx() answered from the dentry cache */
+	STAT_DCACHE_MISSES,	 /* ... and not */
+	STAT_INODES_ALLOCATED,
+	STAT_BLOCKS_ALLOCATED,
+	STAT_BLOCKS_FREED,
+	STAT_BLOCKS_LOGGED, /* metadata blocks written to the journal */
+	STAT_COMMITS,
+	STAT_FLUSHES,
+	STAT_NUM_COUNTERS
+};
+
+enum stat_phase {
+	PHASE_OPEN,			/* mapping an image and recovering its journal */
+	PHASE_COMMIT,		/* journal_commit() */
+	PHASE_FLUSH,		/* journal_flush() */
+	PHASE_CP_COPY,		/* ext2_cp's copy of the contents */
+	PHASE_IMPORT_SCAN,	/* ext2_cp -r, the three phases */
+	PHASE_IMPORT_PLAN,
+	PHASE_IMPORT_COPY,
+	PHASE_CHECK_SWEEP,	/* ext2_checker, the three phases */
+	PHASE_CHECK_SCAN,
+	PHASE_CHECK_MERGE,
+	STAT_NUM_PHASES
+};
+
+// how --stats reports
+#define STATS_OFF  0
+#define STATS_TEXT 1
+#define STATS_JSON 2
+
+#ifdef EXT2_STATS_ON
+extern int stats_on;
+extern unsigned long long stats_counters[STAT_NUM_COUNTERS];
+extern unsigned long long stats_phase_ns[STAT_NUM_PHASES];
+unsigned long long stats_now(void);
+
+#define STAT_ADD(counter, n)                                                                       \
+	do {                                                                                           \
+		if (__builtin_expect(stats_on, 0)) {                                                       \
+			__atomic_fetch_add(&stats_counters[counter], (n), __ATOMIC_RELAXED);                   \
+		}                                                                                          \
+	} while (0)
+#define STAT_PHASE_BEGIN(phase) unsigned long long stat_start_##phase = stats_on ? stats_now() : 0
+#define STAT_PHASE_END(phase)                                                                      \
+	do {                                                                                           \
+		if (__builtin_expect(stats_on, 0)) {                                                       \
+			__atomic_fetch_add(&stats_phase_ns[phase], stats_now() - stat_start_##phase,            \
+							   __ATOMIC_RELAXED);                                                  \
+		}                                                                                          \
+	} while (0)
+#else
+#define STAT_ADD(counter, n) ((void)0)
+#define STAT_PHASE_BEGIN(phase) ((void)0)
+#define STAT_PHASE_END(phase) ((void)0)
+#endif
+
+void stats_enable(int on);
+void stats_reset(void);
+int stats_print(FILE *out, int format);
+int stats_take_option(int *argc, char const *argv[]);
+
+#endif // EXT2_STATS
@@ -0,0 +1,32 @@
+#!/bin/sh
+# Run each tests/*.batch through ext2_batch on a scratch copy of its image and
+# compare what it prints with tests/<name>.expected. A script's header names
+# the image, from Images/, and the flags ext2_batch gets:
+#
+#     # image: emptydisk.img
+#     # flags: -f close
+#
+# The files in tests/data are copied next to the image, so scripts name them
+# bare. Exits non-zero if any script fails a line or prints something else.
+
+cd "$(dirname "$0")" || exit 1
+top=$(cd .. && pwd)
+failed=0
+for script in *.batch; do
+	name=${script%.batch}
+	image=$(sed -n 's/^# image: *//p' "$script")
+	flags=$(sed -n 's/^# flags: *//p' "$script")
+	dir=$(mktemp -d)
+	cp "$top/Images/$image" data/* "$dir"/
+	if (cd "$dir" && "$top/ext2_batch" $flags "$top/tests/$script" >out 2>err) &&
+		cmp -s "$dir/out" "$name.expected"; then
+		echo "PASS $name"
+	else
+		echo "FAIL $name"
+		diff "$name.expected" "$dir/out"
+		cat "$dir/err"
+		failed=1
+	fi
+	rm -rf "$dir"
+done
+exit $failed
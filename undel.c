@@ -0,0 +1,466 @@
+/*
+ * Undelete index used by ext2_restore() and its bulk forms. See undel.h.
+ *
+ * A removed entry is one still readable past the used part of a live
+ * entry's record: rm folds an entry into the record before it, so its bytes
+ * stay where they were until something is written over them. Each
+ * directory's removed entries are hashed by name; the blocks they were found
+ * in are remembered by number, so a block the directory has since swapped is
+ * scanned again. In an indexed directory, block 0 and the index nodes are
+ * never scanned: the index sits in their gaps.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ext2.h"
+#include "undel.h"
+#include "utils.h"
+
+// one removed entry, chained by name hash
+struct undel_ghost {
+	struct undel_entry at;
+	unsigned int hash;
+	int next;
+};
+
+// one directory's removed entries
+struct undel_dir {
+	struct undel_dir *next;
+	unsigned int dir_idx;
+	unsigned int num_blocks;
+	unsigned int *scanned; /* per logical block, its number when scanned; 0 if not yet */
+	unsigned int num_ghosts;
+	unsigned int max_ghosts;
+	struct undel_ghost *ghosts;
+	unsigned int num_buckets;
+	int *buckets;
+};
+
+#define UNDEL_DIRS		 256
+#define UNDEL_MIN_BUCKETS 64
+#define UNDEL_MAX_GHOSTS (1 << 20)
+
+static struct undel_dir *dirs[UNDEL_DIRS];
+static unsigned int total_ghosts;
+// undel_note() is called by rm in operations running side by side; the rest
+// only when one runs alone
+static pthread_mutex_t note_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// ---------- Function Declarations ----------
+int undel_lookup(unsigned char *disk, unsigned int dir_idx, char const *name, int name_len,
+				 unsigned int first, unsigned int end, struct undel_entry *found);
+int undel_list(unsigned char *disk, unsigned int dir_idx, struct undel_entry **entries);
+struct ext2_dir_entry *undel_locate(unsigned char *disk, unsigned int dir_idx,
+									struct undel_entry const *removed, struct ext2_dir_entry **head);
+void undel_note(unsigned char *disk, unsigned int dir_idx, unsigned int lblk,
+				struct ext2_dir_entry *entry);
+void undel_forget_dir(unsigned int dir_idx);
+void undel_clear(void);
+
+
+
+// ---------- Helper Functions ----------
+
+/**
+ * FNV-1a hash of a name
+ */
+static unsigned int undel_hash(char const *name, int name_len) {
+	unsigned int hash = 2166136261u;
+	for (int i = 0; i < name_len; i++) {
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/**
+ * Find the link pointing at a directory's record, or at the NULL ending its chain
+ * @return the link
+ */
+static struct undel_dir **undel_link(unsigned int dir_idx) {
+	struct undel_dir **link = &dirs[dir_idx % UNDEL_DIRS];
+	while (*link != NULL && (*link)->dir_idx != dir_idx) {
+		link = &(*link)->next;
+	}
+	return link;
+}
+
+/**
+ * Free a directory's record
+ */
+static void free_dir(struct undel_dir *dir) {
+	total_ghosts -= dir->num_ghosts;
+	free(dir->scanned);
+	free(dir->ghosts);
+	free(dir->buckets);
+	free(dir);
+}
+
+/**
+ * A directory's record, made empty if it has none yet; the whole index is
+ * dropped first once it holds UNDEL_MAX_GHOSTS entries
+ * @return the record; NULL if out of memory
+ */
+static struct undel_dir *get_dir(unsigned int dir_idx) {
+	struct undel_dir **link = undel_link(dir_idx);
+	if (*link != NULL) {
+		return *link;
+	}
+	if (total_ghosts >= UNDEL_MAX_GHOSTS) {
+		undel_clear();
+		link = undel_link(dir_idx);
+	}
+	struct undel_dir *dir = calloc(1, sizeof(struct undel_dir));
+	if (dir == NULL) {
+		return NULL;
+	}
+	dir->dir_idx = dir_idx;
+	*link = dir;
+	return dir;
+}
+
+/**
+ * Chain every entry of a directory into a bucket array of num_buckets
+ * @return 0 on success, -ENOMEM
+ */
+static int rehash(struct undel_dir *dir, unsigned int num_buckets) {
+	int *buckets = malloc(sizeof(int) * num_buckets);
+	if (buckets == NULL) {
+		return -ENOMEM;
+	}
+	memset(buckets, 0xff, sizeof(int) * num_buckets); // all -1
+	for (unsigned int i = 0; i < dir->num_ghosts; i++) {
+		struct undel_ghost *ghost = &dir->ghosts[i];
+		ghost->next = buckets[ghost->hash & (num_buckets - 1)];
+		buckets[ghost->hash & (num_buckets - 1)] = i;
+	}
+	free(dir->buckets);
+	dir->buckets = buckets;
+	dir->num_buckets = num_buckets;
+	return 0;
+}
+
+/**
+ * Record a removed entry, or update the one recorded at the same place
+ * @return 0 on success, -ENOMEM
+ */
+static int add_ghost(struct undel_dir *dir, struct undel_entry const *at, char const *name, int name_len) {
+	unsigned int hash = undel_hash(name, name_len);
+	if (dir->num_buckets > 0) {
+		for (int i = dir->buckets[hash & (dir->num_buckets - 1)]; i >= 0; i = dir->ghosts[i].next) {
+			struct undel_ghost *ghost = &dir->ghosts[i];
+			if (ghost->at.lblk == at->lblk && ghost->at.offset == at->offset) {
+				ghost->at = *at;
+				ghost->hash = hash;
+				return 0;
+			}
+		}
+	}
+	if (dir->num_ghosts == dir->max_ghosts) {
+		unsigned int new_max = dir->max_ghosts ? dir->max_ghosts * 2 : 16;
+		struct undel_ghost *grown = realloc(dir->ghosts, sizeof(struct undel_ghost) * new_max);
+		if (grown == NULL) {
+			return -ENOMEM;
+		}
+		dir->ghosts = grown;
+		dir->max_ghosts = new_max;
+	}
+	if (dir->num_ghosts >= dir->num_buckets * 2) {
+		int result = rehash(dir, dir->num_buckets ? dir->num_buckets * 2 : UNDEL_MIN_BUCKETS);
+		if (result < 0) {
+			return result;
+		}
+	}
+	struct undel_ghost *ghost = &dir->ghosts[dir->num_ghosts];
+	ghost->at = *at;
+	ghost->hash = hash;
+	ghost->next = dir->buckets[hash & (dir->num_buckets - 1)];
+	dir->buckets[hash & (dir->num_buckets - 1)] = dir->num_ghosts++;
+	total_ghosts++;
+	return 0;
+}
+
+/**
+ * Whether a directory block holds an index rather than entries
+ */
+static int is_index_block(struct ext2_inode *dir_inode, unsigned int lblk, unsigned char *block) {
+	struct ext2_dir_entry *first = (struct ext2_dir_entry *)block;
+	if (!(dir_inode->i_flags & EXT2_INDEX_FL)) {
+		return 0;
+	}
+	return lblk == 0 || (first->inode == 0 && first->name_len == 0 && first->rec_len == EXT2_BLOCK_SIZE);
+}
+
+/**
+ * Record the removed entries of one directory block, unless it was already
+ * scanned as it stands
+ * @return 0 on success, -ENOMEM
+ */
+static int scan_block(unsigned char *disk, struct undel_dir *dir, unsigned int lblk) {
+	struct ext2_inode *dir_inode = get_inode(disk, dir->dir_idx);
+	unsigned int inodes_count = get_super_block(disk)->s_inodes_count;
+	unsigned int block_num = inode_block(disk, dir_inode, lblk);
+	if (lblk < dir->num_blocks && dir->scanned[lblk] == block_num) {
+		return 0;
+	}
+	unsigned char *block = dir_block(disk, dir_inode, lblk);
+	if (block == NULL) {
+		return 0;
+	}
+	if (lblk >= dir->num_blocks) {
+		unsigned int new_num = dir->num_blocks ? dir->num_blocks : 8;
+		while (new_num <= lblk) {
+			new_num *= 2;
+		}
+		unsigned int *grown = realloc(dir->scanned, sizeof(unsigned int) * new_num);
+		if (grown == NULL) {
+			return -ENOMEM;
+		}
+		memset(grown + dir->num_blocks, 0, sizeof(unsigned int) * (new_num - dir->num_blocks));
+		dir->scanned = grown;
+		dir->num_blocks = new_num;
+	}
+
+	if (!is_index_block(dir_inode, lblk, block)) {
+		unsigned int offset = 0;
+		while (offset + sizeof(struct ext2_dir_entry) <= EXT2_BLOCK_SIZE) {
+			struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(block + offset);
+			if (entry->rec_len < sizeof(struct ext2_dir_entry) || entry->rec_len % 4 != 0 ||
+				offset + entry->rec_len > EXT2_BLOCK_SIZE) { // corrupt block
+				break;
+			}
+			unsigned int end = offset + entry->rec_len;
+			unsigned int at = offset + dir_entry_size(entry->name_len);
+			while (at + sizeof(struct ext2_dir_entry) <= end) {
+				struct ext2_dir_entry *removed = (struct ext2_dir_entry *)(block + at);
+				if (at + sizeof(struct ext2_dir_entry) + removed->name_len > end) {
+					break;
+				}
+				if (removed->inode != 0 && removed->inode <= inodes_count && removed->name_len > 0) {
+					struct undel_entry found = {lblk, block_num, at, removed->inode};
+					int result = add_ghost(dir, &found, removed->name, removed->name_len);
+					if (result < 0) {
+						return result;
+					}
+				}
+				at += dir_entry_size(removed->name_len);
+			}
+			offset = end;
+		}
+	}
+	dir->scanned[lblk] = block_num;
+	return 0;
+}
+
+/**
+ * Order removed entries by where they are in the directory
+ */
+static int compare_entries(void const *a, void const *b) {
+	struct undel_entry const *x = a;
+	struct undel_entry const *y = b;
+	if (x->lblk != y->lblk) {
+		return x->lblk < y->lblk ? -1 : 1;
+	}
+	return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+
+
+// ---------- Function Implementations ----------
+
+/**
+ * Find a removed entry by name among a directory's blocks first to end - 1,
+ * scanning those not scanned yet. Of several with the name, the first in the
+ * directory whose inode is free is picked, or else the first.
+ * @param  disk     the disk
+ * @param  dir_idx  the dir's inode index
+ * @param  name     the name (not necessarily null-terminated)
+ * @param  name_len length of the name
+ * @param  first    first logical block to look in
+ * @param  end      one past the last
+ * @param  found    set to the entry
+ * @return          1 if found, 0 if not; -ENOMEM
+ */
+int undel_lookup(unsigned char *disk, unsigned int dir_idx, char const *name, int name_len,
+				 unsigned int first, unsigned int end, struct undel_entry *found) {
+	struct undel_dir *dir = get_dir(dir_idx);
+	if (dir == NULL) {
+		return -ENOMEM;
+	}
+	for (unsigned int lblk = first; lblk < end; lblk++) {
+		int result = scan_block(disk, dir, lblk);
+		if (result < 0) {
+			return result;
+		}
+	}
+	if (dir->num_buckets == 0) {
+		return 0;
+	}
+
+	unsigned int hash = undel_hash(name, name_len);
+	struct undel_ghost *best = NULL;
+	int best_free = 0;
+	struct ext2_dir_entry *head;
+	for (int i = dir->buckets[hash & (dir->num_buckets - 1)]; i >= 0; i = dir->ghosts[i].next) {
+		struct undel_ghost *ghost = &dir->ghosts[i];
+		if (ghost->hash != hash) {
+			continue;
+		}
+		struct ext2_dir_entry *entry = undel_locate(disk, dir_idx, &ghost->at, &head);
+		if (entry == NULL || entry->name_len != name_len || memcmp(entry->name, name, name_len) != 0) {
+			continue;
+		}
+		int is_free = !check_inode_bit(disk, ghost->at.inode);
+		if (best == NULL || is_free > best_free ||
+			(is_free == best_free && compare_entries(&ghost->at, &best->at) < 0)) {
+			best = ghost;
+			best_free = is_free;
+		}
+	}
+	if (best == NULL) {
+		return 0;
+	}
+	*found = best->at;
+	return 1;
+}
+
+/**
+ * Every removed entry of a directory still intact, scanning the blocks not
+ * scanned yet
+ * @param  disk    the disk
+ * @param  dir_idx the dir's inode index
+ * @param  entries set to a malloc'ed array of them, in directory order
+ * @return         number of entries; -ENOMEM
+ */
+int undel_list(unsigned char *disk, unsigned int dir_idx, struct undel_entry **entries) {
+	struct undel_dir *dir = get_dir(dir_idx);
+	if (dir == NULL) {
+		return -ENOMEM;
+	}
+	unsigned int num_blocks = dir_num_blocks(get_inode(disk, dir_idx));
+	for (unsigned int lblk = 0; lblk < num_blocks; lblk++) {
+		int result = scan_block(disk, dir, lblk);
+		if (result < 0) {
+			return result;
+		}
+	}
+
+	*entries = malloc(sizeof(struct undel_entry) * (dir->num_ghosts + 1));
+	if (*entries == NULL) {
+		return -ENOMEM;
+	}
+	int num = 0;
+	struct ext2_dir_entry *head;
+	for (unsigned int i = 0; i < dir->num_ghosts; i++) {
+		if (undel_locate(disk, dir_idx, &dir->ghosts[i].at, &head) != NULL) {
+			(*entries)[num++] = dir->ghosts[i].at;
+		}
+	}
+	qsort(*entries, num, sizeof(struct undel_entry), compare_entries);
+	return num;
+}
+
+/**
+ * Check a removed entry is still where it was found, in the gap of a live
+ * entry's record
+ * @param  disk    the disk
+ * @param  dir_idx the dir's inode index
+ * @param  removed the entry
+ * @param  head    set to the record whose gap holds it
+ * @return         the entry in place on the disk; NULL if it is gone
+ */
+struct ext2_dir_entry *undel_locate(unsigned char *disk, unsigned int dir_idx,
+									struct undel_entry const *removed, struct ext2_dir_entry **head) {
+	struct ext2_inode *dir_inode = get_inode(disk, dir_idx);
+	if (removed->lblk >= dir_num_blocks(dir_inode) ||
+		inode_block(disk, dir_inode, removed->lblk) != removed->pblk) {
+		return NULL;
+	}
+	unsigned char *block = dir_block(disk, dir_inode, removed->lblk);
+	if (block == NULL || is_index_block(dir_inode, removed->lblk, block)) {
+		return NULL;
+	}
+
+	unsigned int offset = 0;
+	while (offset + sizeof(struct ext2_dir_entry) <= EXT2_BLOCK_SIZE) {
+		struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(block + offset);
+		if (entry->rec_len < sizeof(struct ext2_dir_entry) || offset + entry->rec_len > EXT2_BLOCK_SIZE) {
+			return NULL;
+		}
+		unsigned int end = offset + entry->rec_len;
+		if (removed->offset < end) {
+			struct ext2_dir_entry *found = (struct ext2_dir_entry *)(block + removed->offset);
+			if (removed->offset < offset + dir_entry_size(entry->name_len) ||
+				removed->offset + sizeof(struct ext2_dir_entry) > end ||
+				removed->offset + sizeof(struct ext2_dir_entry) + found->name_len > end ||
+				found->inode != removed->inode || found->name_len == 0) {
+				return NULL;
+			}
+			*head = entry;
+			return found;
+		}
+		offset = end;
+	}
+	return NULL;
+}
+
+/**
+ * Record an entry just folded into the record before it, if its block has
+ * been scanned; otherwise the scan will find it
+ * @param disk    the disk
+ * @param dir_idx the dir's inode index
+ * @param lblk    logical block of the directory holding it
+ * @param entry   the entry, in place on the disk
+ */
+void undel_note(unsigned char *disk, unsigned int dir_idx, unsigned int lblk,
+				struct ext2_dir_entry *entry) {
+	pthread_mutex_lock(&note_lock);
+	struct undel_dir *dir = *undel_link(dir_idx);
+	if (dir == NULL || lblk >= dir->num_blocks) {
+		goto out;
+	}
+	unsigned int block_num = inode_block(disk, get_inode(disk, dir_idx), lblk);
+	if (block_num == 0 || dir->scanned[lblk] != block_num) {
+		goto out;
+	}
+	unsigned int offset = (unsigned char *)entry - (disk + (size_t)EXT2_BLOCK_SIZE * block_num);
+	struct undel_entry at = {lblk, block_num, offset, entry->inode};
+	if (add_ghost(dir, &at, entry->name, entry->name_len) < 0) {
+		dir->scanned[lblk] = 0; // scan it again instead
+	}
+
+out:
+	pthread_mutex_unlock(&note_lock);
+}
+
+/**
+ * Drop a directory's removed entries
+ * @param dir_idx the dir's inode index
+ */
+void undel_forget_dir(unsigned int dir_idx) {
+	struct undel_dir **link = undel_link(dir_idx);
+	struct undel_dir *dir = *link;
+	if (dir != NULL) {
+		*link = dir->next;
+		free_dir(dir);
+	}
+}
+
+/**
+ * Free the whole index
+ */
+void undel_clear(void) {
+	for (unsigned int i = 0; i < UNDEL_DIRS; i++) {
+		struct undel_dir *dir = dirs[i];
+		while (dir != NULL) {
+			struct undel_dir *next = dir->next;
+			free_dir(dir);
+			dir = next;
+		}
+		dirs[i] = NULL;
+	}
+	total_ghosts = 0;
+}
@@ -0,0 +1,33 @@
+#ifndef EXT2_UNDEL
+#define EXT2_UNDEL
+
+/*
+ * Undelete index: for each directory restored from, the removed entries
+ * still readable in the gaps its live entries' rec_len covers, by name. A
+ * directory block is scanned for them once, the first time a restore needs
+ * it, and an entry removed from a scanned block is added as it goes. An
+ * entry found is only a candidate: undel_locate() checks it is still intact
+ * in a gap before it is brought back, so writes into the gaps need not keep
+ * the index up.
+ */
+
+struct ext2_dir_entry;
+
+struct undel_entry {
+	unsigned int lblk;	 /* logical block of the directory holding it */
+	unsigned int pblk;	 /* that block's number when it was scanned */
+	unsigned int offset; /* byte offset of the removed entry in the block */
+	unsigned int inode;	 /* the inode it pointed at */
+};
+
+int undel_lookup(unsigned char *disk, unsigned int dir_idx, char const *name, int name_len,
+				 unsigned int first, unsigned int end, struct undel_entry *found);
+int undel_list(unsigned char *disk, unsigned int dir_idx, struct undel_entry **entries);
+struct ext2_dir_entry *undel_locate(unsigned char *disk, unsigned int dir_idx,
+									struct undel_entry const *removed, struct ext2_dir_entry **head);
+void undel_note(unsigned char *disk, unsigned int dir_idx, unsigned int lblk,
+				struct ext2_dir_entry *entry);
+void undel_forget_dir(unsigned int dir_idx);
+void undel_clear(void);
+
+#endif // EXT2_UNDEL
@@ -2,32 +2,191 @@
  * Helper functions for the rest of the ext2_functions.
  */
 
+#define _GNU_SOURCE // copy_file_range
+
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "bitmap.h"
+#include "bmap.h"
+#include "dcache.h"
+#include "dirtylog.h"
+#include "dslot.h"
 #include "ext2.h"
+#include "htree.h"
+#include "overlay.h"
+#include "stats.h"
+#include "undel.h"
 #include "utils.h"
 
+// ---------- Image State ----------
+// init()/fini() map into default_image; library callers switch between their
+// own handles with image_use()
+static struct ext2_image default_image = {
+	.map_fd = -1,
+	.block_size = EXT2_MIN_BLOCK_SIZE,
+	.inode_size = EXT2_GOOD_OLD_INODE_SIZE,
+	.first_ino = EXT2_GOOD_OLD_FIRST_INO,
+	.journal_fd = -1,
+	.dirty_fd = -1,
+	.base_fd = -1,
+};
+struct ext2_image *ext2_cur = &default_image;
+// image the dentry cache and the allocation hints currently describe
+static struct ext2_image *cache_owner;
+
+// ---------- Shared Operations ----------
+// see begin_shared_op(). Groups, directories and inodes are locked by stripe,
+// their number modulo the table size; locks are taken in the order
+// directories (by stripe), inode, window_lock, groups (by stripe), and only
+// in a shared operation.
+#define NUM_GROUP_LOCKS 256
+#define NUM_DIR_LOCKS 256
+#define NUM_INODE_LOCKS 256
+static pthread_mutex_t group_locks[NUM_GROUP_LOCKS] = {[0 ... NUM_GROUP_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER};
+static pthread_rwlock_t dir_locks[NUM_DIR_LOCKS] = {[0 ... NUM_DIR_LOCKS - 1] = PTHREAD_RWLOCK_INITIALIZER};
+static pthread_mutex_t inode_locks[NUM_INODE_LOCKS] = {[0 ... NUM_INODE_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER};
+// the preallocation windows
+static pthread_mutex_t window_lock = PTHREAD_MUTEX_INITIALIZER;
+// the blocks freed since the last flush, taken last of all
+static pthread_mutex_t freed_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// the operations in flight
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t ended; /* signalled when seq moves on, and when newcomers may join */
+	int handles;		  /* operations between begin_shared_op() and end_shared_op() */
+	int closing;		  /* those that changed something and are waiting; no more join */
+	int writers;		  /* of those ended, the ones that changed something */
+	int failed;			  /* one of them failed */
+	unsigned int seq;	  /* transactions ended */
+	int result;			  /* how the last one ended: 0, or its errno */
+} txn = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+// what the calling thread's shared operation holds
+#define MAX_HELD_DIRS 4
+static __thread struct {
+	int shared;			/* inside begin_shared_op() */
+	int needs_commit;	/* waits for the commit even if it changed nothing */
+	int num_dirs;
+	unsigned int dirs[MAX_HELD_DIRS]; /* stripes */
+	int inode;			/* stripe + 1; 0 for none */
+} held;
+
 // ---------- Function Declarations ----------
+int image_open(struct ext2_image *image, char const *file_name, int mode);
+void image_close(struct ext2_image *image);
+void image_use(struct ext2_image *image);
+int end_op(int result);
+void begin_shared_op(void);
+int end_shared_op(int result);
+void lock_dir(unsigned int dir_idx, int write);
+void unlock_dir(unsigned int dir_idx);
+void lock_inode(unsigned int inode_idx);
+int disk_fd(void);
 int init(unsigned char **disk, char const *file_name);
+int init_map(unsigned char **disk, char const *file_name, int mode);
+void fini(unsigned char **disk);
+size_t disk_size(void);
+int map_willneed(unsigned char *disk, size_t offset, size_t len);
 int check_bitmap(unsigned int *bitmap, int index);
 void set_bitmap(unsigned int **bitmap, int index, int value);
-unsigned int new_inode(unsigned char **disk);
+int find_free_bit(unsigned int *bitmap, int start, int size);
+int find_used_bit(unsigned int *bitmap, int start, int size);
+void set_bitmap_range(unsigned int **bitmap, int start, int len, int value);
+struct ext2_super_block *get_super_block(unsigned char *disk);
+unsigned int num_groups(unsigned char *disk);
+struct ext2_group_desc *get_group_desc(unsigned char *disk, unsigned int group);
+unsigned int inode_group(unsigned char *disk, unsigned int inode_idx);
+unsigned int block_group(unsigned char *disk, unsigned int block_num);
+unsigned int group_first_block(unsigned char *disk, unsigned int group);
+int group_num_blocks(unsigned char *disk, unsigned int group);
+unsigned int *group_block_bitmap(unsigned char *disk, unsigned int group);
+unsigned int *group_inode_bitmap(unsigned char *disk, unsigned int group);
+struct ext2_inode *get_inode(unsigned char *disk, unsigned int inode_idx);
+int check_inode_bit(unsigned char *disk, unsigned int inode_idx);
+int check_block_bit(unsigned char *disk, unsigned int block_num);
+int mark_inode(unsigned char *disk, unsigned int inode_idx, int value);
+int mark_block(unsigned char *disk, unsigned int block_num, int value);
+int mark_block_range(unsigned char *disk, unsigned int start, unsigned int len, int value);
+int verify_counters(unsigned char *disk);
+unsigned int new_inode(unsigned char **disk, unsigned int parent_idx);
+unsigned int new_dir_inode(unsigned char **disk, unsigned int parent_idx);
 void init_inode(unsigned char **disk, unsigned int new_inode_idx);
-int new_block(unsigned char **disk);
-int update_dir_entry(unsigned char **disk, struct ext2_inode *parent_inode,
-					  unsigned short current_idx, char *name, unsigned char type);
+int new_block(unsigned char **disk, unsigned int goal);
+unsigned int inode_goal_block(unsigned char *disk, unsigned int inode_idx);
+int alloc_blocks(unsigned char **disk, int count, int goal, int *out);
+int reserve_blocks(unsigned char **disk, int count, int goal, int *out);
+void unreserve_blocks(unsigned char *disk, int const *blocks, int count);
+void claim_blocks(unsigned char *disk, int const *blocks, int count);
+void commit_freed_blocks(struct ext2_image *image);
+void release_freed_blocks(struct ext2_image *image, int all);
+int release_dir_windows(unsigned char *disk, unsigned int dir_idx);
+int indirect_blocks_needed(int num_data);
+unsigned int inode_block(unsigned char *disk, struct ext2_inode *inode, unsigned int lblk);
+int map_inode_blocks(unsigned char *disk, struct ext2_inode *inode, int const *blocks, int num_data,
+					 int *data_blocks);
+int is_fast_symlink(struct ext2_inode *inode);
+int walk_inode_blocks(unsigned char *disk, struct ext2_inode *inode,
+					  int (*visit)(unsigned char *disk, unsigned int block_num, int is_meta, void *arg),
+					  void *arg);
+int mark_inode_blocks(unsigned char *disk, unsigned int inode_idx, int value);
+int is_dot_entry(struct ext2_dir_entry *entry);
+void dir_open(struct dir_cursor *cursor, unsigned int dir_idx);
+struct ext2_dir_entry *dir_next(unsigned char *disk, struct dir_cursor *cursor);
+int walk_dir(unsigned char *disk, unsigned int dir_idx, dir_visit_fn visit, void *arg);
+int walk_tree(unsigned char *disk, unsigned int root_idx, dir_visit_fn visit, void *arg);
+int dir_entry_size(int name_len);
+unsigned int dir_num_blocks(struct ext2_inode *dir_inode);
+unsigned char *dir_block(unsigned char *disk, struct ext2_inode *dir_inode, unsigned int lblk);
+int dir_block_find(unsigned char *block, char const *name, int name_len, struct dir_slot *slot);
+int dir_block_append(unsigned char *block, unsigned int inode_idx, char const *name, int name_len,
+					 unsigned char type);
+int dir_block_insert(unsigned char *block, unsigned int inode_idx, char const *name, int name_len,
+					 unsigned char type);
+int dir_block_gap(unsigned char *block);
+int dir_add_block(unsigned char **disk, unsigned int dir_idx, unsigned int *lblk);
+void dir_readahead(unsigned char *disk, unsigned int dir_idx);
+int dir_find_entry(unsigned char *disk, unsigned int dir_idx, char const *name, int name_len,
+				   struct dir_slot *slot);
+int copy_into_blocks(unsigned char *disk, int src_fd, int const *data_blocks, int num_data,
+					 unsigned long long size);
+int update_dir_entry(unsigned char **disk, unsigned int parent_idx,
+					  unsigned int current_idx, char *name, unsigned char type);
 int parse_path(char const *absolute_path, char **path, char **name);
-int find_idx(unsigned char *disk, char *name, struct ext2_dir_entry *dir);
+int find_idx(unsigned char *disk, unsigned int dir_idx, char const *name, int name_len);
+int resolve_path(unsigned char *disk, char const *path, int *parent_idx, int *child_idx);
+int resolve_path_follow(unsigned char *disk, char const *path, int *parent_idx, int *child_idx);
+int resolve_path_hold(unsigned char *disk, char const *path, int *parent_idx, int *child_idx);
+char *read_symlink(unsigned char *disk, struct ext2_inode *inode);
+int make_dir(unsigned char **disk, unsigned int parent_idx, char *name);
+int make_file(unsigned char **disk, unsigned int parent_idx, unsigned long long size, int **data_blocks);
+int ext2_mkdir(unsigned char **disk, char const *path);
+int ext2_cp(unsigned char **disk, char const *local_path, char const *path);
+int ext2_cp_prepare(unsigned char **disk, char const *local_path, char const *path, struct cp_plan *plan);
+int cp_plan_copy(struct cp_plan const *plan);
+int ext2_cp_finish(unsigned char **disk, char const *path, struct cp_plan *plan);
+void cp_plan_release(unsigned char *disk, struct cp_plan *plan);
+int ext2_ln(unsigned char **disk, char const *src_path, char const *dest_path, int soft_link);
+int ext2_rm(unsigned char **disk, char const *path);
+int ext2_rm_tree(unsigned char **disk, char const *path);
+int ext2_rm_paths(unsigned char **disk, char const *const *paths, int num_paths, int recursive);
+int ext2_restore(unsigned char **disk, char const *path);
+int ext2_restore_paths(unsigned char **disk, char const *const *paths, int num_paths);
+int ext2_restore_tree(unsigned char **disk, char const *path);
 
 
 
@@ -40,319 +199,4432 @@ int find_idx(unsigned char *disk, char *name, struct ext2_dir_entry *dir);
  * @return           0 on success; -1 on failure
  */
 int init(unsigned char **disk, char const *file_name) {
+	return init_map(disk, file_name, EXT2_MAP_AUTO);
+}
+
+
+/**
+ * Map the whole image, sized from its superblock, into the default image.
+ * EXT2_MAP_LAZY reserves no swap and turns off readahead, so only the pages an
+ * operation touches are faulted in; EXT2_MAP_AUTO picks it for large images.
+ * With EXT2_MAP_READ_ONLY or'ed in, other processes reading it may have it
+ * open at the same time.
+ * @param  disk      the global variable disk that stores the disk's info
+ * @param  file_name the image file name
+ * @param  mode      EXT2_MAP_AUTO, EXT2_MAP_FULL or EXT2_MAP_LAZY, or'ed with
+ *                   EXT2_MAP_READ_ONLY if the image is only to be read
+ * @return           0 on success; errno on failure
+ */
+int init_map(unsigned char **disk, char const *file_name, int mode) {
+	int result;
+	STAT_PHASE_BEGIN(PHASE_OPEN);
+	result = image_open(&default_image, file_name, mode);
+	STAT_PHASE_END(PHASE_OPEN);
+	if (result != 0) {
+		return result;
+	}
+	image_use(&default_image);
+	*disk = default_image.disk;
+	return 0;
+}
+
+
+/**
+ * Unmap the default image
+ * @param disk the disk
+ */
+void fini(unsigned char **disk) {
+	image_close(&default_image);
+	*disk = NULL;
+}
+
+
+/**
+ * Lock an image file against other processes, or change the lock held,
+ * waiting if it is in use
+ * @param  fd        the image file
+ * @param  file_name its name
+ * @param  how       LOCK_SH to only read it, LOCK_EX to change it
+ * @return           0 on success; -ENOLCK
+ */
+static int lock_image(int fd, char const *file_name, int how) {
+	int locked = flock(fd, how | LOCK_NB);
+	if (locked < 0 && errno == EWOULDBLOCK) {
+		fprintf(stderr, "init: %s is in use, waiting\n", file_name);
+		locked = flock(fd, how);
+	}
+	if (locked < 0) {
+		perror("init: flock");
+		return -ENOLCK;
+	}
+	return 0;
+}
+
+/**
+ * Map an image and cache its geometry and per-group metadata pointers. The
+ * file may be an overlay (see overlay.h), which is mapped from its base.
+ * @param  image     the handle to fill in
+ * @param  file_name the image file name
+ * @param  mode      EXT2_MAP_AUTO, EXT2_MAP_FULL or EXT2_MAP_LAZY, or'ed with
+ *                   EXT2_MAP_READ_ONLY if the image is only to be read
+ * @return           0 on success; errno on failure
+ */
+int image_open(struct ext2_image *image, char const *file_name, int mode) {
 	int fd = open(file_name, O_RDWR);
 	if (fd < 0) {
 		perror("init: open");
 		return -EINVAL;
 	}
-	*disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (*disk == MAP_FAILED) {
+	// one writer at a time: two would allocate from the same free bits, and
+	// the later flush would write over the earlier one's. Readers share the
+	// image with each other, and have it alone only to replay a journal.
+	int read_only = mode & EXT2_MAP_READ_ONLY;
+	mode &= ~EXT2_MAP_READ_ONLY;
+	int result;
+	if ((result = lock_image(fd, file_name, read_only ? LOCK_SH : LOCK_EX)) < 0 ||
+		(read_only && journal_exists(file_name) && (result = lock_image(fd, file_name, LOCK_EX)) < 0)) {
+		close(fd);
+		return result;
+	}
+	if ((result = journal_recover(fd, file_name)) < 0) {
+		fprintf(stderr, "init: cannot recover %s from its journal\n", file_name);
+		close(fd);
+		return result;
+	}
+	if (read_only && (result = lock_image(fd, file_name, LOCK_SH)) < 0) {
+		close(fd);
+		return result;
+	}
+
+	struct ext2_super_block super_block;
+	if (pread(fd, &super_block, sizeof(super_block), EXT2_SUPER_OFFSET) != sizeof(super_block)) {
+		fprintf(stderr, "init: %s is too small to hold a superblock\n", file_name);
+		close(fd);
+		return -EINVAL;
+	}
+	if (super_block.s_magic != EXT2_SUPER_MAGIC) {
+		fprintf(stderr, "init: %s is not an ext2 image\n", file_name);
+		close(fd);
+		return -EINVAL;
+	}
+
+	if (super_block.s_log_block_size > 6) { // beyond EXT2_MAX_BLOCK_SIZE
+		fprintf(stderr, "init: %s has an invalid block size\n", file_name);
+		close(fd);
+		return -EINVAL;
+	}
+	size_t block_size = (size_t)EXT2_MIN_BLOCK_SIZE << super_block.s_log_block_size;
+#ifdef EXT2_FIXED_BLOCK_SIZE
+	if (block_size != EXT2_FIXED_BLOCK_SIZE) {
+		fprintf(stderr, "init: %s uses %zu-byte blocks, this build only handles %d\n", file_name,
+				block_size, EXT2_FIXED_BLOCK_SIZE);
+		close(fd);
+		return -EINVAL;
+	}
+#endif
+	int inode_size = EXT2_GOOD_OLD_INODE_SIZE;
+	unsigned int first_ino = EXT2_GOOD_OLD_FIRST_INO;
+	if (super_block.s_rev_level != EXT2_GOOD_OLD_REV) {
+		inode_size = super_block.s_inode_size;
+		first_ino = super_block.s_first_ino;
+	}
+	if (inode_size < EXT2_GOOD_OLD_INODE_SIZE || inode_size > block_size) {
+		fprintf(stderr, "init: %s has an invalid inode size\n", file_name);
+		close(fd);
+		return -EINVAL;
+	}
+	if (super_block.s_blocks_per_group == 0 || super_block.s_inodes_per_group == 0) {
+		fprintf(stderr, "init: %s has an invalid group size\n", file_name);
+		close(fd);
+		return -EINVAL;
+	}
+	size_t len = block_size * super_block.s_blocks_count;
+
+	struct stat stats;
+	if (fstat(fd, &stats) < 0) {
+		perror("init: fstat");
+		close(fd);
+		return -1;
+	}
+	if ((size_t)stats.st_size < len) {
+		fprintf(stderr, "init: %s is truncated (%zu of %zu bytes)\n", file_name,
+				(size_t)stats.st_size, len);
+		close(fd);
+		return -EINVAL;
+	}
+
+	// an overlay maps its base, then lays its own blocks over it
+	if ((result = overlay_open(image, fd, file_name)) < 0) {
+		close(fd);
+		return result;
+	}
+	int map_from = image->in_delta != NULL ? image->base_fd : fd;
+
+	if (mode == EXT2_MAP_AUTO) {
+		mode = len > EXT2_LAZY_MAP_THRESHOLD ? EXT2_MAP_LAZY : EXT2_MAP_FULL;
+	}
+	// private: changes reach the file only through journal_commit()
+	int flags = MAP_PRIVATE;
+	if (mode == EXT2_MAP_LAZY) {
+		flags |= MAP_NORESERVE;
+	}
+
+	unsigned char *disk = mmap(NULL, len, PROT_READ | PROT_WRITE, flags, map_from, 0);
+	if (disk == MAP_FAILED) {
 		perror("init: mmap");
+		overlay_detach(image);
+		close(fd);
 		return -1;
 	}
+	if (mode == EXT2_MAP_LAZY) {
+		// no readahead: fault in only what gets touched, then pull the
+		// superblock and group descriptors in up front since every tool reads them
+		madvise(disk, len, MADV_RANDOM);
+		madvise(disk, 3 * block_size, MADV_WILLNEED);
+	}
+
+	// look every group's metadata up once
+	unsigned int data_blocks = super_block.s_blocks_count - super_block.s_first_data_block;
+	unsigned int groups = (data_blocks + super_block.s_blocks_per_group - 1) / super_block.s_blocks_per_group;
+	struct ext2_group_desc *group_desc =
+		(struct ext2_group_desc *)(disk + block_size * (super_block.s_first_data_block + 1));
+	unsigned int **block_bitmaps = malloc(sizeof(unsigned int *) * groups);
+	unsigned int **inode_bitmaps = malloc(sizeof(unsigned int *) * groups);
+	unsigned char **inode_tables = malloc(sizeof(unsigned char *) * groups);
+	int *block_hints = calloc(groups, sizeof(int));
+	int *inode_hints = calloc(groups, sizeof(int));
+	if (block_bitmaps == NULL || inode_bitmaps == NULL || inode_tables == NULL || block_hints == NULL ||
+		inode_hints == NULL) {
+		perror("init: malloc");
+		free(block_bitmaps);
+		free(inode_bitmaps);
+		free(inode_tables);
+		free(block_hints);
+		free(inode_hints);
+		munmap(disk, len);
+		overlay_detach(image);
+		close(fd);
+		return -ENOMEM;
+	}
+	for (unsigned int group = 0; group < groups; group++) {
+		block_bitmaps[group] = (unsigned int *)(disk + block_size * group_desc[group].bg_block_bitmap);
+		inode_bitmaps[group] = (unsigned int *)(disk + block_size * group_desc[group].bg_inode_bitmap);
+		inode_tables[group] = disk + block_size * group_desc[group].bg_inode_table;
+	}
+
+	image->disk = disk;
+	image->map_len = len;
+	image->map_fd = fd;
+	image->map_mode = mode;
+	image->block_size = block_size;
+	image->inode_size = inode_size;
+	image->first_ino = first_ino;
+	image->super_block = (struct ext2_super_block *)(disk + EXT2_SUPER_OFFSET);
+	image->group_desc = group_desc;
+	image->num_groups = groups;
+	image->block_bitmaps = block_bitmaps;
+	image->inode_bitmaps = inode_bitmaps;
+	image->inode_tables = inode_tables;
+	image->block_hints = block_hints;
+	image->inode_hints = inode_hints;
+	image->dir_window_blocks =
+		super_block.s_feature_compat & EXT2_FEATURE_COMPAT_DIR_PREALLOC ? super_block.s_prealloc_dir_blocks : 0;
+	memset(image->dir_windows, 0, sizeof(image->dir_windows));
+	if ((result = journal_attach(image, file_name)) < 0 ||
+		(result = dirtylog_attach(image, file_name)) < 0) {
+		image_close(image);
+		return result;
+	}
+	if ((result = overlay_load(image, 0, len)) < 0) {
+		fprintf(stderr, "init: cannot read %s: %s\n", file_name, strerror(-result));
+		image_close(image);
+		return result;
+	}
 	return 0;
 }
 
 
 /**
- * Check if the index on the bitmap is free
- * @param  bitmap the given bitmap (inode or block)
- * @param  index  index on the block
- * @return        0 on free, 1 on used
+ * Unmap an image and drop everything cached about it
+ * @param image the handle
  */
-int check_bitmap(unsigned int *bitmap, int index) {
-	return (((unsigned char *)bitmap)[index / 8] >> (index % 8)) & 0x1;
+void image_close(struct ext2_image *image) {
+	journal_detach(image);
+	dirtylog_detach(image);
+	overlay_detach(image);
+	if (image->disk != NULL) {
+		munmap(image->disk, image->map_len);
+	}
+	if (image->map_fd >= 0) {
+		close(image->map_fd);
+	}
+	free(image->block_bitmaps);
+	free(image->inode_bitmaps);
+	free(image->inode_tables);
+	free(image->block_hints);
+	free(image->inode_hints);
+	free(image->reserved);
+	free(image->freed);
+	image->disk = NULL;
+	image->map_len = 0;
+	image->map_fd = -1;
+	image->block_bitmaps = NULL;
+	image->inode_bitmaps = NULL;
+	image->inode_tables = NULL;
+	image->block_hints = NULL;
+	image->inode_hints = NULL;
+	image->num_groups = 0;
+	image->reserved = NULL;
+	image->num_reserved = 0;
+	image->freed = NULL;
+	image->num_freed = 0;
+	image->max_freed = 0;
+	image->num_freed_committed = 0;
+	image->num_freed_reserved = 0;
+	image->freed_failed = 0;
+	memset(image->dir_windows, 0, sizeof(image->dir_windows));
+
+	if (cache_owner == image) {
+		dcache_clear();
+		dslot_clear();
+		bmap_clear();
+		undel_clear();
+		cache_owner = NULL;
+	}
+	if (ext2_cur == image) {
+		ext2_cur = &default_image;
+	}
 }
 
 
 /**
- * Set or reset the bitmap
- * @param bitmap  	the bitmap pointer
- * @param index 	index to set or unset
- * @param value  	1 to set, 0 to unset
+ * Make an image the one the helpers operate on. The dentry cache follows
+ * the image; it is dropped only when a different image is picked, so
+ * repeated operations on one image keep it warm. The allocation hints are
+ * the image's own.
+ * @param image the handle
  */
-void set_bitmap(unsigned int **bitmap, int index, int value) {
-	if (value == 1) { // set
-		*(((unsigned char *)*bitmap) + (index / 8)) |= (1 << (index % 8));
-	} else { // unset
-		*(((unsigned char *)*bitmap) + (index / 8)) &= ~(1 << (index % 8));
+void image_use(struct ext2_image *image) {
+	ext2_cur = image;
+	if (cache_owner != image) {
+		dcache_clear();
+		dslot_clear();
+		bmap_clear();
+		undel_clear();
+		cache_owner = image;
 	}
 }
 
+
 /**
- * Allocate and return a new inode
- * @param disk	the disk
- * @return 		the new inode index
- * 				errno on failure
+ * Finish an operation on the current image: commit what it changed if it
+ * succeeded, or undo it if it failed, so an operation lands on the image
+ * whole or not at all. When the commit is flushed is up to the image's
+ * flush policy. An operation undone with -ERESTART is to run again; if
+ * blocks earlier operations freed are held it is after a flush lets go of
+ * them, as it may have run out of blocks for want of them.
+ * @param  result the operation's result
+ * @return        result; the commit's errno if committing failed, the
+ *                flush's if flushing for -ERESTART did
  */
-unsigned int new_inode(unsigned char **disk) {
-	int free_inode_idx = 0;
-	struct ext2_super_block *super_block = (struct ext2_super_block *)(*disk + EXT2_BLOCK_SIZE);
-	struct ext2_group_desc *group_desc = (struct ext2_group_desc *)(*disk + (2 * EXT2_BLOCK_SIZE));
-	unsigned int *inode_bitmap =
-		(unsigned int *)(*disk + EXT2_BLOCK_SIZE * group_desc->bg_inode_bitmap);
-
-	// loop over inode indices to check for a free inode on the bitmap
-	for (free_inode_idx = EXT2_GOOD_OLD_FIRST_INO; free_inode_idx < super_block->s_inodes_count;
-		 free_inode_idx++) {
-		if (check_bitmap(inode_bitmap, free_inode_idx) == 0) {
-			break;
+int end_op(int result) {
+	if (result >= 0) {
+		int committed = journal_commit(ext2_cur);
+		if (committed >= 0) {
+			return result;
 		}
+		result = committed;
 	}
-	if (free_inode_idx == super_block->s_inodes_count) {
-		fprintf(stderr, "no free inode left\n");
-		return -ENOSPC;
+	release_dir_windows(ext2_cur->disk, 0); // their directories may be gone
+	if (journal_abort(ext2_cur)) { // what the caches learned may be gone
+		dcache_clear();
+		dslot_clear();
+		bmap_clear();
+		undel_clear();
+		memset(ext2_cur->block_hints, 0, sizeof(int) * ext2_cur->num_groups);
+		memset(ext2_cur->inode_hints, 0, sizeof(int) * ext2_cur->num_groups);
 	}
-	set_bitmap(&inode_bitmap, free_inode_idx, 1);
+	if (result == -ERESTART && ext2_cur->num_freed_committed > 0) {
+		// the blocks held for earlier operations are let go, see take_blocks_or_windows()
+		int flushed = journal_flush(ext2_cur);
+		if (flushed < 0) {
+			result = flushed;
+		}
+	}
+	return result;
+}
+
 
-	super_block->s_free_inodes_count--;
-	group_desc->bg_free_inodes_count--;
+/**
+ * Lock a group's bitmaps and descriptor counters, in a shared operation
+ */
+static void lock_group(unsigned int group) {
+	if (held.shared) {
+		pthread_mutex_lock(&group_locks[group % NUM_GROUP_LOCKS]);
+	}
+}
 
-	return free_inode_idx + 1;
+static void unlock_group(unsigned int group) {
+	if (held.shared) {
+		pthread_mutex_unlock(&group_locks[group % NUM_GROUP_LOCKS]);
+	}
 }
 
 /**
- * Initialize the new inode.
- * NOTE: i_mode, i_blocks, i_size, i_links_count, i_block need to be set
- * @param disk          the disk
- * @param new_inode_idx index of the new inode
+ * Lock every group, in stripe order, in a shared operation
  */
-void init_inode(unsigned char **disk, unsigned int new_inode_idx) {
-	struct ext2_group_desc *group_desc = (struct ext2_group_desc *)(*disk + (2 * EXT2_BLOCK_SIZE));
-	struct ext2_inode *inode_table =
-		(struct ext2_inode *)(*disk + EXT2_BLOCK_SIZE * group_desc->bg_inode_table);
-	struct ext2_inode *inode = &(inode_table[new_inode_idx]);
+static void lock_all_groups(void) {
+	for (unsigned int i = 0; held.shared && i < ext2_cur->num_groups && i < NUM_GROUP_LOCKS; i++) {
+		pthread_mutex_lock(&group_locks[i]);
+	}
+}
 
-	inode->i_mode = 0;
-	// inode->i_blocks = 0;
-	inode->i_size = 0;
-	inode->i_links_count = 0;
-	// inode->i_block = 0;
-	// inode->extra = 0;
+static void unlock_all_groups(void) {
+	for (unsigned int i = 0; held.shared && i < ext2_cur->num_groups && i < NUM_GROUP_LOCKS; i++) {
+		pthread_mutex_unlock(&group_locks[i]);
+	}
+}
 
-	inode->i_atime = (unsigned int)time(NULL);
-	inode->i_ctime = (unsigned int)time(NULL);
-	inode->i_mtime = 0;
-	inode->i_dtime = 0;
+/**
+ * Lock the preallocation windows, in a shared operation
+ */
+static void lock_windows(void) {
+	if (held.shared) {
+		pthread_mutex_lock(&window_lock);
+	}
+}
 
-	inode->i_uid = 0;
-	inode->i_gid = 0;
-	inode->i_flags = 0;
-	inode->osd1 = 0;
-	inode->i_generation = 0;
-	inode->i_file_acl = 0;
-	inode->i_dir_acl = 0;
-	inode->i_faddr = 0;
+static void unlock_windows(void) {
+	if (held.shared) {
+		pthread_mutex_unlock(&window_lock);
+	}
 }
 
+/**
+ * Whether the calling thread holds a directory stripe
+ * @return its slot in held.dirs; -1 if not held
+ */
+static int held_dir(unsigned int stripe) {
+	for (int i = 0; i < held.num_dirs; i++) {
+		if (held.dirs[i] == stripe) {
+			return i;
+		}
+	}
+	return -1;
+}
 
 /**
- * Allocate a new block on the disk
- * @param  disk the disk
- * @return      the block index
+ * Lock a directory in a shared operation, to read its entries or to change
+ * them, until unlock_dir() or the end of the operation. A directory whose
+ * stripe the thread holds already is not locked again, so a thread holding
+ * one for reading must not ask for it for writing.
+ * @param dir_idx the directory's inode index
+ * @param write   1 to change its entries, 0 to read them
  */
-int new_block(unsigned char **disk) {
-	int free_block_idx = 0;
+void lock_dir(unsigned int dir_idx, int write) {
+	unsigned int stripe = dir_idx % NUM_DIR_LOCKS;
+	if (!held.shared || held_dir(stripe) >= 0) {
+		return;
+	}
+	if (write) {
+		pthread_rwlock_wrlock(&dir_locks[stripe]);
+	} else {
+		pthread_rwlock_rdlock(&dir_locks[stripe]);
+	}
+	held.dirs[held.num_dirs++] = stripe;
+}
 
-	struct ext2_super_block *super_block = (struct ext2_super_block *)(*disk + EXT2_BLOCK_SIZE);
-	struct ext2_group_desc *group_desc = (struct ext2_group_desc *)(*disk + (2 * EXT2_BLOCK_SIZE));
-	unsigned int *block_bitmap =
-		(unsigned int *)(*disk + EXT2_BLOCK_SIZE * group_desc->bg_block_bitmap);
+/**
+ * Lock two directories at once, in stripe order, for an operation that
+ * reads one while changing the other
+ */
+static void lock_dir_pair(unsigned int first_idx, int first_write, unsigned int second_idx,
+						  int second_write) {
+	if (first_idx % NUM_DIR_LOCKS == second_idx % NUM_DIR_LOCKS) {
+		lock_dir(first_idx, first_write || second_write);
+	} else if (first_idx % NUM_DIR_LOCKS < second_idx % NUM_DIR_LOCKS) {
+		lock_dir(first_idx, first_write);
+		lock_dir(second_idx, second_write);
+	} else {
+		lock_dir(second_idx, second_write);
+		lock_dir(first_idx, first_write);
+	}
+}
 
-	for (free_block_idx = 0; free_block_idx < super_block->s_blocks_count; free_block_idx++) {
-		if (!check_bitmap(block_bitmap, free_block_idx)) {
-			break;
-		}
+/**
+ * Read-lock a directory in a shared operation for a moment, unless the
+ * thread holds it already
+ * @param  dir_idx the directory's inode index
+ * @return         1 if it was locked, for the caller to unlock_dir(); 0 if not
+ */
+static int lock_dir_briefly(unsigned int dir_idx) {
+	if (!held.shared || held_dir(dir_idx % NUM_DIR_LOCKS) >= 0) {
+		return 0;
 	}
-	if (free_block_idx == super_block->s_blocks_count) {
-		fprintf(stderr, "no free block left\n");
-		return -ENOSPC;
+	lock_dir(dir_idx, 0);
+	return 1;
+}
+
+/**
+ * Let go of a directory locked with lock_dir() before the operation ends
+ * @param dir_idx the directory's inode index
+ */
+void unlock_dir(unsigned int dir_idx) {
+	int slot = held_dir(dir_idx % NUM_DIR_LOCKS);
+	if (slot < 0) {
+		return;
 	}
-	set_bitmap(&block_bitmap, free_block_idx, 1);
+	pthread_rwlock_unlock(&dir_locks[held.dirs[slot]]);
+	held.dirs[slot] = held.dirs[--held.num_dirs];
+}
 
-	super_block->s_free_blocks_count--;
-	group_desc->bg_free_blocks_count--;
+/**
+ * Lock an inode in a shared operation until it ends, against its links
+ * being counted or it being freed meanwhile. A thread holds one at a time,
+ * taken after its directories.
+ * @param inode_idx the inode's index
+ */
+void lock_inode(unsigned int inode_idx) {
+	if (!held.shared || held.inode != 0) {
+		return;
+	}
+	held.inode = inode_idx % NUM_INODE_LOCKS + 1;
+	pthread_mutex_lock(&inode_locks[held.inode - 1]);
+}
 
-	return free_block_idx + 1;
+/**
+ * Let go of every lock the calling thread's shared operation holds
+ */
+static void unlock_held(void) {
+	if (held.inode != 0) {
+		pthread_mutex_unlock(&inode_locks[held.inode - 1]);
+		held.inode = 0;
+	}
+	while (held.num_dirs > 0) {
+		pthread_rwlock_unlock(&dir_locks[held.dirs[--held.num_dirs]]);
+	}
 }
 
 
+/**
+ * Start an operation on the current image that runs side by side with
+ * others, see utils.h. The caller makes sure nothing but shared operations
+ * run meanwhile. It joins the transaction in flight, or waits for the next
+ * one if that one is being closed.
+ */
+void begin_shared_op(void) {
+	pthread_mutex_lock(&txn.lock);
+	while (txn.closing) {
+		pthread_cond_wait(&txn.ended, &txn.lock);
+	}
+	if (txn.handles++ == 0) {
+		bmap_share(1);
+	}
+	pthread_mutex_unlock(&txn.lock);
+	journal_take_dirtied();
+	held.shared = 1;
+}
+
 
 /**
- * update the parent directory given the current index
- * @param parent_inode parent inode
- * @param current_idx  the current entry's inode index
- * @param name         the current entry's name
- * @param type         dirent type for the current entry
- * @return			   0 on success, errno on failure
+ * End a shared operation and let go of its locks. An operation that changed
+ * something closes the transaction to newcomers and waits for its end: the
+ * last one out runs end_op() for all of them, committing what they changed,
+ * or undoing it if one of them failed, so each lands whole or not at all.
+ * @param  result the operation's result
+ * @return        result; -ERESTART if it was undone as part of a failed
+ *                transaction; the commit's errno if committing failed
  */
-int update_dir_entry(unsigned char **disk, struct ext2_inode *parent_inode,
-					  unsigned short current_idx, char *name, unsigned char type) {
-
-	// loop from the end to find a free or not full block
-	for (int i = 11; i >= 0; i--) {
-		if (parent_inode->i_block[i] != 0) { // may be not full
-			int dir_block_num = parent_inode->i_block[i];
-
-			struct ext2_dir_entry *dir =
-				(struct ext2_dir_entry *)(*disk + EXT2_BLOCK_SIZE * dir_block_num);
-			int curr_len = dir->rec_len;
-
-			while (curr_len <= EXT2_BLOCK_SIZE) {
-				if (curr_len == EXT2_BLOCK_SIZE) { // last entry. check if entry has padding
-												   // new entry's size
-					int new_size = sizeof(struct ext2_dir_entry) + strlen(name);
-					if (new_size % 4 != 0) {
-						new_size += 4 - new_size % 4;
-					}
-
-					// current last entry's real size (w/o padding)
-					int last_ent_size = sizeof(struct ext2_dir_entry) + dir->name_len;
-					if (last_ent_size % 4 != 0) {
-						last_ent_size = 4 * (last_ent_size / 4) + 4;
-					}
-
-					int space_left = dir->rec_len - last_ent_size;
-					if (space_left - new_size >= 0) { // enough space left
-						// rm padding for prev last entry
-						dir->rec_len = last_ent_size;
-
-						dir = (struct ext2_dir_entry *)((unsigned char *)dir + (dir->rec_len));
-						dir->file_type = type;
-						dir->inode = current_idx;
-						dir->name_len = strlen(name);
-						strncpy(dir->name, name, dir->name_len);
-
-						dir->rec_len = space_left;
-						if (dir->rec_len % 4 != 0) {
-							dir->rec_len = 4 * (dir->rec_len / 4) + 4;
-						}
-
-					} else { // not enought space in the current block
-						// allocate new block and make inode block pointer point to the new block
-						int block_num = new_block(disk);
-						if (block_num < 0) {
-							return block_num;
-						}
-						parent_inode->i_block[i + 1] = block_num;
-						dir = (struct ext2_dir_entry *)(*disk + EXT2_BLOCK_SIZE * block_num);
-						dir->file_type = type;
-						dir->inode = current_idx;
-						dir->name_len = strlen(name);
-						strncpy(dir->name, name, dir->name_len);
-						dir->rec_len = EXT2_BLOCK_SIZE;
-						parent_inode->i_size += EXT2_BLOCK_SIZE;
-					}
-					return 0;
-				}
+int end_shared_op(int result) {
+	unlock_held();
+	int wrote = journal_take_dirtied();
+	int waits = wrote || held.needs_commit;
+	held.shared = 0;
+	held.needs_commit = 0;
 
-				dir = (struct ext2_dir_entry *)((unsigned char *)dir + dir->rec_len);
-				curr_len += dir->rec_len;
-			}
+	pthread_mutex_lock(&txn.lock);
+	if (waits) {
+		txn.closing++; // the waiters still to learn how it ended
+	}
+	if (wrote) {
+		txn.writers++;
+		txn.failed |= result < 0;
+	}
+	unsigned int seq = txn.seq;
+	if (--txn.handles == 0) {
+		if (txn.closing) {
+			ext2_cur->txn_ops = txn.writers;
+			txn.result = end_op(txn.failed ? -ERESTART : 0);
+			ext2_cur->txn_ops = 0;
+			txn.writers = 0;
+			txn.failed = 0;
+			txn.seq++;
+			pthread_cond_broadcast(&txn.ended);
 		}
+		bmap_share(0);
 	}
-	return 0;
+	if (waits) {
+		while (txn.seq == seq) {
+			pthread_cond_wait(&txn.ended, &txn.lock);
+		}
+		if (txn.result < 0) {
+			result = txn.result;
+		}
+		if (--txn.closing == 0) { // open to newcomers again
+			pthread_cond_broadcast(&txn.ended);
+		}
+	}
+	pthread_mutex_unlock(&txn.lock);
+	return result;
 }
 
 
 /**
- * Parse the given absolute path to the path and the file/dir name
- * @param  absolute_path the given absolute path
- * @param  path          the path to file
- * @param  name          the file/dir name
- * @return               0 on success
- * 						 -1 on failure
+ * File descriptor the current mapping was made from
+ * @return the image fd; -1 if no image is open
  */
-int parse_path(char const *absolute_path, char **path, char **name) {
-	if (absolute_path[0] != '/') {
-		fprintf(stderr, "%s is not absolute\n", absolute_path);
+int disk_fd(void) {
+	return ext2_cur->map_fd;
+}
+
+
+/**
+ * Size of the current mapping in bytes
+ * @return the mapped length
+ */
+size_t disk_size(void) {
+	return ext2_cur->map_len;
+}
+
+
+/**
+ * Ask the kernel to fault in a region of the mapping ahead of use. Used with
+ * EXT2_MAP_LAZY to bring in a group's metadata on demand.
+ * @param  disk   the disk
+ * @param  offset byte offset into the image
+ * @param  len    length of the region
+ * @return        0 on success; errno on failure
+ */
+int map_willneed(unsigned char *disk, size_t offset, size_t len) {
+	size_t map_len = ext2_cur->map_len;
+	if (offset >= map_len) {
 		return -EINVAL;
 	}
-	int len = strlen(absolute_path);
-	char *abs_path = (char *)absolute_path;
-	// rm last '/'
-	//
-	if (len > 1 && abs_path[len - 1] == '/') {
-		abs_path[len - 1] = '\0';
-		len--;
-	}
-	// get name
-	char *idx = strrchr(abs_path, '/') + 1;
-	if (!(*name = malloc(sizeof(char) * (strlen(idx) + 1)))) {
-		perror("parse_path: malloc");
-		return -1;
+	if (len > map_len - offset) {
+		len = map_len - offset;
 	}
-	strncpy(*name, idx, strlen(idx));
-	// get path
-	abs_path[len - strlen(*name) - 1] = '\0';
-	if (strlen(abs_path) == 0) {
-		abs_path = "/";
-	}
-	if (!(*path = malloc(sizeof(char) * (strlen(abs_path) + 1)))) {
-		perror("parse_path: malloc");
-		return -1;
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t start = offset - offset % page;
+	if (madvise(disk + start, len + (offset - start), MADV_WILLNEED) < 0) {
+		return -errno;
 	}
-	strcpy(*path, abs_path);
-
 	return 0;
 }
 
 
 /**
- * Find the given name's node index
- * @param  disk disk
- * @param  name target
- * @param  dir  dirent
- * @return      node index
+ * Check if the index on the bitmap is free
+ * @param  bitmap the given bitmap (inode or block)
+ * @param  index  index on the block
+ * @return        0 on free, 1 on used
  */
-int find_idx(unsigned char *disk, char *name, struct ext2_dir_entry *dir) {
-	int result;
-	if (strncmp(dir->name, name, dir->name_len) == 0) {
-		return dir->inode;
+int check_bitmap(unsigned int *bitmap, int index) {
+	return (((unsigned char *)bitmap)[index / 8] >> (index % 8)) & 0x1;
+}
+
+
+/**
+ * Set or reset the bitmap
+ * @param bitmap  	the bitmap pointer
+ * @param index 	index to set or unset
+ * @param value  	1 to set, 0 to unset
+ */
+void set_bitmap(unsigned int **bitmap, int index, int value) {
+	dirty_meta(ext2_cur->disk, (unsigned char *)*bitmap + index / 8, 1);
+	if (value == 1) { // set
+		*(((unsigned char *)*bitmap) + (index / 8)) |= (1 << (index % 8));
+	} else { // unset
+		*(((unsigned char *)*bitmap) + (index / 8)) &= ~(1 << (index % 8));
 	}
-	struct ext2_dir_entry *curr_dir = dir;
+}
 
-	struct ext2_group_desc *group_desc = (struct ext2_group_desc *)(disk + EXT2_BLOCK_SIZE * 2);
-	struct ext2_inode *inode_table =
-		(struct ext2_inode *)(disk + EXT2_BLOCK_SIZE * group_desc->bg_inode_table);
 
-	if (curr_dir->inode == 0) {
-		curr_dir = (struct ext2_dir_entry *)((unsigned char *)curr_dir + curr_dir->rec_len);
+/**
+ * Lower a group's next-free hint to a bit just freed
+ * @param hints the image's block_hints or inode_hints
+ * @param group the group
+ * @param index the bit freed in its bitmap
+ */
+static void lower_hint(int *hints, unsigned int group, int index) {
+	if (hints[group] > index) {
+		hints[group] = index;
 	}
+}
+
+
+/**
+ * Change one of the superblock's free counters, which operations in
+ * different groups share
+ * @param counter s_free_blocks_count or s_free_inodes_count
+ * @param delta   how much it changes by
+ */
+static void add_free(unsigned int *counter, int delta) {
+	__atomic_add_fetch(counter, delta, __ATOMIC_RELAXED);
+}
 
-	int curr_rec_len = curr_dir->rec_len;
 
-	while (curr_rec_len <= EXT2_BLOCK_SIZE) {
-		struct ext2_inode *curr_inode = &inode_table[curr_dir->inode - 1];
+/**
+ * Find the first free index in [start, size) of a bitmap, 64 bits at a time
+ * @param  bitmap the bitmap (inode or block)
+ * @param  start  first index to consider
+ * @param  size   number of valid indices in the bitmap
+ * @return        the free index; -ENOSPC if every index in range is used
+ */
+int find_free_bit(unsigned int *bitmap, int start, int size) {
+	unsigned char const *bytes = (unsigned char const *)bitmap;
 
-		if (strncmp(curr_dir->name, name, curr_dir->name_len) == 0) {
-			return curr_dir->inode;
+	for (int word_idx = start / 64; word_idx * 64 < size; word_idx++) {
+		uint64_t word;
+		memcpy(&word, bytes + word_idx * 8, sizeof(word));
+		word = ~le64toh(word);
+		if (word_idx == start / 64 && start % 64 != 0) { // skip bits below start
+			word &= ~0ULL << (start % 64);
 		}
+		if (word != 0) {
+			int index = word_idx * 64 + __builtin_ctzll(word);
+			STAT_ADD(STAT_BITMAP_WORDS, word_idx - start / 64 + 1);
+			return index < size ? index : -ENOSPC;
+		}
+	}
+	STAT_ADD(STAT_BITMAP_WORDS, (size + 63) / 64 - start / 64);
+	return -ENOSPC;
+}
 
 
-		if (curr_dir->file_type == EXT2_FT_DIR) {
-			// skip . and ..
-			if (strncmp(curr_dir->name, ".", curr_dir->name_len) != 0 &&
-				strncmp(curr_dir->name, "..", curr_dir->name_len) != 0) {
-				for (int index = 0; index < 13; index++) {
-					int block_num = curr_inode->i_block[index];
-					if (block_num != 0) {
-						struct ext2_dir_entry *child =
-							(struct ext2_dir_entry *)(disk + (EXT2_BLOCK_SIZE * block_num));
-						if (child->inode != 0) {
-							if ((result = find_idx(disk, name, child)) > 0) {
-								return result;
-							}
-						}
-					}
-				}
-			}
+/**
+ * Find the first used index in [start, size) of a bitmap, i.e. the end of the
+ * free run beginning at start
+ * @param  bitmap the bitmap (inode or block)
+ * @param  start  first index to consider
+ * @param  size   number of valid indices in the bitmap
+ * @return        the used index; size if everything from start on is free
+ */
+int find_used_bit(unsigned int *bitmap, int start, int size) {
+	unsigned char const *bytes = (unsigned char const *)bitmap;
+
+	for (int word_idx = start / 64; word_idx * 64 < size; word_idx++) {
+		uint64_t word;
+		memcpy(&word, bytes + word_idx * 8, sizeof(word));
+		word = le64toh(word);
+		if (word_idx == start / 64 && start % 64 != 0) {
+			word &= ~0ULL << (start % 64);
 		}
-		if (curr_rec_len == EXT2_BLOCK_SIZE) {
-			break;
+		if (word != 0) {
+			int index = word_idx * 64 + __builtin_ctzll(word);
+			STAT_ADD(STAT_BITMAP_WORDS, word_idx - start / 64 + 1);
+			return index < size ? index : size;
 		}
-		curr_dir = (struct ext2_dir_entry *)((unsigned char *)curr_dir + curr_dir->rec_len);
-		curr_rec_len += curr_dir->rec_len;
 	}
-	return -ENOENT;
+	STAT_ADD(STAT_BITMAP_WORDS, (size + 63) / 64 - start / 64);
+	return size;
+}
+
+
+/**
+ * Set or reset a run of bits, whole bytes at a time where possible
+ * @param bitmap the bitmap pointer
+ * @param start  first index to set or unset
+ * @param len    number of indices
+ * @param value  1 to set, 0 to unset
+ */
+void set_bitmap_range(unsigned int **bitmap, int start, int len, int value) {
+	unsigned char *bytes = (unsigned char *)*bitmap;
+	int index = start;
+	int end = start + len;
+
+	// leading partial byte
+	while (index < end && index % 8 != 0) {
+		set_bitmap(bitmap, index++, value);
+	}
+	// whole bytes
+	if (end - index >= 8) {
+		memset(bytes + index / 8, value ? 0xff : 0x00, (end - index) / 8);
+		dirty_meta(ext2_cur->disk, bytes + index / 8, (end - index) / 8);
+		index += (end - index) / 8 * 8;
+	}
+	// trailing partial byte
+	while (index < end) {
+		set_bitmap(bitmap, index++, value);
+	}
+}
+
+// ---------- Group Descriptor Table ----------
+
+/**
+ * The superblock
+ * @param  disk the disk
+ * @return      the superblock
+ */
+struct ext2_super_block *get_super_block(unsigned char *disk) {
+	return (struct ext2_super_block *)(disk + EXT2_SUPER_OFFSET);
+}
+
+
+/**
+ * Number of block groups on the disk
+ * @param  disk the disk
+ * @return      the group count
+ */
+unsigned int num_groups(unsigned char *disk) {
+	return ext2_cur->num_groups;
+}
+
+
+/**
+ * A group's descriptor, from the table cached at open
+ * @param  disk  the disk
+ * @param  group the group number
+ * @return       the group descriptor
+ */
+struct ext2_group_desc *get_group_desc(unsigned char *disk, unsigned int group) {
+	return &ext2_cur->group_desc[group];
+}
+
+
+/**
+ * Group an inode belongs to
+ * @param  disk      the disk
+ * @param  inode_idx the inode index
+ * @return           the group number
+ */
+unsigned int inode_group(unsigned char *disk, unsigned int inode_idx) {
+	return (inode_idx - 1) / get_super_block(disk)->s_inodes_per_group;
+}
+
+
+/**
+ * Group a block belongs to
+ * @param  disk      the disk
+ * @param  block_num the block number
+ * @return           the group number
+ */
+unsigned int block_group(unsigned char *disk, unsigned int block_num) {
+	struct ext2_super_block *super_block = get_super_block(disk);
+	return (block_num - super_block->s_first_data_block) / super_block->s_blocks_per_group;
+}
+
+
+/**
+ * First block covered by a group's block bitmap
+ * @param  disk  the disk
+ * @param  group the group number
+ * @return       the block number of bit 0
+ */
+unsigned int group_first_block(unsigned char *disk, unsigned int group) {
+	struct ext2_super_block *super_block = get_super_block(disk);
+	return super_block->s_first_data_block + group * super_block->s_blocks_per_group;
+}
+
+
+/**
+ * Number of blocks in a group; the last group may be short
+ * @param  disk  the disk
+ * @param  group the group number
+ * @return       number of valid bits in the group's block bitmap
+ */
+int group_num_blocks(unsigned char *disk, unsigned int group) {
+	struct ext2_super_block *super_block = get_super_block(disk);
+	unsigned int left = super_block->s_blocks_count - group_first_block(disk, group);
+	return left < super_block->s_blocks_per_group ? left : super_block->s_blocks_per_group;
+}
+
+
+/**
+ * A group's block bitmap
+ * @param  disk  the disk
+ * @param  group the group number
+ * @return       the bitmap
+ */
+unsigned int *group_block_bitmap(unsigned char *disk, unsigned int group) {
+	return ext2_cur->block_bitmaps[group];
+}
+
+
+/**
+ * A group's inode bitmap
+ * @param  disk  the disk
+ * @param  group the group number
+ * @return       the bitmap
+ */
+unsigned int *group_inode_bitmap(unsigned char *disk, unsigned int group) {
+	return ext2_cur->inode_bitmaps[group];
+}
+
+
+/**
+ * Look an inode up in its group's inode table
+ * @param  disk      the disk
+ * @param  inode_idx the inode index (1-based)
+ * @return           the inode
+ */
+struct ext2_inode *get_inode(unsigned char *disk, unsigned int inode_idx) {
+	unsigned int per_group = ext2_cur->super_block->s_inodes_per_group;
+	unsigned char *inode_table = ext2_cur->inode_tables[(inode_idx - 1) / per_group];
+	return (struct ext2_inode *)(inode_table + (size_t)EXT2_INODE_SIZE * ((inode_idx - 1) % per_group));
+}
+
+
+/**
+ * Check if an inode is marked in use in its group's bitmap
+ * @param  disk      the disk
+ * @param  inode_idx the inode index
+ * @return           0 on free, 1 on used
+ */
+int check_inode_bit(unsigned char *disk, unsigned int inode_idx) {
+	unsigned int per_group = get_super_block(disk)->s_inodes_per_group;
+	return check_bitmap(group_inode_bitmap(disk, (inode_idx - 1) / per_group),
+						(inode_idx - 1) % per_group);
+}
+
+
+/**
+ * Check if a block is marked in use in its group's bitmap
+ * @param  disk      the disk
+ * @param  block_num the block number
+ * @return           0 on free, 1 on used
+ */
+int check_block_bit(unsigned char *disk, unsigned int block_num) {
+	unsigned int group = block_group(disk, block_num);
+	return check_bitmap(group_block_bitmap(disk, group), block_num - group_first_block(disk, group));
+}
+
+
+/**
+ * Mark an inode used or free in its group's bitmap, keeping the group and
+ * superblock free counters in step
+ * @param  disk      the disk
+ * @param  inode_idx the inode index
+ * @param  value     1 to mark used, 0 to mark free
+ * @return           1 if the bit changed, 0 if it already had that value
+ */
+int mark_inode(unsigned char *disk, unsigned int inode_idx, int value) {
+	struct ext2_super_block *super_block = get_super_block(disk);
+	unsigned int group = (inode_idx - 1) / super_block->s_inodes_per_group;
+	int index = (inode_idx - 1) % super_block->s_inodes_per_group;
+	unsigned int *inode_bitmap = group_inode_bitmap(disk, group);
+	struct ext2_group_desc *group_desc = get_group_desc(disk, group);
+
+	lock_group(group);
+	if (check_bitmap(inode_bitmap, index) == value) {
+		unlock_group(group);
+		return 0;
+	}
+	set_bitmap(&inode_bitmap, index, value);
+	if (value) {
+		add_free(&super_block->s_free_inodes_count, -1);
+		group_desc->bg_free_inodes_count--;
+	} else {
+		add_free(&super_block->s_free_inodes_count, 1);
+		group_desc->bg_free_inodes_count++;
+		lower_hint(ext2_cur->inode_hints, group, index);
+	}
+	dirty_meta(disk, group_desc, sizeof(*group_desc));
+	unlock_group(group);
+	dirty_meta(disk, super_block, sizeof(*super_block));
+	return 1;
+}
+
+
+/**
+ * Set or clear a run of bits in the reservation map: plain memory the
+ * journal knows nothing of, so not through set_bitmap_range(). A word at a
+ * time and atomically, as a word may hold the bits of two groups, each
+ * changed under its own lock; find_reserved() reads them the same way.
+ */
+static void mark_reserved(struct ext2_image *image, unsigned int start, unsigned int len, int value) {
+	uint64_t *words = (uint64_t *)__atomic_load_n(&image->reserved, __ATOMIC_ACQUIRE);
+	for (unsigned int block = start; block < start + len;) {
+		unsigned int bit = block % 64;
+		unsigned int bits = start + len - block < 64 - bit ? start + len - block : 64 - bit;
+		uint64_t mask = htole64((bits == 64 ? ~0ULL : (1ULL << bits) - 1) << bit);
+		if (value) {
+			__atomic_fetch_or(&words[block / 64], mask, __ATOMIC_RELAXED);
+		} else {
+			__atomic_fetch_and(&words[block / 64], ~mask, __ATOMIC_RELAXED);
+		}
+		block += bits;
+	}
+}
+
+/**
+ * Find the first reserved, or unreserved, block in [start, end) of the
+ * reservation map, like find_used_bit() and find_free_bit() but with atomic
+ * loads, see mark_reserved()
+ * @param  start    first block to consider
+ * @param  end      the block after the last
+ * @param  reserved 1 for a reserved block, 0 for an unreserved one
+ * @return          the block; end if there is none
+ */
+static int find_reserved(int start, int end, int reserved) {
+	uint64_t *words = (uint64_t *)__atomic_load_n(&ext2_cur->reserved, __ATOMIC_ACQUIRE);
+	for (int word_idx = start / 64; word_idx * 64 < end; word_idx++) {
+		uint64_t word = le64toh(__atomic_load_n(&words[word_idx], __ATOMIC_RELAXED));
+		word = reserved ? word : ~word;
+		if (word_idx == start / 64 && start % 64 != 0) {
+			word &= ~0ULL << (start % 64);
+		}
+		if (word != 0) {
+			int block = word_idx * 64 + __builtin_ctzll(word);
+			return block < end ? block : end;
+		}
+	}
+	return end;
+}
+
+/**
+ * Change the count of reserved blocks
+ * @param image the image
+ * @param delta how much it changes by
+ */
+static void add_reserved(struct ext2_image *image, int delta) {
+	__atomic_add_fetch(&image->num_reserved, delta, __ATOMIC_RELAXED);
+}
+
+/**
+ * Make the reservation map, one bit per block, the first time it is needed.
+ * Whichever thread gets there first installs it, so any lock may be held.
+ * @return 0 on success; -ENOMEM
+ */
+static int reserved_map(unsigned char *disk) {
+	if (__atomic_load_n(&ext2_cur->reserved, __ATOMIC_ACQUIRE) == NULL) {
+		unsigned int num_blocks = get_super_block(disk)->s_blocks_count;
+		unsigned int *reserved = calloc((num_blocks + 63) / 64, sizeof(uint64_t));
+		unsigned int *none = NULL;
+		if (reserved == NULL) {
+			perror("reserve_blocks: calloc");
+			return -ENOMEM;
+		}
+		if (!__atomic_compare_exchange_n(&ext2_cur->reserved, &none, reserved, 0, __ATOMIC_ACQ_REL,
+										 __ATOMIC_ACQUIRE)) {
+			free(reserved);
+		}
+	}
+	return 0;
+}
+
+/**
+ * List a run of held blocks, onto the last run if it continues it and is the
+ * operation in progress's too. Called with freed_lock held.
+ * @return 0 on success; -ENOMEM
+ */
+static int add_freed_run(unsigned int start, unsigned int len, int reserved) {
+	if (ext2_cur->num_freed > ext2_cur->num_freed_committed) {
+		struct freed_run *last = &ext2_cur->freed[ext2_cur->num_freed - 1];
+		if (last->start + last->len == start && last->reserved == reserved) {
+			last->len += len;
+			return 0;
+		}
+	}
+	if (ext2_cur->num_freed == ext2_cur->max_freed) {
+		unsigned int max = ext2_cur->max_freed > 0 ? ext2_cur->max_freed * 2 : 64;
+		struct freed_run *freed = realloc(ext2_cur->freed, sizeof(*freed) * max);
+		if (freed == NULL) {
+			perror("hold_freed_blocks: realloc");
+			return -ENOMEM;
+		}
+		ext2_cur->freed = freed;
+		ext2_cur->max_freed = max;
+	}
+	ext2_cur->freed[ext2_cur->num_freed++] = (struct freed_run){start, len, reserved};
+	ext2_cur->num_freed_reserved += reserved;
+	return 0;
+}
+
+/**
+ * Hold blocks just freed until the flush that makes their freeing durable.
+ * Until then the image as flushed still has them in use, and the next commit
+ * writes file data in place, so no file made in the meantime may get them:
+ * they are reserved, and listed for journal_flush() to let go, or for
+ * journal_abort() to let go of those the operation it undoes freed. Blocks a
+ * cp plan still has reserved stay the plan's until unreserve_blocks() hands
+ * them over. Called with their group locked.
+ * @param start the first block
+ * @param len   number of blocks
+ */
+static void hold_freed_blocks(unsigned int start, unsigned int len) {
+	if (ext2_cur->journal_path == NULL) {
+		return;
+	}
+	int result = reserved_map(ext2_cur->disk);
+	pthread_mutex_lock(&freed_lock);
+	for (unsigned int block = start; result == 0 && block < start + len;) {
+		int reserved = find_reserved(block, block + 1, 1) == (int)block;
+		int stop = find_reserved(block, start + len, !reserved);
+		if ((result = add_freed_run(block, stop - block, reserved)) == 0 && !reserved) {
+			mark_reserved(ext2_cur, block, stop - block, 1);
+			add_reserved(ext2_cur, stop - block);
+		}
+		block = stop;
+	}
+	if (result < 0) {
+		ext2_cur->freed_failed = 1; // the operation's commit fails instead
+	}
+	pthread_mutex_unlock(&freed_lock);
+}
+
+/**
+ * Take a block a cp plan lets go of over for the held run it is in, if it was
+ * freed meanwhile, see hold_freed_blocks(). Called with freed_lock held.
+ * @return 1 if the block stays reserved, held; 0 if not
+ */
+static int take_over_freed(unsigned int block) {
+	for (unsigned int i = 0; ext2_cur->num_freed_reserved > 0 && i < ext2_cur->num_freed; i++) {
+		struct freed_run *run = &ext2_cur->freed[i];
+		if (run->reserved && block >= run->start && block < run->start + run->len) {
+			run->reserved = 2; // taken over once the plan's blocks are all let go of
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Note that the operation in progress was committed: the blocks it freed are
+ * held until the next flush, whatever later operations do
+ * @param image the image
+ */
+void commit_freed_blocks(struct ext2_image *image) {
+	pthread_mutex_lock(&freed_lock);
+	image->num_freed_committed = image->num_freed;
+	pthread_mutex_unlock(&freed_lock);
+}
+
+/**
+ * Let go of blocks held by hold_freed_blocks(): every one once a flush made
+ * their freeing durable, or only those of the operation in progress once it
+ * was undone and they are in use again. Runs still a cp plan's are only
+ * dropped from the list.
+ * @param image the image
+ * @param all   1 for every held block, 0 for the operation in progress's
+ */
+void release_freed_blocks(struct ext2_image *image, int all) {
+	pthread_mutex_lock(&freed_lock);
+	unsigned int keep = all ? 0 : image->num_freed_committed;
+	for (unsigned int i = keep; i < image->num_freed; i++) {
+		struct freed_run *run = &image->freed[i];
+		if (run->reserved) {
+			image->num_freed_reserved--;
+			continue;
+		}
+		mark_reserved(image, run->start, run->len, 0);
+		add_reserved(image, -(int)run->len);
+	}
+	image->num_freed = keep;
+	image->num_freed_committed = keep;
+	image->freed_failed = 0;
+	pthread_mutex_unlock(&freed_lock);
+}
+
+/**
+ * Mark a block used or free in its group's bitmap, keeping the group and
+ * superblock free counters in step
+ * @param  disk      the disk
+ * @param  block_num the block number
+ * @param  value     1 to mark used, 0 to mark free
+ * @return           1 if the bit changed, 0 if it already had that value
+ */
+int mark_block(unsigned char *disk, unsigned int block_num, int value) {
+	struct ext2_super_block *super_block = get_super_block(disk);
+	unsigned int group = block_group(disk, block_num);
+	int index = block_num - group_first_block(disk, group);
+	unsigned int *block_bitmap = group_block_bitmap(disk, group);
+	struct ext2_group_desc *group_desc = get_group_desc(disk, group);
+
+	lock_group(group);
+	if (check_bitmap(block_bitmap, index) == value) {
+		unlock_group(group);
+		return 0;
+	}
+	set_bitmap(&block_bitmap, index, value);
+	if (value) {
+		add_free(&super_block->s_free_blocks_count, -1);
+		group_desc->bg_free_blocks_count--;
+	} else {
+		add_free(&super_block->s_free_blocks_count, 1);
+		group_desc->bg_free_blocks_count++;
+		lower_hint(ext2_cur->block_hints, group, index);
+		hold_freed_blocks(block_num, 1);
+		STAT_ADD(STAT_BLOCKS_FREED, 1);
+	}
+	dirty_meta(disk, group_desc, sizeof(*group_desc));
+	unlock_group(group);
+	dirty_meta(disk, super_block, sizeof(*super_block));
+	return 1;
+}
+
+/**
+ * Mark a run of blocks used or free, a range of bits per group it spans,
+ * keeping the free counters in step like mark_block()
+ * @param  disk  the disk
+ * @param  start the first block number
+ * @param  len   number of blocks
+ * @param  value 1 to mark used, 0 to mark free
+ * @return       number of bits that changed
+ */
+int mark_block_range(unsigned char *disk, unsigned int start, unsigned int len, int value) {
+	struct ext2_super_block *super_block = get_super_block(disk);
+	int changed = 0;
+	while (len > 0) {
+		unsigned int group = block_group(disk, start);
+		int index = start - group_first_block(disk, group);
+		int count = group_num_blocks(disk, group) - index;
+		if ((unsigned int)count > len) {
+			count = len;
+		}
+		unsigned int *block_bitmap = group_block_bitmap(disk, group);
+		struct ext2_group_desc *group_desc = get_group_desc(disk, group);
+
+		lock_group(group);
+		int set = bitmap_count_range(block_bitmap, index, count);
+		int group_changed = value ? count - set : set;
+		if (group_changed > 0) {
+			// when freeing, the runs still in use are the ones to hold
+			for (int bit = find_used_bit(block_bitmap, index, index + count); !value && bit < index + count;) {
+				int stop = find_free_bit(block_bitmap, bit, index + count);
+				stop = stop < 0 ? index + count : stop;
+				hold_freed_blocks(start + (bit - index), stop - bit);
+				bit = find_used_bit(block_bitmap, stop, index + count);
+			}
+			set_bitmap_range(&block_bitmap, index, count, value);
+			if (value) {
+				add_free(&super_block->s_free_blocks_count, -group_changed);
+				group_desc->bg_free_blocks_count -= group_changed;
+			} else {
+				add_free(&super_block->s_free_blocks_count, group_changed);
+				group_desc->bg_free_blocks_count += group_changed;
+				lower_hint(ext2_cur->block_hints, group, index);
+				STAT_ADD(STAT_BLOCKS_FREED, group_changed);
+			}
+			dirty_meta(disk, group_desc, sizeof(*group_desc));
+			changed += group_changed;
+		}
+		unlock_group(group);
+		start += count;
+		len -= count;
+	}
+	if (changed > 0) {
+		dirty_meta(disk, super_block, sizeof(*super_block));
+	}
+	return changed;
+}
+
+
+
+/**
+ * Compare every free counter, per group and in the superblock, with the
+ * bitmaps without changing anything: a popcount per bitmap, cheap enough to
+ * run each time an image is opened. ext2_check() is what repairs them.
+ * @param  disk the disk
+ * @return      number of counters that disagree; 0 if all match
+ */
+int verify_counters(unsigned char *disk) {
+	struct ext2_super_block *super_block = get_super_block(disk);
+	unsigned int inodes_per_group = super_block->s_inodes_per_group;
+	unsigned int total_free_inodes = 0;
+	unsigned int total_free_blocks = 0;
+	int num_wrong = 0;
+
+	for (unsigned int group = 0; group < num_groups(disk); group++) {
+		struct ext2_group_desc *group_desc = get_group_desc(disk, group);
+		unsigned int num_blocks = group_num_blocks(disk, group);
+		unsigned int free_inodes =
+			inodes_per_group - bitmap_count(group_inode_bitmap(disk, group), inodes_per_group);
+		unsigned int free_blocks = num_blocks - bitmap_count(group_block_bitmap(disk, group), num_blocks);
+		num_wrong += group_desc->bg_free_inodes_count != free_inodes;
+		num_wrong += group_desc->bg_free_blocks_count != free_blocks;
+		total_free_inodes += free_inodes;
+		total_free_blocks += free_blocks;
+	}
+	num_wrong += super_block->s_free_inodes_count != total_free_inodes;
+	num_wrong += super_block->s_free_blocks_count != total_free_blocks;
+	return num_wrong;
+}
+
+
+// ---------- Allocation ----------
+
+/**
+ * Take the first free inode, scanning the groups from the goal's on
+ * @param  disk       the disk
+ * @param  goal_group the group to try first
+ * @return            the new inode index; errno on failure
+ */
+static unsigned int take_inode(unsigned char **disk, unsigned int goal_group) {
+	struct ext2_super_block *super_block = get_super_block(*disk);
+	unsigned int groups = num_groups(*disk);
+
+	for (unsigned int i = 0; i < groups; i++) {
+		unsigned int group = (goal_group + i) % groups;
+		struct ext2_group_desc *group_desc = get_group_desc(*disk, group);
+		lock_group(group);
+		if (group_desc->bg_free_inodes_count == 0) {
+			unlock_group(group);
+			continue;
+		}
+		unsigned int *inode_bitmap = group_inode_bitmap(*disk, group);
+
+		// scan the bitmap for a free inode, starting where the last search stopped
+		int *hint = &ext2_cur->inode_hints[group];
+		if (group == 0 && *hint < ext2_cur->first_ino - 1) { // skip the reserved inodes
+			*hint = ext2_cur->first_ino - 1;
+		}
+		int free_inode_idx = find_free_bit(inode_bitmap, *hint, super_block->s_inodes_per_group);
+		if (free_inode_idx < 0) {
+			unlock_group(group);
+			continue;
+		}
+		set_bitmap(&inode_bitmap, free_inode_idx, 1);
+		*hint = free_inode_idx + 1;
+		STAT_ADD(STAT_INODES_ALLOCATED, 1);
+
+		add_free(&super_block->s_free_inodes_count, -1);
+		group_desc->bg_free_inodes_count--;
+		dirty_meta(*disk, group_desc, sizeof(*group_desc));
+		unlock_group(group);
+		dirty_meta(*disk, super_block, sizeof(*super_block));
+
+		return group * super_block->s_inodes_per_group + free_inode_idx + 1;
+	}
+	fprintf(stderr, "no free inode left\n");
+	return -ENOSPC;
+}
+
+/**
+ * Allocate and return a new inode. The parent's group is tried first so a
+ * file's inode, and through it the file's blocks, stay near its directory.
+ * @param disk		 the disk
+ * @param parent_idx inode index of the parent dir; 0 for no preference
+ * @return 			 the new inode index
+ * 					 errno on failure
+ */
+unsigned int new_inode(unsigned char **disk, unsigned int parent_idx) {
+	return take_inode(disk, parent_idx > 0 ? inode_group(*disk, parent_idx) : 0);
+}
+
+/**
+ * A group's descriptor, copied under its lock: its counters change under it
+ * in a shared operation
+ */
+static struct ext2_group_desc group_counters(unsigned char *disk, unsigned int group) {
+	lock_group(group);
+	struct ext2_group_desc group_desc = *get_group_desc(disk, group);
+	unlock_group(group);
+	return group_desc;
+}
+
+/**
+ * Free blocks no operation in flight has reserved, from counters operations
+ * in other groups change meanwhile
+ */
+static long unreserved_free_blocks(unsigned char *disk) {
+	return (long)__atomic_load_n(&get_super_block(disk)->s_free_blocks_count, __ATOMIC_RELAXED) -
+		   (long)__atomic_load_n(&ext2_cur->num_reserved, __ATOMIC_RELAXED);
+}
+
+/**
+ * Group a new directory's inode goes in, after the Orlov allocator: a
+ * top-level directory goes to the group with the fewest directories among
+ * those with at least the average free inodes and blocks, so the trees below
+ * the root start apart; any other goes to the first group from its parent's
+ * on that is not much fuller than average, so a subtree stays together
+ * without piling every directory into one group. The counters are read
+ * without the group locks: one changing meanwhile only moves the guess.
+ * @param  disk       the disk
+ * @param  parent_idx inode index of the parent dir
+ * @return            the goal group
+ */
+static unsigned int dir_goal_group(unsigned char *disk, unsigned int parent_idx) {
+	struct ext2_super_block *super_block = get_super_block(disk);
+	unsigned int groups = num_groups(disk);
+	unsigned int parent_group = inode_group(disk, parent_idx);
+	if (groups == 1) {
+		return 0;
+	}
+
+	long avg_free_inodes = __atomic_load_n(&super_block->s_free_inodes_count, __ATOMIC_RELAXED) / groups;
+	long avg_free_blocks = unreserved_free_blocks(disk) / groups;
+	long num_dirs = 0;
+	for (unsigned int group = 0; group < groups; group++) {
+		num_dirs += group_counters(disk, group).bg_used_dirs_count;
+	}
+
+	if (parent_idx == EXT2_ROOT_INO) {
+		int best = -1;
+		unsigned int best_dirs = 0;
+		for (unsigned int group = 0; group < groups; group++) {
+			struct ext2_group_desc group_desc = group_counters(disk, group);
+			if (group_desc.bg_free_inodes_count == 0 || group_desc.bg_free_inodes_count < avg_free_inodes ||
+				group_desc.bg_free_blocks_count < avg_free_blocks) {
+				continue;
+			}
+			if (best < 0 || group_desc.bg_used_dirs_count < best_dirs) {
+				best = group;
+				best_dirs = group_desc.bg_used_dirs_count;
+			}
+		}
+		if (best >= 0) {
+			return best;
+		}
+	}
+
+	long max_dirs = num_dirs / groups + super_block->s_inodes_per_group / 16;
+	long min_inodes = avg_free_inodes - super_block->s_inodes_per_group / 4;
+	long min_blocks = avg_free_blocks - super_block->s_blocks_per_group / 4;
+	for (unsigned int i = 0; i < groups; i++) {
+		unsigned int group = (parent_group + i) % groups;
+		struct ext2_group_desc group_desc = group_counters(disk, group);
+		if (group_desc.bg_free_inodes_count > 0 && group_desc.bg_used_dirs_count <= max_dirs &&
+			group_desc.bg_free_inodes_count >= min_inodes && group_desc.bg_free_blocks_count >= min_blocks) {
+			return group;
+		}
+	}
+	return parent_group;
+}
+
+/**
+ * Allocate and return a new directory's inode, placed by dir_goal_group()
+ * @param disk		 the disk
+ * @param parent_idx inode index of the parent dir
+ * @return 			 the new inode index
+ * 					 errno on failure
+ */
+unsigned int new_dir_inode(unsigned char **disk, unsigned int parent_idx) {
+	return take_inode(disk, dir_goal_group(*disk, parent_idx));
+}
+
+/**
+ * Initialize the new inode.
+ * NOTE: i_mode, i_blocks, i_size, i_links_count, i_block need to be set
+ * @param disk          the disk
+ * @param new_inode_idx index of the new inode, as returned by new_inode()
+ */
+void init_inode(unsigned char **disk, unsigned int new_inode_idx) {
+	struct ext2_inode *inode = get_inode(*disk, new_inode_idx);
+	dirty_meta(*disk, inode, sizeof(*inode));
+
+	inode->i_mode = 0;
+	inode->i_blocks = 0;
+	inode->i_size = 0;
+	inode->i_links_count = 0;
+	memset(inode->i_block, 0, sizeof(inode->i_block));
+	// inode->extra = 0;
+
+	inode->i_atime = (unsigned int)time(NULL);
+	inode->i_ctime = (unsigned int)time(NULL);
+	inode->i_mtime = 0;
+	inode->i_dtime = 0;
+
+	inode->i_uid = 0;
+	inode->i_gid = 0;
+	inode->i_flags = 0;
+	inode->osd1 = 0;
+	inode->i_generation = 0;
+	inode->i_file_acl = 0;
+	inode->i_dir_acl = 0;
+	inode->i_faddr = 0;
+}
+
+
+/**
+ * Allocate a new block on the disk
+ * @param  disk the disk
+ * @param  goal block number to search from; 0 for the first free block
+ * @return      the block index
+ */
+int new_block(unsigned char **disk, unsigned int goal) {
+	int block_num;
+	int result;
+	if ((result = alloc_blocks(disk, 1, goal, &block_num)) < 0) {
+		return result;
+	}
+	return block_num;
+}
+
+
+/**
+ * First block of the group holding an inode, as an allocation goal for the
+ * inode's data
+ * @param  disk      the disk
+ * @param  inode_idx the inode index
+ * @return           the goal block number
+ */
+unsigned int inode_goal_block(unsigned char *disk, unsigned int inode_idx) {
+	return group_first_block(disk, inode_group(disk, inode_idx));
+}
+
+
+/**
+ * A run of free bits found by alloc_blocks()
+ */
+struct free_run {
+	unsigned int group;
+	int start;
+	int len;
+};
+
+/**
+ * Compare free runs by length, longest first
+ */
+static int cmp_run_len(void const *a, void const *b) {
+	return ((struct free_run const *)b)->len - ((struct free_run const *)a)->len;
+}
+
+/**
+ * Trim a run of free bits to blocks no operation in flight has reserved:
+ * skip the reserved ones at its start, then stop at the next
+ * @param  first_block the group's first block
+ * @param  index       the run's first bit, advanced past reserved blocks
+ * @param  end         the bit after the run
+ * @return             the bit after the trimmed run; *index if all of it is reserved
+ */
+static int unreserved_run(unsigned int first_block, int *index, int end) {
+	int start = find_reserved(first_block + *index, first_block + end, 0);
+	int stop = find_reserved(start, first_block + end, 1);
+	*index = start - first_block;
+	return stop - first_block;
+}
+
+/**
+ * Free runs found so far by take_blocks()
+ */
+struct run_list {
+	struct free_run *runs;
+	int num_runs;
+	int max_runs;
+	long free_total; /* blocks in the runs */
+};
+
+/**
+ * Scan the part of a group's block bitmap one step of take_blocks()'s pass
+ * covers for free runs, skipping blocks reserved by operations in flight,
+ * until one holds count blocks; the others are added to the list
+ * @param  disk     the disk
+ * @param  list     the runs found so far
+ * @param  group    the group
+ * @param  step     0 for the goal group from the goal on, the number of
+ *                  groups for the start of the goal group, anything between
+ *                  for a whole group
+ * @param  goal_bit the goal's bit in the goal group
+ * @param  count    number of blocks wanted
+ * @return          index in list->runs of a run of count blocks or more;
+ *                  -1 if there is none; -ENOMEM
+ */
+static int scan_group(unsigned char *disk, struct run_list *list, unsigned int group, unsigned int step,
+					  int goal_bit, int count) {
+	if (get_group_desc(disk, group)->bg_free_blocks_count == 0) {
+		return -1;
+	}
+	unsigned int *block_bitmap = group_block_bitmap(disk, group);
+	unsigned int first_block = group_first_block(disk, group);
+	int hint = ext2_cur->block_hints[group];
+	int index = hint;
+	int limit = group_num_blocks(disk, group);
+	if (step == 0 && goal_bit > index) {
+		index = goal_bit;
+	} else if (step == num_groups(disk)) {
+		if (goal_bit <= hint) { // nothing left below the goal
+			return -1;
+		}
+		limit = goal_bit;
+	}
+
+	while (index < limit && (index = find_free_bit(block_bitmap, index, limit)) >= 0) {
+		int end = find_used_bit(block_bitmap, index, limit);
+		if (__atomic_load_n(&ext2_cur->num_reserved, __ATOMIC_RELAXED) > 0 &&
+			(end = unreserved_run(first_block, &index, end)) == index) {
+			continue;
+		}
+		if (list->num_runs == list->max_runs) {
+			struct free_run *grown = realloc(list->runs, sizeof(struct free_run) * list->max_runs * 2);
+			if (grown == NULL) {
+				perror("alloc_blocks: realloc");
+				return -ENOMEM;
+			}
+			list->runs = grown;
+			list->max_runs *= 2;
+		}
+		list->runs[list->num_runs].group = group;
+		list->runs[list->num_runs].start = index;
+		list->runs[list->num_runs].len = end - index;
+		if (end - index >= count) {
+			return list->num_runs;
+		}
+		list->num_runs++;
+		list->free_total += end - index;
+		index = end;
+	}
+	return -1;
+}
+
+/**
+ * Mark the first len blocks of a free run used, or reserve them, with its
+ * group's counter and hint in step; the superblock's is the caller's
+ * @param  disk    the disk
+ * @param  run     the run
+ * @param  len     number of blocks to take from its start
+ * @param  out     filled with their block numbers
+ * @param  reserve 1 to reserve the blocks, 0 to mark them used
+ */
+static void take_run(unsigned char *disk, struct free_run const *run, int len, int *out, int reserve) {
+	unsigned int *block_bitmap = group_block_bitmap(disk, run->group);
+	unsigned int first_block = group_first_block(disk, run->group);
+	int *hint = &ext2_cur->block_hints[run->group];
+
+	for (int j = 0; j < len; j++) {
+		out[j] = first_block + run->start + j;
+	}
+	if (reserve) { // counted before the group is unlocked, for scan_group()
+		mark_reserved(ext2_cur, first_block + run->start, len, 1);
+		add_reserved(ext2_cur, len);
+		return;
+	}
+	set_bitmap_range(&block_bitmap, run->start, len, 1);
+	if (run->start == *hint) {
+		*hint = run->start + len;
+	}
+	struct ext2_group_desc *group_desc = get_group_desc(disk, run->group);
+	group_desc->bg_free_blocks_count -= len;
+	dirty_meta(disk, group_desc, sizeof(*group_desc));
+}
+
+/**
+ * Find count free blocks in as few contiguous runs as possible, and mark
+ * them used or only reserve them. The groups' bitmaps are scanned once,
+ * starting from the goal's group and wrapping around; the first run big
+ * enough for the whole request wins, otherwise the longest runs are taken.
+ * Blocks reserved by operations in flight count as used.
+ * In a shared operation the scan for a single run locks one group at a
+ * time, so allocations in different groups go side by side; only a request
+ * that has to be split locks them all to pick the longest runs.
+ * @param  disk    the disk
+ * @param  count   number of blocks wanted
+ * @param  goal    block number to start searching from; 0 for the first free block
+ * @param  out     filled with the block numbers, in disk order per run
+ * @param  reserve 1 to reserve the blocks, 0 to mark them used
+ * @return         count on success; -ENOSPC if there are not enough free blocks
+ */
+static int take_blocks(unsigned char **disk, int count, int goal, int *out, int reserve) {
+	struct ext2_super_block *super_block = get_super_block(*disk);
+	unsigned int groups = num_groups(*disk);
+
+	if (count <= 0) {
+		return 0;
+	}
+	if (count > unreserved_free_blocks(*disk)) {
+		return -ENOSPC;
+	}
+
+	unsigned int goal_group = 0;
+	int goal_bit = 0;
+	if (goal > 0 && goal < super_block->s_blocks_count && goal >= super_block->s_first_data_block) {
+		goal_group = block_group(*disk, goal);
+		goal_bit = goal - group_first_block(*disk, goal_group);
+	}
+
+	struct run_list list = {malloc(sizeof(struct free_run) * 16), 0, 16, 0};
+	if (list.runs == NULL) {
+		perror("alloc_blocks: malloc");
+		return -ENOMEM;
+	}
+
+	// the same pass for a single run, each group under its own lock
+	int found = -1;
+	for (unsigned int i = 0; held.shared && i <= groups && found == -1; i++) {
+		unsigned int group = (goal_group + i) % groups;
+		lock_group(group);
+		list.num_runs = 0;
+		list.free_total = 0;
+		if ((found = scan_group(*disk, &list, group, i, goal_bit, count)) >= 0) {
+			take_run(*disk, &list.runs[found], count, out, reserve);
+		}
+		unlock_group(group);
+	}
+
+	if (found == -1) {
+		// one pass: the goal group from the goal on, every other group, then
+		// the start of the goal group
+		lock_all_groups();
+		list.num_runs = 0;
+		list.free_total = 0;
+		for (unsigned int i = 0; i <= groups && found == -1; i++) {
+			found = scan_group(*disk, &list, (goal_group + i) % groups, i, goal_bit, count);
+		}
+
+		if (found >= 0) { // a single run holds everything
+			take_run(*disk, &list.runs[found], count, out, reserve);
+		} else if (found == -1 && list.free_total >= count) { // fewest runs: take the longest ones first
+			qsort(list.runs, list.num_runs, sizeof(struct free_run), cmp_run_len);
+			int filled = 0;
+			for (int i = 0; i < list.num_runs && filled < count; i++) {
+				int len = list.runs[i].len < count - filled ? list.runs[i].len : count - filled;
+				take_run(*disk, &list.runs[i], len, out + filled, reserve);
+				filled += len;
+			}
+			found = 0;
+		}
+		unlock_all_groups();
+	}
+	free(list.runs);
+	if (found < 0) {
+		return found == -1 ? -ENOSPC : found;
+	}
+
+	if (reserve) {
+		return count;
+	}
+	add_free(&super_block->s_free_blocks_count, -count);
+	dirty_meta(*disk, super_block, sizeof(*super_block));
+	STAT_ADD(STAT_BLOCKS_ALLOCATED, count);
+	return count;
+}
+
+/**
+ * take_blocks(), with the directories' preallocation windows given back and
+ * another try if the free blocks left are all in them. If the rest are held
+ * for committed operations until the next flush, the operation is to be
+ * undone, and run again after it, see end_op().
+ * @return as take_blocks(); -ERESTART to run again after a flush
+ */
+static int take_blocks_or_windows(unsigned char **disk, int count, int goal, int *out, int reserve) {
+	int result = take_blocks(disk, count, goal, out, reserve);
+	if (result == -ENOSPC && release_dir_windows(*disk, 0) > 0) {
+		result = take_blocks(disk, count, goal, out, reserve);
+	}
+	if (result == -ENOSPC && ext2_cur->num_freed_committed > 0) {
+		return -ERESTART; // end_op() flushes to let go of them, for the operation to run again
+	}
+	if (result == -ENOSPC) {
+		fprintf(stderr, "alloc_blocks: no free block left\n");
+	}
+	return result;
+}
+
+/**
+ * Allocate count blocks in as few contiguous runs as possible, see
+ * take_blocks(). The free block counters are updated once per run instead of
+ * once per block.
+ * @param  disk  the disk
+ * @param  count number of blocks wanted
+ * @param  goal  block number to start searching from; 0 for the first free block
+ * @param  out   filled with the allocated block numbers, in disk order per run
+ * @return       count on success; -ENOSPC if there are not enough free blocks,
+ *               -ERESTART if there are after the next flush
+ */
+int alloc_blocks(unsigned char **disk, int count, int goal, int *out) {
+	return take_blocks_or_windows(disk, count, goal, out, 0);
+}
+
+/**
+ * Set count free blocks aside for an operation that writes them before its
+ * metadata: the image is left as it is, but no allocation hands them out
+ * until unreserve_blocks() lets them go, used by then or not.
+ * Reservations live in memory only and are lost with the mapping.
+ * @param  disk  the disk
+ * @param  count number of blocks wanted
+ * @param  goal  block number to start searching from; 0 for the first free block
+ * @param  out   filled with the reserved block numbers, in disk order per run
+ * @return       count on success; -ENOSPC if there are not enough free blocks,
+ *               -ERESTART if there are after the next flush, -ENOMEM
+ */
+int reserve_blocks(unsigned char **disk, int count, int goal, int *out) {
+	int result = reserved_map(*disk);
+	if (result < 0) {
+		return result;
+	}
+	return take_blocks_or_windows(disk, count, goal, out, 1);
+}
+
+/**
+ * Give reserved blocks back, as free as they were, see reserve_blocks().
+ * Those freed since they were taken stay reserved, held until the next
+ * flush, see hold_freed_blocks().
+ * @param  disk   the disk
+ * @param  blocks the reserved blocks
+ * @param  count  number of blocks
+ */
+void unreserve_blocks(unsigned char *disk, int const *blocks, int count) {
+	int kept = 0;
+	pthread_mutex_lock(&freed_lock);
+	for (int i = 0; i < count; i++) {
+		if (take_over_freed(blocks[i])) {
+			kept++;
+		} else {
+			mark_reserved(ext2_cur, blocks[i], 1, 0);
+		}
+	}
+	for (unsigned int i = 0; kept > 0 && i < ext2_cur->num_freed; i++) {
+		if (ext2_cur->freed[i].reserved == 2) {
+			ext2_cur->freed[i].reserved = 0;
+			ext2_cur->num_freed_reserved--;
+		}
+	}
+	pthread_mutex_unlock(&freed_lock);
+	add_reserved(ext2_cur, kept - count);
+}
+
+/**
+ * Mark reserved blocks used, a contiguous run at a time, see
+ * reserve_blocks(). They stay reserved until unreserve_blocks(): an
+ * operation undone after this still has them to retry with.
+ * @param  disk   the disk
+ * @param  blocks the reserved blocks
+ * @param  count  number of blocks
+ */
+void claim_blocks(unsigned char *disk, int const *blocks, int count) {
+	for (int i = 0; i < count;) {
+		int run = 1;
+		while (i + run < count && blocks[i + run] == blocks[i] + run) {
+			run++;
+		}
+		mark_block_range(disk, blocks[i], run, 1);
+		i += run;
+	}
+	STAT_ADD(STAT_BLOCKS_ALLOCATED, count);
+}
+
+
+/**
+ * The window slot a directory's preallocation goes in. Inode numbers are
+ * hashed: the directories spread over the groups sit whole groups apart.
+ */
+static struct dir_window *dir_window(unsigned int dir_idx) {
+	return &ext2_cur->dir_windows[(dir_idx * 0x9e3779b1u >> 16) % EXT2_DIR_WINDOWS];
+}
+
+/**
+ * Give a preallocation window's blocks back and close it. The windows are
+ * locked by the caller here and below.
+ */
+static void close_dir_window(struct dir_window *window) {
+	if (window->len > 0) {
+		mark_reserved(ext2_cur, window->start, window->len, 0);
+		add_reserved(ext2_cur, -window->len);
+	}
+	window->dir_idx = 0;
+	window->len = 0;
+}
+
+/**
+ * Close a directory's preallocation window, or every directory's
+ * @param  disk    the disk
+ * @param  dir_idx inode index of the directory; 0 for all of them
+ * @return         number of blocks given back
+ */
+int release_dir_windows(unsigned char *disk, unsigned int dir_idx) {
+	int released = 0;
+	lock_windows();
+	for (int i = 0; i < EXT2_DIR_WINDOWS; i++) {
+		struct dir_window *window = &ext2_cur->dir_windows[i];
+		if (window->dir_idx != 0 && (dir_idx == 0 || window->dir_idx == dir_idx)) {
+			released += window->len;
+			close_dir_window(window);
+		}
+	}
+	unlock_windows();
+	return released;
+}
+
+/**
+ * Open a directory's preallocation window: reserve the free blocks from
+ * start on, up to the image's window size and within start's group, for the
+ * directory's next blocks. The window takes the slot of whichever directory
+ * held it before.
+ * @param  disk    the disk
+ * @param  dir_idx inode index of the directory
+ * @param  start   the block after the directory's last
+ */
+static void open_dir_window(unsigned char *disk, unsigned int dir_idx, unsigned int start) {
+	struct ext2_super_block *super_block = get_super_block(disk);
+	struct dir_window *window = dir_window(dir_idx);
+	close_dir_window(window);
+	if (ext2_cur->dir_window_blocks == 0 || start < super_block->s_first_data_block ||
+		start >= super_block->s_blocks_count || reserved_map(disk) < 0) {
+		return;
+	}
+
+	unsigned int group = block_group(disk, start);
+	unsigned int first_block = group_first_block(disk, group);
+	int index = start - first_block;
+	int limit = group_num_blocks(disk, group);
+	if (index + ext2_cur->dir_window_blocks < limit) {
+		limit = index + ext2_cur->dir_window_blocks;
+	}
+	lock_group(group);
+	int end = find_used_bit(group_block_bitmap(disk, group), index, limit);
+	if (__atomic_load_n(&ext2_cur->num_reserved, __ATOMIC_RELAXED) > 0) {
+		end = find_reserved(start, first_block + end, 1) - first_block;
+	}
+	if (end > index) {
+		mark_reserved(ext2_cur, start, end - index, 1);
+		add_reserved(ext2_cur, end - index);
+		window->dir_idx = dir_idx;
+		window->start = start;
+		window->len = end - index;
+	}
+	unlock_group(group);
+}
+
+
+/**
+ * Number of indirect blocks needed to map a file of num_data blocks
+ * @param  num_data number of data blocks
+ * @return          number of single/double/triple indirect blocks
+ */
+int indirect_blocks_needed(int num_data) {
+	long ptrs = EXT2_BLOCK_SIZE / sizeof(unsigned int);
+	long left = num_data - EXT2_NDIR_BLOCKS;
+	int meta = 0;
+
+	if (left <= 0) {
+		return 0;
+	}
+	// single indirect
+	meta++;
+	if ((left -= ptrs) <= 0) {
+		return meta;
+	}
+	// double indirect: the top block plus one per ptrs data blocks
+	long ind = (left + ptrs - 1) / ptrs;
+	meta += 1 + (ind < ptrs ? ind : ptrs);
+	if ((left -= ptrs * ptrs) <= 0) {
+		return meta;
+	}
+	// triple indirect
+	meta += 1 + (left + ptrs * ptrs - 1) / (ptrs * ptrs) + (left + ptrs - 1) / ptrs;
+	return meta;
+}
+
+
+/**
+ * Find the slot holding the physical block of a logical block. Missing
+ * indirect blocks on the way are taken from blocks[*next] and zeroed, or make
+ * the lookup fail when blocks is NULL.
+ * @param  disk   the disk
+ * @param  inode  the inode
+ * @param  lblk   logical block number in the file
+ * @param  blocks spare blocks for indirect blocks; NULL for a plain lookup
+ * @param  next   index of the next spare block, advanced as they are used
+ * @return        the slot; NULL if lblk is not mapped or out of range
+ */
+static unsigned int *block_slot(unsigned char *disk, struct ext2_inode *inode, unsigned int lblk,
+								int const *blocks, int *next) {
+	unsigned long ptrs = EXT2_BLOCK_SIZE / sizeof(unsigned int);
+	unsigned long index = lblk;
+	unsigned int *slot;
+	int level;
+
+	if (index < EXT2_NDIR_BLOCKS) {
+		return &inode->i_block[index];
+	}
+	index -= EXT2_NDIR_BLOCKS;
+	if (index < ptrs) {
+		level = 1;
+		slot = &inode->i_block[EXT2_IND_BLOCK];
+	} else if ((index -= ptrs) < ptrs * ptrs) {
+		level = 2;
+		slot = &inode->i_block[EXT2_DIND_BLOCK];
+	} else if ((index -= ptrs * ptrs) < ptrs * ptrs * ptrs) {
+		level = 3;
+		slot = &inode->i_block[EXT2_TIND_BLOCK];
+	} else {
+		return NULL;
+	}
+
+	for (; level > 0; level--) {
+		if (*slot == 0) {
+			if (blocks == NULL) {
+				return NULL;
+			}
+			*slot = blocks[(*next)++];
+			dirty_meta(disk, slot, sizeof(*slot));
+			memset(disk + (size_t)EXT2_BLOCK_SIZE * *slot, 0, EXT2_BLOCK_SIZE);
+			dirty_meta(disk, disk + (size_t)EXT2_BLOCK_SIZE * *slot, EXT2_BLOCK_SIZE);
+		}
+		unsigned int *table = (unsigned int *)(disk + (size_t)EXT2_BLOCK_SIZE * *slot);
+		unsigned long span = level == 3 ? ptrs * ptrs : level == 2 ? ptrs : 1;
+		slot = &table[index / span];
+		index %= span;
+	}
+	return slot;
+}
+
+
+/**
+ * Map a file's logical block to its physical block, following indirect blocks
+ * @param  disk  the disk
+ * @param  inode the inode
+ * @param  lblk  logical block number in the file
+ * @return       the physical block number; 0 for a hole
+ */
+unsigned int inode_block(unsigned char *disk, struct ext2_inode *inode, unsigned int lblk) {
+	unsigned int *slot = block_slot(disk, inode, lblk, NULL, NULL);
+	return slot == NULL ? 0 : *slot;
+}
+
+
+/**
+ * Lay num_data data blocks out in an inode's block pointers. blocks holds the
+ * data blocks and the indirect blocks together (see indirect_blocks_needed());
+ * each indirect block is taken from it just before the data it maps, so a
+ * contiguous allocation stays sequential on disk.
+ * @param  disk        the disk
+ * @param  inode       the inode, with i_block zeroed
+ * @param  blocks      the allocated blocks, in the order to use them
+ * @param  num_data    number of data blocks
+ * @param  data_blocks filled with the physical block of each logical block
+ * @return             number of entries of blocks used; -EFBIG if too many
+ */
+int map_inode_blocks(unsigned char *disk, struct ext2_inode *inode, int const *blocks, int num_data,
+					 int *data_blocks) {
+	int next = 0;
+	for (int lblk = 0; lblk < num_data; lblk++) {
+		unsigned int *slot = block_slot(disk, inode, lblk, blocks, &next);
+		if (slot == NULL) {
+			return -EFBIG;
+		}
+		*slot = blocks[next++];
+		dirty_meta(disk, slot, sizeof(*slot));
+		data_blocks[lblk] = *slot;
+	}
+	return next;
+}
+
+/**
+ * Which entries of blocks map_inode_blocks() would make data blocks, without
+ * mapping anything: it takes each indirect block just before the first data
+ * block under it
+ * @param  blocks      the blocks, in the order map_inode_blocks() would take them
+ * @param  num_data    number of data blocks
+ * @param  data_blocks filled with the physical block of each logical block
+ * @return             0 on success; -EFBIG if too many
+ */
+static int layout_data_blocks(int const *blocks, int num_data, int *data_blocks) {
+	long ptrs = EXT2_BLOCK_SIZE / sizeof(unsigned int);
+	if (num_data > EXT2_NDIR_BLOCKS + ptrs + ptrs * ptrs + ptrs * ptrs * ptrs) {
+		return -EFBIG;
+	}
+	int next = 0;
+	for (long lblk = 0; lblk < num_data; lblk++) {
+		long index = lblk - EXT2_NDIR_BLOCKS;
+		if (index < 0) { // direct: no indirect block on the way
+		} else if (index < ptrs) {
+			next += index == 0;
+		} else if ((index -= ptrs) < ptrs * ptrs) {
+			next += (index == 0) + (index % ptrs == 0);
+		} else {
+			index -= ptrs * ptrs;
+			next += (index == 0) + (index % (ptrs * ptrs) == 0) + (index % ptrs == 0);
+		}
+		data_blocks[lblk] = blocks[next++];
+	}
+	return 0;
+}
+
+
+/**
+ * Visit the blocks under one block pointer
+ * @return the first nonzero visit() result, 0 otherwise
+ */
+static int walk_indirect(unsigned char *disk, unsigned int block_num, int level,
+						 int (*visit)(unsigned char *disk, unsigned int block_num, int is_meta,
+									  void *arg),
+						 void *arg) {
+	int result;
+	if (block_num == 0) {
+		return 0;
+	}
+	if ((result = visit(disk, block_num, level > 0, arg)) != 0 || level == 0) {
+		return result;
+	}
+	unsigned int *table = (unsigned int *)(disk + (size_t)EXT2_BLOCK_SIZE * block_num);
+	for (int i = 0; i < EXT2_BLOCK_SIZE / sizeof(unsigned int); i++) {
+		if ((result = walk_indirect(disk, table[i], level - 1, visit, arg)) != 0) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Whether an inode is a fast symlink, one whose target is kept in i_block
+ * itself. It owns no blocks, so its pointers must not be read as such.
+ */
+int is_fast_symlink(struct ext2_inode *inode) {
+	return (inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFLNK && inode->i_blocks == 0;
+}
+
+/**
+ * Visit every block an inode owns: data blocks and the indirect blocks that
+ * map them, each indirect block before the blocks it points to. A fast
+ * symlink has none.
+ * @param  disk  the disk
+ * @param  inode the inode
+ * @param  visit called per block; is_meta is 1 for indirect blocks. A nonzero
+ * 				 return stops the walk
+ * @param  arg   passed through to visit
+ * @return       the first nonzero visit() result, 0 otherwise
+ */
+int walk_inode_blocks(unsigned char *disk, struct ext2_inode *inode,
+					  int (*visit)(unsigned char *disk, unsigned int block_num, int is_meta, void *arg),
+					  void *arg) {
+	if (is_fast_symlink(inode)) {
+		return 0;
+	}
+	int result;
+	for (int i = 0; i < EXT2_N_BLOCKS; i++) {
+		int level = i < EXT2_NDIR_BLOCKS ? 0 : i - EXT2_NDIR_BLOCKS + 1;
+		if ((result = walk_indirect(disk, inode->i_block[i], level, visit, arg)) != 0) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Mark every block an inode owns used or free, a run at a time from its block map
+ * @param  disk      the disk
+ * @param  inode_idx the inode's index
+ * @param  value     1 to mark used, 0 to mark free
+ * @return           number of blocks whose bit changed; -ENOMEM
+ */
+int mark_inode_blocks(unsigned char *disk, unsigned int inode_idx, int value) {
+	struct bmap const *map = bmap_get(disk, inode_idx);
+	if (map == NULL) {
+		return -ENOMEM;
+	}
+	int changed = 0;
+	for (unsigned int i = 0; i < map->num_owned; i++) {
+		changed += mark_block_range(disk, map->owned[i].pblk, map->owned[i].len, value);
+	}
+	return changed;
+}
+
+
+/**
+ * Read exactly len bytes from fd straight into the mapping
+ * @return 0 on success; errno on failure or early EOF
+ */
+static int read_full(int fd, unsigned char *dst, size_t len) {
+	while (len > 0) {
+		ssize_t got = read(fd, dst, len);
+		if (got < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("read_full: read");
+			return -errno;
+		}
+		if (got == 0) {
+			fprintf(stderr, "read_full: source file shrank while copying\n");
+			return -EIO;
+		}
+		dst += got;
+		len -= got;
+	}
+	return 0;
+}
+
+/**
+ * Stream a local file into its data blocks. Each run of physically
+ * contiguous blocks is filled with one copy_file_range() into the image file,
+ * falling back to one large read() into the mapping, so the data never goes
+ * through an intermediate buffer.
+ * @param  disk        the disk
+ * @param  src_fd      the local file, positioned at its start
+ * @param  data_blocks physical block of each logical block
+ * @param  num_data    number of data blocks
+ * @param  size        file size in bytes
+ * @return             0 on success; errno on failure
+ */
+int copy_into_blocks(unsigned char *disk, int src_fd, int const *data_blocks, int num_data,
+					 unsigned long long size) {
+	int use_copy_range = 1;
+	int lblk = 0;
+	while (lblk < num_data) {
+		// extend the run while the next block follows on disk
+		int run = 1;
+		while (lblk + run < num_data && data_blocks[lblk + run] == data_blocks[lblk] + run) {
+			run++;
+		}
+		unsigned long long offset = (unsigned long long)lblk * EXT2_BLOCK_SIZE;
+		size_t len = (size_t)run * EXT2_BLOCK_SIZE;
+		if (offset + len > size) {
+			len = size - offset;
+		}
+		unsigned char *dst = disk + (size_t)EXT2_BLOCK_SIZE * data_blocks[lblk];
+
+		size_t done = 0;
+		while (use_copy_range && done < len) {
+			loff_t dst_off = (loff_t)EXT2_BLOCK_SIZE * data_blocks[lblk] + done;
+			ssize_t copied = copy_file_range(src_fd, NULL, ext2_cur->map_fd, &dst_off, len - done, 0);
+			if (copied <= 0) { // not supported here, or EOF: let read() sort it out
+				use_copy_range = 0;
+				break;
+			}
+			done += copied;
+		}
+		size_t slack = (size_t)run * EXT2_BLOCK_SIZE - len;
+		int result;
+		if (done < len) {
+			// a block is written either through the file or through the mapping,
+			// never both: redo a partly copied one through the mapping
+			if (done % EXT2_BLOCK_SIZE != 0) {
+				if (lseek(src_fd, -(off_t)(done % EXT2_BLOCK_SIZE), SEEK_CUR) < 0) {
+					perror("copy_into_blocks: lseek");
+					return -errno;
+				}
+				done -= done % EXT2_BLOCK_SIZE;
+			}
+			if (done > 0) {
+				dirty_fd_data(disk, data_blocks[lblk], done / EXT2_BLOCK_SIZE);
+			}
+			if ((result = read_full(src_fd, dst + done, len - done)) < 0) {
+				return result;
+			}
+			// zero the slack after the end of the file
+			memset(dst + len, 0, slack);
+			dirty_data(disk, dst + done, len - done + slack);
+		} else {
+			static unsigned char const zeros[EXT2_MAX_BLOCK_SIZE];
+			if (slack > 0 && // the same, through the file
+				pwrite(ext2_cur->map_fd, zeros, slack,
+					   (off_t)EXT2_BLOCK_SIZE * data_blocks[lblk] + len) != (ssize_t)slack) {
+				perror("copy_into_blocks: pwrite");
+				return -EIO;
+			}
+			dirty_fd_data(disk, data_blocks[lblk], run);
+		}
+		lblk += run;
+	}
+	return 0;
+}
+
+
+
+/**
+ * Bytes a new entry could take after (or, for an unused entry, in place of)
+ * an existing one
+ */
+static int entry_slack(struct ext2_dir_entry *entry) {
+	int used = entry->inode == 0 ? 0 : dir_entry_size(entry->name_len);
+	return entry->rec_len - used;
+}
+
+
+/**
+ * Put a new entry in the slack of an existing one, splitting its rec_len
+ */
+static void place_entry(unsigned char *block, struct ext2_dir_entry *at, unsigned int inode_idx,
+						char const *name, int name_len, unsigned char type) {
+	struct ext2_dir_entry *entry = at;
+	if (at->inode != 0) {
+		int used = dir_entry_size(at->name_len);
+		entry = (struct ext2_dir_entry *)((unsigned char *)at + used);
+		entry->rec_len = at->rec_len - used;
+		at->rec_len = used;
+	}
+	entry->inode = inode_idx;
+	entry->name_len = name_len;
+	entry->file_type = type;
+	memcpy(entry->name, name, name_len);
+	dirty_meta(ext2_cur->disk, block, EXT2_BLOCK_SIZE);
+}
+
+
+/**
+ * Bring the free-slot index up to date with one block of a directory, if
+ * the directory is indexed there
+ */
+static void note_dir_block(unsigned char *disk, unsigned int dir_idx, unsigned int lblk) {
+	if (dslot_tracked(dir_idx)) {
+		dslot_set(dir_idx, lblk, dir_block_gap(dir_block(disk, get_inode(disk, dir_idx), lblk)));
+	}
+}
+
+
+/**
+ * Put a new entry in the first block of a plain directory with a gap that
+ * fits it, indexing the directory's gaps on its first use
+ * @return 1 if it fit, 0 if no block has room
+ */
+static int dir_fill_gap(unsigned char *disk, unsigned int dir_idx, unsigned int inode_idx,
+						char const *name, int name_len, unsigned char type) {
+	struct ext2_inode *dir_inode = get_inode(disk, dir_idx);
+	unsigned int num_blocks = dir_num_blocks(dir_inode);
+	int need = dir_entry_size(name_len);
+	int lblk;
+
+	if (!dslot_tracked(dir_idx)) {
+		if (dslot_track(dir_idx) < 0) {
+			return 0;
+		}
+		for (unsigned int i = 0; i < num_blocks; i++) {
+			dslot_set(dir_idx, i, dir_block_gap(dir_block(disk, dir_inode, i)));
+		}
+	}
+	while ((lblk = dslot_find(dir_idx, need)) >= 0) {
+		unsigned char *block = (unsigned int)lblk < num_blocks ? dir_block(disk, dir_inode, lblk) : NULL;
+		int placed = block != NULL && dir_block_insert(block, inode_idx, name, name_len, type);
+		dslot_set(dir_idx, lblk, dir_block_gap(block)); // also corrects a stale hint
+		if (placed) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+/**
+ * update the parent directory given the current index. Indexed directories
+ * insert through their index. Others append to their last block, then take
+ * the first gap elsewhere that fits (see dslot.h) before growing; a directory
+ * outgrowing its first block gets an index where the file system supports it.
+ * @param parent_idx   parent dir's inode index
+ * @param current_idx  the current entry's inode index
+ * @param name         the current entry's name
+ * @param type         dirent type for the current entry
+ * @return			   0 on success, errno on failure
+ */
+int update_dir_entry(unsigned char **disk, unsigned int parent_idx,
+					  unsigned int current_idx, char *name, unsigned char type) {
+	struct ext2_inode *parent_inode = get_inode(*disk, parent_idx);
+	int name_len = strlen(name);
+	dirty_dir(*disk, parent_idx);
+	int result = -EUCLEAN;
+
+	if (parent_inode->i_flags & EXT2_INDEX_FL) {
+		result = dx_insert(disk, parent_idx, current_idx, name, name_len, type);
+	}
+	if (result == -EUCLEAN) { // not indexed, or the index was broken and dropped
+		unsigned int num_blocks = dir_num_blocks(parent_inode);
+		unsigned char *last = num_blocks > 0 ? dir_block(*disk, parent_inode, num_blocks - 1) : NULL;
+		if (last != NULL && dir_block_append(last, current_idx, name, name_len, type)) {
+			note_dir_block(*disk, parent_idx, num_blocks - 1);
+			result = 0;
+		} else if (dir_fill_gap(*disk, parent_idx, current_idx, name, name_len, type)) {
+			result = 0;
+		} else if (num_blocks == 1 && dx_can_index(*disk)) {
+			dslot_forget_dir(parent_idx);
+			if ((result = dx_make_indexed(disk, parent_idx)) == 0) {
+				result = dx_insert(disk, parent_idx, current_idx, name, name_len, type);
+			}
+		} else {
+			unsigned int lblk;
+			int block_num = dir_add_block(disk, parent_idx, &lblk);
+			if (block_num < 0) {
+				return block_num;
+			}
+			dir_block_append(*disk + (size_t)EXT2_BLOCK_SIZE * block_num, current_idx, name, name_len,
+							 type);
+			note_dir_block(*disk, parent_idx, lblk);
+			result = 0;
+		}
+	}
+	if (result == 0) {
+		dcache_insert(parent_idx, name, name_len, current_idx);
+	}
+	return result;
+}
+
+
+/**
+ * Parse the given absolute path to the path and the file/dir name
+ * @param  absolute_path the given absolute path
+ * @param  path          the path to file
+ * @param  name          the file/dir name
+ * @return               0 on success
+ * 						 -1 on failure
+ */
+int parse_path(char const *absolute_path, char **path, char **name) {
+	if (absolute_path[0] != '/') {
+		fprintf(stderr, "%s is not absolute\n", absolute_path);
+		return -EINVAL;
+	}
+	// ignore trailing '/'s
+	int len = strlen(absolute_path);
+	while (len > 1 && absolute_path[len - 1] == '/') {
+		len--;
+	}
+	// the name is everything after the last '/', the path everything before it
+	int name_start = len;
+	while (name_start > 0 && absolute_path[name_start - 1] != '/') {
+		name_start--;
+	}
+	int path_len = name_start > 1 ? name_start - 1 : 1;
+	if (!(*name = strndup(absolute_path + name_start, len - name_start))) {
+		perror("parse_path: malloc");
+		return -1;
+	}
+	if (!(*path = strndup(absolute_path, path_len))) {
+		perror("parse_path: malloc");
+		free(*name);
+		*name = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+
+// ---------- Directory Traversal ----------
+
+/**
+ * Tell the . and .. entries apart from real children
+ * @param  entry the dirent
+ * @return       1 for . or .., 0 otherwise
+ */
+int is_dot_entry(struct ext2_dir_entry *entry) {
+	return (entry->name_len == 1 && entry->name[0] == '.') ||
+		   (entry->name_len == 2 && entry->name[0] == '.' && entry->name[1] == '.');
+}
+
+
+/**
+ * Start the first directory block after index on its way in while the
+ * current one is visited: readahead for lazy mappings, a cache line otherwise
+ */
+static void prefetch_dir_block(unsigned char *disk, struct ext2_inode *dir_inode, int index) {
+	for (; index < dir_num_blocks(dir_inode); index++) {
+		unsigned int block_num = inode_block(disk, dir_inode, index);
+		if (block_num != 0 && block_num < ext2_cur->super_block->s_blocks_count) {
+			size_t offset = (size_t)EXT2_BLOCK_SIZE * block_num;
+			if (ext2_cur->map_mode == EXT2_MAP_LAZY) {
+				map_willneed(disk, offset, EXT2_BLOCK_SIZE);
+			} else {
+				__builtin_prefetch(disk + offset);
+			}
+			return;
+		}
+	}
+}
+
+
+/**
+ * Start a directory's blocks after its first on their way in before it is
+ * traversed, one madvise() per contiguous run, so a cold directory spread over
+ * many blocks waits on the disk about once instead of once per block. The
+ * first block is left to fault in: it is needed at once.
+ * @param disk    the disk
+ * @param dir_idx inode index of the directory
+ */
+void dir_readahead(unsigned char *disk, unsigned int dir_idx) {
+	struct ext2_inode *dir_inode = get_inode(disk, dir_idx);
+	unsigned int blocks_count = ext2_cur->super_block->s_blocks_count;
+	unsigned int num_blocks = dir_num_blocks(dir_inode);
+	unsigned int run_start = 0;
+	unsigned int run_len = 0;
+
+	for (unsigned int lblk = 1; lblk < num_blocks; lblk++) {
+		unsigned int block_num = inode_block(disk, dir_inode, lblk);
+		if (block_num == 0 || block_num >= blocks_count) {
+			continue;
+		}
+		if (run_len > 0 && block_num == run_start + run_len) {
+			run_len++;
+			continue;
+		}
+		if (run_len > 0) {
+			map_willneed(disk, (size_t)EXT2_BLOCK_SIZE * run_start, (size_t)EXT2_BLOCK_SIZE * run_len);
+		}
+		run_start = block_num;
+		run_len = 1;
+	}
+	if (run_len > 0) {
+		map_willneed(disk, (size_t)EXT2_BLOCK_SIZE * run_start, (size_t)EXT2_BLOCK_SIZE * run_len);
+	}
+}
+
+
+/**
+ * Point a cursor before the first entry of a directory
+ * @param cursor  the cursor
+ * @param dir_idx inode index of the directory
+ */
+void dir_open(struct dir_cursor *cursor, unsigned int dir_idx) {
+	cursor->dir_idx = dir_idx;
+	cursor->block = 0;
+	cursor->offset = 0;
+}
+
+
+/**
+ * Step to the next live entry of the cursor's directory, hopping rec_len
+ * through its blocks and passing over unused (inode 0) entries, index
+ * blocks' included.
+ * Blocks out of range and entries that run off their block end a block early.
+ * @param  disk   the disk
+ * @param  cursor the cursor, advanced past the entry
+ * @return        the entry, in place on the disk; NULL when there are no more
+ */
+struct ext2_dir_entry *dir_next(unsigned char *disk, struct dir_cursor *cursor) {
+	struct ext2_inode *dir_inode = get_inode(disk, cursor->dir_idx);
+	unsigned int blocks_count = ext2_cur->super_block->s_blocks_count;
+
+	while (cursor->block < dir_num_blocks(dir_inode)) {
+		unsigned int block_num = inode_block(disk, dir_inode, cursor->block);
+		if (block_num == 0 || block_num >= blocks_count ||
+			cursor->offset > EXT2_BLOCK_SIZE - (int)sizeof(struct ext2_dir_entry)) {
+			cursor->block++;
+			cursor->offset = 0;
+			continue;
+		}
+		if (cursor->offset == 0) {
+			prefetch_dir_block(disk, dir_inode, cursor->block + 1);
+			STAT_ADD(STAT_DIR_BLOCKS, 1);
+		}
+		struct ext2_dir_entry *entry =
+			(struct ext2_dir_entry *)(disk + (size_t)EXT2_BLOCK_SIZE * block_num + cursor->offset);
+		if (entry->rec_len == 0) { // corrupt block, don't spin on it
+			cursor->offset = EXT2_BLOCK_SIZE;
+			continue;
+		}
+		cursor->offset += entry->rec_len;
+		STAT_ADD(STAT_DIR_RECORDS, 1);
+		if (entry->inode != 0) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+
+/**
+ * Visit every live entry of one directory, . and .. included
+ * @param  disk    the disk
+ * @param  dir_idx inode index of the directory
+ * @param  visit   called per entry with depth 0
+ * @param  arg     passed through to visit
+ * @return         the visitor's stop result; 0 if it never stopped
+ */
+int walk_dir(unsigned char *disk, unsigned int dir_idx, dir_visit_fn visit, void *arg) {
+	struct dir_cursor cursor;
+	struct ext2_dir_entry *entry;
+	int result;
+
+	dir_open(&cursor, dir_idx);
+	dir_readahead(disk, dir_idx);
+	while ((entry = dir_next(disk, &cursor)) != NULL) {
+		if ((result = visit(disk, dir_idx, entry, 0, arg)) != WALK_NEXT && result != WALK_PRUNE) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+
+/**
+ * Visit every live entry under a directory depth first, each entry before
+ * what lies below it: the order of a recursive walk, without the recursion.
+ * Subdirectories are entered by file_type as it stands after their entry was
+ * visited, so a visitor may fix it first; . and .. are never entered. A tree
+ * deeper than there are inodes must loop, and ends the walk. Each directory
+ * is read ahead as it is entered, see dir_readahead().
+ * @param  disk     the disk
+ * @param  root_idx inode index of the directory to start from
+ * @param  visit    called per entry with the depth of its directory below root_idx
+ * @param  arg      passed through to visit
+ * @return          the visitor's stop result; 0 if it never stopped;
+ * 					-ENOMEM; -ELOOP
+ */
+int walk_tree(unsigned char *disk, unsigned int root_idx, dir_visit_fn visit, void *arg) {
+	unsigned int inodes_count = ext2_cur->super_block->s_inodes_count;
+	int max_depth = 16;
+	struct dir_cursor *stack = malloc(sizeof(struct dir_cursor) * max_depth); // FREE
+	if (stack == NULL) {
+		perror("walk_tree: malloc");
+		return -ENOMEM;
+	}
+
+	int result = 0;
+	int depth = 0;
+	dir_open(&stack[0], root_idx);
+	dir_readahead(disk, root_idx);
+	while (depth >= 0) {
+		unsigned int dir_idx = stack[depth].dir_idx;
+		struct ext2_dir_entry *entry = dir_next(disk, &stack[depth]);
+		if (entry == NULL) {
+			depth--;
+			continue;
+		}
+
+		result = visit(disk, dir_idx, entry, depth, arg);
+		if (result == WALK_PRUNE) {
+			result = 0;
+			continue;
+		} else if (result != WALK_NEXT) {
+			break;
+		}
+		if (entry->file_type != EXT2_FT_DIR || is_dot_entry(entry) || entry->inode > inodes_count) {
+			continue;
+		}
+
+		if (depth + 1 == max_depth) {
+			if ((unsigned int)max_depth > inodes_count) {
+				fprintf(stderr, "walk_tree: directory loop below inode %u\n", root_idx);
+				result = -ELOOP;
+				break;
+			}
+			struct dir_cursor *grown = realloc(stack, sizeof(struct dir_cursor) * max_depth * 2);
+			if (grown == NULL) {
+				perror("walk_tree: realloc");
+				result = -ENOMEM;
+				break;
+			}
+			stack = grown;
+			max_depth *= 2;
+		}
+		dir_open(&stack[++depth], entry->inode);
+		dir_readahead(disk, entry->inode);
+	}
+	free(stack);
+	return result;
+}
+
+
+/**
+ * Bytes a directory entry with a name of name_len needs, padding included
+ */
+int dir_entry_size(int name_len) {
+	return (sizeof(struct ext2_dir_entry) + name_len + 3) & ~3;
+}
+
+
+/**
+ * Number of blocks a directory spans, holes included
+ */
+unsigned int dir_num_blocks(struct ext2_inode *dir_inode) {
+	return (dir_inode->i_size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+}
+
+
+/**
+ * A directory block by its logical number
+ * @param  disk      the disk
+ * @param  dir_inode the directory's inode
+ * @param  lblk      logical block number in the directory
+ * @return           the block, in place on the disk; NULL for a hole or a bad block number
+ */
+unsigned char *dir_block(unsigned char *disk, struct ext2_inode *dir_inode, unsigned int lblk) {
+	unsigned int block_num = inode_block(disk, dir_inode, lblk);
+	if (block_num == 0 || block_num >= ext2_cur->super_block->s_blocks_count) {
+		return NULL;
+	}
+	STAT_ADD(STAT_DIR_BLOCKS, 1);
+	return disk + (size_t)EXT2_BLOCK_SIZE * block_num;
+}
+
+
+/**
+ * Find a live entry by name in one directory block
+ * @param  block    the block
+ * @param  name     the name (not necessarily null-terminated)
+ * @param  name_len length of the name
+ * @param  slot     filled with the entry and the one before it; lblk is left alone
+ * @return          1 if found, 0 if not
+ */
+int dir_block_find(unsigned char *block, char const *name, int name_len, struct dir_slot *slot) {
+	struct ext2_dir_entry *prev = NULL;
+	int offset = 0;
+	while (offset <= EXT2_BLOCK_SIZE - (int)sizeof(struct ext2_dir_entry)) {
+		struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(block + offset);
+		if (entry->rec_len == 0) { // corrupt block
+			break;
+		}
+		STAT_ADD(STAT_DIR_RECORDS, 1);
+		if (entry->inode != 0 && entry->name_len == name_len && memcmp(entry->name, name, name_len) == 0) {
+			slot->prev = prev;
+			slot->entry = entry;
+			return 1;
+		}
+		prev = entry;
+		offset += entry->rec_len;
+	}
+	return 0;
+}
+
+
+/**
+ * Add an entry in the slack after the last entry of a directory block, or
+ * in place of a lone unused entry, as dir_add_block() leaves it. Gaps
+ * further in are left alone, for ext2_restore().
+ * @param  block     the block
+ * @param  inode_idx inode index of the new entry
+ * @param  name      its name
+ * @param  name_len  length of the name
+ * @param  type      its dirent file type
+ * @return           1 if it fit, 0 if the block has no room
+ */
+int dir_block_append(unsigned char *block, unsigned int inode_idx, char const *name, int name_len,
+					 unsigned char type) {
+	struct ext2_dir_entry *last;
+	int offset = 0;
+	while (1) {
+		last = (struct ext2_dir_entry *)(block + offset);
+		if (last->rec_len == 0 || offset + last->rec_len > EXT2_BLOCK_SIZE) { // corrupt block
+			return 0;
+		}
+		STAT_ADD(STAT_DIR_RECORDS, 1);
+		if (offset + last->rec_len == EXT2_BLOCK_SIZE) {
+			break;
+		}
+		offset += last->rec_len;
+	}
+
+	if (offset > 0 && last->inode == 0) { // a removed entry's name, kept for restore
+		return 0;
+	}
+	if (entry_slack(last) < dir_entry_size(name_len)) {
+		return 0;
+	}
+	place_entry(block, last, inode_idx, name, name_len, type);
+	return 1;
+}
+
+
+/**
+ * Add an entry in the first gap of a directory block big enough for it,
+ * wherever it is in the block
+ * @param  block     the block
+ * @param  inode_idx inode index of the new entry
+ * @param  name      its name
+ * @param  name_len  length of the name
+ * @param  type      its dirent file type
+ * @return           1 if it fit, 0 if the block has no room
+ */
+int dir_block_insert(unsigned char *block, unsigned int inode_idx, char const *name, int name_len,
+					 unsigned char type) {
+	int need = dir_entry_size(name_len);
+	for (int offset = 0; offset < EXT2_BLOCK_SIZE;) {
+		struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(block + offset);
+		if (entry->rec_len == 0 || offset + entry->rec_len > EXT2_BLOCK_SIZE) { // corrupt block
+			return 0;
+		}
+		STAT_ADD(STAT_DIR_RECORDS, 1);
+		if (entry_slack(entry) >= need) {
+			place_entry(block, entry, inode_idx, name, name_len, type);
+			return 1;
+		}
+		offset += entry->rec_len;
+	}
+	return 0;
+}
+
+
+/**
+ * Largest gap a new entry could take in a directory block
+ * @param  block the block; NULL for a hole
+ * @return       its size in bytes; 0 for a full or corrupt block
+ */
+int dir_block_gap(unsigned char *block) {
+	int largest = 0;
+	if (block == NULL) {
+		return 0;
+	}
+	for (int offset = 0; offset < EXT2_BLOCK_SIZE;) {
+		struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(block + offset);
+		if (entry->rec_len == 0 || offset + entry->rec_len > EXT2_BLOCK_SIZE) {
+			return 0;
+		}
+		STAT_ADD(STAT_DIR_RECORDS, 1);
+		if (entry_slack(entry) > largest) {
+			largest = entry_slack(entry);
+		}
+		offset += entry->rec_len;
+	}
+	return largest;
+}
+
+
+/**
+ * Grow a directory by one block holding a single unused entry, taking the
+ * indirect blocks that block needs along with it. Holes only ever appear
+ * among the direct blocks (see free_dir_entry()), so the indirect blocks
+ * needed follow from the block count.
+ * On an image with COMPAT_DIR_PREALLOC the directory keeps a window of
+ * s_prealloc_dir_blocks blocks reserved past its last, which its next blocks
+ * come from, so a directory growing among other allocations stays
+ * contiguous. Windows live in memory only, like the reservations they are,
+ * and are given back when the blocks run out.
+ * @param  disk    the disk
+ * @param  dir_idx inode index of the directory
+ * @param  lblk    set to the new block's logical number
+ * @return         the new block's physical number; errno on failure
+ */
+int dir_add_block(unsigned char **disk, unsigned int dir_idx, unsigned int *lblk) {
+	struct ext2_inode *dir_inode = get_inode(*disk, dir_idx);
+	unsigned int next = dir_num_blocks(dir_inode);
+	int num_blocks = 1 + indirect_blocks_needed(next + 1) - indirect_blocks_needed(next);
+	unsigned int goal = next > 0 ? inode_block(*disk, dir_inode, next - 1) : 0;
+	struct dir_window *window = dir_window(dir_idx);
+	int blocks[4];
+	int result;
+
+	lock_windows();
+	if (window->dir_idx == dir_idx && window->len > 0 && num_blocks == 1 && goal > 0 &&
+		window->start == goal + 1 && !check_block_bit(*disk, window->start)) {
+		blocks[0] = window->start++;
+		window->len--;
+		mark_block(*disk, blocks[0], 1); // used before it stops being reserved
+		mark_reserved(ext2_cur, blocks[0], 1, 0);
+		add_reserved(ext2_cur, -1);
+		unlock_windows();
+		STAT_ADD(STAT_BLOCKS_ALLOCATED, 1);
+	} else {
+		if (window->dir_idx == dir_idx) { // its blocks are where this one should go
+			close_dir_window(window);
+		}
+		unlock_windows();
+		if ((result = alloc_blocks(disk, num_blocks, goal > 0 ? goal + 1 : inode_goal_block(*disk, dir_idx),
+								   blocks)) < 0) {
+			return result;
+		}
+	}
+	int used = 0;
+	unsigned int *slot = block_slot(*disk, dir_inode, next, blocks, &used);
+	if (slot == NULL) {
+		return -EFBIG;
+	}
+	*slot = blocks[used++];
+	dirty_meta(*disk, slot, sizeof(*slot));
+
+	struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(*disk + (size_t)EXT2_BLOCK_SIZE * *slot);
+	entry->inode = 0;
+	entry->rec_len = EXT2_BLOCK_SIZE;
+	entry->name_len = 0;
+	entry->file_type = EXT2_FT_UNKNOWN;
+	dirty_meta(*disk, entry, EXT2_BLOCK_SIZE);
+
+	dir_inode->i_size += EXT2_BLOCK_SIZE;
+	dir_inode->i_blocks += used * (EXT2_BLOCK_SIZE / 512);
+	dirty_meta(*disk, dir_inode, sizeof(*dir_inode));
+	note_dir_block(*disk, dir_idx, next);
+	lock_windows();
+	if (window->dir_idx != dir_idx || window->len == 0) {
+		open_dir_window(*disk, dir_idx, *slot + 1);
+	}
+	unlock_windows();
+	*lblk = next;
+	return *slot;
+}
+
+
+/**
+ * Find a live entry by name in a directory: through its index if it has a
+ * sound one, block by block otherwise
+ * @param  disk     the disk
+ * @param  dir_idx  inode index of the directory
+ * @param  name     the name (not necessarily null-terminated)
+ * @param  name_len length of the name
+ * @param  slot     filled with where the entry is
+ * @return          1 if found, 0 if not
+ */
+int dir_find_entry(unsigned char *disk, unsigned int dir_idx, char const *name, int name_len,
+				   struct dir_slot *slot) {
+	struct ext2_inode *dir_inode = get_inode(disk, dir_idx);
+	if (dir_inode->i_flags & EXT2_INDEX_FL) {
+		int found = dx_lookup(disk, dir_idx, name, name_len, slot);
+		if (found >= 0) {
+			return found;
+		}
+	}
+	dir_readahead(disk, dir_idx);
+	for (unsigned int lblk = 0; lblk < dir_num_blocks(dir_inode); lblk++) {
+		unsigned char *block = dir_block(disk, dir_inode, lblk);
+		if (block != NULL && dir_block_find(block, name, name_len, slot)) {
+			slot->lblk = lblk;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+// state for find_idx_visit
+struct find_idx_arg {
+	char const *name;
+	int name_len;
+	int found;
+};
+
+/**
+ * walk_dir() visitor for find_idx: cache every entry passed, stop at the name
+ */
+static int find_idx_visit(unsigned char *disk, unsigned int dir_idx, struct ext2_dir_entry *entry,
+						  int depth, void *arg) {
+	struct find_idx_arg *find = arg;
+	dcache_insert(dir_idx, entry->name, entry->name_len, entry->inode);
+	if (entry->name_len == find->name_len && strncmp(entry->name, find->name, find->name_len) == 0) {
+		find->found = entry->inode;
+		return WALK_STOP;
+	}
+	return WALK_NEXT;
+}
+
+
+/**
+ * find_idx() past the dentry cache: look the name up in the dir's index, or
+ * scan the dir's blocks
+ */
+static int find_entry(unsigned char *disk, unsigned int dir_idx, char const *name, int name_len) {
+	// an index leads straight to the one block that can hold the name
+	if (get_inode(disk, dir_idx)->i_flags & EXT2_INDEX_FL) {
+		struct dir_slot slot;
+		int found = dx_lookup(disk, dir_idx, name, name_len, &slot);
+		if (found > 0) {
+			dcache_insert(dir_idx, name, name_len, slot.entry->inode);
+			return slot.entry->inode;
+		} else if (found == 0) {
+			return -ENOENT;
+		}
+	}
+
+	struct find_idx_arg find = {name, name_len, 0};
+	if (walk_dir(disk, dir_idx, find_idx_visit, &find) == WALK_STOP) {
+		return find.found;
+	}
+	dcache_set_complete(dir_idx);
+	return -ENOENT;
+}
+
+
+/**
+ * Find the given name in a single directory. Answers from the dentry cache
+ * when it can; otherwise looks the name up in the dir's index, or scans the
+ * dir's blocks, caching every entry it passes. In a shared operation the
+ * directory is read-locked for that, unless the caller holds it already.
+ * @param  disk     disk
+ * @param  dir_idx  inode index of the directory to search
+ * @param  name     target name (not necessarily null-terminated)
+ * @param  name_len length of the name
+ * @return          node index; -ENOENT if the directory has no such entry
+ */
+int find_idx(unsigned char *disk, unsigned int dir_idx, char const *name, int name_len) {
+	int cached = dcache_lookup(dir_idx, name, name_len);
+	if (cached != 0) {
+		STAT_ADD(STAT_DCACHE_HITS, 1);
+		return cached;
+	}
+	STAT_ADD(STAT_DCACHE_MISSES, 1);
+
+	int locked = lock_dir_briefly(dir_idx);
+	int found = find_entry(disk, dir_idx, name, name_len);
+	if (locked) {
+		unlock_dir(dir_idx);
+	}
+	return found;
+}
+
+
+/**
+ * Copy a symlink's target out of its inode: from i_block itself for a fast
+ * symlink, from its data blocks otherwise
+ * @return the malloc'ed, null-terminated target; NULL if out of memory
+ */
+char *read_symlink(unsigned char *disk, struct ext2_inode *inode) {
+	unsigned int size = inode->i_size;
+	char *target = malloc(size + 1);
+	if (target == NULL) {
+		return NULL;
+	}
+	if (is_fast_symlink(inode) && size <= sizeof(inode->i_block)) {
+		memcpy(target, inode->i_block, size);
+	} else {
+		for (unsigned int done = 0; done < size; done += EXT2_BLOCK_SIZE) {
+			unsigned int block_num = inode_block(disk, inode, done / EXT2_BLOCK_SIZE);
+			unsigned int len = size - done < EXT2_BLOCK_SIZE ? size - done : EXT2_BLOCK_SIZE;
+			if (block_num == 0) {
+				memset(target + done, 0, len);
+			} else {
+				memcpy(target + done, disk + (size_t)EXT2_BLOCK_SIZE * block_num, len);
+			}
+		}
+	}
+	target[size] = '\0';
+	return target;
+}
+
+/**
+ * Walk an absolute path one component at a time from the root, only scanning
+ * the directories on the path. A symlink before the last component is
+ * followed: its target and the rest of the path make the path walked on, an
+ * absolute target from the root, a relative one from the link's directory.
+ * At most EXT2_MAX_SYMLINK_HOPS links are followed. In a shared operation
+ * a link is read with its directory locked, once the name still leads to
+ * it; the walk starts over if it does not.
+ * @param  follow_last 1 to follow a symlink in the last component too
+ * @param  last_name   set to the last component's name, EXT2_NAME_LEN + 1
+ *                     bytes; NULL if not wanted
+ * @return             0 on success; -ENOENT, -ENAMETOOLONG, -ELOOP or -ENOMEM
+ */
+static int walk_path(unsigned char *disk, char const *path, int follow_last, int *parent_idx,
+					 int *child_idx, char *last_name) {
+	int parent = EXT2_ROOT_INO;
+	int curr = EXT2_ROOT_INO;
+	int hops = 0;
+	char *owned = NULL; // FREE: the path being walked once a link was followed
+	char const *comp = path;
+	int result = 0;
+	if (last_name != NULL) {
+		last_name[0] = '\0';
+	}
+	while (1) {
+		while (*comp == '/') {
+			comp++;
+		}
+		if (*comp == '\0') { // trailing slashes or the root itself
+			break;
+		}
+		int comp_len = strcspn(comp, "/");
+		if (comp_len > EXT2_NAME_LEN) {
+			result = -ENAMETOOLONG;
+			goto out;
+		}
+		if (curr <= 0) { // a previous component was missing
+			result = -ENOENT;
+			goto out;
+		}
+		if ((get_inode(disk, curr)->i_mode & EXT2_S_IFMT) != EXT2_S_IFDIR) {
+			result = -ENOENT;
+			goto out;
+		}
+		parent = curr;
+		curr = find_idx(disk, parent, comp, comp_len);
+		if (last_name != NULL) {
+			memcpy(last_name, comp, comp_len);
+			last_name[comp_len] = '\0';
+		}
+		char const *name = comp;
+		comp += comp_len;
+
+		char const *rest = comp + strspn(comp, "/");
+		if (curr <= 0 || (*rest == '\0' && !follow_last)) {
+			continue;
+		}
+		struct ext2_inode *inode = get_inode(disk, curr);
+		if ((inode->i_mode & EXT2_S_IFMT) != EXT2_S_IFLNK) {
+			continue;
+		}
+		if (++hops > EXT2_MAX_SYMLINK_HOPS) {
+			result = -ELOOP;
+			goto out;
+		}
+
+		// walk on along the target, then what was left of the path
+		int locked = lock_dir_briefly(parent);
+		if (locked && find_idx(disk, parent, name, comp_len) != curr) { // changed meanwhile
+			unlock_dir(parent);
+			free(owned);
+			owned = NULL;
+			comp = path;
+			parent = curr = EXT2_ROOT_INO;
+			hops = 0;
+			continue;
+		}
+		char *target = read_symlink(disk, inode); // FREE
+		if (locked) {
+			unlock_dir(parent);
+		}
+		char *next = target == NULL ? NULL : malloc(strlen(target) + strlen(comp) + 1);
+		if (next == NULL) {
+			free(target);
+			result = -ENOMEM;
+			goto out;
+		}
+		strcpy(next, target);
+		strcat(next, comp);
+		free(target);
+		free(owned);
+		owned = next;
+		comp = owned;
+		if (*comp == '/') {
+			parent = curr = EXT2_ROOT_INO;
+		} else {
+			curr = parent;
+		}
+	}
+
+	*parent_idx = parent;
+	*child_idx = curr > 0 ? curr : 0;
+out:
+	free(owned);
+	return result;
+}
+
+/**
+ * Walk an absolute path to its last component, following symlinks on the way
+ * but not the last component itself, like lstat
+ * @param  disk       disk
+ * @param  path       the absolute path
+ * @param  parent_idx set to the inode index of the last component's parent
+ * @param  child_idx  set to the last component's inode index, 0 if it does not exist
+ * @return            0 on success
+ * 					  -ENOENT if a component before the last is missing or not a dir
+ * 					  -ELOOP if more than EXT2_MAX_SYMLINK_HOPS links are on the way
+ */
+int resolve_path(unsigned char *disk, char const *path, int *parent_idx, int *child_idx) {
+	if (path[0] != '/') {
+		fprintf(stderr, "%s is not absolute\n", path);
+		return -EINVAL;
+	}
+	return walk_path(disk, path, 0, parent_idx, child_idx, NULL);
+}
+
+/**
+ * resolve_path(), following a symlink in the last component as well, like stat
+ */
+int resolve_path_follow(unsigned char *disk, char const *path, int *parent_idx, int *child_idx) {
+	if (path[0] != '/') {
+		fprintf(stderr, "%s is not absolute\n", path);
+		return -EINVAL;
+	}
+	return walk_path(disk, path, 1, parent_idx, child_idx, NULL);
+}
+
+/**
+ * resolve_path_follow() for an operation that goes on to read the file: in
+ * a shared operation the file is locked with lock_inode() until it ends,
+ * once its name, looked at again with the directory locked, still leads to it
+ */
+int resolve_path_hold(unsigned char *disk, char const *path, int *parent_idx, int *child_idx) {
+	char name[EXT2_NAME_LEN + 1];
+	if (path[0] != '/') {
+		fprintf(stderr, "%s is not absolute\n", path);
+		return -EINVAL;
+	}
+	while (1) {
+		int result = walk_path(disk, path, 1, parent_idx, child_idx, name);
+		if (result < 0 || !held.shared || *child_idx == 0 || *child_idx == EXT2_ROOT_INO) {
+			return result;
+		}
+		int locked = lock_dir_briefly(*parent_idx);
+		int same = find_idx(disk, *parent_idx, name, strlen(name)) == *child_idx;
+		if (same) {
+			lock_inode(*child_idx);
+		}
+		if (locked) {
+			unlock_dir(*parent_idx);
+		}
+		if (same) {
+			return 0;
+		}
+	}
+}
+
+
+
+// ---------- Operations ----------
+/**
+ * Create a directory and link it into its parent: its inode, its first
+ * block with . and .., and the counts that go with them
+ * @param  disk       the disk
+ * @param  parent_idx the parent dir's inode index
+ * @param  name       the new directory's name
+ * @return            the new directory's inode index; errno on failure
+ */
+int make_dir(unsigned char **disk, unsigned int parent_idx, char *name) {
+	struct ext2_inode *parent_inode = get_inode(*disk, parent_idx);
+	int result;
+
+	// create inode
+	int new_dir_idx;
+	if ((new_dir_idx = new_dir_inode(disk, parent_idx)) < 0) {
+		fprintf(stderr, "make_dir: new_dir_inode\n");
+		return new_dir_idx;
+	}
+	init_inode(disk, new_dir_idx);
+
+	int new_block_idx;
+	if ((new_block_idx = new_block(disk, inode_goal_block(*disk, new_dir_idx))) < 0) {
+		if (new_block_idx != -ERESTART) {
+			fprintf(stderr, "make_dir: new_block\n");
+		}
+		mark_inode(*disk, new_dir_idx, 0);
+		return new_block_idx;
+	}
+	lock_windows();
+	open_dir_window(*disk, new_dir_idx, new_block_idx + 1);
+	unlock_windows();
+
+	struct ext2_inode *curr_inode = get_inode(*disk, new_dir_idx);
+	curr_inode->i_block[0] = new_block_idx;
+	curr_inode->i_mode = EXT2_S_IFDIR;
+	curr_inode->i_links_count = 2;
+	curr_inode->i_size = EXT2_BLOCK_SIZE;
+	curr_inode->i_blocks = EXT2_BLOCK_SIZE / 512;
+	dirty_meta(*disk, curr_inode, sizeof(*curr_inode));
+
+	// add . and .. in dir entry
+	struct ext2_dir_entry *curr_dir =
+		(struct ext2_dir_entry *)(*disk + (size_t)EXT2_BLOCK_SIZE * new_block_idx);
+	curr_dir->inode = new_dir_idx;
+	curr_dir->name_len = 1; // '.'
+	strcpy(curr_dir->name, ".");
+	curr_dir->rec_len = sizeof(struct ext2_dir_entry) + curr_dir->name_len;
+	if (curr_dir->rec_len % 4 != 0) {
+		curr_dir->rec_len += 4 - curr_dir->rec_len % 4;
+	}
+	curr_dir->file_type = EXT2_FT_DIR;
+
+	int dot_len = curr_dir->rec_len;
+	curr_dir = (struct ext2_dir_entry *)((unsigned char *)curr_dir + dot_len);
+	curr_dir->inode = parent_idx;
+	curr_dir->name_len = 2; // '..'
+	strcpy(curr_dir->name, "..");
+	curr_dir->rec_len = EXT2_BLOCK_SIZE - dot_len; // '..' is the last entry
+	curr_dir->file_type = EXT2_FT_DIR;
+	dirty_meta(*disk, *disk + (size_t)EXT2_BLOCK_SIZE * new_block_idx, EXT2_BLOCK_SIZE);
+	dirty_dir(*disk, new_dir_idx);
+
+	parent_inode->i_links_count++;
+	dirty_meta(*disk, parent_inode, sizeof(*parent_inode));
+	unsigned int group = inode_group(*disk, new_dir_idx);
+	struct ext2_group_desc *group_desc = get_group_desc(*disk, group);
+	lock_group(group);
+	group_desc->bg_used_dirs_count++;
+	dirty_meta(*disk, group_desc, sizeof(*group_desc));
+	unlock_group(group);
+
+	// update parent's dir entry
+	if ((result = update_dir_entry(disk, parent_idx, new_dir_idx, name, EXT2_FT_DIR)) < 0) {
+		return result;
+	}
+	return new_dir_idx;
+}
+
+
+/**
+ * Fill in a new regular file's inode for size bytes held in num_blocks
+ * blocks, data and indirect, leaving its block pointers to the caller
+ * @param  disk       the disk
+ * @param  inode_idx  the new inode's index
+ * @param  size       file size in bytes
+ * @param  num_blocks number of data and indirect blocks
+ */
+static void init_file_inode(unsigned char **disk, unsigned int inode_idx, unsigned long long size,
+							int num_blocks) {
+	struct ext2_super_block *super_block = get_super_block(*disk);
+	init_inode(disk, inode_idx);
+
+	struct ext2_inode *inode = get_inode(*disk, inode_idx);
+	inode->i_mode = EXT2_S_IFREG;
+	inode->i_ctime = (unsigned int)time(NULL);
+	inode->i_size = size & 0xffffffff;
+	inode->i_dir_acl = size >> 32;
+	inode->i_links_count = 1;
+	if (inode->i_dir_acl != 0) {
+		__atomic_fetch_or(&super_block->s_feature_ro_compat, EXT2_FEATURE_RO_COMPAT_LARGE_FILE,
+						  __ATOMIC_RELAXED);
+		dirty_meta(*disk, super_block, sizeof(*super_block));
+	}
+	inode->i_blocks = num_blocks * (EXT2_BLOCK_SIZE / 512);
+}
+
+/**
+ * Create a regular file's inode with its data blocks reserved and mapped,
+ * but not its contents nor a link to it
+ * @param  disk        the disk
+ * @param  parent_idx  the parent dir's inode index, for placement
+ * @param  size        file size in bytes
+ * @param  data_blocks set to the malloc'ed physical block of each logical block
+ * @return             the new inode index; errno on failure
+ */
+int make_file(unsigned char **disk, unsigned int parent_idx, unsigned long long size, int **data_blocks) {
+	struct ext2_super_block *super_block = get_super_block(*disk);
+	int result;
+
+	int blocks_needed = size / EXT2_BLOCK_SIZE;
+	if (size % EXT2_BLOCK_SIZE != 0) {
+		blocks_needed++;
+	}
+	int meta_blocks = indirect_blocks_needed(blocks_needed);
+	if (blocks_needed + meta_blocks > __atomic_load_n(&super_block->s_free_blocks_count, __ATOMIC_RELAXED)) {
+		fprintf(stderr, "make_file: blocks not enough for file\n");
+		return -ENOSPC;
+	}
+
+	// create inode for the new file on disk
+	int current_inode_idx;
+	if ((current_inode_idx = new_inode(disk, parent_idx)) < 0) {
+		fprintf(stderr, "make_file: new_inode\n");
+		return current_inode_idx;
+	}
+	init_file_inode(disk, current_inode_idx, size, blocks_needed + meta_blocks);
+	struct ext2_inode *curr_inode = get_inode(*disk, current_inode_idx);
+
+	// reserve the data and indirect blocks in one contiguous run if possible
+	int *new_blocks = malloc(sizeof(int) * (blocks_needed + meta_blocks + 1)); // FREE
+	*data_blocks = malloc(sizeof(int) * (blocks_needed + 1));
+	if (new_blocks == NULL || *data_blocks == NULL) {
+		perror("make_file: malloc");
+		mark_inode(*disk, current_inode_idx, 0);
+		result = -ENOMEM;
+		goto out;
+	}
+	if ((result = alloc_blocks(disk, blocks_needed + meta_blocks,
+							   inode_goal_block(*disk, current_inode_idx), new_blocks)) < 0) {
+		if (result != -ERESTART) {
+			fprintf(stderr, "make_file: alloc_blocks\n");
+		}
+		mark_inode(*disk, current_inode_idx, 0);
+		goto out;
+	}
+	if ((result = map_inode_blocks(*disk, curr_inode, new_blocks, blocks_needed, *data_blocks)) < 0) {
+		fprintf(stderr, "make_file: file too large\n");
+		goto out;
+	}
+	result = current_inode_idx;
+
+out:
+	free(new_blocks);
+	if (result < 0) {
+		free(*data_blocks);
+		*data_blocks = NULL;
+	}
+	return result;
+}
+
+
+// Library versions of the tools, so many operations can share one mapping
+// and its caches (see ext2_batch). Each returns 0 or a negative errno.
+
+/**
+ * Create a directory, like mkdir
+ * @param  disk the disk
+ * @param  path absolute path of the new directory
+ * @return      0 on success; -ENOENT if its parent is missing, -EEXIST if it exists
+ */
+int ext2_mkdir(unsigned char **disk, char const *path) {
+	int result;
+
+	// find parent dir's inode index and check the new dir does not exist yet
+	int parent_idx;
+	int curr_idx;
+	if ((result = resolve_path(*disk, path, &parent_idx, &curr_idx)) < 0) {
+		fprintf(stderr, "ext2_mkdir: resolve_path\n");
+		return result;
+	}
+	if (curr_idx > 0) {
+		fprintf(stderr, "ext2_mkdir: file already exists\n");
+		return -EEXIST;
+	}
+
+	// parse the absolute path into the path and the dir's name
+	char *dir_path = NULL; // FREE
+	char *name = NULL;	   // FREE
+	if ((result = parse_path(path, &dir_path, &name)) != 0) {
+		fprintf(stderr, "ext2_mkdir: parse_path\n");
+		return result;
+	}
+
+	// others may add to the parent meanwhile: look again with it locked
+	if (held.shared) {
+		lock_dir(parent_idx, 1);
+		if (find_idx(*disk, parent_idx, name, strlen(name)) > 0) {
+			fprintf(stderr, "ext2_mkdir: file already exists\n");
+			result = -EEXIST;
+			goto out;
+		}
+	}
+
+	if ((result = make_dir(disk, parent_idx, name)) > 0) {
+		result = 0;
+	}
+
+out:
+
+	free(dir_path);
+	free(name);
+	return result;
+}
+
+
+/**
+ * First step of ext2_cp(): check the source and the target, then reserve the
+ * file's blocks, placed for the parent's group where its inode will most
+ * likely go. The image is not changed.
+ * @param  disk       the disk
+ * @param  local_path path of the source file on the host
+ * @param  path       absolute path of the new file on the disk
+ * @param  plan       filled in; released on failure
+ * @return            0 on success; -ENOENT if the source or the parent is missing,
+ *                    -EEXIST if the target exists, -ENOSPC if it does not fit
+ */
+int ext2_cp_prepare(unsigned char **disk, char const *local_path, char const *path, struct cp_plan *plan) {
+	int result;
+	memset(plan, 0, sizeof(*plan));
+	plan->src_fd = -1;
+
+	// check if the given local path is valid
+	struct stat stats;
+	if (stat(local_path, &stats) == -1) {
+		perror("ext2_cp: stat");
+		return -ENOENT;
+	}
+	if (!S_ISREG(stats.st_mode)) {
+		fprintf(stderr, "ext2_cp: local file [%s] needs to be a regular file (-r for a directory).\n",
+				local_path);
+		return -ENOENT;
+	}
+
+	// find parent dir's inode index and check the target does not exist yet
+	int parent_idx;
+	int curr_idx;
+	if ((result = resolve_path(*disk, path, &parent_idx, &curr_idx)) < 0) {
+		fprintf(stderr, "ext2_cp: resolve_path\n");
+		return result;
+	}
+	if (curr_idx > 0) {
+		fprintf(stderr, "ext2_cp: file already exists\n");
+		return -EEXIST;
+	}
+
+	plan->size = stats.st_size;
+	plan->image_fd = ext2_cur->map_fd;
+	plan->block_size = EXT2_BLOCK_SIZE;
+	plan->num_data = (plan->size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+	plan->num_blocks = plan->num_data + indirect_blocks_needed(plan->num_data);
+	plan->blocks = malloc(sizeof(int) * (plan->num_blocks + 1));
+	plan->data_blocks = malloc(sizeof(int) * (plan->num_data + 1));
+	if (plan->blocks == NULL || plan->data_blocks == NULL) {
+		perror("ext2_cp: malloc");
+		result = -ENOMEM;
+		goto fail;
+	}
+	if ((result = reserve_blocks(disk, plan->num_blocks, inode_goal_block(*disk, parent_idx),
+								 plan->blocks)) < 0) {
+		if (result != -ERESTART) {
+			fprintf(stderr, "ext2_cp: blocks not enough for file\n");
+		}
+		goto fail;
+	}
+	plan->reserved = 1;
+	if ((result = layout_data_blocks(plan->blocks, plan->num_data, plan->data_blocks)) < 0) {
+		fprintf(stderr, "ext2_cp: file too large\n");
+		goto fail;
+	}
+
+	if ((plan->src_fd = open(local_path, O_RDONLY)) < 0) {
+		perror("ext2_cp: open");
+		result = -ENOENT;
+		goto fail;
+	}
+	// the blocks may have been freed by an operation alongside, so they are
+	// written to only once that has committed
+	held.needs_commit = 1;
+	return 0;
+
+fail:
+	cp_plan_release(*disk, plan);
+	return result;
+}
+
+
+#define CP_BUFFER_SIZE (1 << 20)
+
+/**
+ * Second step of ext2_cp(): stream the file into its reserved blocks, each
+ * run of contiguous blocks with copy_file_range() into the image file, or
+ * through a buffer with read() and pwrite() where that cannot be used.
+ * Nothing goes through the mapping and nothing but the plan is read, so
+ * other operations may run meanwhile.
+ * @param  plan the plan from ext2_cp_prepare()
+ * @return      0 on success; errno on failure
+ */
+int cp_plan_copy(struct cp_plan const *plan) {
+	static unsigned char const zeros[EXT2_MAX_BLOCK_SIZE];
+	size_t block_size = plan->block_size;
+	unsigned char *buf = NULL; // FREE
+	int use_copy_range = 1;
+	int result = 0;
+
+	for (int lblk = 0; lblk < plan->num_data;) {
+		// extend the run while the next block follows on disk
+		int run = 1;
+		while (lblk + run < plan->num_data && plan->data_blocks[lblk + run] == plan->data_blocks[lblk] + run) {
+			run++;
+		}
+		off_t dst = (off_t)block_size * plan->data_blocks[lblk];
+		unsigned long long offset = (unsigned long long)lblk * block_size;
+		size_t len = (size_t)run * block_size;
+		if (offset + len > plan->size) {
+			len = plan->size - offset;
+		}
+
+		size_t done = 0;
+		while (done < len) {
+			ssize_t copied = 0;
+			if (use_copy_range) {
+				loff_t dst_off = dst + done;
+				copied = copy_file_range(plan->src_fd, NULL, plan->image_fd, &dst_off, len - done, 0);
+			}
+			if (copied <= 0) { // not supported here, or EOF: let read() sort it out
+				use_copy_range = 0;
+				if (buf == NULL && (buf = malloc(CP_BUFFER_SIZE)) == NULL) {
+					perror("ext2_cp: malloc");
+					result = -ENOMEM;
+					goto out;
+				}
+				copied = len - done < CP_BUFFER_SIZE ? len - done : CP_BUFFER_SIZE;
+				if ((result = read_full(plan->src_fd, buf, copied)) < 0) {
+					goto out;
+				}
+				if (pwrite(plan->image_fd, buf, copied, dst + done) != copied) {
+					perror("ext2_cp: pwrite");
+					result = -EIO;
+					goto out;
+				}
+			}
+			done += copied;
+		}
+
+		// zero the slack after the end of the file
+		size_t slack = (size_t)run * block_size - len;
+		if (slack > 0 && pwrite(plan->image_fd, zeros, slack, dst + len) != (ssize_t)slack) {
+			perror("ext2_cp: pwrite");
+			result = -EIO;
+			goto out;
+		}
+		lblk += run;
+	}
+
+out:
+	free(buf);
+	return result;
+}
+
+
+/**
+ * Last step of ext2_cp(): create the inode, turn the reserved blocks into
+ * its own and link it. The path is looked up again, as other operations may
+ * have changed the tree since ext2_cp_prepare().
+ * @param  disk the disk
+ * @param  path absolute path of the new file on the disk
+ * @param  plan the plan, copied into its blocks
+ * @return      0 on success; -ENOENT if the parent is gone, -EEXIST if the target
+ *              exists by now, -ENOSPC if no inode is left
+ */
+int ext2_cp_finish(unsigned char **disk, char const *path, struct cp_plan *plan) {
+	int result;
+
+	int parent_idx;
+	int curr_idx;
+	if ((result = resolve_path(*disk, path, &parent_idx, &curr_idx)) < 0) {
+		fprintf(stderr, "ext2_cp: resolve_path\n");
+		return result;
+	}
+	if (curr_idx > 0) {
+		fprintf(stderr, "ext2_cp: file already exists\n");
+		return -EEXIST;
+	}
+
+	// parse the absolute path into the path and the file's name
+	char *file_path = NULL; // FREE
+	char *name = NULL;		// FREE
+	if ((result = parse_path(path, &file_path, &name)) != 0) {
+		fprintf(stderr, "ext2_cp: parse_path\n");
+		goto out;
+	}
+	if (held.shared) { // see ext2_mkdir()
+		lock_dir(parent_idx, 1);
+		if (find_idx(*disk, parent_idx, name, strlen(name)) > 0) {
+			fprintf(stderr, "ext2_cp: file already exists\n");
+			result = -EEXIST;
+			goto out;
+		}
+	}
+
+	int inode_idx;
+	if ((inode_idx = new_inode(disk, parent_idx)) < 0) {
+		fprintf(stderr, "ext2_cp: new_inode\n");
+		result = inode_idx;
+		goto out;
+	}
+	init_file_inode(disk, inode_idx, plan->size, plan->num_blocks);
+	claim_blocks(*disk, plan->blocks, plan->num_blocks);
+	if ((result = map_inode_blocks(*disk, get_inode(*disk, inode_idx), plan->blocks, plan->num_data,
+								   plan->data_blocks)) < 0) {
+		fprintf(stderr, "ext2_cp: file too large\n");
+		goto out;
+	}
+	for (int lblk = 0, run; lblk < plan->num_data; lblk += run) {
+		for (run = 1; lblk + run < plan->num_data &&
+					  plan->data_blocks[lblk + run] == plan->data_blocks[lblk] + run;
+			 run++) {
+		}
+		dirty_fd_data(*disk, plan->data_blocks[lblk], run);
+	}
+
+	result = update_dir_entry(disk, parent_idx, inode_idx, name, EXT2_FT_REG_FILE);
+
+out:
+	free(file_path);
+	free(name);
+	return result;
+}
+
+
+/**
+ * Give back what a cp plan holds: its reservation, whether or not its
+ * blocks were taken, the source file and the block lists
+ * @param disk the disk
+ * @param plan the plan
+ */
+void cp_plan_release(unsigned char *disk, struct cp_plan *plan) {
+	if (plan->reserved) {
+		unreserve_blocks(disk, plan->blocks, plan->num_blocks);
+		plan->reserved = 0;
+	}
+	if (plan->src_fd >= 0) {
+		close(plan->src_fd);
+		plan->src_fd = -1;
+	}
+	free(plan->blocks);
+	free(plan->data_blocks);
+	plan->blocks = NULL;
+	plan->data_blocks = NULL;
+}
+
+
+/**
+ * Copy a local regular file onto the disk, like cp: ext2_cp_prepare(),
+ * cp_plan_copy() and ext2_cp_finish() in a row
+ * @param  disk       the disk
+ * @param  local_path path of the source file on the host
+ * @param  path       absolute path of the new file on the disk
+ * @return            0 on success; -ENOENT if the source or the parent is missing,
+ *                    -EEXIST if the target exists, -ENOSPC if it does not fit
+ */
+int ext2_cp(unsigned char **disk, char const *local_path, char const *path) {
+	struct cp_plan plan;
+	int result;
+	if ((result = ext2_cp_prepare(disk, local_path, path, &plan)) < 0) {
+		return result;
+	}
+
+	// stream the file's bytes into its blocks
+	STAT_PHASE_BEGIN(PHASE_CP_COPY);
+	result = cp_plan_copy(&plan);
+	STAT_PHASE_END(PHASE_CP_COPY);
+	if (result < 0) {
+		fprintf(stderr, "ext2_cp: cp_plan_copy\n");
+	} else {
+		result = ext2_cp_finish(disk, path, &plan);
+	}
+	cp_plan_release(*disk, &plan);
+	return result;
+}
+
+
+/**
+ * Create a hard link or a symlink, like ln [-s]. A symlink target shorter
+ * than i_block is stored there as a fast symlink, longer ones in data blocks.
+ * @param  disk      the disk
+ * @param  src_path  absolute path of the link target
+ * @param  dest_path absolute path of the new link
+ * @param  soft_link 1 for a symlink, 0 for a hard link
+ * @return           0 on success; -ENOENT if the source is missing, -EEXIST if the link
+ *                   exists, -EISDIR for a hard link to a directory
+ */
+int ext2_ln(unsigned char **disk, char const *src_path, char const *dest_path, int soft_link) {
+	struct ext2_super_block *super_block = get_super_block(*disk);
+	unsigned long src_len = strlen(src_path);
+	int result;
+
+	// search for the src file/lnk's inode
+	int src_parent_idx;
+	int src_idx;
+	if ((result = resolve_path(*disk, src_path, &src_parent_idx, &src_idx)) < 0 || src_idx == 0) {
+		fprintf(stderr, "ext2_ln: src file does not exists\n");
+		return -ENOENT;
+	}
+	if (!soft_link && (get_inode(*disk, src_idx)->i_mode & EXT2_S_IFDIR)) {
+		fprintf(stderr, "ext2_ln: hard link to a directory\n");
+		return -EISDIR;
+	}
+
+	// find dest parent dir's inode index and check the link does not exist yet
+	int dest_parent_idx;
+	int dest_idx;
+	if ((result = resolve_path(*disk, dest_path, &dest_parent_idx, &dest_idx)) < 0) {
+		fprintf(stderr, "ext2_ln: resolve_path\n");
+		return result;
+	}
+	if (dest_idx > 0) {
+		fprintf(stderr, "ext2_ln: dest file already exists\n");
+		return -EEXIST;
+	}
+
+	// parse the absolute dest_path into the dest_path and the dir's dest_lnk
+	char *dest_dir = NULL; // FREE
+	char *dest_lnk = NULL; // FREE
+	char *src_dir = NULL;  // FREE
+	char *src_name = NULL; // FREE
+	if ((result = parse_path(dest_path, &dest_dir, &dest_lnk)) != 0 ||
+		(!soft_link && (result = parse_path(src_path, &src_dir, &src_name)) != 0)) {
+		fprintf(stderr, "ext2_ln: parse_path\n");
+		goto out;
+	}
+
+	// others may change the directories meanwhile: look again with them locked
+	if (held.shared && soft_link) {
+		lock_dir(dest_parent_idx, 1);
+	} else if (held.shared) {
+		lock_dir_pair(src_parent_idx, 0, dest_parent_idx, 1);
+		if ((src_idx = find_idx(*disk, src_parent_idx, src_name, strlen(src_name))) <= 0) {
+			fprintf(stderr, "ext2_ln: src file does not exists\n");
+			result = -ENOENT;
+			goto out;
+		}
+		if (get_inode(*disk, src_idx)->i_mode & EXT2_S_IFDIR) {
+			fprintf(stderr, "ext2_ln: hard link to a directory\n");
+			result = -EISDIR;
+			goto out;
+		}
+	}
+	if (held.shared && find_idx(*disk, dest_parent_idx, dest_lnk, strlen(dest_lnk)) > 0) {
+		fprintf(stderr, "ext2_ln: dest file already exists\n");
+		result = -EEXIST;
+		goto out;
+	}
+
+	if (soft_link) {
+		// a target short enough is kept in i_block itself, with no block to read
+		int fast = src_len < EXT2_N_BLOCKS * sizeof(unsigned int);
+		int blocks_needed = 0;
+		if (!fast) {
+			blocks_needed = (src_len + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+			if (blocks_needed > __atomic_load_n(&super_block->s_free_blocks_count, __ATOMIC_RELAXED)) {
+				fprintf(stderr, "ext2_ln: blocks not enough for file\n");
+				result = -ENOSPC;
+				goto out;
+			}
+			if (blocks_needed > EXT2_NDIR_BLOCKS) {
+				fprintf(stderr, "ext2_ln: link target too long\n");
+				result = -ENAMETOOLONG;
+				goto out;
+			}
+		}
+
+		int soft_lnk_idx;
+		if ((soft_lnk_idx = new_inode(disk, dest_parent_idx)) < 0) {
+			fprintf(stderr, "ext2_ln: new_inode\n");
+			result = soft_lnk_idx;
+			goto out;
+		}
+		init_inode(disk, soft_lnk_idx);
+
+		struct ext2_inode *soft_lnk_inode = get_inode(*disk, soft_lnk_idx);
+		soft_lnk_inode->i_mode = EXT2_S_IFLNK;
+		soft_lnk_inode->i_ctime = (unsigned int)time(NULL);
+		soft_lnk_inode->i_size = src_len;
+		soft_lnk_inode->i_links_count = 1;
+		soft_lnk_inode->i_blocks = blocks_needed * (EXT2_BLOCK_SIZE / 512);
+		if (fast) {
+			memcpy(soft_lnk_inode->i_block, src_path, src_len);
+		}
+		dirty_meta(*disk, soft_lnk_inode, sizeof(*soft_lnk_inode));
+
+		// reserve the blocks in one run and store the target path in them
+		int new_blocks[EXT2_NDIR_BLOCKS];
+		if (!fast && (result = alloc_blocks(disk, blocks_needed, inode_goal_block(*disk, soft_lnk_idx),
+											new_blocks)) < 0) {
+			if (result != -ERESTART) {
+				fprintf(stderr, "ext2_ln: alloc_blocks\n");
+			}
+			mark_inode(*disk, soft_lnk_idx, 0);
+			goto out;
+		}
+		for (int idx = 0; idx < blocks_needed; idx++) {
+			soft_lnk_inode->i_block[idx] = new_blocks[idx];
+			unsigned long offset = idx * EXT2_BLOCK_SIZE;
+			unsigned long len = src_len - offset < EXT2_BLOCK_SIZE ? src_len - offset : EXT2_BLOCK_SIZE;
+			memcpy(*disk + (size_t)EXT2_BLOCK_SIZE * new_blocks[idx], src_path + offset, len);
+			dirty_meta(*disk, *disk + (size_t)EXT2_BLOCK_SIZE * new_blocks[idx], len);
+		}
+
+		result = update_dir_entry(disk, dest_parent_idx, soft_lnk_idx, dest_lnk, EXT2_FT_SYMLINK);
+	} else {
+		struct ext2_inode *src_inode = get_inode(*disk, src_idx);
+		unsigned char type =
+			(src_inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFLNK ? EXT2_FT_SYMLINK : EXT2_FT_REG_FILE;
+		lock_inode(src_idx); // against its links changing through another name
+		if ((result = update_dir_entry(disk, dest_parent_idx, src_idx, dest_lnk, type)) == 0) {
+			src_inode->i_links_count++;
+			dirty_meta(*disk, src_inode, sizeof(*src_inode));
+		}
+	}
+
+out:
+	free(dest_dir);
+	free(dest_lnk);
+	free(src_dir);
+	free(src_name);
+	return result;
+}
+
+
+// the inodes and blocks a bulk rm frees or a restore re-marks, applied in one pass at the end
+struct mark_batch {
+	unsigned int *inodes;
+	unsigned int num_inodes;
+	unsigned int max_inodes;
+	struct bmap_run *runs;
+	unsigned int num_runs;
+	unsigned int max_runs;
+};
+
+/**
+ * Make room in a batch for one more inode and num_runs more runs
+ * @return 0 on success, -ENOMEM
+ */
+static int batch_reserve(struct mark_batch *batch, unsigned int num_runs) {
+	if (batch->num_inodes == batch->max_inodes) {
+		unsigned int new_max = batch->max_inodes ? batch->max_inodes * 2 : 16;
+		unsigned int *grown = realloc(batch->inodes, sizeof(unsigned int) * new_max);
+		if (grown == NULL) {
+			return -ENOMEM;
+		}
+		batch->inodes = grown;
+		batch->max_inodes = new_max;
+	}
+	if (batch->num_runs + num_runs > batch->max_runs) {
+		unsigned int new_max = batch->max_runs ? batch->max_runs * 2 : 16;
+		while (new_max < batch->num_runs + num_runs) {
+			new_max *= 2;
+		}
+		struct bmap_run *grown = realloc(batch->runs, sizeof(struct bmap_run) * new_max);
+		if (grown == NULL) {
+			return -ENOMEM;
+		}
+		batch->runs = grown;
+		batch->max_runs = new_max;
+	}
+	return 0;
+}
+
+/**
+ * Add an inode and every block it owns to a batch
+ * @return 0 on success, -ENOMEM
+ */
+static int batch_add_inode(unsigned char *disk, struct mark_batch *batch, unsigned int inode_idx) {
+	struct bmap const *map = bmap_get(disk, inode_idx);
+	if (map == NULL || batch_reserve(batch, map->num_owned) < 0) {
+		return -ENOMEM;
+	}
+	batch->inodes[batch->num_inodes++] = inode_idx;
+	memcpy(batch->runs + batch->num_runs, map->owned, sizeof(struct bmap_run) * map->num_owned);
+	batch->num_runs += map->num_owned;
+	return 0;
+}
+
+static int compare_inodes(void const *a, void const *b) {
+	unsigned int x = *(unsigned int const *)a;
+	unsigned int y = *(unsigned int const *)b;
+	return x < y ? -1 : x > y;
+}
+
+static int compare_runs(void const *a, void const *b) {
+	struct bmap_run const *x = a;
+	struct bmap_run const *y = b;
+	return x->pblk < y->pblk ? -1 : x->pblk > y->pblk;
+}
+
+/**
+ * Mark a batch's inodes and blocks used or free: its inodes a group at a
+ * time, its runs sorted and merged so each stretch of blocks is one
+ * mark_block_range(), the free counters following like mark_inode()'s
+ * @param disk  the disk
+ * @param batch the batch
+ * @param value 1 to mark used, 0 to mark free
+ */
+static void batch_apply(unsigned char *disk, struct mark_batch *batch, int value) {
+	struct ext2_super_block *super_block = get_super_block(disk);
+	unsigned int per_group = super_block->s_inodes_per_group;
+	unsigned int total = 0;
+
+	qsort(batch->inodes, batch->num_inodes, sizeof(unsigned int), compare_inodes);
+	for (unsigned int i = 0; i < batch->num_inodes;) {
+		unsigned int group = (batch->inodes[i] - 1) / per_group;
+		unsigned int *inode_bitmap = group_inode_bitmap(disk, group);
+		unsigned int changed = 0;
+		lock_group(group);
+		for (; i < batch->num_inodes && (batch->inodes[i] - 1) / per_group == group; i++) {
+			int index = (batch->inodes[i] - 1) % per_group;
+			if (check_bitmap(inode_bitmap, index) != value) {
+				set_bitmap(&inode_bitmap, index, value);
+				if (!value) {
+					lower_hint(ext2_cur->inode_hints, group, index);
+				}
+				changed++;
+			}
+		}
+		if (changed > 0) {
+			struct ext2_group_desc *group_desc = get_group_desc(disk, group);
+			group_desc->bg_free_inodes_count += value ? -changed : changed;
+			dirty_meta(disk, group_desc, sizeof(*group_desc));
+			total += changed;
+		}
+		unlock_group(group);
+	}
+	if (total > 0) {
+		add_free(&super_block->s_free_inodes_count, value ? -total : total);
+		dirty_meta(disk, super_block, sizeof(*super_block));
+	}
+
+	qsort(batch->runs, batch->num_runs, sizeof(struct bmap_run), compare_runs);
+	for (unsigned int i = 0; i < batch->num_runs;) {
+		unsigned int start = batch->runs[i].pblk;
+		unsigned int end = start + batch->runs[i].len;
+		for (i++; i < batch->num_runs && batch->runs[i].pblk <= end; i++) {
+			if (batch->runs[i].pblk + batch->runs[i].len > end) {
+				end = batch->runs[i].pblk + batch->runs[i].len;
+			}
+		}
+		mark_block_range(disk, start, end - start, value);
+	}
+}
+
+/**
+ * Free what a batch holds
+ */
+static void batch_free(struct mark_batch *batch) {
+	free(batch->inodes);
+	free(batch->runs);
+}
+
+
+/**
+ * Drop one link to an inode; with the last one it is freed, its bits left to
+ * the batch
+ * @param  disk      disk
+ * @param  inode_idx the inode's index
+ * @param  batch     where it and its blocks are added once no links are left
+ * @return           0 on success, -ENOMEM
+ */
+static int rm_inode(unsigned char *disk, unsigned int inode_idx, struct mark_batch *batch) {
+	struct ext2_inode *inode = get_inode(disk, inode_idx);
+	if (inode->i_links_count <= 1) {
+		if (batch_add_inode(disk, batch, inode_idx) < 0) {
+			return -ENOMEM;
+		}
+		inode->i_links_count = 0;
+		inode->i_dtime = (unsigned int)time(NULL);
+		bmap_forget(inode_idx);
+	} else {
+		inode->i_links_count--;
+	}
+	dirty_meta(disk, inode, sizeof(*inode));
+	return 0;
+}
+
+/**
+ * Free a directory's inode, its bits left to the batch, and forget what the
+ * caches hold for it. Its entries are left as they are: its blocks go with it.
+ * @param  disk    disk
+ * @param  dir_idx the dir's inode index
+ * @param  batch   where it and its blocks are added
+ * @return         0 on success, -ENOMEM
+ */
+static int rm_dir(unsigned char *disk, unsigned int dir_idx, struct mark_batch *batch) {
+	struct ext2_inode *inode = get_inode(disk, dir_idx);
+	if (batch_add_inode(disk, batch, dir_idx) < 0) {
+		return -ENOMEM;
+	}
+	inode->i_links_count = 0;
+	inode->i_dtime = (unsigned int)time(NULL);
+	dirty_meta(disk, inode, sizeof(*inode));
+	unsigned int group = inode_group(disk, dir_idx);
+	struct ext2_group_desc *group_desc = get_group_desc(disk, group);
+	lock_group(group);
+	group_desc->bg_used_dirs_count--;
+	dirty_meta(disk, group_desc, sizeof(*group_desc));
+	unlock_group(group);
+
+	bmap_forget(dir_idx);
+	dcache_forget_dir(dir_idx);
+	dslot_forget_dir(dir_idx);
+	undel_forget_dir(dir_idx);
+	release_dir_windows(disk, dir_idx);
+	return 0;
+}
+
+/**
+ * Free the parent's dirent for target, and drop target from the dentry cache
+ * @param disk         disk
+ * @param parent_idx   parent dir's inode index
+ * @param curr_idx     target index
+ * @param target_name  target name
+ */
+static void free_dir_entry(unsigned char **disk, unsigned int parent_idx, int curr_idx,
+						   char *target_name) {
+	struct ext2_inode *parent_inode = get_inode(*disk, parent_idx);
+	int name_len = strlen(target_name);
+	struct dir_slot slot;
+
+	dcache_remove(parent_idx, target_name, name_len);
+	dirty_dir(*disk, parent_idx);
+
+	if (!dir_find_entry(*disk, parent_idx, target_name, name_len, &slot) ||
+		slot.entry->inode != curr_idx) {
+		return;
+	}
+	if (slot.prev != NULL) {
+		slot.prev->rec_len += slot.entry->rec_len;
+		dirty_meta(*disk, slot.prev, sizeof(*slot.prev));
+		undel_note(*disk, parent_idx, slot.lblk, slot.entry);
+	} else if (slot.entry->rec_len < EXT2_BLOCK_SIZE || slot.lblk >= EXT2_NDIR_BLOCKS ||
+			   (parent_inode->i_flags & EXT2_INDEX_FL)) {
+		// other entries follow, or the block has to stay: an index points at it,
+		// or taking it out would leave a hole among the indirect blocks
+		slot.entry->inode = 0;
+		dirty_meta(*disk, slot.entry, sizeof(*slot.entry));
+	} else { // no prev_dir. set whole block to 0
+		int dir_block_num = parent_inode->i_block[slot.lblk];
+		parent_inode->i_block[slot.lblk] = 0;
+		dirty_meta(*disk, parent_inode, sizeof(*parent_inode));
+		mark_block(*disk, dir_block_num, 0);
+	}
+	note_dir_block(*disk, parent_idx, slot.lblk);
+}
+
+
+/**
+ * walk_tree() visitor for rm -r: drop a link to every file below the
+ * directory and free every directory, fixing a directory's file_type first
+ * so the walk enters it
+ */
+static int rm_tree_visit(unsigned char *disk, unsigned int dir_idx, struct ext2_dir_entry *entry,
+						 int depth, void *arg) {
+	if (is_dot_entry(entry) || entry->inode > get_super_block(disk)->s_inodes_count) {
+		return WALK_PRUNE;
+	}
+	int result;
+	if ((get_inode(disk, entry->inode)->i_mode & EXT2_S_IFMT) != EXT2_S_IFDIR) {
+		result = rm_inode(disk, entry->inode, arg);
+		return result < 0 ? result : WALK_PRUNE;
+	}
+	if (entry->file_type != EXT2_FT_DIR) {
+		entry->file_type = EXT2_FT_DIR;
+		dirty_meta(disk, entry, sizeof(*entry));
+	}
+	result = rm_dir(disk, entry->inode, arg);
+	return result < 0 ? result : WALK_NEXT;
+}
+
+/**
+ * Remove what a path names into a batch: a file or link, or with recursive a
+ * directory and everything below it
+ * @return 0 on success; -ENOENT if it does not exist or is a directory without
+ *         recursive, -EBUSY for the root, -ENOMEM
+ */
+static int rm_path(unsigned char **disk, char const *path, int recursive, struct mark_batch *batch) {
+	int result;
+
+	// find the file/lnk's inode and its parent dir's inode
+	int parent_idx;
+	int curr_idx;
+	if ((result = resolve_path(*disk, path, &parent_idx, &curr_idx)) < 0) {
+		fprintf(stderr, "ext2_rm: resolve_path\n");
+		return result;
+	}
+	if (curr_idx == 0) {
+		fprintf(stderr, "ext2_rm: %s does not exist\n", path);
+		return -ENOENT;
+	}
+
+	// parse the absolute path into the path and the file's name
+	char *file_path = NULL; // FREE
+	char *name = NULL;		// FREE
+	if ((result = parse_path(path, &file_path, &name)) != 0) {
+		fprintf(stderr, "ext2_rm: parse_path\n");
+		return result;
+	}
+
+	// others may remove or link it meanwhile: look again with the parent and
+	// the file locked
+	if (held.shared && curr_idx != EXT2_ROOT_INO) {
+		lock_dir(parent_idx, 1);
+		if ((curr_idx = find_idx(*disk, parent_idx, name, strlen(name))) <= 0) {
+			fprintf(stderr, "ext2_rm: %s does not exist\n", path);
+			result = -ENOENT;
+			goto out;
+		}
+		lock_inode(curr_idx);
+	}
+
+	// find curr inode
+	struct ext2_inode *curr_inode = get_inode(*disk, curr_idx);
+	int is_dir = (curr_inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR;
+	if (is_dir ? !recursive : !(curr_inode->i_mode & EXT2_S_IFLNK || curr_inode->i_mode & EXT2_S_IFREG)) {
+		fprintf(stderr, "ext2_rm: invalid file type %i\n", curr_inode->i_mode);
+		result = -ENOENT;
+		goto out;
+	}
+	if (curr_idx == EXT2_ROOT_INO) {
+		fprintf(stderr, "ext2_rm: cannot remove the root directory\n");
+		result = -EBUSY;
+		goto out;
+	}
+
+	if (is_dir) {
+		// everything below it, then itself; .. no longer links the parent
+		if ((result = walk_tree(*disk, curr_idx, rm_tree_visit, batch)) == 0 &&
+			(result = rm_dir(*disk, curr_idx, batch)) == 0) {
+			free_dir_entry(disk, parent_idx, curr_idx, name);
+			struct ext2_inode *parent_inode = get_inode(*disk, parent_idx);
+			parent_inode->i_links_count--;
+			dirty_meta(*disk, parent_inode, sizeof(*parent_inode));
+		}
+	} else {
+		// free curr from its parent's block, then drop its link
+		free_dir_entry(disk, parent_idx, curr_idx, name);
+		result = rm_inode(*disk, curr_idx, batch);
+	}
+
+out:
+	free(file_path);
+	free(name);
+	return result;
+}
+
+
+/**
+ * Remove a file or link, like rm
+ * @param  disk the disk
+ * @param  path absolute path of the file or link
+ * @return      0 on success; -ENOENT if it does not exist or is a directory
+ */
+int ext2_rm(unsigned char **disk, char const *path) {
+	struct mark_batch batch = {0};
+	int result = rm_path(disk, path, 0, &batch);
+	if (result == 0) {
+		batch_apply(*disk, &batch, 0);
+	}
+	batch_free(&batch);
+	return result;
+}
+
+
+/**
+ * Remove a directory and everything below it, like rm -r, in one walk: the
+ * inodes and blocks freed are cleared together at the end, a group or a run
+ * at a time
+ * @param  disk the disk
+ * @param  path absolute path of the directory, or of a file or link
+ * @return      0 on success; -ENOENT if it does not exist, -EBUSY for the root, -ENOMEM
+ */
+int ext2_rm_tree(unsigned char **disk, char const *path) {
+	struct mark_batch batch = {0};
+	int result = rm_path(disk, path, 1, &batch);
+	if (result == 0) {
+		batch_apply(*disk, &batch, 0);
+	}
+	batch_free(&batch);
+	return result;
+}
+
+
+/**
+ * Remove several paths in one pass, clearing the inodes and blocks they free
+ * together once all are gone. A path that cannot be removed is reported and
+ * skipped.
+ * @param  disk      the disk
+ * @param  paths     absolute paths
+ * @param  num_paths number of paths
+ * @param  recursive whether directories are removed with everything below them
+ * @return           number of paths removed; -ENOMEM
+ */
+int ext2_rm_paths(unsigned char **disk, char const *const *paths, int num_paths, int recursive) {
+	struct mark_batch batch = {0};
+	int removed = 0;
+	for (int i = 0; i < num_paths; i++) {
+		int result = rm_path(disk, paths[i], recursive, &batch);
+		if (result == -ENOMEM) {
+			removed = result;
+			goto out;
+		}
+		removed += result == 0;
+	}
+	batch_apply(*disk, &batch, 0);
+
+out:
+	batch_free(&batch);
+	return removed;
+}
+
+
+/**
+ * Why a removed entry cannot be brought back
+ * @return the reason; NULL if it can be
+ */
+static char const *unrecoverable(unsigned char *disk, struct ext2_dir_entry *entry) {
+	if (check_inode_bit(disk, entry->inode) == 1) {
+		return "the inode has already been taken";
+	}
+	struct ext2_inode *inode = get_inode(disk, entry->inode);
+	if (inode->i_dtime == 0) {
+		return "the inode was not deleted";
+	}
+	if ((inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR) {
+		return "it is a directory";
+	}
+	return NULL;
+}
+
+/**
+ * Split a removed entry back out of the gap holding it and revive its inode,
+ * leaving the bitmap bits to the batch
+ * @param  disk       the disk
+ * @param  parent_idx parent dir's inode index
+ * @param  removed    the entry, checked with unrecoverable()
+ * @param  entry      the entry in place, found by undel_locate()
+ * @param  head       the record whose gap holds it
+ * @param  batch      where its inode and blocks are added
+ * @return            0 on success, -ENOMEM
+ */
+static int restore_entry(unsigned char *disk, unsigned int parent_idx, struct undel_entry const *removed,
+						 struct ext2_dir_entry *entry, struct ext2_dir_entry *head,
+						 struct mark_batch *batch) {
+	if (batch_add_inode(disk, batch, entry->inode) < 0) {
+		return -ENOMEM;
+	}
+
+	unsigned char *block = disk + (size_t)EXT2_BLOCK_SIZE * removed->pblk;
+	unsigned int head_offset = (unsigned char *)head - block;
+	entry->rec_len = head_offset + head->rec_len - removed->offset;
+	head->rec_len = removed->offset - head_offset;
+	dirty_meta(disk, block, EXT2_BLOCK_SIZE);
+	dirty_dir(disk, parent_idx);
+	note_dir_block(disk, parent_idx, removed->lblk);
+
+	struct ext2_inode *inode = get_inode(disk, entry->inode);
+	inode->i_links_count++;
+	inode->i_dtime = 0;
+	inode->i_mtime = (unsigned int)time(NULL);
+	dirty_meta(disk, inode, sizeof(*inode));
+	dcache_insert(parent_idx, entry->name, entry->name_len, entry->inode);
+	return 0;
+}
+
+/**
+ * Bring back the removed file or link a path named into a batch
+ * @return 0 on success; -EEXIST if the path is in use, -ENOENT if the entry or its
+ *         inode is gone, -ENOMEM
+ */
+static int restore_path(unsigned char **disk, char const *path, struct mark_batch *batch) {
+	int result;
+
+	// find parent dir's inode index and check the file is not there anymore
+	int parent_idx;
+	int curr_idx;
+	if ((result = resolve_path(*disk, path, &parent_idx, &curr_idx)) < 0) {
+		fprintf(stderr, "ext2_restore: resolve_path\n");
+		return result;
+	}
+	if (curr_idx > 0) {
+		fprintf(stderr, "ext2_restore: %s already exists\n", path);
+		return -EEXIST;
+	}
+
+	// parse the absolute path into the path and the file's name
+	char *file_path = NULL; // FREE
+	char *name = NULL;		// FREE
+	if ((result = parse_path(path, &file_path, &name)) != 0) {
+		fprintf(stderr, "ext2_restore: parse_path\n");
+		return result;
+	}
+	int name_len = strlen(name);
+
+	// in an indexed dir only the leaf the name hashes to can hold it
+	struct ext2_inode *parent_inode = get_inode(*disk, parent_idx);
+	unsigned int first = 0;
+	unsigned int end = dir_num_blocks(parent_inode);
+	if ((parent_inode->i_flags & EXT2_INDEX_FL) && dx_leaf(*disk, parent_idx, name, name_len, &first) == 0) {
+		end = first + 1;
+	}
+	struct undel_entry removed;
+	struct ext2_dir_entry *head;
+	struct ext2_dir_entry *entry;
+	char const *reason;
+	if ((result = undel_lookup(*disk, parent_idx, name, name_len, first, end, &removed)) < 0) {
+		fprintf(stderr, "ext2_restore: out of memory\n");
+	} else if (result == 0 || (entry = undel_locate(*disk, parent_idx, &removed, &head)) == NULL) {
+		fprintf(stderr, "ext2_restore: no removed entry named %s\n", name);
+		result = -ENOENT;
+	} else if ((reason = unrecoverable(*disk, entry)) != NULL) {
+		fprintf(stderr, "ext2_restore: %s: %s\n", path, reason);
+		result = -ENOENT;
+	} else {
+		result = restore_entry(*disk, parent_idx, &removed, entry, head, batch);
+	}
+
+	free(file_path);
+	free(name);
+	return result;
+}
+
+
+/**
+ * Bring back a removed file or link from the gap its dirent left behind
+ * @param  disk the disk
+ * @param  path absolute path the file had
+ * @return      0 on success; -EEXIST if the path is in use, -ENOENT if the entry or its
+ *              inode is gone
+ */
+int ext2_restore(unsigned char **disk, char const *path) {
+	struct mark_batch batch = {0};
+	int result = restore_path(disk, path, &batch);
+	if (result == 0) {
+		batch_apply(*disk, &batch, 1);
+	}
+	batch_free(&batch);
+	return result;
+}
+
+
+/**
+ * Bring back several removed files or links in one pass, marking their
+ * inodes and blocks in use together once all are back. A path that cannot be
+ * restored is reported and skipped.
+ * @param  disk      the disk
+ * @param  paths     absolute paths the files had
+ * @param  num_paths number of paths
+ * @return           number of files restored; -ENOMEM
+ */
+int ext2_restore_paths(unsigned char **disk, char const *const *paths, int num_paths) {
+	struct mark_batch batch = {0};
+	int restored = 0;
+	for (int i = 0; i < num_paths; i++) {
+		int result = restore_path(disk, paths[i], &batch);
+		if (result == -ENOMEM) {
+			restored = result;
+			goto out;
+		}
+		restored += result == 0;
+	}
+	batch_apply(*disk, &batch, 1);
+
+out:
+	batch_free(&batch);
+	return restored;
+}
+
+
+// directories found by walk_tree() for ext2_restore_tree()
+struct dir_list {
+	unsigned int *dirs;
+	unsigned int num_dirs;
+	unsigned int max_dirs;
+};
+
+/**
+ * Append a directory to a list
+ * @return 0 on success, -ENOMEM
+ */
+static int dir_list_add(struct dir_list *list, unsigned int dir_idx) {
+	if (list->num_dirs == list->max_dirs) {
+		unsigned int new_max = list->max_dirs ? list->max_dirs * 2 : 64;
+		unsigned int *grown = realloc(list->dirs, sizeof(unsigned int) * new_max);
+		if (grown == NULL) {
+			return -ENOMEM;
+		}
+		list->dirs = grown;
+		list->max_dirs = new_max;
+	}
+	list->dirs[list->num_dirs++] = dir_idx;
+	return 0;
+}
+
+/**
+ * walk_tree() visitor: list every directory below the walk's root
+ */
+static int list_dir_visit(unsigned char *disk, unsigned int dir_idx, struct ext2_dir_entry *entry,
+						  int depth, void *arg) {
+	if (entry->file_type != EXT2_FT_DIR || is_dot_entry(entry)) {
+		return WALK_NEXT;
+	}
+	return dir_list_add(arg, entry->inode) < 0 ? -ENOMEM : WALK_NEXT;
+}
+
+/**
+ * Bring back everything still recoverable under a directory, in it and in
+ * its subdirectories, in one pass: each directory's gaps are scanned once and
+ * the inodes and blocks are marked in use together at the end. Entries whose
+ * inode is taken or whose name is in use again are left alone.
+ * @param  disk the disk
+ * @param  path absolute path of the directory
+ * @return      number of files restored; -ENOENT if the path is not a directory, -ENOMEM
+ */
+int ext2_restore_tree(unsigned char **disk, char const *path) {
+	int result;
+	int parent_idx;
+	int dir_idx;
+	if ((result = resolve_path(*disk, path, &parent_idx, &dir_idx)) < 0) {
+		fprintf(stderr, "ext2_restore_tree: resolve_path\n");
+		return result;
+	}
+	if (dir_idx == 0 || (get_inode(*disk, dir_idx)->i_mode & EXT2_S_IFMT) != EXT2_S_IFDIR) {
+		fprintf(stderr, "ext2_restore_tree: %s is not a directory\n", path);
+		return -ENOENT;
+	}
+
+	struct dir_list list = {0};			// FREE
+	struct mark_batch batch = {0};	// FREE
+	struct undel_entry *removed = NULL; // FREE
+	if ((result = dir_list_add(&list, dir_idx)) < 0 ||
+		(result = walk_tree(*disk, dir_idx, list_dir_visit, &list)) < 0) {
+		goto out;
+	}
+
+	int restored = 0;
+	for (unsigned int i = 0; i < list.num_dirs; i++) {
+		int indexed = get_inode(*disk, list.dirs[i])->i_flags & EXT2_INDEX_FL;
+		int num_removed = undel_list(*disk, list.dirs[i], &removed);
+		if (num_removed < 0) {
+			result = num_removed;
+			goto out;
+		}
+		for (int j = 0; j < num_removed; j++) {
+			struct ext2_dir_entry *head;
+			struct ext2_dir_entry *entry = undel_locate(*disk, list.dirs[i], &removed[j], &head);
+			struct dir_slot slot;
+			unsigned int leaf;
+			if (entry == NULL || entry->file_type == EXT2_FT_DIR || unrecoverable(*disk, entry) != NULL ||
+				dir_find_entry(*disk, list.dirs[i], entry->name, entry->name_len, &slot)) {
+				continue;
+			}
+			// a leaf split leaves copies of the entries it moved behind; only the
+			// leaf a name hashes to may take it back
+			if (indexed && (dx_leaf(*disk, list.dirs[i], entry->name, entry->name_len, &leaf) < 0 ||
+							leaf != removed[j].lblk)) {
+				continue;
+			}
+			if ((result = restore_entry(*disk, list.dirs[i], &removed[j], entry, head, &batch)) < 0) {
+				goto out;
+			}
+			restored++;
+		}
+		free(removed);
+		removed = NULL;
+	}
+	batch_apply(*disk, &batch, 1);
+	result = restored;
+
+out:
+	if (result < 0) {
+		fprintf(stderr, "ext2_restore_tree: %s\n", strerror(-result));
+	}
+	free(removed);
+	free(list.dirs);
+	batch_free(&batch);
+	return result;
 }
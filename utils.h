@@ -3,16 +3,296 @@
 #ifndef EXT2_UTIL
 #define EXT2_UTIL
 
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "ext2ops.h"
+#include "journal.h"
+
+/* Mapping modes for init_map() */
+#define EXT2_MAP_AUTO 0 /* lazy above EXT2_LAZY_MAP_THRESHOLD, full below */
+#define EXT2_MAP_FULL 1 /* plain mapping of the whole image */
+#define EXT2_MAP_LAZY 2 /* no swap reservation, no readahead, fault on demand */
+#define EXT2_MAP_READ_ONLY 4 /* or'ed in: nothing will be changed, so readers may share the image */
+
+#define EXT2_LAZY_MAP_THRESHOLD (1UL << 30)
+
+#define EXT2_DIR_WINDOWS 64 /* preallocation windows kept per image, by directory inode */
+
+/*
+ * Blocks held past the end of a growing directory, see dir_add_block()
+ */
+struct dir_window {
+	unsigned int dir_idx; /* 0 if the window is closed */
+	unsigned int start;	  /* the next block the directory gets */
+	unsigned int len;
+};
+
+/*
+ * A run of blocks freed since the last flush, see hold_freed_blocks()
+ */
+struct freed_run {
+	unsigned int start;
+	unsigned int len;
+	int reserved; /* still reserved for the cp plan that claimed them, see unreserve_blocks() */
+};
+
+/*
+ * An open image: its mapping, geometry and the per-group metadata pointers,
+ * all looked up once by image_open(). The helpers below work on ext2_cur,
+ * whose disk their disk argument must be; init() maps into a default image
+ * and makes it current, library callers switch with image_use().
+ * Building with -DEXT2_FIXED_BLOCK_SIZE=1024 (or 4096, ...) turns the block
+ * size into a constant so offset math folds at compile time; image_open()
+ * then refuses images of any other block size.
+ */
+struct ext2_image {
+	unsigned char *disk;
+	size_t map_len;
+	int map_fd;
+	int map_mode;			 /* EXT2_MAP_FULL or EXT2_MAP_LAZY */
+	int block_size;			 /* bytes per block */
+	int inode_size;			 /* bytes per on-disk inode */
+	unsigned int first_ino;	 /* first non-reserved inode */
+	struct ext2_super_block *super_block;
+	struct ext2_group_desc *group_desc; /* the descriptor table */
+	unsigned int num_groups;
+	unsigned int **block_bitmaps; /* per group */
+	unsigned int **inode_bitmaps; /* per group */
+	unsigned char **inode_tables; /* per group */
+	int *block_hints;			  /* per group, lowest bit of its block bitmap that may be free */
+	int *inode_hints;			  /* ... of its inode bitmap */
+
+	/* write-ahead journal, see journal.h */
+	char *journal_path;
+	int journal_fd;					/* -1 until the first commit that logs anything */
+	unsigned int journal_seq;		/* flushes since the image was opened */
+	off_t journal_len;				/* bytes logged since the last flush */
+	unsigned long long journal_sum; /* running checksum of those bytes */
+	struct dirty_set pending;		/* blocks committed since the last flush */
+	struct dirty_set op_set;		/* blocks the operation in progress changed */
+	int has_dirty;					/* the operation in progress changed something */
+	int unsynced_data;				/* file data written since the last flush */
+	int flush_policy;				/* EXT2OPS_FLUSH_OP, EXT2OPS_FLUSH_BATCH or EXT2OPS_FLUSH_CLOSE */
+	int flush_every;				/* operations per flush under EXT2OPS_FLUSH_BATCH */
+	int ops_pending;				/* operations committed since the last flush */
+	int txn_ops;					/* operations sharing the one in progress; 0 if it runs alone */
+
+	/* persistent dirty log, see dirtylog.h */
+	char *dirty_path;
+	int dirty_fd;				/* -1 if the image has none */
+	int dirty_unsynced;			/* records appended since the last flush */
+	unsigned int *dirty_dirs;	/* directories the operation in progress changed */
+	int num_dirty_dirs;
+	int max_dirty_dirs;
+
+	/* blocks held for operations whose metadata is not written yet, see reserve_blocks() */
+	unsigned int *reserved;		/* one bit per block; NULL until the first reservation */
+	unsigned int num_reserved;
+
+	/* blocks freed since the last flush, held as reservations until it; see hold_freed_blocks() */
+	struct freed_run *freed;
+	unsigned int num_freed;
+	unsigned int max_freed;
+	unsigned int num_freed_committed; /* the first ones, freed by committed operations */
+	unsigned int num_freed_reserved;  /* those with reserved set */
+	int freed_failed;				  /* a run could not be held for want of memory */
+
+	/* per-directory preallocation, see dir_add_block(); held as reservations */
+	int dir_window_blocks; /* blocks a window holds; 0 unless the image has COMPAT_DIR_PREALLOC */
+	struct dir_window dir_windows[EXT2_DIR_WINDOWS];
+
+	/* copy-on-write overlay, see overlay.h */
+	int base_fd;			 /* the base image, mapped in place of map_fd; -1 unless an overlay */
+	unsigned char *in_delta; /* one bit per block the overlay holds; NULL unless an overlay */
+	int delta_unsynced;		 /* in_delta changed since it was last written */
+};
+extern struct ext2_image *ext2_cur;
+
+#ifdef EXT2_FIXED_BLOCK_SIZE
+#define EXT2_BLOCK_SIZE EXT2_FIXED_BLOCK_SIZE
+#else
+#define EXT2_BLOCK_SIZE (ext2_cur->block_size)
+#endif
+#define EXT2_INODE_SIZE (ext2_cur->inode_size)
+
+int image_open(struct ext2_image *image, char const *file_name, int mode);
+void image_close(struct ext2_image *image);
+void image_use(struct ext2_image *image);
+int end_op(int result);
+
+/*
+ * Operations on the current image may run side by side between
+ * begin_shared_op() and end_shared_op(), as long as nothing else runs: the
+ * allocator then locks the groups it works in, and an operation keeps the
+ * directories whose entries it changes or relies on, and the inode whose
+ * links it counts or whose contents it reads, locked until it ends. Path
+ * walks take no lock on a directory whose names are cached. The operations in flight make up one operation in
+ * progress, committed by the last one to end; the others that changed
+ * something wait for it. If one of those failed, all of them are undone and
+ * end with -ERESTART, to be run again one at a time.
+ */
+void begin_shared_op(void);
+int end_shared_op(int result);
+void lock_dir(unsigned int dir_idx, int write);
+void unlock_dir(unsigned int dir_idx);
+void lock_inode(unsigned int inode_idx);
+
+int disk_fd(void);
 int init(unsigned char **disk, char const *file_name);
+int init_map(unsigned char **disk, char const *file_name, int mode);
+void fini(unsigned char **disk);
+size_t disk_size(void);
+int map_willneed(unsigned char *disk, size_t offset, size_t len);
 int check_bitmap(unsigned int *bitmap, int index);
 void set_bitmap(unsigned int **bitmap, int index, int value);
-unsigned int new_inode(unsigned char **disk);
+int find_free_bit(unsigned int *bitmap, int start, int size);
+int find_used_bit(unsigned int *bitmap, int start, int size);
+void set_bitmap_range(unsigned int **bitmap, int start, int len, int value);
+struct ext2_super_block *get_super_block(unsigned char *disk);
+unsigned int num_groups(unsigned char *disk);
+struct ext2_group_desc *get_group_desc(unsigned char *disk, unsigned int group);
+unsigned int inode_group(unsigned char *disk, unsigned int inode_idx);
+unsigned int block_group(unsigned char *disk, unsigned int block_num);
+unsigned int group_first_block(unsigned char *disk, unsigned int group);
+int group_num_blocks(unsigned char *disk, unsigned int group);
+unsigned int *group_block_bitmap(unsigned char *disk, unsigned int group);
+unsigned int *group_inode_bitmap(unsigned char *disk, unsigned int group);
+struct ext2_inode *get_inode(unsigned char *disk, unsigned int inode_idx);
+int check_inode_bit(unsigned char *disk, unsigned int inode_idx);
+int check_block_bit(unsigned char *disk, unsigned int block_num);
+int mark_inode(unsigned char *disk, unsigned int inode_idx, int value);
+int mark_block(unsigned char *disk, unsigned int block_num, int value);
+int mark_block_range(unsigned char *disk, unsigned int start, unsigned int len, int value);
+int verify_counters(unsigned char *disk);
+unsigned int new_inode(unsigned char **disk, unsigned int parent_idx);
+unsigned int new_dir_inode(unsigned char **disk, unsigned int parent_idx);
 void init_inode(unsigned char **disk, unsigned int new_inode_idx);
-int new_block(unsigned char **disk);
-int update_dir_entry(unsigned char **disk, struct ext2_inode *parent_inode, unsigned short current_idx, char *name,
+int new_block(unsigned char **disk, unsigned int goal);
+unsigned int inode_goal_block(unsigned char *disk, unsigned int inode_idx);
+int alloc_blocks(unsigned char **disk, int count, int goal, int *out);
+int reserve_blocks(unsigned char **disk, int count, int goal, int *out);
+void unreserve_blocks(unsigned char *disk, int const *blocks, int count);
+void claim_blocks(unsigned char *disk, int const *blocks, int count);
+void commit_freed_blocks(struct ext2_image *image);
+void release_freed_blocks(struct ext2_image *image, int all);
+int release_dir_windows(unsigned char *disk, unsigned int dir_idx);
+int indirect_blocks_needed(int num_data);
+unsigned int inode_block(unsigned char *disk, struct ext2_inode *inode, unsigned int lblk);
+int map_inode_blocks(unsigned char *disk, struct ext2_inode *inode, int const *blocks, int num_data,
+					 int *data_blocks);
+int is_fast_symlink(struct ext2_inode *inode);
+int walk_inode_blocks(unsigned char *disk, struct ext2_inode *inode,
+					  int (*visit)(unsigned char *disk, unsigned int block_num, int is_meta, void *arg),
+					  void *arg);
+int mark_inode_blocks(unsigned char *disk, unsigned int inode_idx, int value);
+
+/*
+ * Directory traversal. A cursor steps through the live entries of one
+ * directory; walk_dir() and walk_tree() drive a visitor over them, the latter
+ * depth first from a root with an explicit stack, so deep trees cost heap
+ * rather than call stack. A visitor returns WALK_NEXT to go on, WALK_PRUNE to
+ * go on without descending into the entry, and anything else to stop the walk
+ * with that result.
+ */
+#define WALK_NEXT 0
+#define WALK_PRUNE 1
+#define WALK_STOP 2
+
+struct dir_cursor {
+	unsigned int dir_idx;
+	int block;	/* logical block of the directory */
+	int offset; /* byte offset of the next entry in that block */
+};
+typedef int (*dir_visit_fn)(unsigned char *disk, unsigned int dir_idx,
+							struct ext2_dir_entry *entry, int depth, void *arg);
+
+int is_dot_entry(struct ext2_dir_entry *entry);
+void dir_open(struct dir_cursor *cursor, unsigned int dir_idx);
+struct ext2_dir_entry *dir_next(unsigned char *disk, struct dir_cursor *cursor);
+int walk_dir(unsigned char *disk, unsigned int dir_idx, dir_visit_fn visit, void *arg);
+int walk_tree(unsigned char *disk, unsigned int root_idx, dir_visit_fn visit, void *arg);
+
+/* Where a directory entry was found */
+struct dir_slot {
+	unsigned int lblk;			  /* logical block of the directory holding it */
+	struct ext2_dir_entry *prev;  /* the entry before it in that block; NULL if it is first */
+	struct ext2_dir_entry *entry; /* the entry, in place on the disk */
+};
+
+int dir_entry_size(int name_len);
+unsigned int dir_num_blocks(struct ext2_inode *dir_inode);
+unsigned char *dir_block(unsigned char *disk, struct ext2_inode *dir_inode, unsigned int lblk);
+int dir_block_find(unsigned char *block, char const *name, int name_len, struct dir_slot *slot);
+int dir_block_append(unsigned char *block, unsigned int inode_idx, char const *name, int name_len,
+					 unsigned char type);
+int dir_block_insert(unsigned char *block, unsigned int inode_idx, char const *name, int name_len,
+					 unsigned char type);
+int dir_block_gap(unsigned char *block);
+int dir_add_block(unsigned char **disk, unsigned int dir_idx, unsigned int *lblk);
+void dir_readahead(unsigned char *disk, unsigned int dir_idx);
+int dir_find_entry(unsigned char *disk, unsigned int dir_idx, char const *name, int name_len,
+				   struct dir_slot *slot);
+
+int copy_into_blocks(unsigned char *disk, int src_fd, int const *data_blocks, int num_data,
+					 unsigned long long size);
+int update_dir_entry(unsigned char **disk, unsigned int parent_idx, unsigned int current_idx, char *name,
                       unsigned char type);
 int parse_path(char const *absolute_path, char **path, char **name);
-int find_idx(unsigned char *disk, char *name, struct ext2_dir_entry *dir);
+int find_idx(unsigned char *disk, unsigned int dir_idx, char const *name, int name_len);
+
+/* Symlinks met on a path are followed, at most this many per lookup */
+#define EXT2_MAX_SYMLINK_HOPS 8
+
+int resolve_path(unsigned char *disk, char const *path, int *parent_idx, int *child_idx);
+int resolve_path_follow(unsigned char *disk, char const *path, int *parent_idx, int *child_idx);
+int resolve_path_hold(unsigned char *disk, char const *path, int *parent_idx, int *child_idx);
+char *read_symlink(unsigned char *disk, struct ext2_inode *inode);
+
+/* Operations behind the tools, usable on one mapping many times over */
+int make_dir(unsigned char **disk, unsigned int parent_idx, char *name);
+int make_file(unsigned char **disk, unsigned int parent_idx, unsigned long long size, int **data_blocks);
+int ext2_mkdir(unsigned char **disk, char const *path);
+int ext2_cp(unsigned char **disk, char const *local_path, char const *path);
+int ext2_cp_tree(unsigned char **disk, char const *local_path, char const *path, int num_threads);
+
+/*
+ * ext2_cp() in three steps, so the copy can run alongside other operations:
+ * ext2_cp_prepare() checks the target and reserves the file's blocks without
+ * changing the image, cp_plan_copy() streams the file into them straight
+ * through the image file, touching no metadata and no shared state, and
+ * ext2_cp_finish() creates the inode, takes the blocks and links the file.
+ * cp_plan_release() gives back whatever the plan still holds.
+ */
+struct cp_plan {
+	int src_fd;
+	unsigned long long size;
+	int image_fd;
+	int block_size;
+	int num_data;	  /* data blocks */
+	int num_blocks;	  /* data and indirect blocks */
+	int *blocks;	  /* reserved, in the order map_inode_blocks() takes them; malloc'ed */
+	int *data_blocks; /* the physical block of each logical block; malloc'ed */
+	int reserved;	  /* blocks is still reserved */
+};
+int ext2_cp_prepare(unsigned char **disk, char const *local_path, char const *path, struct cp_plan *plan);
+int cp_plan_copy(struct cp_plan const *plan);
+int ext2_cp_finish(unsigned char **disk, char const *path, struct cp_plan *plan);
+void cp_plan_release(unsigned char *disk, struct cp_plan *plan);
+int ext2_ln(unsigned char **disk, char const *src_path, char const *dest_path, int soft_link);
+int ext2_rm(unsigned char **disk, char const *path);
+int ext2_rm_tree(unsigned char **disk, char const *path);
+int ext2_rm_paths(unsigned char **disk, char const *const *paths, int num_paths, int recursive);
+int ext2_restore(unsigned char **disk, char const *path);
+int ext2_restore_paths(unsigned char **disk, char const *const *paths, int num_paths);
+int ext2_restore_tree(unsigned char **disk, char const *path);
+int ext2_cat(unsigned char **disk, char const *path, int out_fd);
+int ext2_export(unsigned char **disk, char const *path, char const *local_path, int recursive);
+unsigned long long inode_size(struct ext2_inode *inode);
+int export_inode(unsigned char *disk, unsigned int inode_idx, int out_fd);
+int ext2_check(unsigned char **disk);
+int ext2_check_parallel(unsigned char **disk, int num_threads);
+int ext2_check_incremental(unsigned char **disk);
 
 
 #endif // EXT2_UTIL